@@ -21,26 +21,20 @@
 #endif
 #endif
 
-template <typename T>
-class Node
-{
-public:
-  T data;
-  Node * next;
-  Node(T _data,Node * _next)//:data(_data),next(_next){}
-  {
-  data=_data;
-  next=_next;
-  }
-};
-
 template <typename T>
 class List
 {
-  Node<T> * root;
+  // elements are kept in a growing array, so that appending, counting 
+  // and indexed access take constant time
+  T * items;
+  int count;
+  int capacity;
 
 public:
   List();
+  // copies own their elements
+  List(const List &other);
+  List & operator = (const List &other);
   ~List();
   void push_back(const T &value);
   void clear();
@@ -50,96 +44,76 @@ public:
 };
 
 template <typename T>
-List<T>::List():root(0){};
+List<T>::List():items(0),count(0),capacity(0){};
 
 template <typename T>
-List<T>::~List(){};
+List<T>::List(const List &other):items(0),count(0),capacity(0)
+{
+  for (int i=0;i<other.count;i++){push_back(other.items[i]);}
+}
+
+template <typename T>
+List<T> & List<T>::operator = (const List &other)
+{
+  if (this!=&other){
+    clear();
+    for (int i=0;i<other.count;i++){push_back(other.items[i]);}
+  }
+  return *this;
+}
+
+template <typename T>
+List<T>::~List(){clear();}
 
 template<typename T>
 void List<T>::clear()
 {
-  Node<T> * p = root;
-  while (p){
-	p = root->next;
-	if (root){delete root;}
-	root = p;
-  }
+  if (items){delete [] items;}
+  items = 0;
+  count = 0;
+  capacity = 0;
 }
 
 template<typename T>
 void List<T>::push_back(const T &val)
 {
-  if (!root){
-	root = new Node<T>(val,0);
-  }else{
-	Node<T> * ptr = root;
-	while (ptr->next){
-	  ptr = ptr->next;
-	}
-	ptr->next = new Node<T>(val,0);
+  if (count==capacity){
+    capacity = capacity?capacity*2:4;
+    T * p = new T[capacity];
+    for (int i=0;i<count;i++){p[i]=items[i];}
+    if (items){delete [] items;}
+    items = p;
   }
+  items[count++] = val;
 }
 
 template<typename T>
 int List<T>::size()
 {
-  int count=0;
-  if (!root){return 0;}
-  else{
-	Node<T> * ptr = root;
-	count++;
-	while (ptr->next){
-	  ptr = ptr->next;
-	  count++;
-	}
-	return count;
-  }
   return count;
 }
 
 template<typename T>
 void List<T>::erase(int idx)
 {
-  int i=0;
-  if (idx>=0){
-    Node<T> * curr=root;
-    Node<T> * prev=0;
-    if (!curr){fprintf(stderr,"%s: %d: %s: error: insufficient elements",__FILE__,__LINE__,__FUNCTION__);return;}
-    for (i=0;i<idx;i++,prev=curr,curr=curr->next){
-      if (!curr->next){fprintf(stderr,"%s: %d: %s: error: insufficient elements",__FILE__,__LINE__,__FUNCTION__);return;}
-    }
-    if (!prev){
-      if (!curr->next){
-        delete root;root=0;
-      }else{
-        prev=root;
-        root=curr->next;
-        delete prev;prev=0;
-      }
-    }else if (!curr){
-      delete prev;prev=0;
-    }else{
-      prev->next=curr->next;
-      delete curr;curr=0;
-    }
-  }else{fprintf(stderr,"%s: %d: %s: error: invalid argument",__FILE__,__LINE__,__FUNCTION__);}
+  if (idx<0){fprintf(stderr,"%s: %d: %s: error: invalid argument",__FILE__,__LINE__,__FUNCTION__);return;}
+  if (idx>=count){fprintf(stderr,"%s: %d: %s: error: insufficient elements",__FILE__,__LINE__,__FUNCTION__);return;}
+  for (int i=idx+1;i<count;i++){items[i-1]=items[i];}
+  count--;
 }
 
 template<typename T>
 T List<T>::operator [] (int idx)
 {
-  Node<T> * ptr=root;
-  if (idx>=0){
-    if (!ptr){fprintf(stderr,"%s: %d: %s: error: insufficient elements",__FILE__,__LINE__,__FUNCTION__);}
-    int i=0;
-    for (i=0;i<idx;i++,ptr=ptr->next){
-      if (!ptr){fprintf(stderr,"%s: %d: %s: error: insufficient elements",__FILE__,__LINE__,__FUNCTION__);}
-    }
-  }else{
+  if (idx<0){
     fprintf(stderr,"%s: %d: %s: error: invalid argument",__FILE__,__LINE__,__FUNCTION__);
+    return T();
   }
-  return ptr->data;
+  if (idx>=count){
+    fprintf(stderr,"%s: %d: %s: error: insufficient elements",__FILE__,__LINE__,__FUNCTION__);
+    return T();
+  }
+  return items[idx];
 }
 
 #endif // __LIST_H__
-
@@ -90,6 +90,18 @@ typedef struct CvNetwork CvNetwork;
 #define CV_DNN_GRAD_ESTIM_RANDOM        0
 #define CV_DNN_GRAD_ESTIM_BY_WORST_IMG  1
 
+// synchronous training splits each mini batch over workers and applies the
+// summed gradient once; asynchronous (Hogwild) training lets every worker 
+// train on mini batches of its own and update shared weights without locks
+#define CV_DNN_TRAIN_SYNC               0
+#define CV_DNN_TRAIN_HOGWILD            1
+
+// gradients sent to a parameter server as they are, in half precision, or
+// as the largest values only, with the rest carried over to later batches
+#define CV_DNN_COMPRESS_NONE            0
+#define CV_DNN_COMPRESS_FP16            1
+#define CV_DNN_COMPRESS_TOPK            2
+
 typedef void (CV_CDECL *CvNetworkAddLayer)(CvNetwork* network, CvDNNLayer* layer);
 typedef CvDNNLayer* (CV_CDECL *CvNetworkGetLayer)(CvNetwork* network, const char * name);
 typedef CvDNNLayer* (CV_CDECL *CvNetworkGetLastLayer)(const CvNetwork* network);
@@ -107,6 +119,104 @@ typedef struct CvStatModelParams
 typedef void (CV_CDECL *CvNetworkRead)( CvNetwork * network, CvFileStorage * fs);
 typedef void (CV_CDECL *CvNetworkWrite)( CvNetwork * network, CvFileStorage * fs);
 
+// Static memory plan of network activations used in inference. Lifetime of
+// each activation X[k] is computed over the layer list, extended along the
+// input_layers/output_layers side edges, and activations whose lifetimes
+// do not overlap are placed at the same offset of a single arena.
+typedef struct CvDNNMemoryPlan
+{
+  // number of activations, X[0] is the network input, X[k+1] is the output
+  // of the k-th layer
+  int n_tensors;
+  // max number of samples per batch the plan is made for
+  int batch_size;
+  // columns of each activation, rows are given by the batch size
+  int * cols;
+  // index of the layer producing X[k] and of the last layer reading it
+  int * first_use;
+  int * last_use;
+  // offset and (aligned) size of each activation within the arena, in bytes
+  size_t * offsets;
+  size_t * sizes;
+  // headers of the activations, pointing into the arena
+  CvMat * mats;
+  uchar * raw;
+  uchar * data;
+  // size of the arena
+  size_t planned_bytes;
+  // size of a distinct buffer per activation, plus the copy of output
+  // kept by each layer
+  size_t naive_bytes;
+  // largest total size of activations live at the same time
+  size_t live_bytes;
+}CvDNNMemoryPlan;
+
+// Checkpoints of network activations used in training. The layers are cut
+// into segments, and only the activations X[k] at segment boundaries are kept
+// through the forward pass. Interior activations of all segments share a
+// single buffer sized for the largest segment, and those of a segment are
+// recomputed from the boundary starting it right before its backward pass.
+// Layers keep no copy of their outputs, and hold their scratch buffers for a
+// segment at a time, which are then allocated again for each batch.
+typedef struct CvDNNCheckpointPlan
+{
+  int n_segments;
+  // the s-th segment runs layers bounds[s] to bounds[s+1]-1, the first
+  // bound is 0 and the last one is the number of layers
+  int * bounds;
+  // max number of samples per batch the plan is made for
+  int batch_size;
+  // offset of each interior activation within the shared buffer, in bytes,
+  // unused for activations at segment boundaries
+  size_t * offsets;
+  uchar * raw;
+  uchar * data;
+  // size of the shared buffer
+  size_t interior_bytes;
+  // size of all activations held through a training pass, without and
+  // with checkpoints
+  size_t naive_bytes;
+  size_t checkpointed_bytes;
+}CvDNNCheckpointPlan;
+
+// Compiled execution plan of a network. Layers are flattened into an array of
+// ops in topological order, with the activations read and written by each op
+// resolved to indices, so that training and prediction don't walk the layer
+// list, and layers are found by name through a hashed index.
+typedef struct CvDNNExecOp
+{
+  CvDNNLayer * layer;
+  // forward pass of the op maps X[input] to X[output]
+  int input;
+  int output;
+  // index of the last op reading X[output], either as next layer or via
+  // side edges, n_ops if the output of the network
+  int last_use;
+}CvDNNExecOp;
+
+typedef struct CvDNNExecPlan
+{
+  int n_ops;
+  CvDNNExecOp * ops;
+  CvDNNLayer * last_layer;
+  // open addressing table of op indices hashed by layer name, -1 for empty
+  // entries, the size is a power of two
+  int hash_size;
+  int * hash_table;
+}CvDNNExecPlan;
+
+// Execution context for running inference on a network shared by several 
+// threads. The context holds copies of the network layers, which share weights
+// with the original layers but keep their own activations, scratch buffers and
+// memory plan, so that each context may run in a different thread.
+typedef struct CvDNNExecContext
+{
+  // network the context is created for, only read by the context
+  CvNetwork * shared_network;
+  // network made of the layer copies
+  CvNetwork * network;
+}CvDNNExecContext;
+
 typedef struct CvNetwork
 {
   int n_layers;
@@ -118,6 +228,17 @@ typedef struct CvNetwork
   CvNetworkWrite write;                           
   CvNetworkRelease release;
   CvNetworkEvaluate eval;
+  // scratch buffers shared by all layers in the network
+  CvDNNWorkspace * workspace;
+  // activation buffers used in prediction, created at first prediction
+  CvDNNMemoryPlan * memory_plan;
+  // flat list of layer ops, compiled at first run and dropped when a layer
+  // is added
+  CvDNNExecPlan * exec_plan;
+  // input values are converted as x*input_scale+input_shift in prediction,
+  // the same as training data, and saved with the weights
+  double input_scale;
+  double input_shift;
 }CvNetwork;
 
 //add by lxts on jun-22-2008
@@ -139,6 +260,19 @@ typedef struct CvDNNStatModelParams
   float validate_ratio; // typically 0.1, to split validation data from training dataset
   int nepochs;
   float momentum_ratio; // typically 0.9, to update momentum term to speed up training
+  int optimizer;        // CV_DNN_OPTIMIZER_*, plain gradient descent by default
+  float beta2;          // typically 0.999, decay rate of second moment for Adam
+  float epsilon;        // typically 1e-8, added to the root of second moment for Adam
+  float weight_decay;   // L2 penalty, decoupled weight decay for AdamW
+  int accum_batches;    // mini-batches whose gradients are averaged into each update, 1 by default
+  int n_workers;        // threads each mini-batch is split over, 1 to train on the calling thread
+  int train_mode;       // CV_DNN_TRAIN_SYNC or CV_DNN_TRAIN_HOGWILD
+  // parameter server to train with as one of its workers, if host is given
+  const char * ps_host;
+  int ps_port;
+  int ps_compression;   // CV_DNN_COMPRESS_NONE, CV_DNN_COMPRESS_FP16 or CV_DNN_COMPRESS_TOPK
+  float ps_topk_ratio;  // fraction of gradient values sent with top-k compression
+  int checkpoint_segments; // segments of recomputed activations in training, 0 to keep all
 }CvDNNStatModelParams;
 
 // this macro is added by lxts on jun/22/2008
@@ -181,6 +315,116 @@ CVAPI(CvDNNStatModelParams*) cvLoadNetworkSolver(const char * filename);
 
 CVAPI(CvDNNLayer*) cvGetCNNLastLayer(const CvNetwork * network);
 
+CVAPI(CvDNNExecPlan*) cvCompileNetwork(CvNetwork * network);
+
+CVAPI(void) cvReleaseNetworkExecPlan(CvDNNExecPlan ** plan);
+
+CVAPI(CvDNNMemoryPlan*) cvCreateNetworkMemoryPlan(const CvNetwork * network, int batch_size);
+
+CVAPI(void) cvReleaseNetworkMemoryPlan(CvDNNMemoryPlan ** plan);
+
+CVAPI(CvDNNCheckpointPlan*) cvCreateCheckpointPlan(const CvNetwork * network, int batch_size, 
+                                                   int n_segments);
+
+CVAPI(void) cvReleaseCheckpointPlan(CvDNNCheckpointPlan ** plan);
+
+CVAPI(void) cvSetNetworkOptimizer(CvNetwork * network, CvDNNOptimizer * optimizer);
+
+CVAPI(void) cvStepNetwork(CvNetwork * network, int t, int n_batches CV_DEFAULT(1));
+
+CVAPI(void) cvResetRecurrentStates(CvNetwork * network);
+
+CVAPI(void) cvQuantizeNetwork(CvNetwork * network, int type, const CvMat * samples, int batch_size);
+
+CVAPI(void) cvDequantizeNetwork(CvNetwork * network);
+
+CVAPI(int) cvGetNetworkQuantization(const CvNetwork * network);
+
+CVAPI(CvDNNExecContext*) cvCreateDNNExecContext(CvNetwork * network);
+
+CVAPI(void) cvReleaseDNNExecContext(CvDNNExecContext ** context);
+
+CVAPI(void) cvDNNPredict(CvDNNExecContext * context, const CvMat * samples, CvMat * result, 
+                         int batch_size);
+
+/****************************************************************************************\
+*                                   Parameter server                                     *
+\****************************************************************************************/
+
+// Holds the weights of a network for worker processes training it on shards of the
+// data, and applies their gradients received over TCP.
+typedef struct CvDNNParamServer CvDNNParamServer;
+
+CVAPI(CvDNNParamServer*) cvCreateParamServer(CvNetwork * network, int port, int n_workers,
+                                             int staleness);
+
+CVAPI(int) cvGetParamServerPort(const CvDNNParamServer * server);
+
+CVAPI(void) cvRunParamServer(CvDNNParamServer * server);
+
+CVAPI(void) cvReleaseParamServer(CvDNNParamServer ** server);
+
+/****************************************************************************************\
+*                                   Binary tensor files                                  *
+\****************************************************************************************/
+
+// A tensor file holds a header page (magic, element type and shape) followed by the 
+// matrix rows as stored in memory, so that the payload can be mapped without parsing.
+#define CV_DNN_TENSOR_MAGIC       "CVTENSOR"
+#define CV_DNN_TENSOR_HEADER_SIZE 4096
+
+CVAPI(void) cvSaveTensor(const char * filename, const CvMat * mat);
+
+CVAPI(int) cvIsTensorFile(const char * filename);
+
+CVAPI(CvMat*) cvMapTensor(const char * filename);
+
+CVAPI(void) cvReleaseMappedTensor(CvMat ** mat);
+
+/****************************************************************************************\
+*                                  Training data sources                                 *
+\****************************************************************************************/
+
+struct CvDNNDataSource;
+
+// reads samples idx[0..count-1] into the first <count> rows of float matrices X and Y
+typedef void (CV_CDECL *CvDNNDataSourceRead)(struct CvDNNDataSource * source, 
+                                             const int * idx, int count, CvMat * X, CvMat * Y);
+typedef void (CV_CDECL *CvDNNDataSourceRelease)(struct CvDNNDataSource ** source);
+
+#define CV_DNN_DATA_SOURCE_FIELDS()                                     \
+    int n_samples;                                                      \
+    /* number of input and output values of a sample */                 \
+    int n_inputs;                                                       \
+    int n_outputs;                                                      \
+    /* input values are converted as x*scale+shift when read */         \
+    double scale;                                                       \
+    double shift;                                                       \
+    CvDNNDataSourceRead read;                                           \
+    CvDNNDataSourceRelease release
+
+// Source of training samples, read by index so that samples are never moved for
+// shuffling; it is read from the background thread of a batch loader.
+typedef struct CvDNNDataSource
+{
+  CV_DNN_DATA_SOURCE_FIELDS();
+}CvDNNDataSource;
+
+// Loader of shuffled mini batches, read ahead from a data source
+typedef struct CvDNNBatchLoader CvDNNBatchLoader;
+
+CVAPI(CvDNNDataSource*) cvCreateMatDataSource(const CvMat * samples, const CvMat * responses);
+
+CVAPI(CvDNNBatchLoader*) cvCreateBatchLoader(CvDNNDataSource * source, const CvMat * sample_idx,
+                                             int batch_size, int n_prefetch, CvRNG * rng);
+
+CVAPI(void) cvGetNextBatch(CvDNNBatchLoader * loader, CvMat * X, CvMat * Y);
+
+CVAPI(void) cvReleaseBatchLoader(CvDNNBatchLoader ** loader);
+
+CVAPI(CvDNNStatModel*) cvTrainCNNClassifierFromSource(
+            CvDNNDataSource * source, const CvDNNStatModelParams* params);
+
 /****************************************************************************************\
 *                               Estimate classifiers algorithms                          *
 \****************************************************************************************/
@@ -28,7 +28,14 @@
 #include "cxcore.h"
 #include "list.h"
 
+// number of workspace slots a layer can reserve buffers for
+#define CV_DNN_WORKSPACE_SLOTS                     32
+
 typedef struct CvDNNLayer CvDNNLayer;
+typedef struct CvDNNWorkspace CvDNNWorkspace;
+typedef struct CvDNNWorkspaceBuffer CvDNNWorkspaceBuffer;
+typedef struct CvDNNOptimizer CvDNNOptimizer;
+typedef struct CvDNNQuantization CvDNNQuantization;
 
 typedef void (CV_CDECL *CvDNNLayerForward)
     ( CvDNNLayer* layer, const CvMat* input, CvMat* output );
@@ -36,6 +43,7 @@ typedef void (CV_CDECL *CvDNNLayerBackward)
     ( CvDNNLayer* layer, int t, const CvMat* X, const CvMat* dE_dY, CvMat* dE_dX);
 typedef void (CV_CDECL *CvDNNLayerRelease)(CvDNNLayer** layer);
 typedef void (CV_CDECL *CvDNNLayerClear)(CvDNNLayer* layer);
+typedef void (CV_CDECL *CvDNNLayerStep)(CvDNNLayer* layer, int t, int n_batches);
 
 #define CV_DNN_LAYER_FIELDS()                                         \
     /* Indicator of the layer's type */                               \
@@ -62,10 +70,21 @@ typedef void (CV_CDECL *CvDNNLayerClear)(CvDNNLayer* layer);
     int time_index;                                                     \
     /* sequence length, for attention model: n_glimpses*n_targets */    \
     int seq_length;                                                     \
+    /* recurrent layers in sequence mode: number of time steps that */ \
+    /* gradients flow back through, the whole sequence if 0 */          \
+    int bptt_window;                                                    \
+    /* recurrent layers in sequence mode: whether the last states of */ \
+    /* a batch are the initial states of the next one, so that rows */  \
+    /* of consecutive batches continue the same streams */              \
+    int stateful;                                                       \
+    /* number of rows of the states carried over, 0 after a reset */    \
+    int n_carried;                                                      \
                                                                         \
     /* activation function type for hidden layer activation, */         \
     /* either sigmoid,tanh,softmax or relu */                           \
     char activation[20];                                                \
+    /* activation resolved to CV_DNN_ACTIVATION_* at layer creation */  \
+    int activation_type;                                                \
     /* Learning rate at the first iteration */                          \
     float init_learn_rate;                                              \
     /* Dynamics of learning rate decreasing */                          \
@@ -79,8 +98,11 @@ typedef void (CV_CDECL *CvDNNLayerClear)(CvDNNLayer* layer);
     /* Trainable weights of the layer (including bias) */               \
     /* i-th row is a set of weights of the i-th output plane */         \
     CvMat* weights;                                                     \
-    /* Weights matrix from backward pass, for gradient checking */      \
+    /* Gradient store: backward only sums dE_dW of the weights here, */ \
+    /* which are changed by an explicit step (see cvStepNetwork) */     \
     CvMat * dE_dW;                                                      \
+    /* Number of backward passes summed into dE_dW since last step */   \
+    int n_grads;                                                        \
     /* output states, default size: (n_output_planes, batch_size) */    \
     CvMat * Y;                                                          \
                                                                         \
@@ -88,6 +110,9 @@ typedef void (CV_CDECL *CvDNNLayerClear)(CvDNNLayer* layer);
     CvDNNLayerBackward backward;                                        \
     CvDNNLayerRelease  release;                                         \
     CvDNNLayerClear  clear;                                             \
+    /* Applies and resets the gradient store, null for layers without */ \
+    /* trainable weights */                                             \
+    CvDNNLayerStep   step;                                              \
     /* Pointers to the previous and next layers in the network */       \
     CvDNNLayer* prev_layer;                                             \
     CvDNNLayer* next_layer;                                             \
@@ -101,6 +126,22 @@ typedef void (CV_CDECL *CvDNNLayerClear)(CvDNNLayer* layer);
     /* Enable memory cache for reducing memory allocation overhead */   \
     CvMat * dY_dX;                                                      \
     int enable_cache;                                                   \
+    /* Arena where scratch buffers of forward/backward pass are taken */ \
+    CvDNNWorkspace * workspace;                                         \
+    /* Buffers of the layer by slot, see cvGetWorkspaceMat */           \
+    CvDNNWorkspaceBuffer * ws_slots[CV_DNN_WORKSPACE_SLOTS];            \
+    /* Bits of the slots only read within the passes of a batch, see */ \
+    /* cvReleaseWorkspaceScratch */                                      \
+    unsigned ws_scratch;                                                \
+    /* Layer of the shared network, if this is a copy of it made for */ \
+    /* an execution context; weights are shared with the copy */        \
+    CvDNNLayer * shared_layer;                                          \
+    /* Rule and state by which gradients are applied to the weights, */ \
+    /* plain gradient descent if null */                                \
+    CvDNNOptimizer * optimizer;                                         \
+    /* Calibration or int8 weights of the layer for quantized inference, */ \
+    /* null for float inference, see cvQuantizeNetwork */                \
+    CvDNNQuantization * quant;                                          \
                                                                         \
     int visualize
 
@@ -120,11 +161,91 @@ typedef struct CvDNNLayer
 #define ICV_DNN_TIMEDISTRIBUTED_LAYER    0x00008888
 #define ICV_DNN_LSTM_LAYER           0x00009999
 #define ICV_DNN_REPEATVECTOR_LAYER      0x0000AAAA
+#define ICV_DNN_GRU_LAYER            0x0000BBBB
 
 #define CV_DNN_LEARN_RATE_DECREASE_HYPERBOLICALLY  1
 #define CV_DNN_LEARN_RATE_DECREASE_SQRT_INV        2
 #define CV_DNN_LEARN_RATE_DECREASE_LOG_INV         3
 
+// algorithms for computing forward pass of convolution layer
+#define CV_DNN_CONVOLUTION_DIRECT                  0
+#define CV_DNN_CONVOLUTION_IM2COL                  1
+#define CV_DNN_CONVOLUTION_FFT                     2
+#define CV_DNN_CONVOLUTION_WINOGRAD_2X2            3
+#define CV_DNN_CONVOLUTION_WINOGRAD_4X4            4
+// select the fastest of above algorithms at first forward pass
+#define CV_DNN_CONVOLUTION_AUTO                    5
+
+// alignment of buffers handed out by workspace arena, in bytes
+#define CV_DNN_WORKSPACE_ALIGN                     32
+
+typedef struct CvDNNWorkspaceBuffer
+{
+  // layer and slot index the buffer is reserved for
+  CvDNNLayer * owner;
+  int slot;
+  // arena the buffer is accounted in, null for a layer without one
+  CvDNNWorkspace * workspace;
+  // allocated memory and its aligned part of <capacity> bytes
+  void * raw;
+  uchar * data;
+  size_t capacity;
+  // header handed out to the owner, re-initialized on every request
+  CvMat mat;
+  struct CvDNNWorkspaceBuffer * prev;
+  struct CvDNNWorkspaceBuffer * next;
+}CvDNNWorkspaceBuffer;
+
+// Arena of scratch buffers shared by all layers of a network. Buffers are 
+// requested by (layer, slot) and only grow, so that once the largest batch
+// has been processed, forward and backward passes perform no heap allocation.
+// Layers keep their buffers in a slot array, the arena keeps them listed for
+// accounting; each execution context has its own arena, which is not locked.
+typedef struct CvDNNWorkspace
+{
+  CvDNNWorkspaceBuffer * buffers;
+  int n_buffers;
+  // number of heap allocations performed by the arena since its creation
+  int n_allocs;
+  // total size of all buffers, in bytes, and the largest it has been
+  size_t total_bytes;
+  size_t peak_bytes;
+}CvDNNWorkspace;
+
+// update rules of optimizers, momentum and Nesterov momentum keep a velocity
+// per weight, Adam and AdamW the running means of gradient and its square
+#define CV_DNN_OPTIMIZER_SGD        0
+#define CV_DNN_OPTIMIZER_MOMENTUM   1
+#define CV_DNN_OPTIMIZER_NESTEROV   2
+#define CV_DNN_OPTIMIZER_ADAM       3
+#define CV_DNN_OPTIMIZER_ADAMW      4
+
+typedef struct CvDNNOptimizerState
+{
+  // data of the weights the state is kept for
+  const uchar * owner;
+  // velocity, or first moment for Adam, and second moment for Adam
+  CvMat * m;
+  CvMat * v;
+  // number of updates applied, for bias correction of Adam
+  int t;
+  struct CvDNNOptimizerState * next;
+}CvDNNOptimizerState;
+
+// Optimizer shared by all layers of a network, with states created at the
+// first update of each weights matrix. Weights are told apart by their data,
+// so that sub-matrices of weights have states of their own.
+typedef struct CvDNNOptimizer
+{
+  int type;
+  float momentum;      // momentum, or decay rate of first moment for Adam
+  float beta2;         // decay rate of second moment for Adam
+  float epsilon;
+  // L2 penalty added to gradient, or decoupled weight decay for AdamW
+  float weight_decay;
+  CvDNNOptimizerState * states;
+}CvDNNOptimizer;
+
 CV_INLINE
 int icvIsDNNLayer( CvDNNLayer * layer ) {
   return ( ((layer) != NULL) &&
@@ -167,6 +288,39 @@ int icvIsSimpleRNNLayer( CvDNNLayer * layer ) {
            (((CvDNNLayer*) (layer))->flags & ~CV_MAGIC_MASK) == ICV_DNN_RECURRENTNN_LAYER );
 }
 
+CV_INLINE
+int icvIsLSTMLayer( CvDNNLayer * layer ) {
+  return ( (icvIsDNNLayer( layer )) &&
+           (((CvDNNLayer*) (layer))->flags & ~CV_MAGIC_MASK) == ICV_DNN_LSTM_LAYER );
+}
+
+CV_INLINE
+int icvIsGRULayer( CvDNNLayer * layer ) {
+  return ( (icvIsDNNLayer( layer )) &&
+           (((CvDNNLayer*) (layer))->flags & ~CV_MAGIC_MASK) == ICV_DNN_GRU_LAYER );
+}
+
+// time_index of a recurrent layer running all time steps of the sequence in a
+// single call, instead of one copy of the layer per time step; LSTM and GRU 
+// layers always run in this mode
+#define CV_DNN_RNN_SEQUENCE         -1
+
+/* Recurrent layer in sequence mode, its input and output rows hold all time
+   steps of a sample one after another. */
+CV_INLINE
+int icvIsSequenceRNNLayer( CvDNNLayer * layer ) {
+  return ( (icvIsSimpleRNNLayer( layer ) || icvIsLSTMLayer( layer ) || icvIsGRULayer( layer )) &&
+           layer->time_index==CV_DNN_RNN_SEQUENCE );
+}
+
+/* Whether gradients at time step <t> of a recurrent layer in sequence mode
+   flow back to time step t-1, they do not across the boundaries of the
+   windows of truncated back propagation through time. */
+CV_INLINE
+int icvIsBPTTConnected( const CvDNNLayer * layer, int t ) {
+  return ( t>0 && (layer->bptt_window<=0 || t%layer->bptt_window!=0) );
+}
+
 CV_INLINE
 int icvIsMergeLayer( CvDNNLayer * layer ) {                              
   return ( (icvIsDNNLayer( layer )) &&
@@ -190,11 +344,23 @@ typedef struct CvDNNConvolutionLayer
   CV_DNN_LAYER_FIELDS();
   // Kernel size (height and width) for convolution.
   int K;
+  // algorithm for computing forward pass, e.g. CV_DNN_CONVOLUTION_DIRECT
+  int algorithm;
   // for simard method
   CvMat * WX; 
-  // (x1+x2+x3+x4), where x1,...x4 are some elements of X
-  // - is the vector used in computing of the activation function in backward
-  CvMat * sumX;//for simard method
+  // (x1+x2+...+xn), where x1,...,xn are input planes of X, 
+  // default size: (batch_size, input_height*input_width)
+  CvMat * sumX;
+  // lowered input for im2col method, each sample takes (K*K+1) rows of 
+  // output_height*output_width columns, default size: (K*K+1, batch_size*Ysize)
+  CvMat * Xcol;
+  // transformed weights for winograd and fft methods
+  CvMat * Wt;
+  // copy of weights where Wt is transformed from, Wt is re-computed once 
+  // weights are updated
+  CvMat * Wt_src;
+  // algorithm Wt is transformed for
+  int Wt_algorithm;
   // connections matrix, (i,j)-th element is 1 iff there is a connection between
   // i-th plane of the current layer and j-th plane of the previous layer;
   // (i,j)-th element is equal to 0 otherwise
@@ -272,6 +438,40 @@ typedef struct CvDNNSimpleRNNLayer
   CvMat * dWxh, * dWhh, * dWhy;
 }CvDNNSimpleRNNLayer;
 
+typedef struct CvDNNLSTMLayer
+{
+  CV_DNN_LAYER_FIELDS();
+  // weights are packed in a matrix of size (4*n_output_planes, n_input_planes+n_output_planes+1),
+  // with rows of input, forget, cell and output gates, and columns of input 
+  // weights, recurrent weights and bias
+  // -------------------------------------------------------
+  // VARIABLES REQUIRED FOR COMPUTING FORWARD & BACKWARD PASS
+  // -------------------------------------------------------
+  // gate activations, size: (batch_size, seq_length*4*n_output_planes)
+  CvMat * gates;
+  // cell states, size: (batch_size, seq_length*n_output_planes)
+  CvMat * C;
+  // hidden states, size: (batch_size, seq_length*n_output_planes)
+  CvMat * H;
+}CvDNNLSTMLayer;
+
+typedef struct CvDNNGRULayer
+{
+  CV_DNN_LAYER_FIELDS();
+  // weights are packed in a matrix of size (3*n_output_planes, n_input_planes+n_output_planes+1),
+  // with rows of reset, update and candidate gates, and columns of input 
+  // weights, recurrent weights and bias
+  // -------------------------------------------------------
+  // VARIABLES REQUIRED FOR COMPUTING FORWARD & BACKWARD PASS
+  // -------------------------------------------------------
+  // gate activations, size: (batch_size, seq_length*3*n_output_planes)
+  CvMat * gates;
+  // recurrent projections of the gates, size: (batch_size, seq_length*3*n_output_planes)
+  CvMat * HH;
+  // hidden states, size: (batch_size, seq_length*n_output_planes)
+  CvMat * H;
+}CvDNNGRULayer;
+
 typedef struct CvDNNInputLayer
 {
   // shape of the data are available in common `layer fields`
@@ -301,6 +501,15 @@ typedef struct CvDNNMergeLayer
 }CvDNNMergeLayer;
 
 /*------------------------ activation functions -----------------------*/
+#define CV_DNN_ACTIVATION_NONE     0
+#define CV_DNN_ACTIVATION_TANH     1
+#define CV_DNN_ACTIVATION_SIGMOID  2
+#define CV_DNN_ACTIVATION_RELU     3
+#define CV_DNN_ACTIVATION_SOFTMAX  4
+
+CVAPI(int) cvGetActivationType(const char * activation);
+CVAPI(void) cvActivate(int activation, const CvMat * src, const CvMat * bias, CvMat * WX, CvMat * Y);
+CVAPI(void) cvActivateDer(int activation, const CvMat * WX, const CvMat * dE_dY, CvMat * dE_dY_afder);
 CVAPI(void) cvTanh(CvMat * src, CvMat * dst);
 CVAPI(void) cvTanhDer(CvMat * src, CvMat * dst);
 CVAPI(void) cvSigmoid(CvMat * src, CvMat * dst);
@@ -309,6 +518,67 @@ CVAPI(void) cvReLU(CvMat * src, CvMat * dst);
 CVAPI(void) cvReLUDer(CvMat * src, CvMat * dst);
 CVAPI(void) cvSoftmax(CvMat * src, CvMat * dst);
 CVAPI(void) cvSoftmaxDer(CvMat * X, CvMat * dE_dY, CvMat * dE_dY_afder);
+CVAPI(void) cvSoftmaxCrossEntropyDer(const CvMat * X, const CvMat * target, CvMat * dE_dX);
+
+/*------------------------ vectorized math functions ------------------*/
+#define CV_DNN_FASTMATH_SCALAR 0
+#define CV_DNN_FASTMATH_SSE2   1
+#define CV_DNN_FASTMATH_AVX2   2
+
+CVAPI(int) cvSetFastMathLevel(int level);
+CVAPI(int) cvGetFastMathLevel();
+CVAPI(void) cvFastExp(const CvMat * src, CvMat * dst);
+
+/*------------------------ optimizers ---------------------------------*/
+CVAPI(int) cvGetOptimizerType(const char * optimizer);
+CVAPI(CvDNNOptimizer*) cvCreateDNNOptimizer(int type, float momentum, float beta2, float epsilon,
+                                            float weight_decay);
+CVAPI(void) cvReleaseDNNOptimizer(CvDNNOptimizer ** optimizer);
+CVAPI(void) cvOptimizerUpdate(CvDNNOptimizer * optimizer, CvMat * weights, const CvMat * dE_dW,
+                              float learn_rate);
+
+/*------------------------ reduced precision --------------------------*/
+// while input ranges are collected in float forward passes
+#define CV_DNN_QUANT_CALIBRATE   1
+// when forward passes run on int8 weights and inputs
+#define CV_DNN_QUANT_INT8        2
+// when forward passes read weights stored as IEEE half precision floats,
+// or as bfloat16 (upper half of float), accumulating in float
+#define CV_DNN_QUANT_FP16        3
+#define CV_DNN_QUANT_BF16        4
+// rows of int8 operands are padded with zeros to a multiple of this
+#define CV_DNN_QUANT_ALIGN      16
+
+// Symmetric int8 quantization of the input and weights of a convolution or
+// dense layer: input x is taken as round(x/xscale) clipped to [-127,127],
+// weights of each output channel with a scale of their own, so that the
+// output is acc*scale+bias for int32 accumulator acc of the channel.
+// With 16 bit storage, W holds the weights of a dense layer as CV_16U bits
+// and only bias is used besides.
+typedef struct CvDNNQuantization
+{
+  int state;
+  // largest magnitude of the input seen in calibration
+  float xmax;
+  float xscale;
+  // int8 weights without bias, (n_outputs, CV_DNN_QUANT_ALIGN padded inputs),
+  // or 16 bit weights without bias, (n_outputs, n_inputs)
+  CvMat * W;
+  // per channel output scale and bias, (1, n_outputs)
+  CvMat * scale;
+  CvMat * bias;
+}CvDNNQuantization;
+
+CVAPI(void) cvGEMMInt8(const CvMat * A, const CvMat * B, CvMat * C);
+
+CVAPI(void) cvGEMMFloat16(const CvMat * A, const CvMat * B, int storage, CvMat * C);
+
+/*------------------------ workspace arena ----------------------------*/
+CVAPI(CvDNNWorkspace*) cvCreateDNNWorkspace();
+CVAPI(void) cvReleaseDNNWorkspace(CvDNNWorkspace ** workspace);
+CVAPI(CvMat*) cvGetWorkspaceMat(CvDNNLayer * layer, int slot, int rows, int cols, int type);
+CVAPI(void) cvReleaseWorkspaceMats(CvDNNLayer * layer);
+CVAPI(void) cvReleaseWorkspaceScratch(CvDNNLayer * layer);
 
 CVAPI(CvDNNLayer*) cvCreateConvolutionLayer( 
     const int dtype, const char * name, const CvDNNLayer * ref_layer,
@@ -347,6 +617,16 @@ CVAPI(CvDNNLayer*) cvCreateSimpleRNNLayer(
     float init_learn_rate, int update_rule, const char * activation, 
     CvMat * Wxh, CvMat * Whh, CvMat * Why );
 
+CVAPI(CvDNNLayer*) cvCreateLSTMLayer( 
+    const int dtype, const char * name, 
+    int n_inputs, int n_outputs, int seq_length, 
+    float init_learn_rate, int update_rule, CvMat * weights );
+
+CVAPI(CvDNNLayer*) cvCreateGRULayer( 
+    const int dtype, const char * name, 
+    int n_inputs, int n_outputs, int seq_length, 
+    float init_learn_rate, int update_rule, CvMat * weights );
+
 CVAPI(CvDNNLayer*) cvCreateInputLayer( 
     const int dtype, const char * name, 
     int n_inputs, int input_height, int input_width, int seq_length,
@@ -0,0 +1,110 @@
+/** -*- c++ -*- 
+ *
+ * \file   perf_convolution.cpp
+ *
+ * \brief  timing of convolution layer forward pass with different 
+ *         algorithms, over the layer shapes of the models in data directory
+ */
+
+#include "cnn.h"
+#include <stdio.h>
+
+// (n_input_planes, input_size, n_output_planes, ksize), 
+// taken from convolution layers in data/*/*_model.yml
+static const int conv_shapes[][4] = {
+  { 1, 28,  6, 5}, { 6, 12, 16, 5},                 // mnist/lenet
+  { 3, 32, 12, 5}, {12, 14, 18, 5},                 // cifar/convnet
+  { 1, 64, 10, 5}, {10, 30, 50, 5}, {50, 13, 50, 5},// mnist/multi_convnet
+  { 1, 64,  4, 5}, { 4, 30, 10, 5}, {10, 13, 10, 5},// mnist/localize_convnet
+  { 1, 64,  6, 7}, { 6, 19, 16, 7},                 // mnist/multi_stn
+  { 1, 28,  6, 5}, { 6, 12, 16, 5},                 // mnist/multi_stn (st1)
+  { 1, 80,  6, 5}, { 6, 38, 10, 5}, {10, 17, 18, 5},// primate/convnet
+  { 1, 36,  6, 5}, { 6, 16, 16, 5},                 // svhn/dram
+  { 1, 28,  6, 3}, { 6, 13, 16, 3}, {16, 32, 32, 3},// 3x3 kernels
+};
+
+static const struct { int algorithm; const char * name; } conv_algorithms[] = {
+  {CV_DNN_CONVOLUTION_DIRECT, "direct"},
+  {CV_DNN_CONVOLUTION_IM2COL, "im2col"},
+  {CV_DNN_CONVOLUTION_FFT,    "fft"},
+  {CV_DNN_CONVOLUTION_WINOGRAD_2X2, "winograd_2x2"},
+  {CV_DNN_CONVOLUTION_WINOGRAD_4X4, "winograd_4x4"},
+};
+
+double icvTimeConvolutionForward(int algorithm, int n_inputs, int imsize, 
+                                 int n_outputs, int ksize, int batch_size, int niters)
+{
+  const int imsize_out = imsize-ksize+1;
+  CvDNNLayer * layer = cvCreateConvolutionLayer(
+    CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.01,1,"relu",0,0);
+  ((CvDNNConvolutionLayer*)layer)->algorithm = algorithm;
+  CvMat * X = cvCreateMat(batch_size,n_inputs*imsize*imsize,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs*imsize_out*imsize_out,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  layer->forward(layer,X,Y); // warm up
+  double t0 = (double)cvGetTickCount();
+  for (int iter=0;iter<niters;iter++){ layer->forward(layer,X,Y); }
+  double elapsed = ((double)cvGetTickCount()-t0)/(cvGetTickFrequency()*1000.*niters);
+  layer->release(&layer);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  return elapsed; // in ms
+}
+
+double icvTimeConvolutionBackward(int n_inputs, int imsize, int n_outputs, int ksize, 
+                                  int batch_size, int niters)
+{
+  const int imsize_out = imsize-ksize+1;
+  CvDNNLayer * layer = cvCreateConvolutionLayer(
+    CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.01,1,"relu",0,0);
+  CvMat * X = cvCreateMat(batch_size,n_inputs*imsize*imsize,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs*imsize_out*imsize_out,CV_32F);
+  CvMat * dE_dX = cvCreateMat(batch_size,n_inputs*imsize*imsize,CV_32F);
+  CvMat * dE_dY = cvCreateMat(batch_size,n_outputs*imsize_out*imsize_out,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,dE_dY,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  layer->forward(layer,X,Y);
+  layer->backward(layer,1,X,dE_dY,dE_dX); // warm up
+  double t0 = (double)cvGetTickCount();
+  for (int iter=0;iter<niters;iter++){ layer->backward(layer,iter+1,X,dE_dY,dE_dX); }
+  double elapsed = ((double)cvGetTickCount()-t0)/(cvGetTickFrequency()*1000.*niters);
+  layer->release(&layer);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dX);
+  cvReleaseMat(&dE_dY);
+  return elapsed; // in ms
+}
+
+int main(int argc, char * argv[])
+{
+  const int batch_size = argc>1?atoi(argv[1]):32;
+  const int niters = argc>2?atoi(argv[2]):10;
+  const int n_shapes = sizeof(conv_shapes)/sizeof(conv_shapes[0]);
+  const int n_algorithms = sizeof(conv_algorithms)/sizeof(conv_algorithms[0]);
+  fprintf(stderr,"batch_size: %d, iterations: %d\n",batch_size,niters);
+  fprintf(stdout,"%-24s","shape");
+  for (int ai=0;ai<n_algorithms;ai++){fprintf(stdout,"%14s",conv_algorithms[ai].name);}
+  fprintf(stdout,"%14s   (ms per batch)\n","backward");
+  for (int si=0;si<n_shapes;si++){
+    const int * shape = conv_shapes[si];
+    char label[64];
+    sprintf(label,"%d@%dx%d -> %d, K=%d",shape[0],shape[1],shape[1],shape[2],shape[3]);
+    fprintf(stdout,"%-24s",label);
+    for (int ai=0;ai<n_algorithms;ai++){
+      const int algorithm = conv_algorithms[ai].algorithm;
+      if ((algorithm==CV_DNN_CONVOLUTION_WINOGRAD_2X2 || 
+           algorithm==CV_DNN_CONVOLUTION_WINOGRAD_4X4) && shape[3]!=3){
+        fprintf(stdout,"%14s","-"); continue;
+      }
+      fprintf(stdout,"%14.3f",icvTimeConvolutionForward(algorithm,
+        shape[0],shape[1],shape[2],shape[3],batch_size,niters));
+      fflush(stdout);
+    }
+    fprintf(stdout,"%14.3f\n",icvTimeConvolutionBackward(
+      shape[0],shape[1],shape[2],shape[3],batch_size,niters));
+  }
+  return 0;
+}
@@ -0,0 +1,142 @@
+/** -*- c++ -*-
+ *
+ * \file   perf_training.cpp
+ *
+ * \brief  throughput (samples/sec) and convergence of synchronous and
+ *         asynchronous (Hogwild) training, on synthetic classification tasks
+ */
+
+#include "cnn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+static const int imsize = 16, ksize = 5, n_classes = 4;
+
+// small convnet, and a dense network of the same input size
+static CvNetwork * icvCreateBenchNetwork(int convnet)
+{
+  const int imsize_out = imsize-ksize+1, n_pooled = 6*(imsize_out/2)*(imsize_out/2);
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1));
+  if (convnet){
+    network->add_layer(network,
+      cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,6,ksize,.1,1,"tanh",0,0));
+    network->add_layer(network,
+      cvCreateMaxPoolingLayer(CV_32F,"pool1",0,6,imsize_out,imsize_out,2,.1,1,0));
+    network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,n_pooled,32,.1,1,"tanh",0));
+  }else{
+    network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,imsize*imsize,32,.1,1,"tanh",0));
+  }
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,32,n_classes,.1,1,"softmax",0));
+  return network;
+}
+
+// each sample is the template of its class with uniform noise added
+static void icvCreateBenchData(const CvMat * templates, int nsamples, 
+                               CvMat ** samples, CvMat ** responses, CvRNG * rng)
+{
+  CvMat noise_row, template_row;
+  *samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  *responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(rng,*samples,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvZero(*responses);
+  for (int si=0;si<nsamples;si++){
+    const int label = cvRandInt(rng)%n_classes;
+    cvGetRow(*samples,&noise_row,si);
+    cvGetRow(templates,&template_row,label);
+    cvAdd(&noise_row,&template_row,&noise_row);
+    CV_MAT_ELEM(**responses,float,si,label)=1;
+  }
+}
+
+static float icvBenchAccuracy(const CvMat * result, const CvMat * expected)
+{
+  int n_correct = 0;
+  for (int si=0;si<result->rows;si++){
+    CvPoint rloc, eloc; CvMat rrow, erow;
+    cvMinMaxLoc(cvGetRow(result,&rrow,si),0,0,0,&rloc);
+    cvMinMaxLoc(cvGetRow(expected,&erow,si),0,0,0,&eloc);
+    n_correct += (rloc.x==eloc.x);
+  }
+  return 100.f*n_correct/float(result->rows);
+}
+
+/* Trains a fresh network and reports training throughput, loss and accuracy
+   on the test samples. */
+static void icvBenchTraining(int convnet, int train_mode, int n_workers, int batch_size,
+                             int n_epochs, const CvMat * samples, const CvMat * responses,
+                             const CvMat * test_samples, const CvMat * test_responses)
+{
+  CvNetwork * network = icvCreateBenchNetwork(convnet);
+  CvDNNStatModelParams params;
+  memset(&params,0,sizeof(params));
+  params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+  params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+  cvSetIdentity(params.etalons);
+  params.network = network;
+  params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+  params.max_iter = 1;
+  params.batch_size = batch_size;
+  params.validate_ratio = .1f;
+  params.nepochs = n_epochs;
+  params.n_workers = n_workers;
+  params.train_mode = train_mode;
+
+  CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+  double t0 = (double)cvGetTickCount();
+  CvDNNStatModel * model = cvTrainCNNClassifierFromSource(source,&params);
+  double elapsed = ((double)cvGetTickCount()-t0)/(cvGetTickFrequency()*1e6);
+  source->release(&source);
+  cvReleaseMat(&params.etalons);
+
+  CvMat * result = cvCreateMat(test_responses->rows,test_responses->cols,CV_32F);
+  model->predict(network,test_samples,result,batch_size);
+  fprintf(stdout,"%-10s%-10s%10d%14.1f%12.4f%12.1f\n",convnet?"convnet":"dense",
+          train_mode==CV_DNN_TRAIN_HOGWILD?"hogwild":"sync",n_workers,
+          n_epochs*samples->rows*(1.-params.validate_ratio)/elapsed,
+          cvNorm(result,test_responses)/float(result->rows),
+          icvBenchAccuracy(result,test_responses));
+  fflush(stdout);
+  cvReleaseMat(&result);
+  model->release(&model);
+}
+
+int main(int argc, char * argv[])
+{
+#ifdef _OPENMP
+  const int max_workers = argc>1?atoi(argv[1]):omp_get_max_threads();
+#else
+  const int max_workers = argc>1?atoi(argv[1]):1;
+#endif
+  const int batch_size = argc>2?atoi(argv[2]):16;
+  const int n_epochs = argc>3?atoi(argv[3]):4;
+  const int nsamples = argc>4?atoi(argv[4]):4000;
+  CvRNG rng = cvRNG(-1);
+  CvMat * templates = cvCreateMat(n_classes,imsize*imsize,CV_32F);
+  CvMat * samples = 0, * responses = 0, * test_samples = 0, * test_responses = 0;
+  cvRandArr(&rng,templates,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  icvCreateBenchData(templates,nsamples,&samples,&responses,&rng);
+  icvCreateBenchData(templates,nsamples/4,&test_samples,&test_responses,&rng);
+  fprintf(stderr,"batch_size: %d, epochs: %d, samples: %d\n",batch_size,n_epochs,nsamples);
+  fprintf(stdout,"%-10s%-10s%10s%14s%12s%12s\n","network","mode","workers","samples/sec",
+          "test loss","test acc%");
+  for (int convnet=1;convnet>=0;convnet--){
+    for (int n_workers=1;n_workers<=max_workers;n_workers*=2){
+      icvBenchTraining(convnet,CV_DNN_TRAIN_SYNC,n_workers,batch_size,n_epochs,
+                       samples,responses,test_samples,test_responses);
+      if (n_workers>1){
+        icvBenchTraining(convnet,CV_DNN_TRAIN_HOGWILD,n_workers,batch_size,n_epochs,
+                         samples,responses,test_samples,test_responses);
+      }
+    }
+  }
+  cvReleaseMat(&templates);
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+  cvReleaseMat(&test_samples);
+  cvReleaseMat(&test_responses);
+  return 0;
+}
@@ -29,6 +29,8 @@
 #include "layers.h"
 #include "precomp.hpp"
 
+#include <vector>
+
 // void cvCopyEx(CvMat * src, CvMat * dst);
 
 CvMat * cvCloneTransposed(CvMat * src);
@@ -55,6 +57,9 @@ void icvCNNRepeatVectorBackward( CvDNNLayer* layer, int t, const CvMat*, const C
 void icvCNNConvolutionRelease( CvDNNLayer** p_layer );
 void icvCNNConvolutionForward( CvDNNLayer* layer, const CvMat* X, CvMat* Y );
 void icvCNNConvolutionBackward( CvDNNLayer*  layer, int t, const CvMat* X, const CvMat* dE_dY, CvMat* dE_dX );
+void icvCNNConvolutionPrepare( CvDNNLayer* layer );
+void icvCNNConvolutionUpdate( CvDNNLayer* layer, const CvMat* dE_dW, int t );
+void icvCNNConvolutionStep( CvDNNLayer* layer, int t, int n_batches );
 
 /*------------------ functions for sub-sampling layer -------------------*/
 void icvCNNMaxPoolingRelease( CvDNNLayer** p_layer );
@@ -65,11 +70,23 @@ void icvCNNMaxPoolingBackward( CvDNNLayer*  layer, int t, const CvMat* X, const
 void icvCNNDenseRelease( CvDNNLayer** p_layer );
 void icvCNNDenseForward( CvDNNLayer* layer, const CvMat* X, CvMat* Y );
 void icvCNNDenseBackward( CvDNNLayer* layer, int t, const CvMat*, const CvMat* dE_dY, CvMat* dE_dX );
+void icvCNNDenseUpdate( CvDNNLayer* layer, const CvMat* dE_dW, int t );
+void icvCNNDenseStep( CvDNNLayer* layer, int t, int n_batches );
 
 /*-------------- functions for recurrent layer -----------------------*/
 void icvCNNRecurrentRelease( CvDNNLayer** p_layer );
 void icvCNNRecurrentForward( CvDNNLayer* layer, const CvMat* X, CvMat* Y );
 void icvCNNRecurrentBackward( CvDNNLayer* layer, int t, const CvMat*, const CvMat* dE_dY, CvMat* dE_dX );
+void icvCNNRecurrentStep( CvDNNLayer* layer, int t, int n_batches );
+
+/*-------------- functions for LSTM and GRU layers ------------------*/
+void icvCNNLSTMRelease( CvDNNLayer** p_layer );
+void icvCNNLSTMForward( CvDNNLayer* layer, const CvMat* X, CvMat* Y );
+void icvCNNLSTMBackward( CvDNNLayer* layer, int t, const CvMat*, const CvMat* dE_dY, CvMat* dE_dX );
+void icvCNNGRURelease( CvDNNLayer** p_layer );
+void icvCNNGRUForward( CvDNNLayer* layer, const CvMat* X, CvMat* Y );
+void icvCNNGRUBackward( CvDNNLayer* layer, int t, const CvMat*, const CvMat* dE_dY, CvMat* dE_dX );
+void icvCNNGatedRecurrentStep( CvDNNLayer* layer, int t, int n_batches );
 
 /*-------------- functions for multi target layer -----------------------*/
 void icvCNNMergeRelease( CvDNNLayer** p_layer );
@@ -85,4 +102,54 @@ CvDNNLayer* icvCreateLayer( int layer_type,
 
 void icvVisualizeCNNLayer(CvDNNLayer * layer, const CvMat * Y);
 
+/*----------- vectorized transcendental functions on float arrays -------*/
+void icvExp_32f( const float * src, float * dst, int n );
+void icvTanh_32f( const float * src, float * dst, int n );
+void icvSigmoid_32f( const float * src, float * dst, int n );
+void icvLSTMCell_32f( float * gates, const float * bias, const float * c_prev, 
+                      float * c, float * h, int n );
+void icvGRUCell_32f( float * gates, const float * hh, const float * bias, const float * h_prev,
+                     float * h, int n );
+void icvBilinearSample_32f( const float * src, int height, int width, int nchannels,
+                            float x0, float y0, float dx, float dy, float * dst, int dst_step, int n );
+
+/*------------------------- reduced precision ---------------------------*/
+void icvQuantizeInt8( const float * src, float scale, schar * dst, int n );
+void icvDequantizeInt32( const int * src, const float * scale, const float * bias, int step,
+                         int relu, float * dst, int n );
+void icvCalibrateQuantization( CvDNNQuantization * quant, const CvMat * X );
+void icvReleaseQuantization( CvDNNQuantization ** quant );
+void icvDequantizeLayer( CvDNNLayer * layer );
+void icvWriteQuantization( CvFileStorage * fs, const char * name, const CvDNNQuantization * quant );
+CvDNNQuantization * icvReadQuantization( CvFileStorage * fs, CvFileNode * node );
+
+/*----------------------- half precision conversion ---------------------*/
+void icvFloatToHalf( const float * src, unsigned short * dst, int n );
+void icvHalfToFloat( const unsigned short * src, float * dst, int n );
+void icvFloatToBFloat16( const float * src, unsigned short * dst, int n );
+void icvBFloat16ToFloat( const unsigned short * src, float * dst, int n );
+
+/*------------------- worker side of parameter server -------------------*/
+typedef struct CvDNNParamClient
+{
+  int fd;
+  int worker_id;
+  int n_workers;
+  int clock;
+  int compression;
+  float topk_ratio;
+  int n_weights;
+  int n_grads;
+  float * grad;
+  // gradient not sent yet with top-k compression
+  float * residual;
+  std::vector<char> payload;
+}CvDNNParamClient;
+
+CvDNNParamClient * icvConnectParamServer( const char * host, int port, const struct CvDNNExecPlan * plan,
+                                          int compression, float topk_ratio );
+void icvExchangeGradients( CvDNNParamClient * client, const struct CvDNNExecPlan * plan,
+                           int n_batches );
+void icvCloseParamClient( CvDNNParamClient ** client );
+
 #endif // __DNN_H__
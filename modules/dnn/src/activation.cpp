@@ -0,0 +1,195 @@
+/** -*- c++ -*-
+ *
+ * \file   activation.cpp
+ * \date   Sat Oct 17 16:40:05 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  bias and activation epilogues fused into a single pass
+ */
+
+#include "_dnn.h"
+
+ML_IMPL int cvGetActivationType(const char * activation)
+{
+  if (!activation){return -1;}
+  if (!strcmp(activation,"none")){return CV_DNN_ACTIVATION_NONE;}
+  if (!strcmp(activation,"tanh")){return CV_DNN_ACTIVATION_TANH;}
+  if (!strcmp(activation,"sigmoid")){return CV_DNN_ACTIVATION_SIGMOID;}
+  if (!strcmp(activation,"relu")){return CV_DNN_ACTIVATION_RELU;}
+  if (!strcmp(activation,"softmax")){return CV_DNN_ACTIVATION_SOFTMAX;}
+  return -1;
+}
+
+// one loop per combination of optional arguments, so that each loop body
+// is branch free and can be vectorized
+#define ICV_DNN_ACTIVATE_ROW(fx)                                          \
+  if (bias){                                                            \
+    if (wx){ for (j=0;j<n;j++){ T x = src[j]+bias[j]; wx[j] = x; y[j] = (fx); } } \
+    else   { for (j=0;j<n;j++){ T x = src[j]+bias[j]; y[j] = (fx); } }             \
+  }else{                                                                \
+    if (wx){ for (j=0;j<n;j++){ T x = src[j]; wx[j] = x; y[j] = (fx); } }          \
+    else   { for (j=0;j<n;j++){ T x = src[j]; y[j] = (fx); } }                     \
+  }
+
+/* y = f(src+bias), keeping src+bias in wx if given, for activation
+   functions applied element-wise. */
+template<typename T>
+static void icvActivateRow(int activation, const T * src, const T * bias, T * wx, T * y, int n)
+{
+  int j;
+  switch (activation){
+  case CV_DNN_ACTIVATION_NONE:    ICV_DNN_ACTIVATE_ROW(x); break;
+  case CV_DNN_ACTIVATION_TANH:    ICV_DNN_ACTIVATE_ROW(tanh(x)); break;
+  case CV_DNN_ACTIVATION_SIGMOID: ICV_DNN_ACTIVATE_ROW(T(1)/(T(1)+exp(-x))); break;
+  case CV_DNN_ACTIVATION_RELU:    ICV_DNN_ACTIVATE_ROW(x>0?x:T(0)); break;
+  }
+}
+
+#undef ICV_DNN_ACTIVATE_ROW
+
+// float rows run tanh and sigmoid through the vectorized functions, a
+// block at a time so that the biased input is still in cache
+#define ICV_DNN_ACTIVATE_BLOCK 256
+
+static void icvActivateRow(int activation, const float * src, const float * bias, float * wx, float * y, int n)
+{
+  if (activation!=CV_DNN_ACTIVATION_TANH && activation!=CV_DNN_ACTIVATION_SIGMOID){
+    icvActivateRow<float>(activation,src,bias,wx,y,n); return;
+  }
+  for (int j0=0;j0<n;j0+=ICV_DNN_ACTIVATE_BLOCK){
+    const int m = n-j0<ICV_DNN_ACTIVATE_BLOCK?n-j0:ICV_DNN_ACTIVATE_BLOCK;
+    icvActivateRow<float>(CV_DNN_ACTIVATION_NONE,src+j0,bias?bias+j0:0,wx?wx+j0:0,y+j0,m);
+    if (activation==CV_DNN_ACTIVATION_TANH){icvTanh_32f(y+j0,y+j0,m);}
+    else{icvSigmoid_32f(y+j0,y+j0,m);}
+  }
+}
+
+/* dst = f'(wx).*dy, dst may be the same as dy. */
+template<typename T>
+static void icvActivateDerRow(int activation, const T * wx, const T * dy, T * dst, int n)
+{
+  int j;
+  switch (activation){
+  case CV_DNN_ACTIVATION_NONE:
+    for (j=0;j<n;j++){ dst[j] = dy[j]; } break;
+  case CV_DNN_ACTIVATION_TANH:
+    for (j=0;j<n;j++){ T t = tanh(wx[j]); dst[j] = (T(1)-t*t)*dy[j]; } break;
+  case CV_DNN_ACTIVATION_SIGMOID:
+    for (j=0;j<n;j++){ T s = T(1)/(T(1)+exp(-wx[j])); dst[j] = s*(T(1)-s)*dy[j]; } break;
+  case CV_DNN_ACTIVATION_RELU:
+    for (j=0;j<n;j++){ dst[j] = wx[j]>0?dy[j]:T(0); } break;
+  }
+}
+
+static void icvActivateDerRow(int activation, const float * wx, const float * dy, float * dst, int n)
+{
+  float fx[ICV_DNN_ACTIVATE_BLOCK];
+  if (activation!=CV_DNN_ACTIVATION_TANH && activation!=CV_DNN_ACTIVATION_SIGMOID){
+    icvActivateDerRow<float>(activation,wx,dy,dst,n); return;
+  }
+  for (int j0=0;j0<n;j0+=ICV_DNN_ACTIVATE_BLOCK){
+    const int m = n-j0<ICV_DNN_ACTIVATE_BLOCK?n-j0:ICV_DNN_ACTIVATE_BLOCK;
+    if (activation==CV_DNN_ACTIVATION_TANH){
+      icvTanh_32f(wx+j0,fx,m);
+      for (int j=0;j<m;j++){ dst[j0+j] = (1.f-fx[j]*fx[j])*dy[j0+j]; }
+    }else{
+      icvSigmoid_32f(wx+j0,fx,m);
+      for (int j=0;j<m;j++){ dst[j0+j] = fx[j]*(1.f-fx[j])*dy[j0+j]; }
+    }
+  }
+}
+
+/* Adds <bias> (a vector with one element per column, or null) to each row
+   of <src>, keeps the result in <WX> (or not, if null) and writes its
+   activation to <Y>, all in a single pass. <src> may be the same as <WX>
+   or <Y>. Softmax is computed on rows of the biased input afterwards. */
+ML_IMPL void cvActivate(int activation, const CvMat * src, const CvMat * bias, CvMat * WX, CvMat * Y)
+{
+  CV_FUNCNAME("cvActivate");
+  __BEGIN__;
+  const int type = CV_MAT_TYPE(src->type);
+  const int nr = src->rows, nc = src->cols;
+  CV_ASSERT(CV_ARE_SIZES_EQ(src,Y) && CV_ARE_TYPES_EQ(src,Y));
+  CV_ASSERT(!WX || (CV_ARE_SIZES_EQ(src,WX) && CV_ARE_TYPES_EQ(src,WX)));
+  CV_ASSERT(!bias || (CV_ARE_TYPES_EQ(src,bias) && bias->rows*bias->cols==nc &&
+                      (bias->rows==1 || CV_IS_MAT_CONT(bias->type))));
+  if (activation<CV_DNN_ACTIVATION_NONE || activation>CV_DNN_ACTIVATION_SOFTMAX){
+    CV_ERROR(CV_StsBadArg,"Unknown activation type");
+  }
+  if (activation==CV_DNN_ACTIVATION_SOFTMAX){
+    // biased input is staged in WX, or in Y if it's not kept
+    CvMat * dst = WX?WX:Y;
+    CV_CALL(cvActivate(CV_DNN_ACTIVATION_NONE,src,bias,0,dst));
+    CV_CALL(cvSoftmax(dst,Y));
+    EXIT;
+  }
+  if (type==CV_32F){
+    const float * bptr = bias?bias->data.fl:0;
+    for (int ri=0;ri<nr;ri++){
+      icvActivateRow(activation,(const float*)(src->data.ptr+src->step*ri),bptr,
+                     WX?(float*)(WX->data.ptr+WX->step*ri):(float*)0,
+                     (float*)(Y->data.ptr+Y->step*ri),nc);
+    }
+  }else if (type==CV_64F){
+    const double * bptr = bias?bias->data.db:0;
+    for (int ri=0;ri<nr;ri++){
+      icvActivateRow(activation,(const double*)(src->data.ptr+src->step*ri),bptr,
+                     WX?(double*)(WX->data.ptr+WX->step*ri):(double*)0,
+                     (double*)(Y->data.ptr+Y->step*ri),nc);
+    }
+  }else{
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
+  }
+  __END__;
+}
+
+/* dE_dY_afder = f'(WX).*dE_dY in a single pass, without computing f'(WX)
+   into a matrix of its own. <dE_dY_afder> may be the same as <dE_dY>. */
+ML_IMPL void cvActivateDer(int activation, const CvMat * WX, const CvMat * dE_dY, CvMat * dE_dY_afder)
+{
+  CV_FUNCNAME("cvActivateDer");
+  __BEGIN__;
+  const int type = CV_MAT_TYPE(WX->type);
+  const int nr = WX->rows, nc = WX->cols;
+  if (activation==CV_DNN_ACTIVATION_SOFTMAX){
+    CV_CALL(cvSoftmaxDer((CvMat*)WX,(CvMat*)dE_dY,dE_dY_afder));
+    EXIT;
+  }
+  CV_ASSERT(CV_ARE_SIZES_EQ(WX,dE_dY) && CV_ARE_TYPES_EQ(WX,dE_dY));
+  CV_ASSERT(CV_ARE_SIZES_EQ(WX,dE_dY_afder) && CV_ARE_TYPES_EQ(WX,dE_dY_afder));
+  if (activation<CV_DNN_ACTIVATION_NONE || activation>CV_DNN_ACTIVATION_SOFTMAX){
+    CV_ERROR(CV_StsBadArg,"Unknown activation type");
+  }
+  if (type==CV_32F){
+    for (int ri=0;ri<nr;ri++){
+      icvActivateDerRow(activation,(const float*)(WX->data.ptr+WX->step*ri),
+                        (const float*)(dE_dY->data.ptr+dE_dY->step*ri),
+                        (float*)(dE_dY_afder->data.ptr+dE_dY_afder->step*ri),nc);
+    }
+  }else if (type==CV_64F){
+    for (int ri=0;ri<nr;ri++){
+      icvActivateDerRow(activation,(const double*)(WX->data.ptr+WX->step*ri),
+                        (const double*)(dE_dY->data.ptr+dE_dY->step*ri),
+                        (double*)(dE_dY_afder->data.ptr+dE_dY_afder->step*ri),nc);
+    }
+  }else{
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
+  }
+  __END__;
+}
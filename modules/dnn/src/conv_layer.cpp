@@ -25,8 +25,39 @@
 
 #include "_dnn.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 void icvCNNConvolutionForwardDirect( CvDNNLayer* _layer, const CvMat* X, CvMat* Y );
 void icvCNNConvolutionForwardFFT( CvDNNLayer* _layer, const CvMat* X, CvMat* Y );
+void icvCNNConvolutionForwardIm2col( CvDNNLayer* _layer, const CvMat* X, CvMat* Y );
+void icvCNNConvolutionForwardWinograd( CvDNNLayer* _layer, const CvMat* X, CvMat* Y );
+void icvCNNConvolutionSelectAlgorithm( CvDNNLayer* _layer, const CvMat* X, CvMat* Y );
+void icvCNNConvolutionForwardInt8( CvDNNLayer* _layer, const CvMat* X, CvMat* Y );
+static void icvCNNConvolutionSumPlanes( CvDNNConvolutionLayer * layer, const CvMat * X );
+static void icvCNNConvolutionTransformWeights( 
+    CvDNNConvolutionLayer * layer, const CvMat * weights, int algorithm );
+
+// slots of scratch buffers taken from workspace arena
+#define ICV_CONV_WS_WX          0
+#define ICV_CONV_WS_Y           1
+#define ICV_CONV_WS_SUMX        2
+#define ICV_CONV_WS_XCOL        3
+#define ICV_CONV_WS_YCOL        4
+#define ICV_CONV_WS_DEDY        5
+#define ICV_CONV_WS_DEDY_AFDER  6
+#define ICV_CONV_WS_DEDW        7
+#define ICV_CONV_WS_DEDXCOL     8
+#define ICV_CONV_WS_DFT         9
+#define ICV_CONV_WS_SUMQ       10
+#define ICV_CONV_WS_XQ         11
+#define ICV_CONV_WS_ACC        12
+// all but the copy of output and the gradient store are filled again in each pass
+#define ICV_CONV_WS_SCRATCH \
+  ((1u<<ICV_CONV_WS_WX)|(1u<<ICV_CONV_WS_SUMX)|(1u<<ICV_CONV_WS_XCOL)|(1u<<ICV_CONV_WS_YCOL)| \
+   (1u<<ICV_CONV_WS_DEDY)|(1u<<ICV_CONV_WS_DEDY_AFDER)|(1u<<ICV_CONV_WS_DEDXCOL)|       \
+   (1u<<ICV_CONV_WS_DFT)|(1u<<ICV_CONV_WS_SUMQ)|(1u<<ICV_CONV_WS_XQ)|(1u<<ICV_CONV_WS_ACC))
 
 /*************************************************************************/
 ML_IMPL CvDNNLayer* cvCreateConvolutionLayer( 
@@ -51,6 +82,10 @@ ML_IMPL CvDNNLayer* cvCreateConvolutionLayer(
   if ( K < 1 || init_learn_rate <= 0 || init_learn_rate > 1 ) {
     CV_ERROR( CV_StsBadArg, "Incorrect parameters" );
   }
+  const int activation_type = cvGetActivationType(activation);
+  if ( activation_type<0 || activation_type==CV_DNN_ACTIVATION_SOFTMAX ) {
+    CV_ERROR( CV_StsBadArg, "Unknown activation type" );
+  }
 
   CV_CALL(layer = (CvDNNConvolutionLayer*)icvCreateLayer( 
     ICV_DNN_CONVOLUTION_LAYER, dtype, name, sizeof(CvDNNConvolutionLayer), 
@@ -60,11 +95,15 @@ ML_IMPL CvDNNLayer* cvCreateConvolutionLayer(
     icvCNNConvolutionRelease, icvCNNConvolutionForward, icvCNNConvolutionBackward ));
 
   strcpy(layer->activation,activation);
+  layer->activation_type = activation_type;
   layer->enable_cache = 1;
   layer->K = K;
+  layer->algorithm = CV_DNN_CONVOLUTION_DIRECT;
   layer->seq_length = 1;
   layer->visualize = visualize;
   layer->ref_layer = (CvDNNLayer*)ref_layer;
+  layer->step = icvCNNConvolutionStep;
+  layer->ws_scratch = ICV_CONV_WS_SCRATCH;
   if (input_layer){layer->input_layers.push_back((CvDNNLayer*)input_layer);}
   CV_CALL(layer->weights = cvCreateMat( n_output_planes, K*K+1, CV_32FC1 ));
   CV_CALL(layer->connect_mask = cvCreateMat( n_output_planes, n_input_planes, CV_8UC1));
@@ -117,11 +156,98 @@ ML_IMPL CvDNNLayer* cvCreateConvolutionLayer(
 
 void icvCNNConvolutionForward( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
 {
-#if 1
-  icvCNNConvolutionForwardDirect(_layer, X, Y);
-#else
-  icvCNNConvolutionForwardFFT(_layer, X, Y);
-#endif
+  CV_FUNCNAME("icvCNNConvolutionForward");
+
+  if (!icvIsConvolutionLayer(_layer)){CV_ERROR( CV_StsBadArg, "Invalid layer" );}
+
+  __BEGIN__;
+
+  CvDNNConvolutionLayer* layer = (CvDNNConvolutionLayer*) _layer;
+
+  if (layer->quant && layer->quant->state==CV_DNN_QUANT_INT8){
+    CV_CALL(icvCNNConvolutionForwardInt8(_layer, X, Y)); EXIT;
+  }
+
+  if (layer->algorithm==CV_DNN_CONVOLUTION_AUTO){
+    CV_CALL(icvCNNConvolutionSelectAlgorithm(_layer, X, Y));
+  }
+
+  switch (layer->algorithm){
+  case CV_DNN_CONVOLUTION_DIRECT: CV_CALL(icvCNNConvolutionForwardDirect(_layer, X, Y)); break;
+  case CV_DNN_CONVOLUTION_IM2COL: CV_CALL(icvCNNConvolutionForwardIm2col(_layer, X, Y)); break;
+  case CV_DNN_CONVOLUTION_FFT:    CV_CALL(icvCNNConvolutionForwardFFT(_layer, X, Y)); break;
+  case CV_DNN_CONVOLUTION_WINOGRAD_2X2:
+  case CV_DNN_CONVOLUTION_WINOGRAD_4X4: CV_CALL(icvCNNConvolutionForwardWinograd(_layer, X, Y)); break;
+  default: CV_ERROR(CV_StsBadArg,"Unknown convolution algorithm");
+  }
+
+  // all algorithms normalize X in place, the range of the planes summed up
+  // is what the int8 path quantizes
+  if (layer->quant && layer->quant->state==CV_DNN_QUANT_CALIBRATE){
+    CV_CALL(icvCNNConvolutionSumPlanes(layer, X));
+    icvCalibrateQuantization(layer->quant, layer->sumX);
+  }
+
+  __END__;
+}
+
+/* Normalize each input plane of X in place, to zero mean and .5/sdv scale. */
+static void icvCNNConvolutionNormalizeInput( CvDNNConvolutionLayer * layer, const CvMat * X )
+{
+  const int nXplanes = layer->n_input_planes;
+  const int Xsize    = layer->input_width*layer->input_height;
+  const int nsamples = X->rows;
+  CvScalar avg,sdv;
+  for ( int si = 0; si < nsamples; si++ ){
+  for ( int no = 0; no < nXplanes; no++ ){
+    float * xptr = X->data.fl+Xsize*nXplanes*si+Xsize*no;
+    CvMat img = cvMat(Xsize,1,CV_32F,xptr);
+    cvAvgSdv(&img,&avg,&sdv);
+    cvSubS(&img,avg,&img);
+    cvScale(&img,&img,.5f/(1e-5f+sdv.val[0]));
+  }
+  }
+}
+
+/* Keep a copy of WX (scaled, before activation) for backward pass, 
+   apply activation function on Y and keep the copy of Y as layer output. 
+   If <Ycol> is given, WX is read from its plane-major output planes, so that 
+   scattering them into Y is done in the same pass as activation. */
+static void icvCNNConvolutionActivate( CvDNNConvolutionLayer * layer, const CvMat * Ycol, CvMat * Y )
+{
+  CV_FUNCNAME("icvCNNConvolutionActivate");
+  __BEGIN__;
+
+  CV_CALL(layer->WX = cvGetWorkspaceMat((CvDNNLayer*)layer,ICV_CONV_WS_WX,Y->rows,Y->cols,CV_32F));
+
+  if (Ycol){
+    const int nYplanes = layer->n_output_planes;
+    const int Ysize = layer->output_width*layer->output_height;
+    CV_ASSERT( Ycol->rows == nYplanes && Ycol->cols == Y->rows*Ysize && CV_IS_MAT_CONT(Y->type) );
+    for ( int si = 0; si < Y->rows; si++ ){
+    for ( int no = 0; no < nYplanes; no++ ){
+      const int offset = Ysize*nYplanes*si+Ysize*no;
+      CvMat src = cvMat(1,Ysize,CV_32F,Ycol->data.fl+Ycol->cols*no+Ysize*si);
+      CvMat WX = cvMat(1,Ysize,CV_32F,layer->WX->data.fl+offset);
+      CvMat dst = cvMat(1,Ysize,CV_32F,Y->data.fl+offset);
+      CV_CALL(cvActivate(layer->activation_type,&src,0,&WX,&dst));
+    }
+    }
+  }else{
+    CV_CALL(cvActivate(layer->activation_type,Y,0,layer->WX,Y));
+  }
+
+  CV_ASSERT(cvCountNAN(Y)<1);
+  
+  // keep a copy of output for layers reading it via input_layers, unless
+  // the output itself has been bound to layer->Y in prediction or training
+  if (layer->Y!=Y){
+    CV_CALL(layer->Y = cvGetWorkspaceMat((CvDNNLayer*)layer,ICV_CONV_WS_Y,Y->rows,Y->cols,CV_32F));
+    cvCopy(Y,layer->Y);
+  }
+  if (layer->visualize){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
+
+  __END__;
 }
 
 void icvCNNConvolutionForwardDirect( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
@@ -152,33 +278,15 @@ void icvCNNConvolutionForwardDirect( CvDNNLayer* _layer, const CvMat* X, CvMat*
 
   const int nsamples = X->rows; // training batch size
 
-  // int no; xx, yy, ni, , kx, ky
-  // float *Yplane = 0, *Xplane = 0, *w = 0;
-  uchar* connect_mask_data = 0;
-
   CV_ASSERT( X->cols == nXplanes*Xsize && X->rows == nsamples );
   CV_ASSERT( Y->cols == nYplanes*Ysize && Y->rows == nsamples );
   CV_ASSERT( Xheight-K+1 == Yheight && Xwidth-K+1 == Ywidth );
 
   cvSetZero( Y );
 
-  // Yplane = Y->data.fl;
-  // w = layer->weights->data.fl;
-  connect_mask_data = layer->connect_mask->data.ptr;
-
   // normalize input
-  CvScalar avg,sdv;
-  for ( int si = 0; si < nsamples; si++ ){
-  for ( int no = 0; no < nXplanes; no++ ){
-    float * xptr = X->data.fl+Xsize*nXplanes*si+Xsize*no;
-    CvMat img = cvMat(Xsize,1,CV_32F,xptr);
-    cvAvgSdv(&img,&avg,&sdv);
-    cvSubS(&img,avg,&img);
-    cvScale(&img,&img,.5f/(1e-5f+sdv.val[0]));
-  }
-  }
+  icvCNNConvolutionNormalizeInput(layer,X);
   
-  // for ( no = 0; no < nYplanes; no++, Yplane += Ysize, w += n_weights_for_Yplane ){
 #pragma omp parallel for
   for ( int si = 0; si < nsamples; si++ ){
     for ( int no = 0; no < nYplanes; no++ ){
@@ -203,26 +311,240 @@ void icvCNNConvolutionForwardDirect( CvDNNLayer* _layer, const CvMat* X, CvMat*
   } // si
 
   cvScale(Y,Y,1.f/float(K*K)); //fprintf(stderr,"avg: %f, sdv: %f\n",cvAvg(Y).val[0],cvSdv(Y));
-  if (!layer->WX){layer->WX=cvCloneMat(Y);}
-  else if (layer->WX->rows==Y->rows){cvCopy(Y,layer->WX);}
-  else{cvReleaseMat(&layer->WX);layer->WX=cvCloneMat(Y);}
+  CV_CALL(icvCNNConvolutionActivate(layer,0,Y));
+
+  __END__;
+}
 
-  if (!strcmp(layer->activation,"none")){ // do nothing
-  }else if (!strcmp(layer->activation,"tanh")){ CV_CALL(cvTanh( Y, Y ));
-  }else if (!strcmp(layer->activation,"sigmoid")){ CV_CALL(cvSigmoid( Y, Y ));
-  }else if (!strcmp(layer->activation,"relu")){ CV_CALL(cvReLU( Y, Y ));
-  }else{CV_ERROR(CV_StsBadArg,"Unknown activation type");}
+/* Sum up input planes of each sample in X into layer->sumX. */
+static void icvCNNConvolutionSumPlanes( CvDNNConvolutionLayer * layer, const CvMat * X )
+{
+  CV_FUNCNAME("icvCNNConvolutionSumPlanes");
+  __BEGIN__;
 
-  CV_ASSERT(cvCountNAN(Y)<1);
+  const int nXplanes = layer->n_input_planes;
+  const int Xsize    = layer->input_width*layer->input_height;
+  const int nsamples = X->rows;
+
+  CV_CALL(layer->sumX = cvGetWorkspaceMat((CvDNNLayer*)layer,ICV_CONV_WS_SUMX,nsamples,Xsize,CV_32F));
+
+#pragma omp parallel for
+  for ( int si = 0; si < nsamples; si++ ){
+    float * xptr = X->data.fl+Xsize*nXplanes*si;
+    float * sptr = layer->sumX->data.fl+Xsize*si;
+    memcpy(sptr,xptr,sizeof(float)*Xsize); xptr+=Xsize;
+    for ( int ni = 1; ni < nXplanes; ni++, xptr += Xsize ){
+      for ( int xi = 0; xi < Xsize; xi++ ){ sptr[xi] += xptr[xi]; }
+    }
+  }
+
+  __END__;
+}
+
+/* Lower the batch X into layer->Xcol, with input planes summed up in layer->sumX.
+   The (ky,kx)-th row of Xcol holds sumX(yy+ky,xx+kx) of all output locations 
+   (yy,xx) of all samples, the last row holds n_input_planes for bias. */
+static void icvCNNConvolutionIm2col( CvDNNConvolutionLayer * layer, const CvMat * X )
+{
+  CV_FUNCNAME("icvCNNConvolutionIm2col");
+  __BEGIN__;
+
+  const int K = layer->K;
+  const int KK = K*K;
+  const int nXplanes = layer->n_input_planes;
+  const int Xwidth   = layer->input_width ;
+  const int Xsize    = Xwidth*layer->input_height;
+  const int Yheight  = layer->output_height;
+  const int Ywidth   = layer->output_width;
+  const int Ysize    = Ywidth*Yheight;
+  const int nsamples = X->rows;
+
+  CV_CALL(layer->Xcol = cvGetWorkspaceMat((CvDNNLayer*)layer,ICV_CONV_WS_XCOL,KK+1,nsamples*Ysize,CV_32F));
+  CV_CALL(icvCNNConvolutionSumPlanes(layer,X));
+
+#pragma omp parallel for
+  for ( int si = 0; si < nsamples; si++ ){
+    float * sptr = layer->sumX->data.fl+Xsize*si;
+    for ( int ky = 0; ky < K; ky++ ){
+    for ( int kx = 0; kx < K; kx++ ){
+      float * cptr = layer->Xcol->data.fl+layer->Xcol->cols*(K*ky+kx)+Ysize*si;
+      for ( int yy = 0; yy < Yheight; yy++ ){
+        memcpy(cptr+Ywidth*yy,sptr+Xwidth*(yy+ky)+kx,sizeof(float)*Ywidth);
+      } // yy
+    } // kx
+    } // ky
+    float * bptr = layer->Xcol->data.fl+layer->Xcol->cols*KK+Ysize*si;
+    for ( int yi = 0; yi < Ysize; yi++ ){ bptr[yi] = float(nXplanes); } // bias
+  } // si
+
+  __END__;
+}
+
+/* Since a single K*K kernel of each output plane is shared across all input 
+   planes, the input planes are summed up before lowering. The lowered batch 
+   Xcol has K*K+1 rows (the last row holds n_input_planes for bias), and the
+   output planes of all samples are computed with a single (blocked) GEMM:
+   Ycol = W * Xcol / (K*K), then scattered back to Y in sample-major order. */
+void icvCNNConvolutionForwardIm2col( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
+{
+  CV_FUNCNAME("icvCNNConvolutionForwardIm2col");
+
+  if (!icvIsConvolutionLayer(_layer)){CV_ERROR( CV_StsBadArg, "Invalid layer" );}
+
+  CvMat * Ycol = 0;
+
+  __BEGIN__;
+
+  CvDNNConvolutionLayer* layer = (CvDNNConvolutionLayer*) _layer;
+  CvDNNLayer * ref_layer = layer->ref_layer;
+  CvMat * weights = ref_layer?ref_layer->weights:layer->weights;
   
-  if (layer->Y){
-    if (layer->Y->rows==Y->rows){cvCopy(Y,layer->Y);}else{cvReleaseMat(&layer->Y);layer->Y=cvCloneMat(Y);}
-  }else{layer->Y=cvCloneMat(Y);}
-  if (layer->visualize){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
+  const int K = layer->K;
+  const int KK = K*K;
+  CV_ASSERT(weights->cols==KK+1);
+
+  const int nXplanes = layer->n_input_planes;
+  const int Xheight  = layer->input_height;
+  const int Xwidth   = layer->input_width ;
+  const int Xsize    = Xwidth*Xheight;
+
+  const int nYplanes = layer->n_output_planes;
+  const int Yheight  = layer->output_height;
+  const int Ywidth   = layer->output_width;
+  const int Ysize    = Ywidth*Yheight;
+
+  const int nsamples = X->rows; // training batch size
+
+  CV_ASSERT( X->cols == nXplanes*Xsize && X->rows == nsamples );
+  CV_ASSERT( Y->cols == nYplanes*Ysize && Y->rows == nsamples );
+  CV_ASSERT( Xheight-K+1 == Yheight && Xwidth-K+1 == Ywidth );
+  CV_ASSERT( CV_IS_MAT_CONT(X->type) && CV_IS_MAT_CONT(Y->type) );
+
+  // normalize input
+  icvCNNConvolutionNormalizeInput(layer,X);
+
+  CV_CALL(Ycol = cvGetWorkspaceMat(_layer,ICV_CONV_WS_YCOL,nYplanes,nsamples*Ysize,CV_32F));
+  CV_CALL(icvCNNConvolutionIm2col(layer,X));
+
+  CV_CALL(cvGEMM( weights, layer->Xcol, 1.f/float(KK), 0, 0, Ycol ));
+
+  // scatter output planes back to sample-major order while activating them
+  CV_CALL(icvCNNConvolutionActivate(layer,Ycol,Y));
 
   __END__;
 }
 
+/* Same lowering as icvCNNConvolutionForwardIm2col, on int8 input planes summed
+   up and weights quantized by cvQuantizeNetwork: each output location of each
+   sample is a row of Xq, so that the int32 accumulators of all output planes 
+   are computed by a single int8 GEMM, Acc = Wq * Xq^T. Accumulators are
+   dequantized with the scale and bias of their output plane, ReLU is applied
+   in the same pass. */
+void icvCNNConvolutionForwardInt8( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
+{
+  CV_FUNCNAME("icvCNNConvolutionForwardInt8");
+
+  if (!icvIsConvolutionLayer(_layer)){CV_ERROR( CV_StsBadArg, "Invalid layer" );}
+
+  CvMat * sumXq = 0, * Xq = 0, * acc = 0;
+
+  __BEGIN__;
+
+  CvDNNConvolutionLayer* layer = (CvDNNConvolutionLayer*) _layer;
+  CvDNNQuantization * quant = layer->quant;
+  
+  const int K = layer->K;
+  const int KK = K*K;
+  const int kpad = quant->W->cols;
+  CV_ASSERT(kpad>=KK && quant->W->rows==layer->n_output_planes);
+
+  const int nXplanes = layer->n_input_planes;
+  const int Xwidth   = layer->input_width ;
+  const int Xsize    = Xwidth*layer->input_height;
+
+  const int nYplanes = layer->n_output_planes;
+  const int Yheight  = layer->output_height;
+  const int Ywidth   = layer->output_width;
+  const int Ysize    = Ywidth*Yheight;
+
+  const int nsamples = X->rows;
+  const int relu = layer->activation_type==CV_DNN_ACTIVATION_RELU;
+
+  CV_ASSERT( X->cols == nXplanes*Xsize );
+  CV_ASSERT( Y->cols == nYplanes*Ysize && Y->rows == nsamples );
+  CV_ASSERT( CV_IS_MAT_CONT(X->type) && CV_IS_MAT_CONT(Y->type) );
+
+  // normalize input, sum up input planes and quantize them
+  icvCNNConvolutionNormalizeInput(layer,X);
+  CV_CALL(icvCNNConvolutionSumPlanes(layer,X));
+  CV_CALL(sumXq = cvGetWorkspaceMat(_layer,ICV_CONV_WS_SUMQ,nsamples,Xsize,CV_8S));
+  icvQuantizeInt8(layer->sumX->data.fl,quant->xscale,(schar*)sumXq->data.ptr,nsamples*Xsize);
+
+  // lower into rows of zero padded K*K patches
+  CV_CALL(Xq = cvGetWorkspaceMat(_layer,ICV_CONV_WS_XQ,nsamples*Ysize,kpad,CV_8S));
+  CV_CALL(acc = cvGetWorkspaceMat(_layer,ICV_CONV_WS_ACC,nYplanes,nsamples*Ysize,CV_32S));
+#pragma omp parallel for
+  for ( int si = 0; si < nsamples; si++ ){
+    const schar * sptr = (const schar*)sumXq->data.ptr+Xsize*si;
+    for ( int yy = 0; yy < Yheight; yy++ ){
+    for ( int xx = 0; xx < Ywidth; xx++ ){
+      schar * qptr = (schar*)(Xq->data.ptr+Xq->step*(Ysize*si+Ywidth*yy+xx));
+      for ( int ky = 0; ky < K; ky++ ){
+        memcpy(qptr+K*ky,sptr+Xwidth*(yy+ky)+xx,K);
+      }
+      memset(qptr+KK,0,kpad-KK);
+    } // xx
+    } // yy
+  } // si
+
+  CV_CALL(cvGEMMInt8( quant->W, Xq, acc ));
+
+  // scatter output planes back to sample-major order while dequantizing them
+  for ( int si = 0; si < nsamples; si++ ){
+  for ( int no = 0; no < nYplanes; no++ ){
+    icvDequantizeInt32((const int*)(acc->data.ptr+acc->step*no)+Ysize*si,
+                       quant->scale->data.fl+no,quant->bias->data.fl+no,0,relu,
+                       Y->data.fl+Ysize*nYplanes*si+Ysize*no,Ysize);
+  }
+  }
+  if (!relu){ CV_CALL(cvActivate(layer->activation_type,Y,0,0,Y)); }
+
+  // keep a copy of output for layers reading it via input_layers
+  if (layer->Y!=Y){
+    CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_CONV_WS_Y,Y->rows,Y->cols,CV_32F));
+    cvCopy(Y,layer->Y);
+  }
+  if (layer->visualize){icvVisualizeCNNLayer(_layer,Y);}
+
+  __END__;
+}
+
+/* Returns non-zero if layer->Wt holds the transform of current weights for 
+   given algorithm. Since weights are updated in backward pass, or by gradient
+   checking and loading, or through ref_layer, the transform is validated 
+   against a copy of the weights it was computed from. */
+static int icvCNNConvolutionTransformIsValid( 
+    CvDNNConvolutionLayer * layer, const CvMat * weights, int algorithm )
+{
+  return layer->Wt && layer->Wt_src && layer->Wt_algorithm==algorithm &&
+    CV_ARE_SIZES_EQ(layer->Wt_src,weights) &&
+    !memcmp(layer->Wt_src->data.fl,weights->data.fl,sizeof(float)*weights->rows*weights->cols);
+}
+
+static void icvCNNConvolutionTransformUpdated( 
+    CvDNNConvolutionLayer * layer, const CvMat * weights, int algorithm )
+{
+  if (layer->Wt_src && !CV_ARE_SIZES_EQ(layer->Wt_src,weights)){cvReleaseMat(&layer->Wt_src);}
+  if (!layer->Wt_src){layer->Wt_src = cvCloneMat(weights);}else{cvCopy(weights,layer->Wt_src);}
+  layer->Wt_algorithm = algorithm;
+}
+
+/* Since the kernel is shared across input planes and DFT is linear, spectra of 
+   input planes are accumulated by transforming the sum of input planes, then 
+   each output plane takes a single inverse DFT. Kernel spectra (flipped and 
+   scaled by 1/(K*K)) are cached in layer->Wt, and each thread works on its
+   own buffers taken from the workspace. Circular convolution of size >= input size 
+   is sufficient, as wrapped-around entries fall out of the valid output. */
 void icvCNNConvolutionForwardFFT( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
 {
   CV_FUNCNAME("icvCNNConvolutionForwardFFT");
@@ -236,8 +558,8 @@ void icvCNNConvolutionForwardFFT( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
   CvMat * weights = ref_layer?ref_layer->weights:layer->weights;
   
   const int K = layer->K;
-  const int n_weights_for_Yplane = K*K + 1;
-  CV_ASSERT(weights->cols==n_weights_for_Yplane);
+  const int KK = K*K;
+  CV_ASSERT(weights->cols==KK+1);
 
   const int nXplanes = layer->n_input_planes;
   const int Xheight  = layer->input_height;
@@ -250,87 +572,343 @@ void icvCNNConvolutionForwardFFT( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
   const int Ysize    = Ywidth*Yheight;
 
   const int nsamples = X->rows; // training batch size
-
-  // int no; xx, yy, ni, , kx, ky
-  // float *Yplane = 0, *Xplane = 0, *w = 0;
-  uchar* connect_mask_data = 0;
+  const int dft_M = cvGetOptimalDFTSize(Xheight);
+  const int dft_N = cvGetOptimalDFTSize(Xwidth);
+#ifdef _OPENMP
+  const int nthreads = omp_get_max_threads();
+#else
+  const int nthreads = 1;
+#endif
 
   CV_ASSERT( X->cols == nXplanes*Xsize && X->rows == nsamples );
   CV_ASSERT( Y->cols == nYplanes*Ysize && Y->rows == nsamples );
   CV_ASSERT( Xheight-K+1 == Yheight && Xwidth-K+1 == Ywidth );
+  CV_ASSERT( CV_IS_MAT_CONT(X->type) && CV_IS_MAT_CONT(Y->type) );
 
-  cvSetZero( Y );
+  // kernel spectra, only when weights are updated
+  CV_CALL(icvCNNConvolutionTransformWeights(layer,weights,CV_DNN_CONVOLUTION_FFT));
 
-  // Yplane = Y->data.fl;
-  // w = layer->weights->data.fl;
-  connect_mask_data = layer->connect_mask->data.ptr;
+  // per-thread buffers for input spectrum and product of spectra
+  CvMat * dft_buf = 0;
+  CV_CALL(dft_buf = cvGetWorkspaceMat(_layer,ICV_CONV_WS_DFT,nthreads*2*dft_M,dft_N,CV_32F));
 
   // normalize input
-  CvScalar avg,sdv;
-  for ( int si = 0; si < nsamples; si++ ){
-  for ( int no = 0; no < nXplanes; no++ ){
-    float * xptr = X->data.fl+Xsize*nXplanes*si+Xsize*no;
-    CvMat img = cvMat(Xsize,1,CV_32F,xptr);
-    cvAvgSdv(&img,&avg,&sdv);
-    cvSubS(&img,avg,&img);
-    cvScale(&img,&img,.5f/(1e-5f+sdv.val[0]));
-  }
-  }
+  icvCNNConvolutionNormalizeInput(layer,X);
+  CV_CALL(icvCNNConvolutionSumPlanes(layer,X));
   
-  const int dft_M = cvGetOptimalDFTSize(Xheight+K-1);
-  const int dft_N = cvGetOptimalDFTSize(Xwidth+K-1);
 #pragma omp parallel for
   for ( int si = 0; si < nsamples; si++ ){
-    CvMat * dft_A = cvCreateMat(dft_M, dft_N, CV_32F); cvZero(dft_A);
-    CvMat * dft_B = cvCreateMat(dft_M, dft_N, CV_32F); cvZero(dft_B);
+#ifdef _OPENMP
+    const int tid = omp_get_thread_num();
+#else
+    const int tid = 0;
+#endif
+    CvMat dft_A, dft_C, submat_hdr;
+    cvGetRows(dft_buf,&dft_A,dft_M*(2*tid),dft_M*(2*tid+1));
+    cvGetRows(dft_buf,&dft_C,dft_M*(2*tid+1),dft_M*(2*tid+2));
+    CvMat A = cvMat(Xheight,Xwidth,CV_32F,layer->sumX->data.fl+Xsize*si);
+    cvZero(&dft_A);
+    cvGetSubRect( &dft_A, &submat_hdr, cvRect(0,0,A.cols,A.rows)); cvCopy(&A,&submat_hdr);
+    cvDFT( &dft_A, &dft_A, CV_DXT_FORWARD, A.rows );
     for ( int no = 0; no < nYplanes; no++ ){
-    float * xptr = X->data.fl+Xsize*nXplanes*si;
-    float * yptr = Y->data.fl+Ysize*nYplanes*si+Ysize*no;
-    float * wptr = weights->data.fl+n_weights_for_Yplane*no;
-    CvMat submat_hdr;
-    CvMat B = cvMat(K,K,CV_32F,wptr);
-    cvGetSubRect( dft_B, &submat_hdr, cvRect(0,0,B.cols,B.rows)); cvCopy(&B,&submat_hdr);
-    cvFlip(&submat_hdr,&submat_hdr,-1);
-    cvGetSubRect( dft_B, &submat_hdr, cvRect(B.cols,0,dft_B->cols-B.cols,B.rows)); cvZero(&submat_hdr);
-    cvDFT( dft_B, dft_B, CV_DXT_FORWARD, B.rows );
-    for ( int ni = 0; ni < nXplanes; ni++, xptr += Xsize ){
-    CvMat A = cvMat(Xheight,Xwidth,CV_32F,xptr);
-    CvMat C = cvMat(Yheight,Ywidth,CV_32F,yptr);
-    cvGetSubRect( dft_A, &submat_hdr, cvRect(0,0,A.cols,A.rows)); cvCopy(&A,&submat_hdr);
-    cvGetSubRect( dft_A, &submat_hdr, cvRect(A.cols,0,dft_A->cols-A.cols,A.rows)); cvZero(&submat_hdr);
-    cvDFT( dft_A, dft_A, CV_DXT_FORWARD, A.rows );
-    cvMulSpectrums( dft_A, dft_B, dft_A, 0);
-    cvDFT( dft_A, dft_A, CV_DXT_INVERSE, C.rows+K-1 ); // calculate only the top part
-    cvGetSubRect( dft_A, &submat_hdr, cvRect(K-1,K-1,C.cols,C.rows) );
-    cvAddS(&submat_hdr, cvScalar(wptr[K*K]), &C); // bias
-    } // ni
+      const float bias = weights->data.fl[weights->cols*no+KK]*float(nXplanes)/float(KK);
+      CvMat C = cvMat(Yheight,Ywidth,CV_32F,Y->data.fl+Ysize*nYplanes*si+Ysize*no);
+      CvMat spectrum;
+      cvGetRows(layer->Wt,&spectrum,dft_M*no,dft_M*(no+1));
+      cvMulSpectrums( &dft_A, &spectrum, &dft_C, 0 );
+      cvDFT( &dft_C, &dft_C, CV_DXT_INV_SCALE, Yheight+K-1 ); // calculate only the top part
+      cvGetSubRect( &dft_C, &submat_hdr, cvRect(K-1,K-1,C.cols,C.rows) );
+      cvAddS(&submat_hdr, cvScalar(bias), &C);
     } // no
-    if (dft_A){cvReleaseMat(&dft_A);dft_A=0;}
-    if (dft_B){cvReleaseMat(&dft_B);dft_B=0;}
   } // si
 
-  cvScale(Y,Y,.5/float(K*K*K*K));
-  // fprintf(stderr,"avg: %f, sdv: %f\n",cvAvg(Y).val[0],cvSdv(Y));
-  if (!layer->WX){layer->WX=cvCloneMat(Y);}
-  else if (layer->WX->rows==Y->rows){cvCopy(Y,layer->WX);}
-  else{cvReleaseMat(&layer->WX);layer->WX=cvCloneMat(Y);}
+  CV_CALL(icvCNNConvolutionActivate(layer,0,Y));
 
-  if (!strcmp(layer->activation,"none")){ // do nothing
-  }else if (!strcmp(layer->activation,"tanh")){ CV_CALL(cvTanh( Y, Y ));
-  }else if (!strcmp(layer->activation,"sigmoid")){ CV_CALL(cvSigmoid( Y, Y ));
-  }else if (!strcmp(layer->activation,"relu")){ CV_CALL(cvReLU( Y, Y ));
-  }else{CV_ERROR(CV_StsBadArg,"Unknown activation type");}
+  __END__;
+}
 
-  CV_ASSERT(cvCountNAN(Y)<1);
-  
-  if (layer->Y){
-    if (layer->Y->rows==Y->rows){cvCopy(Y,layer->Y);}else{cvReleaseMat(&layer->Y);layer->Y=cvCloneMat(Y);}
-  }else{layer->Y=cvCloneMat(Y);}
-  if (layer->visualize){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
+/* Winograd minimal filtering F(m x m, 3 x 3), Y = A^T [(G g G^T) .* (B^T d B)] A
+   for each (m+2)x(m+2) input tile d and 3x3 kernel g [Lavin & Gray, 2015] */
+static const float icvWinogradBT_2x2[] = {
+  1, 0,-1, 0,
+  0, 1, 1, 0,
+  0,-1, 1, 0,
+  0, 1, 0,-1 };
+static const float icvWinogradG_2x2[] = {
+  1,  0, 0,
+  .5f, .5f, .5f,
+  .5f,-.5f, .5f,
+  0,  0, 1 };
+static const float icvWinogradAT_2x2[] = {
+  1, 1, 1, 0,
+  0, 1,-1,-1 };
+static const float icvWinogradBT_4x4[] = {
+  4, 0,-5, 0, 1, 0,
+  0,-4,-4, 1, 1, 0,
+  0, 4,-4,-1, 1, 0,
+  0,-2,-1, 2, 1, 0,
+  0, 2,-1,-2, 1, 0,
+  0, 4, 0,-5, 0, 1 };
+static const float icvWinogradG_4x4[] = {
+  1.f/4.f,        0,        0,
+  -1.f/6.f, -1.f/6.f, -1.f/6.f,
+  -1.f/6.f,  1.f/6.f, -1.f/6.f,
+  1.f/24.f, 1.f/12.f,  1.f/6.f,
+  1.f/24.f,-1.f/12.f,  1.f/6.f,
+  0,        0,        1 };
+static const float icvWinogradAT_4x4[] = {
+  1, 1, 1, 1, 1, 0,
+  0, 1,-1, 2,-2, 0,
+  0, 1, 1, 4, 4, 0,
+  0, 1,-1, 8,-8, 1 };
+
+/* dst(M,N) = T(M,L) * src(L,N) * T'(N,L)^T, for small row-major matrices */
+template<int M, int L, int N> static inline
+void icvWinogradTransform( const float * T, const float * src, int srcstep, 
+                           const float * Tp, float * dst )
+{
+  float buf[M*N];
+  for ( int ii = 0; ii < M; ii++ ){
+  for ( int jj = 0; jj < N; jj++ ){
+    float val = 0;
+    for ( int kk = 0; kk < L; kk++ ){ val += T[L*ii+kk]*src[srcstep*kk+jj]; }
+    buf[N*ii+jj] = val;
+  }
+  }
+  for ( int ii = 0; ii < M; ii++ ){
+  for ( int jj = 0; jj < M; jj++ ){
+    float val = 0;
+    for ( int kk = 0; kk < N; kk++ ){ val += buf[N*ii+kk]*Tp[N*jj+kk]; }
+    dst[M*ii+jj] = val;
+  }
+  }
+}
 
+template<int m> static 
+void icvCNNConvolutionWinograd( CvDNNConvolutionLayer * layer, const CvMat * weights, CvMat * Y,
+                                const float * BT, const float * AT )
+{
+  const int alpha = m+2;
+  const int nXplanes = layer->n_input_planes;
+  const int Xheight  = layer->input_height;
+  const int Xwidth   = layer->input_width ;
+  const int Xsize    = Xwidth*Xheight;
+  const int nYplanes = layer->n_output_planes;
+  const int Yheight  = layer->output_height;
+  const int Ywidth   = layer->output_width;
+  const int Ysize    = Ywidth*Yheight;
+  const int nsamples = Y->rows;
+  const int ntiles_y = (Yheight+m-1)/m;
+  const int ntiles_x = (Ywidth+m-1)/m;
+  const float * U = layer->Wt->data.fl;
+
+#pragma omp parallel for
+  for ( int si = 0; si < nsamples; si++ ){
+    const float * sptr = layer->sumX->data.fl+Xsize*si;
+    float * yptr = Y->data.fl+Ysize*nYplanes*si;
+    float d[alpha*alpha], V[alpha*alpha], MM[alpha*alpha], tile[m*m];
+    for ( int ty = 0; ty < ntiles_y; ty++ ){
+    for ( int tx = 0; tx < ntiles_x; tx++ ){
+      const int y0 = ty*m, x0 = tx*m;
+      const int th = MIN(m,Yheight-y0), tw = MIN(m,Ywidth-x0);
+      // gather input tile, zero padded on boundary
+      for ( int yy = 0; yy < alpha; yy++ ){
+      for ( int xx = 0; xx < alpha; xx++ ){
+        d[alpha*yy+xx] = (y0+yy<Xheight && x0+xx<Xwidth)?sptr[Xwidth*(y0+yy)+x0+xx]:0;
+      }
+      }
+      icvWinogradTransform<alpha,alpha,alpha>(BT,d,alpha,BT,V);
+      for ( int no = 0; no < nYplanes; no++ ){
+        const float * Uptr = U+alpha*alpha*no;
+        const float bias = weights->data.fl[weights->cols*no+9]*float(nXplanes)/9.f;
+        for ( int ii = 0; ii < alpha*alpha; ii++ ){ MM[ii] = Uptr[ii]*V[ii]; }
+        icvWinogradTransform<m,alpha,alpha>(AT,MM,alpha,AT,tile);
+        float * Yplane = yptr+Ysize*no;
+        for ( int yy = 0; yy < th; yy++ ){
+        for ( int xx = 0; xx < tw; xx++ ){
+          Yplane[Ywidth*(y0+yy)+x0+xx] = tile[m*yy+xx]+bias;
+        }
+        }
+      } // no
+    } // tx
+    } // ty
+  } // si
+}
+
+/* Transforms weights for fft or winograd algorithm into layer->Wt, unless it 
+   is up to date. Transforms borrowed by a per-context copy of the layer from 
+   the shared network are left untouched, the copy computes its own instead. */
+static void icvCNNConvolutionTransformWeights( 
+    CvDNNConvolutionLayer * layer, const CvMat * weights, int algorithm )
+{
+  CV_FUNCNAME("icvCNNConvolutionTransformWeights");
+  __BEGIN__;
+  if (!icvCNNConvolutionTransformIsValid(layer,weights,algorithm)){
+    CvDNNConvolutionLayer * shared_layer = (CvDNNConvolutionLayer*)layer->shared_layer;
+    if (shared_layer){
+      if (layer->Wt==shared_layer->Wt){layer->Wt=0;}
+      if (layer->Wt_src==shared_layer->Wt_src){layer->Wt_src=0;}
+    }
+    const int K = layer->K;
+    const int KK = K*K;
+    const int nYplanes = layer->n_output_planes;
+    if (algorithm==CV_DNN_CONVOLUTION_FFT){
+      const int dft_M = cvGetOptimalDFTSize(layer->input_height);
+      const int dft_N = cvGetOptimalDFTSize(layer->input_width);
+      if (layer->Wt && (layer->Wt->rows!=nYplanes*dft_M || layer->Wt->cols!=dft_N)){
+        cvReleaseMat(&layer->Wt);layer->Wt=0;
+      }
+      if (!layer->Wt){CV_CALL(layer->Wt = cvCreateMat(nYplanes*dft_M,dft_N,CV_32F));}
+      cvZero(layer->Wt);
+      for ( int no = 0; no < nYplanes; no++ ){
+        CvMat B = cvMat(K,K,CV_32F,weights->data.fl+weights->cols*no);
+        CvMat spectrum, submat_hdr;
+        cvGetRows(layer->Wt,&spectrum,dft_M*no,dft_M*(no+1));
+        cvGetSubRect(&spectrum,&submat_hdr,cvRect(0,0,K,K));
+        cvFlip(&B,&submat_hdr,-1);
+        cvScale(&submat_hdr,&submat_hdr,1.f/float(KK));
+        cvDFT(&spectrum,&spectrum,CV_DXT_FORWARD,K);
+      }
+    }else if (algorithm==CV_DNN_CONVOLUTION_WINOGRAD_2X2 || 
+              algorithm==CV_DNN_CONVOLUTION_WINOGRAD_4X4){
+      const int m = (algorithm==CV_DNN_CONVOLUTION_WINOGRAD_4X4)?4:2;
+      const int alpha = m+2;
+      const float * G = (m==4)?icvWinogradG_4x4:icvWinogradG_2x2;
+      if (layer->Wt && layer->Wt->cols!=alpha*alpha){cvReleaseMat(&layer->Wt);layer->Wt=0;}
+      if (!layer->Wt){CV_CALL(layer->Wt = cvCreateMat(nYplanes,alpha*alpha,CV_32F));}
+      for ( int no = 0; no < nYplanes; no++ ){
+        float g[9]; 
+        for ( int ii = 0; ii < 9; ii++ ){ g[ii] = weights->data.fl[weights->cols*no+ii]/9.f; }
+        if (m==4){ icvWinogradTransform<6,3,3>(G,g,3,G,layer->Wt->data.fl+alpha*alpha*no); }
+        else     { icvWinogradTransform<4,3,3>(G,g,3,G,layer->Wt->data.fl+alpha*alpha*no); }
+      }
+    }else{
+      CV_ERROR(CV_StsBadArg,"No weights transform for the algorithm");
+    }
+    icvCNNConvolutionTransformUpdated(layer,weights,algorithm);
+  }
   __END__;
 }
 
+/* Computes cached weights transform ahead of the first forward pass, so that 
+   per-context copies of the layer can share it. */
+void icvCNNConvolutionPrepare( CvDNNLayer* _layer )
+{
+  CV_FUNCNAME("icvCNNConvolutionPrepare");
+  if (!icvIsConvolutionLayer(_layer)){CV_ERROR( CV_StsBadArg, "Invalid layer" );}
+  __BEGIN__;
+  CvDNNConvolutionLayer* layer = (CvDNNConvolutionLayer*) _layer;
+  CvMat * weights = layer->ref_layer?layer->ref_layer->weights:layer->weights;
+  const int algorithm = layer->algorithm;
+  if (algorithm==CV_DNN_CONVOLUTION_FFT || algorithm==CV_DNN_CONVOLUTION_WINOGRAD_2X2 ||
+      algorithm==CV_DNN_CONVOLUTION_WINOGRAD_4X4){
+    CV_CALL(icvCNNConvolutionTransformWeights(layer,weights,algorithm));
+  }
+  __END__;
+}
+
+/* Winograd F(2x2,3x3) or F(4x4,3x3) on the sum of input planes, the 
+   transformed kernels U=G*g*G^T/(K*K) are cached in layer->Wt. */
+void icvCNNConvolutionForwardWinograd( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
+{
+  CV_FUNCNAME("icvCNNConvolutionForwardWinograd");
+
+  if (!icvIsConvolutionLayer(_layer)){CV_ERROR( CV_StsBadArg, "Invalid layer" );}
+
+  __BEGIN__;
+
+  CvDNNConvolutionLayer* layer = (CvDNNConvolutionLayer*) _layer;
+  CvDNNLayer * ref_layer = layer->ref_layer;
+  CvMat * weights = ref_layer?ref_layer->weights:layer->weights;
+  const int algorithm = layer->algorithm;
+  const int m = (algorithm==CV_DNN_CONVOLUTION_WINOGRAD_4X4)?4:2;
+  const float * BT = (m==4)?icvWinogradBT_4x4:icvWinogradBT_2x2;
+  const float * AT = (m==4)?icvWinogradAT_4x4:icvWinogradAT_2x2;
+
+  const int nXplanes = layer->n_input_planes;
+  const int Xsize    = layer->input_width*layer->input_height;
+  const int nYplanes = layer->n_output_planes;
+  const int Ysize    = layer->output_width*layer->output_height;
+  const int nsamples = X->rows; // training batch size
+
+  if (layer->K!=3){CV_ERROR(CV_StsBadArg,"Winograd convolution requires 3x3 kernel");}
+  CV_ASSERT( weights->cols==10 && weights->rows==nYplanes );
+  CV_ASSERT( X->cols == nXplanes*Xsize && X->rows == nsamples );
+  CV_ASSERT( Y->cols == nYplanes*Ysize && Y->rows == nsamples );
+  CV_ASSERT( CV_IS_MAT_CONT(X->type) && CV_IS_MAT_CONT(Y->type) );
+
+  // transform kernels, only when weights are updated
+  CV_CALL(icvCNNConvolutionTransformWeights(layer,weights,algorithm));
+
+  // normalize input
+  icvCNNConvolutionNormalizeInput(layer,X);
+  CV_CALL(icvCNNConvolutionSumPlanes(layer,X));
+
+  if (m==4){ icvCNNConvolutionWinograd<4>(layer,weights,Y,BT,AT); }
+  else     { icvCNNConvolutionWinograd<2>(layer,weights,Y,BT,AT); }
+
+  CV_CALL(icvCNNConvolutionActivate(layer,0,Y));
+
+  __END__;
+}
+
+static const char * icvCNNConvolutionAlgorithmName( int algorithm )
+{
+  switch (algorithm){
+  case CV_DNN_CONVOLUTION_DIRECT: return "direct";
+  case CV_DNN_CONVOLUTION_IM2COL: return "im2col";
+  case CV_DNN_CONVOLUTION_FFT:    return "fft";
+  case CV_DNN_CONVOLUTION_WINOGRAD_2X2: return "winograd_2x2";
+  case CV_DNN_CONVOLUTION_WINOGRAD_4X4: return "winograd_4x4";
+  default: return "auto";
+  }
+}
+
+/* Select the fastest algorithm for the layer, by timing each candidate 
+   on a copy of the first batch; the selection is kept for later batches. */
+void icvCNNConvolutionSelectAlgorithm( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
+{
+  CV_FUNCNAME("icvCNNConvolutionSelectAlgorithm");
+
+  if (!icvIsConvolutionLayer(_layer)){CV_ERROR( CV_StsBadArg, "Invalid layer" );}
+
+  CvMat * Xcopy = 0;
+
+  __BEGIN__;
+
+  CvDNNConvolutionLayer* layer = (CvDNNConvolutionLayer*) _layer;
+  int candidates[] = {CV_DNN_CONVOLUTION_IM2COL, CV_DNN_CONVOLUTION_FFT, 
+    CV_DNN_CONVOLUTION_WINOGRAD_2X2, CV_DNN_CONVOLUTION_WINOGRAD_4X4, CV_DNN_CONVOLUTION_DIRECT};
+  const int n_candidates = sizeof(candidates)/sizeof(candidates[0]);
+  const int visualize = layer->visualize;
+  int best_algorithm = CV_DNN_CONVOLUTION_IM2COL;
+  double best_time = DBL_MAX;
+
+  CV_CALL(Xcopy = cvCreateMat(X->rows,X->cols,CV_32F));
+  layer->visualize = 0;
+  for ( int ci = 0; ci < n_candidates; ci++ ){
+    const int algorithm = candidates[ci];
+    if ((algorithm==CV_DNN_CONVOLUTION_WINOGRAD_2X2 || 
+         algorithm==CV_DNN_CONVOLUTION_WINOGRAD_4X4) && layer->K!=3){continue;}
+    layer->algorithm = algorithm;
+    // first run for allocating caches and transforming weights
+    cvCopy(X,Xcopy); CV_CALL(icvCNNConvolutionForward(_layer, Xcopy, Y));
+    cvCopy(X,Xcopy);
+    double t0 = (double)cvGetTickCount();
+    CV_CALL(icvCNNConvolutionForward(_layer, Xcopy, Y));
+    double elapsed = ((double)cvGetTickCount()-t0)/cvGetTickFrequency();
+    if (elapsed<best_time){best_time=elapsed;best_algorithm=algorithm;}
+  }
+  layer->visualize = visualize;
+  layer->algorithm = best_algorithm;
+  fprintf(stderr,"ConvolutionLayer(%s): use %s algorithm (%.3fms per batch)\n",
+          layer->name,icvCNNConvolutionAlgorithmName(best_algorithm),best_time*.001);
+
+  __END__;
+
+  if (Xcopy){cvReleaseMat(&Xcopy);Xcopy=0;}
+}
+
 /* <dE_dY>, <dE_dX> should be row-vectors.
    Function computes partial derivatives <dE_dX>
    of the loss function with respect to the planes components
@@ -338,18 +916,29 @@ void icvCNNConvolutionForwardFFT( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
    It is a basic function for back propagation method.
    Input parameter <dE_dY> is the partial derivative of the
    loss function with respect to the planes components
-   of the current layer. */
+   of the current layer. 
+   No Jacobian is formed: with the batch lowered into Xcol (see im2col forward), 
+     dE_dW = dE_dYcol * Xcol^T / (K*K),
+     dE_dXcol = W^T * dE_dYcol / (K*K),
+   and dE_dXcol is accumulated back to image locations (col2im), which is
+   shared by all input planes. */
 void icvCNNConvolutionBackward(
     CvDNNLayer * _layer, int t, const CvMat* X, const CvMat* _dE_dY, CvMat* dE_dX )
 {
   CV_FUNCNAME("icvCNNConvolutionBackward");
   if ( !icvIsConvolutionLayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
 
+  CvMat * dE_dY_afder = 0;
+  CvMat * dE_dYcol = 0;
+  CvMat * dE_dXcol = 0;
+  CvMat * dE_dW = 0;
+
   __BEGIN__;
 
   CvDNNConvolutionLayer * layer = (CvDNNConvolutionLayer*) _layer;
   int n_output_layers = layer->output_layers.size();
   CvDNNLayer * ref_layer = layer->ref_layer;
+  CvDNNLayer * owner = ref_layer?ref_layer:_layer;
   CvMat * weights = ref_layer?ref_layer->weights:layer->weights;
   
   const int K = layer->K;
@@ -367,12 +956,11 @@ void icvCNNConvolutionBackward(
 
   const int batch_size = X->rows;
   CvMat * dE_dY = (CvMat*)_dE_dY;
-  CvMat* dY_dX = 0;
-  CvMat* dY_dW = 0;
-  CvMat* dE_dW = 0;
+  CvMat sub_weights;
 
   if (n_output_layers){
-    dE_dY = cvCreateMat(batch_size,Y_plane_size*n_Y_planes,CV_32F); cvZero(dE_dY);
+    CV_CALL(dE_dY = cvGetWorkspaceMat(_layer,ICV_CONV_WS_DEDY,batch_size,Y_plane_size*n_Y_planes,CV_32F));
+    cvZero(dE_dY);
     for (int li=0;li<n_output_layers;li++){
       CvDNNLayer * output_layer = layer->output_layers[li];
       if (icvIsDenseLayer(output_layer)){
@@ -380,108 +968,89 @@ void icvCNNConvolutionBackward(
       }
     } // average loss from all task
   }
-  CvMat * dE_dY_afder = cvCreateMat(dE_dY->rows, dE_dY->cols, CV_32F); cvZero(dE_dY_afder);
+  CV_CALL(dE_dY_afder = cvGetWorkspaceMat(_layer,ICV_CONV_WS_DEDY_AFDER,dE_dY->rows,dE_dY->cols,CV_32F));
 
   CV_ASSERT( t >= 1 );
   CV_ASSERT( n_Y_planes == weights->rows );
+  CV_ASSERT( X->cols == n_X_planes*X_plane_size );
+  CV_ASSERT( dE_dY->rows == batch_size && dE_dY->cols == n_Y_planes*Y_plane_size );
+  CV_ASSERT( dE_dX->rows == batch_size && dE_dX->cols == X->cols );
+  CV_ASSERT( CV_IS_MAT_CONT(X->type) && CV_IS_MAT_CONT(dE_dX->type) );
 
-  if (layer->enable_cache){
-    if (!layer->dY_dX){layer->dY_dX=cvCreateMat( n_Y_planes*Y_plane_size, X->cols, CV_32F );}
-    dY_dX = layer->dY_dX;
+  // dE_dY_afder = f'(WX)*dE_dY
+  CV_CALL(cvActivateDer(layer->activation_type,layer->WX,dE_dY,dE_dY_afder));
+
+  // gather output planes into plane-major order, same as Ycol in forward pass
+  CV_CALL(dE_dYcol = cvGetWorkspaceMat(_layer,ICV_CONV_WS_YCOL,n_Y_planes,batch_size*Y_plane_size,CV_32F));
+  for ( int si = 0; si < batch_size; si++ ){
+  for ( int no = 0; no < n_Y_planes; no++ ){
+    memcpy(dE_dYcol->data.fl+dE_dYcol->cols*no+Y_plane_size*si,
+           dE_dY_afder->data.fl+dE_dY_afder->cols*si+Y_plane_size*no,sizeof(float)*Y_plane_size);
+  }
+  }
+
+  // dE_dW = dE_dYcol * Xcol^T, summed into the gradient store of the layer 
+  // owning the weights, so that layers sharing them through ref_layer 
+  // contribute to a single update
+  CV_CALL(icvCNNConvolutionIm2col(layer,X));
+  CV_CALL(dE_dW = cvGetWorkspaceMat(owner,ICV_CONV_WS_DEDW,weights->rows,weights->cols,CV_32F));
+  if (owner->n_grads){
+    CV_CALL(cvGEMM( dE_dYcol, layer->Xcol, 1.f/float(KK), dE_dW, 1, dE_dW, CV_GEMM_B_T ));
   }else{
-    dY_dX = cvCreateMat( n_Y_planes*Y_plane_size, X->cols, CV_32F );
+    CV_CALL(cvGEMM( dE_dYcol, layer->Xcol, 1.f/float(KK), 0, 0, dE_dW, CV_GEMM_B_T ));
   }
-  dY_dW = cvCreateMat( dY_dX->rows, weights->cols*weights->rows, CV_32F );
-  dE_dW = cvCreateMat( 1, dY_dW->cols, CV_32F );
-  cvZero( dY_dX );
-  cvZero( dY_dW );
+  owner->dE_dW = dE_dW;
+  owner->n_grads++;
 
-  // compute gradient of the loss function with respect to X and W
+  // dE_dX = col2im( W^T * dE_dYcol )
+  CV_CALL(dE_dXcol = cvGetWorkspaceMat(_layer,ICV_CONV_WS_DEDXCOL,KK,batch_size*Y_plane_size,CV_32F));
+  CV_CALL(cvGetCols( weights, &sub_weights, 0, KK ));
+  CV_CALL(cvGEMM( &sub_weights, dE_dYcol, 1.f/float(KK), 0, 0, dE_dXcol, CV_GEMM_A_T ));
 #pragma omp parallel for
   for ( int si = 0; si < batch_size; si++ ){
-    int yloc = 0;
-    for ( int no = 0; no < n_Y_planes; no++, yloc += Y_plane_size ){
-    int noKK = no*(KK+1);
-    int xloc = 0;
-    float * xptr = X->data.fl+X->cols*si;
-    float * wptr = weights->data.fl + noKK;
-    for ( int ni = 0; ni < n_X_planes; ni++, xptr += X_plane_size, xloc += X_plane_size ){
-      for ( int yy = 0; yy < Xheight - K + 1; yy++ ){
-      for ( int xx = 0; xx < Xwidth - K + 1; xx++ ){
-#if 0
-        for ( int ky = 0; ky < K; ky++ ){
-        for ( int kx = 0; kx < K; kx++ ){
-          int kidx = K*ky+kx; // weights
-          int ridx = Ywidth*yy+xx;
-          int cidx = Xwidth*(yy+ky)+(xx+kx);
-          CV_MAT_ELEM(*dY_dX,float,yloc+ridx,xloc+cidx) = wptr[kidx];
-          CV_MAT_ELEM(*dY_dW,float,yloc+ridx,noKK+kidx) += xptr[cidx];
-        } // ky
-        } // kx
-        int ridx = Ywidth*yy+xx;
-#else
-        int ridx=Ywidth*yy+xx;
-        int dydx_step=(yloc+ridx)*dY_dX->cols;
-        int dydw_step=(yloc+ridx)*dY_dW->cols;
-        for ( int ky = 0; ky < K; ky++ ){
-        int kstep=K*ky; int xstep=Xwidth*(yy+ky);
-        for ( int kx = 0; kx < K; kx++ ){
-          int kidx=kstep+kx, cidx=xstep+(xx+kx);
-          (dY_dX->data.fl+dydx_step)[xloc+cidx]=wptr[kidx];
-          (dY_dW->data.fl+dydw_step)[noKK+kidx]+=xptr[cidx];
-        } // ky
-        } // kx
-#endif
-        CV_MAT_ELEM(*dY_dW, float, yloc+ridx, noKK+KK) += 1; // bias
-      } // xx
+    float * dxptr = dE_dX->data.fl+dE_dX->cols*si;
+    memset(dxptr,0,sizeof(float)*X_plane_size);
+    for ( int ky = 0; ky < K; ky++ ){
+    for ( int kx = 0; kx < K; kx++ ){
+      const float * cptr = dE_dXcol->data.fl+dE_dXcol->cols*(K*ky+kx)+Y_plane_size*si;
+      for ( int yy = 0; yy < Yheight; yy++ ){
+        float * dxrow = dxptr+Xwidth*(yy+ky)+kx;
+        const float * crow = cptr+Ywidth*yy;
+        for ( int xx = 0; xx < Ywidth; xx++ ){ dxrow[xx] += crow[xx]; }
       } // yy
-    } // ni
-    } // no
-  } // si
-  cvScale(dY_dW,dY_dW,1.f/float(batch_size));
-
-  // dE_dY_afder = (tanh'(WX))*dE_dY
-  if (!strcmp(layer->activation,"none")){
-    cvCopy(dE_dY,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"tanh")){ 
-    cvTanhDer(layer->WX,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"sigmoid")){ 
-    cvSigmoidDer(layer->WX,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"relu")){ 
-    cvReLUDer(layer->WX,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY,dE_dY_afder);
-  }else{CV_ASSERT(false);}
-
-  // dE_dW = sum( dE_dY * dY_dW )
-  CvMat * dE_dW_ = cvCreateMat( batch_size, dY_dW->cols, CV_32FC1 );
-  CV_CALL(cvGEMM( dE_dY_afder, dY_dW, 1.f,0,1.f,dE_dW_ )); 
-  cvReduce(dE_dW_,dE_dW,-1,CV_REDUCE_SUM);
-  cvReleaseMat(&dE_dW_);
-
-  // dE_dX = dE_dY * dY_dX
-  CV_CALL(cvGEMM( dE_dY_afder, dY_dX, 1.f,0,1.f,dE_dX ));
-
-  // update weights
-  {
-    CvMat dE_dW_mat;
-    float eta = -layer->init_learn_rate*cvInvSqrt((float)t);
-    cvReshape( dE_dW, &dE_dW_mat, 0, weights->rows );
-    if (!layer->dE_dW){
-      ((CvDNNLayer*)layer)->dE_dW = cvCloneMat(&dE_dW_mat);
-    }else{
-      cvCopy(&dE_dW_mat,((CvDNNLayer*)layer)->dE_dW);
+    } // kx
+    } // ky
+    // kernel is shared by all input planes
+    for ( int ni = 1; ni < n_X_planes; ni++ ){
+      memcpy(dxptr+X_plane_size*ni,dxptr,sizeof(float)*X_plane_size);
     }
-    cvScaleAdd( &dE_dW_mat, cvRealScalar(eta), weights, weights );
-  }
+  } // si
 
-  if (n_output_layers){cvReleaseMat(&dE_dY);dE_dY=0;}
-  if (!layer->enable_cache){ if (dY_dX){cvReleaseMat( &dY_dX );dY_dX=0;} }
-  if (dE_dY_afder){cvReleaseMat( &dE_dY_afder );dE_dY_afder=0;}
-  if (dY_dW){cvReleaseMat( &dY_dW );dY_dW=0;}
-  if (dE_dW){cvReleaseMat( &dE_dW );dE_dW=0;}
+  __END__;
+}
+
+/* Applies gradient <dE_dW> to the weights used by the layer at iteration <t>. */
+void icvCNNConvolutionUpdate( CvDNNLayer * layer, const CvMat * dE_dW, int t )
+{
+  CV_FUNCNAME("icvCNNConvolutionUpdate");
+  __BEGIN__;
+  CvMat * weights = layer->ref_layer?layer->ref_layer->weights:layer->weights;
+  float eta = -layer->init_learn_rate*cvInvSqrt((float)t);
+  CV_ASSERT(CV_ARE_SIZES_EQ(dE_dW,weights));
+  CV_CALL(cvOptimizerUpdate( layer->optimizer, weights, dE_dW, -eta ));
+  __END__;
+}
 
+/* Applies gradients summed in the store of the layer since last step,
+   averaged over the n_batches mini batches they were accumulated from. */
+void icvCNNConvolutionStep( CvDNNLayer * layer, int t, int n_batches )
+{
+  CV_FUNCNAME("icvCNNConvolutionStep");
+  __BEGIN__;
+  if (!layer->n_grads){EXIT;}
+  if (n_batches>1){ cvScale(layer->dE_dW,layer->dE_dW,1./n_batches); }
+  CV_CALL(icvCNNConvolutionUpdate(layer,layer->dE_dW,t));
+  layer->n_grads = 0;
   __END__;
 }
 
@@ -503,7 +1072,11 @@ void icvCNNConvolutionRelease( CvDNNLayer** p_layer )
       CV_ERROR( CV_StsBadArg, "Invalid layer" );
 
   if (layer->weights){cvReleaseMat( &layer->weights );layer->weights=0;}
+  if (layer->Wt){cvReleaseMat( &layer->Wt );layer->Wt=0;}
+  if (layer->Wt_src){cvReleaseMat( &layer->Wt_src );layer->Wt_src=0;}
+  icvReleaseQuantization( &layer->quant );
   cvReleaseMat( &layer->connect_mask );
+  cvReleaseWorkspaceMats( *p_layer );
   cvFree( p_layer );
 
   __END__;
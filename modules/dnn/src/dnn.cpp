@@ -52,6 +52,7 @@
 // #include "cvext.h"
 // #include "_dnn.h"
 #include "cvtimer.h"
+#include <new>
 
 /*************************************************************************\
  *               Auxilary functions declarations                         *
@@ -66,16 +67,21 @@ void icvCNNModelUpdate(
         const CvMat* CV_DEFAULT(0), const CvMat* CV_DEFAULT(0));
 void icvCNNModelRelease( CvDNNStatModel** cnn_model );
 
-void icvTrainNetwork( CvNetwork* network,
-                     const CvMat* images, const CvMat* responses, CvDNNStatModelParams * params);
+void icvTrainNetwork( CvNetwork* network, CvDNNDataSource * source, 
+                      CvDNNStatModelParams * params );
 //        int grad_estim_type, int max_iter, int start_iter, int batch_size);
 
+// number of mini batches read ahead of training by the batch loader
+#define ICV_DNN_PREFETCH_BATCHES 4
+
 /*-------------- functions for the CNN network -------------------------*/
 void icvNetworkAddLayer( CvNetwork* network, CvDNNLayer* layer );
 CvDNNLayer* icvNetworkGetLayer( CvNetwork* network, const char * name );
 void icvNetworkRelease( CvNetwork** network );
 void icvNetworkRead( CvNetwork * network, CvFileStorage * fs );
 void icvNetworkWrite( CvNetwork * network, CvFileStorage * fs );
+static int icvFindExecOp( const CvDNNExecPlan * plan, const char * name );
+static int icvIsExecPlanValid( const CvNetwork * network );
 /* In all layer functions we denote input by X and output by Y, where
    X and Y are column-vectors, so that
    length(X)==<n_input_planes>*<input_height>*<input_width>,
@@ -84,6 +90,7 @@ void icvNetworkWrite( CvNetwork * network, CvFileStorage * fs );
 
 /*--------------------------- utility functions -----------------------*/
 float icvEvalAccuracy(CvDNNLayer * last_layer, CvMat * result, CvMat * expected);
+int icvIsPlannedOutputLayer(CvDNNLayer * layer);
 
 /**************************************************************************\
  *                 Functions implementations                              *
@@ -119,9 +126,9 @@ void icvCheckNetwork(CvNetwork * network,
       CV_ERROR( CV_StsBadArg, "Invalid input sizes of the first layer" );
     }
   }
-  if (icvIsSimpleRNNLayer(last_layer)){
+  if (icvIsSimpleRNNLayer(last_layer) || icvIsSequenceRNNLayer(last_layer)){
     if ( params->etalons->cols != last_layer->n_output_planes*
-         ((CvDNNSimpleRNNLayer*)last_layer)->seq_length*
+         last_layer->seq_length*
          last_layer->output_height*last_layer->output_width ) {
       CV_ERROR( CV_StsBadArg, "Invalid output sizes of the last layer" );
     }
@@ -156,6 +163,13 @@ void icvCheckCNNModelParams(CvDNNStatModelParams * params,
   if ( params->max_iter < 1 ) {
     params->max_iter = 1;
   }
+  if ( params->optimizer < CV_DNN_OPTIMIZER_SGD || params->optimizer > CV_DNN_OPTIMIZER_ADAMW ) {
+    CV_ERROR( CV_StsBadArg, "Invalid <optimizer>" );
+  }
+  if ( params->optimizer >= CV_DNN_OPTIMIZER_ADAM ) {
+    if ( params->beta2 <= 0 ) { params->beta2 = .999f; }
+    if ( params->epsilon <= 0 ) { params->epsilon = 1e-8f; }
+  }
 }
 
 /********************************************************************\
@@ -197,55 +211,491 @@ cvTrainCNNClassifier( const CvMat* _train_data, int tflag,
             const CvMat*, const CvMat* _sample_idx, const CvMat*, const CvMat* )
 {
   CvDNNStatModel* cnn_model    = 0;
-  CvMat * train_data = cvCloneMat(_train_data);
-  CvMat* responses             = 0;
+  CvDNNDataSource * source     = 0;
 
   CV_FUNCNAME("cvTrainCNNClassifier");
   __BEGIN__;
 
-  int n_images;
-  int img_size;
   CvDNNStatModelParams* params = (CvDNNStatModelParams*)_params;
+  CV_CALL(source = cvCreateMatDataSource(_train_data,_responses));
 
-  CV_CALL(cnn_model = (CvDNNStatModel*)
-    cvCreateStatModel(CV_STAT_MODEL_MAGIC_VAL|CV_DNN_MAGIC_VAL, sizeof(CvDNNStatModel)));
-  
-  img_size = _train_data->cols;
-  n_images = _train_data->rows;
-  cnn_model->cls_labels = params->cls_labels;
-  responses = cvCreateMat(n_images,_responses->cols,CV_32F);
-  cvConvert(_responses,responses);
-  CV_ASSERT(CV_MAT_TYPE(train_data->type)==CV_32F);
-
-  // normalize image value range
+  // normalize image value range, applied while samples are read into mini
+  // batches, so that training data of any depth is neither copied nor converted
   if (icvIsConvolutionLayer(params->network->first_layer->next_layer)){
     double minval, maxval;
-    cvMinMaxLoc(train_data,&minval,&maxval,0,0);
-    cvSubS(train_data,cvScalar(minval),train_data);
-    cvScale(train_data,train_data,10./((maxval-minval)*.5f));
-    cvAddS(train_data,cvScalar(-1.f),train_data);
+    cvMinMaxLoc(_train_data,&minval,&maxval,0,0);
+    source->scale = 10./((maxval-minval)*.5f);
+    source->shift = -minval*source->scale-1.f;
   }
 
+  CV_CALL(cnn_model = cvTrainCNNClassifierFromSource(source,params));
+  __END__;
+
+  if (source){source->release(&source);}
+
+  return (CvDNNStatModel*)cnn_model;
+}
+
+ML_IMPL CvDNNStatModel*
+cvTrainCNNClassifierFromSource( CvDNNDataSource * source, const CvDNNStatModelParams* _params )
+{
+  CvDNNStatModel* cnn_model    = 0;
+
+  CV_FUNCNAME("cvTrainCNNClassifierFromSource");
+  __BEGIN__;
+
+  CvDNNStatModelParams* params = (CvDNNStatModelParams*)_params;
+  if (!source || !source->read){CV_ERROR(CV_StsBadArg,"Invalid data source");}
+
+  CV_CALL(cnn_model = (CvDNNStatModel*)
+    cvCreateStatModel(CV_STAT_MODEL_MAGIC_VAL|CV_DNN_MAGIC_VAL, sizeof(CvDNNStatModel)));
+  cnn_model->cls_labels = params->cls_labels;
+
   icvCheckCNNModelParams(params,cnn_model,cvFuncName);
-  icvCheckNetwork(params->network,params,img_size,cvFuncName);
+  icvCheckNetwork(params->network,params,source->n_inputs,cvFuncName);
 
   cnn_model->network = params->network;
   CV_CALL(cnn_model->etalons = cvCloneMat( params->etalons ));
 
-  CV_CALL( icvTrainNetwork( cnn_model->network, train_data, responses, params) );
+  CV_CALL( icvTrainNetwork( cnn_model->network, source, params) );
   __END__;
 
   if ( cvGetErrStatus() < 0 && cnn_model ){
     cnn_model->release( (CvDNNStatModel**)&cnn_model );
   }
-  cvReleaseMat( &train_data );
-  cvReleaseMat( &responses );
 
   return (CvDNNStatModel*)cnn_model;
 }
 
 /*************************************************************************/
-void icvTrainNetwork( CvNetwork* network,const CvMat* samples, const CvMat* responses, CvDNNStatModelParams * params)
+/* Columns of activation X[k] of <plan> in training, all time steps of a 
+   sample are in a row of the output of input and sequence mode layers. */
+static int icvGetTrainActivationCols( const CvDNNExecPlan * plan, int k )
+{
+  if (k==0){
+    CvDNNLayer * first_layer = plan->ops[0].layer;
+    return first_layer->n_input_planes*first_layer->input_width*
+      first_layer->input_height*first_layer->seq_length;
+  }
+  CvDNNLayer * layer = plan->ops[k-1].layer;
+  int n_outputs = layer->n_output_planes*layer->output_height*layer->output_width;
+  if (icvIsInputLayer(layer) || icvIsSequenceRNNLayer(layer)){ n_outputs *= layer->seq_length; }
+  return n_outputs;
+}
+
+/* Activation and gradient buffers of each op output in <plan>, for mini 
+   batches of <batch_size> samples. With <checkpoints> given, interior 
+   activations of its segments are headers into its shared buffer. */
+static void icvCreateTrainBuffers( const CvDNNExecPlan * plan, int batch_size,
+                                   const CvDNNCheckpointPlan * checkpoints,
+                                   CvMat *** p_X, CvMat *** p_dE_dX )
+{
+  CvMat ** X = 0;
+  CvMat ** dE_dX = 0;
+  CV_FUNCNAME("icvCreateTrainBuffers");
+  __BEGIN__;
+  const int n_layers = plan->n_ops;
+  CvDNNLayer * first_layer = plan->ops[0].layer;
+  CV_CALL(X = (CvMat**)cvAlloc( (n_layers+1)*sizeof(CvMat*) )); memset( X, 0, (n_layers+1)*sizeof(CvMat*) );
+  CV_CALL(dE_dX = (CvMat**)cvAlloc( (n_layers+1)*sizeof(CvMat*) )); memset( dE_dX, 0, (n_layers+1)*sizeof(CvMat*) );
+  if (checkpoints){
+    CV_ASSERT(checkpoints->batch_size>=batch_size && checkpoints->bounds[checkpoints->n_segments]==n_layers);
+    for ( int s = 0; s < checkpoints->n_segments; s++ ){
+      for ( int k = checkpoints->bounds[s]+1; k < checkpoints->bounds[s+1]; k++ ){
+        CV_CALL(X[k] = cvCreateMatHeader( batch_size, icvGetTrainActivationCols(plan,k), CV_32F ));
+        cvSetData( X[k], checkpoints->data+checkpoints->offsets[k], CV_AUTOSTEP );
+      }
+    }
+  }
+  CV_CALL(X[0] = cvCreateMat( batch_size, icvGetTrainActivationCols(plan,0), CV_32F ));
+  CV_CALL(dE_dX[0] = cvCreateMat( batch_size, X[0]->cols*first_layer->seq_length, CV_32F ));
+  cvZero(X[0]); cvZero(dE_dX[0]);
+  for ( int k = 0; k < n_layers; k++ ){
+    if (!X[k+1]){ CV_CALL(X[k+1] = cvCreateMat( batch_size, icvGetTrainActivationCols(plan,k+1), CV_32F )); }
+    CV_CALL(dE_dX[k+1] = cvCreateMat( batch_size, X[k+1]->cols, CV_32F ));
+    cvZero(X[k+1]); cvZero(dE_dX[k+1]);
+  }
+  __END__;
+  *p_X = X;
+  *p_dE_dX = dE_dX;
+}
+
+static void icvReleaseTrainBuffers( int n_layers, CvMat *** p_X, CvMat *** p_dE_dX )
+{
+  CvMat ** X = *p_X;
+  CvMat ** dE_dX = *p_dE_dX;
+  for ( int k = 0; k <= n_layers; k++ ){
+    if (X){cvReleaseMat( &X[k] );}
+    if (dE_dX){cvReleaseMat( &dE_dX[k] );}
+  }
+  if (X){cvFree( p_X );}
+  if (dE_dX){cvFree( p_dE_dX );}
+}
+
+/* Forward pass of <op> in training, within a segment ending at activation
+   X[end]. Layers keeping a copy of their output for later layers read it from
+   X[op->output] instead, as in prediction, unless it is an interior activation
+   read beyond the segment, which the next segment recomputed overwrites. */
+static void icvTrainForwardOp( const CvDNNExecOp * op, CvMat ** X, int end )
+{
+  CV_FUNCNAME("icvTrainForwardOp");
+  __BEGIN__;
+  CvDNNLayer * layer = op->layer;
+  if (icvIsPlannedOutputLayer(layer)){
+    layer->Y = (op->output>=end || op->last_use<end)?X[op->output]:0;
+  }
+  CV_CALL(layer->forward( layer, X[op->input], X[op->output] ));
+  __END__;
+}
+
+/* Frees scratch buffers of ops <start> to <end>-1 of <ops>, which are filled
+   again when the segment is recomputed. */
+static void icvReleaseSegmentScratch( const CvDNNExecOp * ops, int start, int end )
+{
+  for (int k=start;k<end;k++){
+    CvDNNLayer * layer = ops[k].layer;
+    cvReleaseWorkspaceScratch(layer);
+    if (layer->clear){ layer->clear(layer); }
+  }
+}
+
+/* Runs forward pass on the mini batch in X[0], then propagates gradient of
+   squared error between network output and <expected> backward through all ops,
+   which sum gradients of their weights into the layers' gradient stores. 
+   With <checkpoints> given, segments are back propagated last to first, each
+   after its interior activations are recomputed, except for the last segment
+   whose activations are still those of the forward pass. Scratch buffers of 
+   the layers are then only held for a segment at a time. */
+static void icvTrainBatch( const CvDNNExecPlan * plan, const CvDNNCheckpointPlan * checkpoints,
+                           CvMat ** X, CvMat ** dE_dX, const CvMat * expected, int t )
+{
+  CV_FUNCNAME("icvTrainBatch");
+  __BEGIN__;
+  const CvDNNExecOp * ops = plan->ops;
+  const int n_layers = plan->n_ops;
+  const int n_segments = checkpoints?checkpoints->n_segments:1;
+  int k, s;
+  for ( k = 0, s = 0; k < n_layers; k++ ){
+    if (checkpoints && k==checkpoints->bounds[s+1]){
+      icvReleaseSegmentScratch(ops,checkpoints->bounds[s],k); s++;
+    }
+    CV_CALL(icvTrainForwardOp( ops+k, X, checkpoints?checkpoints->bounds[s+1]:n_layers ));
+  }
+  CV_ASSERT(cvCountNAN(X[n_layers])<1);
+  cvCopy( X[n_layers], dE_dX[n_layers] );
+  cvSub( dE_dX[n_layers], expected, dE_dX[n_layers] );
+  for ( s = n_segments-1; s >= 0; s-- ){
+    const int start = checkpoints?checkpoints->bounds[s]:0;
+    const int end = checkpoints?checkpoints->bounds[s+1]:n_layers;
+    // layers of the segment refresh their own states as well, which layers
+    // copied over time steps share
+    for ( k = start; s < n_segments-1 && k < end; k++ ){
+      CV_CALL(icvTrainForwardOp( ops+k, X, end ));
+    }
+    for ( k = end-1; k >= start; k-- ){
+      CvDNNLayer * layer = ops[k].layer;
+      CV_CALL(layer->backward( layer, t, X[ops[k].input], dE_dX[ops[k].output], 
+                               dE_dX[ops[k].input] ));
+    }
+    if (checkpoints){ icvReleaseSegmentScratch(ops,start,end); }
+  }
+  __END__;
+}
+
+/* Applies gradients summed by the layers of <plan> over their last <n_batches>
+   mini batches, averaged, as the update of iteration <t>. */
+static void icvStepExecPlan( const CvDNNExecPlan * plan, int t, int n_batches )
+{
+  CV_FUNCNAME("icvStepExecPlan");
+  __BEGIN__;
+  for (int k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    if (layer->step && layer->n_grads){CV_CALL(layer->step(layer,t,n_batches));}
+  }
+  __END__;
+}
+
+/* Drops the states carried over between batches by stateful recurrent layers
+   of <network>, so that the next batch starts new streams from zero states. */
+ML_IMPL void cvResetRecurrentStates(CvNetwork * network)
+{
+  CV_FUNCNAME("cvResetRecurrentStates");
+  __BEGIN__;
+  if ( !network ) {
+    CV_ERROR( CV_StsNullPtr, "Null <network> pointer" );
+  }
+  for ( CvDNNLayer * layer = network->first_layer; layer; layer = layer->next_layer ) {
+    layer->n_carried = 0;
+  }
+  __END__;
+}
+
+/* Drops gradients summed by the layers of <plan> since their last step. */
+static void icvClearExecPlanGradients( const CvDNNExecPlan * plan )
+{
+  for (int k=0;k<plan->n_ops;k++){plan->ops[k].layer->n_grads = 0;}
+}
+
+// A worker of data-parallel training, which trains a slice of every mini batch
+// on its own execution context. Weights are shared with the network, and 
+// gradients are left in the layer copies to be reduced over all workers.
+// In asynchronous training, a worker trains whole mini batches read by its 
+// own loader, and steps its layer copies to update the shared weights.
+typedef struct CvDNNTrainWorker
+{
+  CvDNNExecContext * context;
+  CvDNNExecPlan * plan;
+  CvDNNCheckpointPlan * checkpoints;
+  CvMat ** X;
+  CvMat ** dE_dX;
+  // rows of the mini batch trained by the worker
+  int start;
+  int count;
+  // used by asynchronous training only
+  CvDNNBatchLoader * loader;
+  CvMat * expected;
+  double sumloss;
+  double sumacc;
+  int n_batches;
+}CvDNNTrainWorker;
+
+/* Returns non-zero if all layers of <plan> can be trained on worker copies,
+   which requires their gradients to be sums over samples and applied by 
+   the trainer. */
+static int icvIsDataParallelPlan( const CvDNNExecPlan * plan )
+{
+  for (int k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    if (layer->seq_length>1){return 0;}
+    if (!icvIsInputLayer(layer) && !icvIsConvolutionLayer(layer) && 
+        !icvIsMaxPoolingLayer(layer) && !icvIsDenseLayer(layer) && 
+        !icvIsMergeLayer(layer)){return 0;}
+  }
+  return 1;
+}
+
+/* Whether <plan> has stateful recurrent layers, whose rows of consecutive 
+   batches continue the same streams. */
+static int icvIsStatefulPlan( const CvDNNExecPlan * plan )
+{
+  for (int k=0;k<plan->n_ops;k++){
+    if (plan->ops[k].layer->stateful){return 1;}
+  }
+  return 0;
+}
+
+static void icvReleaseTrainWorkers( CvDNNTrainWorker ** p_workers, int n_workers, int n_layers )
+{
+  CvDNNTrainWorker * workers = *p_workers;
+  if (!workers){return;}
+  for (int w=0;w<n_workers;w++){
+    icvReleaseTrainBuffers(n_layers,&workers[w].X,&workers[w].dE_dX);
+    if (workers[w].checkpoints){cvReleaseCheckpointPlan(&workers[w].checkpoints);}
+    if (workers[w].loader){cvReleaseBatchLoader(&workers[w].loader);}
+    if (workers[w].expected){cvReleaseMat(&workers[w].expected);}
+    if (workers[w].context){cvReleaseDNNExecContext(&workers[w].context);}
+  }
+  cvFree(p_workers);
+}
+
+/* Splits mini batches of <batch_size> samples over <n_workers> workers, each
+   with its own copy of the network layers and buffers for its slice. With 
+   <async> set, each worker gets buffers for whole mini batches instead. 
+   Activations of each worker are checkpointed with <n_segments> above 0. */
+static CvDNNTrainWorker * icvCreateTrainWorkers( CvNetwork * network, int n_workers, 
+                                                 int batch_size, int async, int n_segments )
+{
+  CvDNNTrainWorker * workers = 0;
+  CV_FUNCNAME("icvCreateTrainWorkers");
+  __BEGIN__;
+  CV_CALL(workers = (CvDNNTrainWorker*)cvAlloc(sizeof(CvDNNTrainWorker)*n_workers));
+  memset(workers,0,sizeof(CvDNNTrainWorker)*n_workers);
+  for (int w=0;w<n_workers;w++){
+    CvDNNTrainWorker * worker = workers+w;
+    worker->start = async?0:batch_size*w/n_workers;
+    worker->count = async?batch_size:batch_size*(w+1)/n_workers-worker->start;
+    CV_CALL(worker->context = cvCreateDNNExecContext(network));
+    CV_CALL(worker->plan = cvCompileNetwork(worker->context->network));
+    if (n_segments>0){
+      CV_CALL(worker->checkpoints = cvCreateCheckpointPlan(worker->context->network,
+                                                           worker->count,n_segments));
+    }
+    CV_CALL(icvCreateTrainBuffers(worker->plan,worker->count,worker->checkpoints,
+                                  &worker->X,&worker->dE_dX));
+  }
+  __END__;
+  if (cvGetErrStatus()<0){icvReleaseTrainWorkers(&workers,n_workers,network->n_layers);}
+  return workers;
+}
+
+/* Sums weights gradients of all workers into the layer copies of the first 
+   worker, pairwise in log2(n_workers) rounds, with the pairs of each round 
+   reduced concurrently. */
+static void icvAllReduceGradients( CvDNNTrainWorker * workers, int n_workers, int n_layers )
+{
+  for (int stride=1;stride<n_workers;stride*=2){
+    const int n_pairs = (n_workers+2*stride-1)/(2*stride);
+#pragma omp parallel for num_threads(n_pairs) schedule(static,1)
+    for (int pi=0;pi<n_pairs;pi++){
+      const int dst = 2*stride*pi, src = dst+stride;
+      if (src>=n_workers){continue;}
+      for (int k=0;k<n_layers;k++){
+        CvDNNLayer * dst_layer = workers[dst].plan->ops[k].layer;
+        CvDNNLayer * src_layer = workers[src].plan->ops[k].layer;
+        if (dst_layer->n_grads && src_layer->n_grads){
+          cvAdd(dst_layer->dE_dW,src_layer->dE_dW,dst_layer->dE_dW);
+        }
+      }
+    }
+  }
+}
+
+/* Passes a mini batch over all workers, output of the network is gathered 
+   in <Y>, and gradients are left in the layer copies of each worker. */
+static void icvTrainBatchDataParallel( CvDNNTrainWorker * workers, int n_workers,
+                                       const CvMat * X, const CvMat * expected, CvMat * Y, int t )
+{
+  CV_FUNCNAME("icvTrainBatchDataParallel");
+  __BEGIN__;
+  const int n_layers = workers[0].plan->n_ops;
+  int n_failed = 0;
+  // layer errors are raised as exceptions, which must not leave the parallel region
+#pragma omp parallel for num_threads(n_workers) schedule(static,1) reduction(+:n_failed)
+  for (int w=0;w<n_workers;w++){
+    CvDNNTrainWorker * worker = workers+w;
+    try{
+      CvMat X_slice, expected_slice, Y_slice;
+      cvGetRows(X,&X_slice,worker->start,worker->start+worker->count);
+      cvGetRows(expected,&expected_slice,worker->start,worker->start+worker->count);
+      cvCopy(&X_slice,worker->X[0]);
+      icvTrainBatch(worker->plan,worker->checkpoints,worker->X,worker->dE_dX,&expected_slice,t);
+      cvGetRows(Y,&Y_slice,worker->start,worker->start+worker->count);
+      cvCopy(worker->X[n_layers],&Y_slice);
+    }catch(...){
+      n_failed++;
+    }
+  }
+  if (n_failed){CV_ERROR(CV_StsError,"Failed to train mini batch on worker threads");}
+  __END__;
+}
+
+/* Reduces gradients of all workers and applies them to the shared weights 
+   once, through the layer copies of the first worker, which share weights 
+   and optimizer with the network. */
+static void icvStepDataParallel( CvDNNTrainWorker * workers, int n_workers, int t,
+                                 int n_batches )
+{
+  CV_FUNCNAME("icvStepDataParallel");
+  __BEGIN__;
+  icvAllReduceGradients(workers,n_workers,workers[0].plan->n_ops);
+  CV_CALL(icvStepExecPlan(workers[0].plan,t,n_batches));
+  for (int w=1;w<n_workers;w++){icvClearExecPlanGradients(workers[w].plan);}
+  __END__;
+}
+
+/* Hogwild training: each worker reads shuffled mini batches of its own part of
+   <train_idx> and trains them on its execution context, which is stepped every 
+   <n_accum> of its mini batches to update the shared weights without locking.
+   Updates are counted over all workers for the learning rate schedule; 
+   workers only wait for each other at the end of an epoch. */
+static void icvTrainHogwild( CvNetwork * network, CvDNNTrainWorker * workers, int n_workers,
+                             CvDNNDataSource * source, const CvMat * train_idx, 
+                             const CvMat * samples_valid, const CvMat * response_valid,
+                             CvMat * result_valid, int batch_size, int n_epochs, int n_accum,
+                             CvRNG * rng )
+{
+  CV_FUNCNAME("icvTrainHogwild");
+  __BEGIN__;
+  const int n_layers = workers[0].plan->n_ops;
+  const int n_samples_train = train_idx->cols;
+  CvDNNLayer * last_layer = workers[0].plan->last_layer;
+  int iter = 0;
+
+  for (int w=0;w<n_workers;w++){
+    CvDNNTrainWorker * worker = workers+w;
+    const int start = n_samples_train*w/n_workers, end = n_samples_train*(w+1)/n_workers;
+    CvMat idx_hdr;
+    CvRNG worker_rng = cvRNG(cvRandInt(rng));
+    cvGetCols(train_idx,&idx_hdr,start,end);
+    CV_CALL(worker->loader = cvCreateBatchLoader(source,&idx_hdr,batch_size,
+                                                 ICV_DNN_PREFETCH_BATCHES,&worker_rng));
+    CV_CALL(worker->expected = cvCreateMat(batch_size*last_layer->seq_length,
+                                           worker->X[n_layers]->cols,CV_32F));
+    worker->n_batches = (end-start+batch_size-1)/batch_size;
+  }
+
+  CvTimer timer; timer.start();
+  for ( int epoch_iter=0; epoch_iter<n_epochs; epoch_iter++ ){
+    int n_failed = 0, n_batches = 0;
+    double sumloss = 0, sumacc = 0;
+    // layer errors are raised as exceptions, which must not leave the parallel region
+#pragma omp parallel for num_threads(n_workers) schedule(static,1) reduction(+:n_failed)
+    for (int w=0;w<n_workers;w++){
+      CvDNNTrainWorker * worker = workers+w;
+      worker->sumloss = worker->sumacc = 0;
+      try{
+        for (int bi=0;bi<worker->n_batches;bi++){
+          CvMat expected_hdr;
+          cvReshape(worker->expected,&expected_hdr,0,batch_size);
+          cvGetNextBatch(worker->loader,worker->X[0],&expected_hdr);
+          icvTrainBatch(worker->plan,worker->checkpoints,worker->X,worker->dE_dX,
+                        worker->expected,bi+1);
+          if ((bi+1)%n_accum==0 || bi==worker->n_batches-1){
+            int t;
+#pragma omp atomic capture
+            t = ++iter;
+            icvStepExecPlan(worker->plan,t,bi%n_accum+1);
+          }
+          worker->sumloss += cvNorm(worker->X[n_layers],worker->expected)/float(batch_size);
+          worker->sumacc += icvEvalAccuracy(last_layer,worker->X[n_layers],worker->expected);
+        }
+      }catch(...){
+        n_failed++;
+      }
+    }
+    if (n_failed){CV_ERROR(CV_StsError,"Failed to train mini batches on worker threads");}
+
+    for (int w=0;w<n_workers;w++){
+      sumloss += workers[w].sumloss; sumacc += workers[w].sumacc; n_batches += workers[w].n_batches;
+    }
+    float elapsed = timer.elapsed();
+    fprintf(stderr, "epoch: %d/%d, hogwild: %d workers, ", epoch_iter+1, n_epochs, n_workers);
+    fprintf(stderr, "sumacc: %.1f%%, sumloss: %f, ", sumacc/n_batches, sumloss/n_batches);
+    fprintf(stderr, "samples/sec: %.1f, ", float(epoch_iter+1)*n_samples_train/elapsed);
+    CV_CALL(icvCNNModelPredict(network, samples_valid, result_valid, batch_size));
+    fprintf(stderr, "validacc: %.1f%%\n", 
+            icvEvalAccuracy(last_layer, result_valid, (CvMat*)response_valid));
+  }
+  __END__;
+}
+
+/* Prints peak bytes of a training pass with <checkpoints>: activations held
+   with and without them, the largest size of buffers in <workspace> measured
+   once trained on, e.g. pre-activations kept for backward pass, and their 
+   sum. All are those of each of <n_workers> workers. */
+static void icvPrintCheckpointPlan( const CvDNNCheckpointPlan * checkpoints, 
+                                    const CvDNNWorkspace * workspace, int n_workers )
+{
+  fprintf(stderr,"Checkpoints: %d segments%s, naive: %.1fKB, checkpointed: %.1fKB, "
+          "saved: %.1fKB, workspace: %.1fKB, peak: %.1fKB\n",
+          checkpoints->n_segments,n_workers>1?" per worker":"",
+          checkpoints->naive_bytes/1024.,checkpoints->checkpointed_bytes/1024.,
+          (checkpoints->naive_bytes-checkpoints->checkpointed_bytes)/1024.,
+          workspace->peak_bytes/1024.,
+          (checkpoints->checkpointed_bytes+workspace->peak_bytes)/1024.);
+}
+
+/* Mini batches are read by index from <source> on a background thread, ahead of
+   the batch being trained on, so that the training set is never copied or moved. 
+   With params->n_workers>1, each mini batch is split over worker threads, see
+   icvTrainBatchDataParallel, or workers train asynchronously with 
+   params->train_mode set to CV_DNN_TRAIN_HOGWILD, see icvTrainHogwild.
+   Weights are updated once every params->accum_batches mini batches, by the
+   mean of their gradients, as by a single batch of all their samples. With params->checkpoint_segments above 0, only
+   activations at segment boundaries are kept through the forward pass, and
+   the others are recomputed in backward pass, see cvCreateCheckpointPlan. */
+void icvTrainNetwork( CvNetwork* network, CvDNNDataSource * source, 
+                      CvDNNStatModelParams * params )
 {
   // const int grad_estim_type=params->grad_estim_type;
   const int start_iter=params->start_iter;
@@ -255,109 +705,206 @@ void icvTrainNetwork( CvNetwork* network,const CvMat* samples, const CvMat* resp
   //const int max_iter=params->max_iter;
   CvMat** X     = 0;
   CvMat** dE_dX = 0;
+  CvMat * batch_X = 0;
+  CvMat * batch_Y = 0;
+  CvMat * expected = 0;
+  CvMat * result_valid = 0;
+  CvMat * samples_valid = 0;
+  CvMat * response_valid = 0;
+  CvMat * train_idx = 0;
+  CvMat * shuffle_idx = 0;
+  CvDNNBatchLoader * loader = 0;
+  CvDNNTrainWorker * workers = 0;
+  CvDNNParamClient * client = 0;
+  CvDNNOptimizer * optimizer = 0;
+  CvDNNCheckpointPlan * checkpoints = 0;
+  const int hogwild = params->train_mode==CV_DNN_TRAIN_HOGWILD;
+  const int n_accum = MAX(params->accum_batches,1);
+  int n_workers = MAX(params->n_workers,1);
+  int n_segments = MAX(params->checkpoint_segments,0);
   const int n_layers = network->n_layers;
-  int k=0;
   CV_FUNCNAME("icvTrainNetwork");
   __BEGIN__;
 
+  CvDNNExecPlan * plan = 0;
+  CV_CALL(plan = cvCompileNetwork(network));
+  for (int k=0;k<plan->n_ops;k++){
+    if (plan->ops[k].layer->quant){
+      CV_ERROR(CV_StsBadArg,"Quantized network can not be trained, see cvDequantizeNetwork");
+    }
+  }
   CvDNNLayer * first_layer = network->first_layer;
-  CvDNNLayer * last_layer = cvGetCNNLastLayer(network);
+  // inputs are predicted with the conversion they are trained with
+  network->input_scale = source->scale;
+  network->input_shift = source->shift;
+  // optimizer states live as long as training, layer copies made for
+  // workers below share them with the network
+  if (params->optimizer!=CV_DNN_OPTIMIZER_SGD || params->weight_decay>0){
+    CV_CALL(optimizer = cvCreateDNNOptimizer(params->optimizer,params->momentum_ratio,
+                                             params->beta2,params->epsilon,params->weight_decay));
+  }
+  CV_CALL(cvSetNetworkOptimizer(network,optimizer));
+  CvDNNLayer * last_layer = plan->last_layer;
+  const int stateful = icvIsStatefulPlan(plan);
   const int n_inputs   =
     first_layer->n_input_planes*first_layer->input_width*first_layer->input_height;
-  const int n_samples   = responses->rows; CV_ASSERT(n_samples==samples->rows);
+  const int n_samples   = source->n_samples;
   CV_ASSERT(validate_ratio>0 && validate_ratio<1.f);
-  const int n_samples_train = n_samples*(1.f-validate_ratio);
+  int n_samples_train = n_samples*(1.f-validate_ratio);
   const int n_samples_valid = n_samples-n_samples_train;
-  CvMat * samples_train = cvCreateMat(n_samples_train, samples->cols, CV_32F);
-  CvMat * samples_valid = cvCreateMat(n_samples_valid, samples->cols, CV_32F);
-  CvMat * response_train = cvCreateMat(n_samples_train, responses->cols, CV_32F);
-  CvMat * response_valid = cvCreateMat(n_samples_valid, responses->cols, CV_32F);
-  CvMat * X0 = cvCreateMat( batch_size*first_layer->seq_length, n_inputs, CV_32F );
-  CvDNNLayer * layer = 0;
   int n=0;
+  // mini batches trained since weights were last updated
+  int n_pending=0;
   CvRNG rng = cvRNG(-1);
-  const int max_iter = n_epochs*n_samples_train;
+  int max_iter = n_epochs*n_samples_train;
 
-  // split samples into `train` and `valid`
-  CvMat * shuffle_idx = cvCreateMat(1,n_samples,CV_32S);
+  // split samples into `train` and `valid`, training samples are referred to by
+  // index only, validation samples are read once; samples of stateful layers
+  // are consecutive pieces of a stream, of which validation takes the last ones
+  CV_CALL(shuffle_idx = cvCreateMat(1,n_samples,CV_32S));
   for (int ii=0;ii<n_samples;ii++){CV_MAT_ELEM(*shuffle_idx,int,0,ii)=ii;}
-  cvRandShuffle(shuffle_idx, &rng, 1.f);
-  for ( k = 0; k < n_samples_train; k++ ){
-    memcpy(samples_train->data.fl+samples->cols*k,
-           samples->data.fl+samples->cols*shuffle_idx->data.i[k],
-           sizeof(float)*samples->cols);
-    memcpy(response_train->data.fl+responses->cols*k,
-           responses->data.fl+responses->cols*shuffle_idx->data.i[k],
-           sizeof(float)*responses->cols);
-  }
-  for ( ; k < n_samples; k++ ){
-    memcpy(samples_valid->data.fl+samples->cols*(k-n_samples_train),
-           samples->data.fl+samples->cols*shuffle_idx->data.i[k],
-           sizeof(float)*samples->cols);
-    memcpy(response_valid->data.fl+responses->cols*(k-n_samples_train),
-           responses->data.fl+responses->cols*shuffle_idx->data.i[k],
-           sizeof(float)*responses->cols);
-  }
+  if (!stateful){cvRandShuffle(shuffle_idx, &rng, 1.f);}
+  CV_CALL(train_idx = cvCreateMat(1,n_samples_train,CV_32S));
+  memcpy(train_idx->data.i,shuffle_idx->data.i,sizeof(int)*n_samples_train);
+  CV_CALL(samples_valid = cvCreateMat(n_samples_valid, source->n_inputs, CV_32F));
+  CV_CALL(response_valid = cvCreateMat(n_samples_valid, source->n_outputs, CV_32F));
+  CV_CALL(source->read(source,shuffle_idx->data.i+n_samples_train,n_samples_valid,
+                       samples_valid,response_valid));
   cvReleaseMat(&shuffle_idx);shuffle_idx=0;
+
+  // the stream is cut into <batch_size> parts, trained side by side, so that
+  // row i of each batch continues row i of the previous one
+  if (stateful){
+    const int n_batches = n_samples_train/batch_size;
+    if (n_batches<1){CV_ERROR(CV_StsBadArg,"Stateful layers need at least a batch of training samples");}
+    for (int bi=0;bi<n_batches;bi++){
+      for (int ii=0;ii<batch_size;ii++){train_idx->data.i[bi*batch_size+ii] = ii*n_batches+bi;}
+    }
+    train_idx->cols = n_samples_train = n_batches*batch_size;
+    max_iter = n_epochs*n_samples_train;
+  }
+
+  // as a worker of parameter server, train on a shard of the training samples,
+  // which all workers split the same way, and leave gradients to the server
+  if (params->ps_host){
+    if (!icvIsDataParallelPlan(plan)){
+      CV_ERROR(CV_StsBadArg,"Network can not be trained with a parameter server");
+    }
+    CV_CALL(client = icvConnectParamServer(params->ps_host,params->ps_port,plan,
+                                           params->ps_compression,params->ps_topk_ratio));
+    int n_shard = 0;
+    for (int ii=client->worker_id;ii<n_samples_train;ii+=client->n_workers){
+      train_idx->data.i[n_shard++] = train_idx->data.i[ii];
+    }
+    CV_ASSERT(n_shard>0);
+    train_idx->cols = n_samples_train = n_shard;
+    max_iter = n_epochs*n_samples_train;
+    n_workers = 1;
+    fprintf(stderr,"worker %d/%d of parameter server at %s:%d, %d training samples\n",
+            client->worker_id+1,client->n_workers,params->ps_host,params->ps_port,n_shard);
+  }
+
+  // a synchronous worker needs a sample of each mini batch, an asynchronous
+  // one needs samples of its own
+  n_workers = MIN(n_workers,hogwild?n_samples_train:batch_size);
+  if (n_workers>1 && stateful){
+    fprintf(stderr,"warning: stateful layers are trained on a single thread.\n");
+    n_workers = 1;
+  }
+  // a recomputed stateful layer would start from the states it carried over
+  if (n_segments>0 && stateful){
+    fprintf(stderr,"warning: activations of stateful layers are not checkpointed.\n");
+    n_segments = 0;
+  }
+  if (n_workers>1 && !hogwild && !icvIsDataParallelPlan(plan)){
+    fprintf(stderr,"warning: network can not be trained in data-parallel, "
+            "training on a single thread.\n");
+    n_workers = 1;
+  }
   
-  // initialize input data
-  CV_CALL(X = (CvMat**)cvAlloc( (n_layers+1)*sizeof(CvMat*) )); memset( X, 0, (n_layers+1)*sizeof(CvMat*) );
-  CV_CALL(dE_dX = (CvMat**)cvAlloc( (n_layers+1)*sizeof(CvMat*) )); memset( dE_dX, 0, (n_layers+1)*sizeof(CvMat*) );
-  CV_CALL(X[0] = cvCreateMat( batch_size, n_inputs*first_layer->seq_length, CV_32F ));
-  CV_CALL(dE_dX[0] = cvCreateMat( batch_size, X[0]->cols*first_layer->seq_length, CV_32F ));
-  cvZero(X[0]); cvZero(dE_dX[0]); cvZero(X0);
-  for ( k = 0, layer = first_layer; k < n_layers; k++, layer = layer->next_layer ){
-    int n_outputs = layer->n_output_planes*layer->output_height*layer->output_width;
-    if (icvIsInputLayer(layer)){
-      CV_CALL(X[k+1] = cvCreateMat( batch_size, n_outputs*layer->seq_length, CV_32F )); 
-      CV_CALL(dE_dX[k+1] = cvCreateMat( batch_size, X[k+1]->cols*layer->seq_length, CV_32F ));
-    }else{
-      CV_CALL(X[k+1] = cvCreateMat( batch_size, n_outputs, CV_32F )); 
-      CV_CALL(dE_dX[k+1] = cvCreateMat( batch_size, X[k+1]->cols, CV_32F ));
+  if (n_workers>1 && hogwild){
+    CV_CALL(workers = icvCreateTrainWorkers(network,n_workers,batch_size,1,n_segments));
+    CV_CALL(result_valid = cvCreateMat(response_valid->rows, response_valid->cols, CV_32F));
+    CV_CALL(icvTrainHogwild(network,workers,n_workers,source,train_idx,samples_valid,
+                            response_valid,result_valid,batch_size,n_epochs,n_accum,&rng));
+    if (n_segments>0){
+      icvPrintCheckpointPlan(workers[0].checkpoints,workers[0].context->network->workspace,n_workers);
     }
-    cvZero(X[k+1]); cvZero(dE_dX[k+1]);
+    EXIT;
   }
 
+  // initialize input data, the whole mini batch goes through the network 
+  // buffers, unless it is split over worker threads
+  if (n_workers>1){
+    CV_CALL(workers = icvCreateTrainWorkers(network,n_workers,batch_size,0,n_segments));
+    CV_CALL(batch_X = cvCreateMat( batch_size, n_inputs, CV_32F ));
+    CV_CALL(batch_Y = cvCreateMat( batch_size, workers[0].X[n_layers]->cols, CV_32F ));
+  }else{
+    if (n_segments>0){
+      CV_CALL(checkpoints = cvCreateCheckpointPlan(network,batch_size,n_segments));
+    }
+    CV_CALL(icvCreateTrainBuffers(plan,batch_size,checkpoints,&X,&dE_dX));
+    batch_X = X[0]; batch_Y = X[n_layers];
+  }
+
+  // buffers reused by all iterations
+  // all time steps of a sequence mode layer are in a row of its output
+  CV_CALL(expected = cvCreateMat(batch_size*(icvIsSequenceRNNLayer(last_layer)?1:last_layer->seq_length),
+                                 batch_Y->cols,CV_32F));
+  CV_CALL(result_valid = cvCreateMat(response_valid->rows, response_valid->cols, CV_32F));
+
   CvTimer timer; timer.start();
-  shuffle_idx = cvCreateMat(1,n_samples_train,CV_32S);
-  for (int ii=0;ii<n_samples_train;ii++){CV_MAT_ELEM(*shuffle_idx,int,0,ii)=ii;}
+  // training samples are shuffled by the loader at the beginning of each epoch,
+  // unless streams of stateful layers are read in order, from zero states
+  CV_CALL(loader = cvCreateBatchLoader(source,train_idx,batch_size,ICV_DNN_PREFETCH_BATCHES,
+                                       stateful?0:&rng));
   for ( int epoch_iter=0; epoch_iter<n_epochs; epoch_iter++) {
-  cvRandShuffle(shuffle_idx, &rng, 1.f);
-  cvReorderRows(samples_train,shuffle_idx);
-  cvReorderRows(response_train,shuffle_idx);
-    
+    if (stateful){ CV_CALL(cvResetRecurrentStates(network)); }
+
   for ( n = 0; n < n_samples_train; n+=batch_size )
   {
-    int nclasses = X[n_layers]->cols;
-    CvMat * expected = cvCreateMat(batch_size*last_layer->seq_length,nclasses,CV_32F);
-
-    // 1) Compute the network output on the <X0>
-    CvMat X0_hdr,Y0_hdr;
-    cvGetRows(samples_train,&X0_hdr,n,n+batch_size);
-    cvGetRows(response_train,&Y0_hdr,n,n+batch_size);
-    cvCopy(&X0_hdr,X[0]); cvCopy(&Y0_hdr,expected);
+    int ttt = (epoch_iter*n_samples_train+n+batch_size)/batch_size;
+    const int last_batch = epoch_iter==n_epochs-1 && n+batch_size>=n_samples_train;
+
+    // 1) Compute the network output on the <X0>, the last batch of an epoch
+    //    wraps around to its first samples
+    CvMat expected_hdr;
+    cvReshape(expected,&expected_hdr,0,batch_size);
+    CV_CALL(cvGetNextBatch(loader,batch_X,&expected_hdr));
     //fprintf(stderr,"\n");cvPrintf(stderr, "%.0f,", expected);
 
-    // Perform prediction with current weight parameters
-    for ( k = 0, layer = first_layer; k < n_layers - 1; k++, layer = layer->next_layer ){
-      CV_CALL(layer->forward( layer, X[k], X[k+1] )); 
+    // 2) Compute the gradient
+    if (workers){
+      CV_CALL(icvTrainBatchDataParallel(workers,n_workers,batch_X,expected,batch_Y,ttt));
+    }else{
+      CV_CALL(icvTrainBatch(plan,checkpoints,X,dE_dX,expected,ttt));
+    }
+    // buffers of the layers are all taken by the first batch
+    if (n_segments>0 && epoch_iter==0 && n==0){
+      if (workers){
+        icvPrintCheckpointPlan(workers[0].checkpoints,workers[0].context->network->workspace,n_workers);
+      }else{
+        icvPrintCheckpointPlan(checkpoints,network->workspace,1);
+      }
     }
-    CV_CALL(layer->forward( layer, X[k], X[k+1] ));
 
-    // 2) Compute the gradient
-    CV_ASSERT(cvCountNAN(X[n_layers])<1);
-    cvCopy( X[n_layers], dE_dX[n_layers] );
-    cvSub( dE_dX[n_layers], expected, dE_dX[n_layers] );
-
-    // 3) Update weights by the gradient descent
-    for ( k = n_layers; k > 0; k--, layer = layer->prev_layer ){
-      int ttt = (epoch_iter*n_samples_train+n+batch_size)/batch_size;
-      CV_CALL(layer->backward( layer, ttt, X[k-1], dE_dX[k], dE_dX[k-1] ));
+    // 3) update weights by the gradients averaged over last <n_accum> mini batches,
+    //    or leave them to the parameter server
+    if (++n_pending==n_accum || last_batch){
+      const int t = (ttt+n_accum-1)/n_accum;
+      if (client){
+        CV_CALL(icvExchangeGradients(client,plan,n_pending));
+      }else if (workers){
+        CV_CALL(icvStepDataParallel(workers,n_workers,t,n_pending));
+      }else{
+        CV_CALL(icvStepExecPlan(plan,t,n_pending));
+      }
+      n_pending = 0;
     }
 
     // 4) compute loss & accuracy, print progress
-    float trloss = cvNorm(X[n_layers], expected)/float(batch_size);
-    float top1 = icvEvalAccuracy(last_layer, X[n_layers], expected);
+    float trloss = cvNorm(batch_Y, expected)/float(batch_size);
+    float top1 = icvEvalAccuracy(last_layer, batch_Y, expected);
     static double sumloss = 0; sumloss += trloss;
     static double sumacc  = 0; sumacc  += top1;
     static const float log_freq = 100.f;
@@ -371,64 +918,67 @@ void icvTrainNetwork( CvNetwork* network,const CvMat* samples, const CvMat* resp
       fprintf(stderr, "sumacc: %.1f%%[%.1f%%], sumloss: %f, ", accval,top1,lossval);
       fprintf(stderr,"eta: %s, ",time2str_concise(elapsed/progress*(1.-progress)));
       {
-      CvMat * result_valid = cvCreateMat(response_valid->rows, response_valid->cols, CV_32F);
       icvCNNModelPredict(network, samples_valid, result_valid, batch_size);
       float validacc = icvEvalAccuracy(last_layer, result_valid, response_valid);
-      fprintf(stderr, "validacc: %.1f%%\n", validacc); cvReleaseMat(&result_valid);
+      fprintf(stderr, "validacc: %.1f%%\n", validacc);
       }
       if (n_inputs<100){
-        CvMat X0_reshape_hdr; cvReshape(X[0],&X0_reshape_hdr,0,batch_size*first_layer->seq_length);
+        CvMat X0_reshape_hdr; cvReshape(batch_X,&X0_reshape_hdr,0,batch_size*first_layer->seq_length);
         fprintf(stderr,"input:\n");// cvPrintf(stderr,"%.0f ", X[0]);
         cvPrintf(stderr,"%.0f ", &X0_reshape_hdr);
       }
       if (batch_size<10){
-        {fprintf(stderr,"output:\n");cvPrintf(stderr,"%.1f ", X[n_layers]);}
+        {fprintf(stderr,"output:\n");cvPrintf(stderr,"%.1f ", batch_Y);}
         {fprintf(stderr,"expect:\n");cvPrintf(stderr,"%.1f ", expected);}
       }
     }
-
-    if (expected){cvReleaseMat(&expected);expected=0;}
   }
   }
-  if (X0){cvReleaseMat(&X0);X0=0;}
   __END__;
 
-  for ( k = 0; k <= n_layers; k++ ){
-    cvReleaseMat( &X[k] );
-    cvReleaseMat( &dE_dX[k] );
+  if (expected){cvReleaseMat(&expected);expected=0;}
+  if (result_valid){cvReleaseMat(&result_valid);result_valid=0;}
+  if (samples_valid){cvReleaseMat(&samples_valid);samples_valid=0;}
+  if (response_valid){cvReleaseMat(&response_valid);response_valid=0;}
+  if (train_idx){cvReleaseMat(&train_idx);train_idx=0;}
+  if (loader){cvReleaseBatchLoader(&loader);}
+  if (shuffle_idx){cvReleaseMat(&shuffle_idx);shuffle_idx=0;}
+  if (optimizer){
+    cvSetNetworkOptimizer(network,0);
+    cvReleaseDNNOptimizer(&optimizer);
   }
-  if (X){cvFree( &X );X=0;}
-  if (dE_dX){cvFree( &dE_dX );dE_dX=0;}
+  if (client){icvCloseParamClient(&client);}
+  if (workers){
+    icvReleaseTrainWorkers(&workers,n_workers,n_layers);
+    cvReleaseMat(&batch_X);
+    cvReleaseMat(&batch_Y);
+  }
+  icvReleaseTrainBuffers(n_layers,&X,&dE_dX);
+  if (checkpoints){cvReleaseCheckpointPlan(&checkpoints);}
 }
 
 float icvEvalAccuracy(CvDNNLayer * last_layer, CvMat * result, CvMat * expected)
 {
   CV_FUNCNAME("icvEvalAccuracy");
   float top1 = 0;
-  int batch_size = result->rows;
-  CvMat * sorted = cvCreateMat(result->rows,result->cols,CV_32F);
-  CvMat * indices = cvCreateMat(result->rows,result->cols,CV_32S);
-  CvMat * indtop1 = cvCreateMat(result->rows,1,CV_32S);
-  CvMat * expectedmat = cvCreateMat(result->rows,1,CV_32S);
-  CvMat * indtop1true = cvCreateMat(result->rows,result->cols,CV_32S);
-  CvMat * indtop1res = cvCreateMat(result->rows,1,CV_8U);
   __BEGIN__;
-  cvSort(result,sorted,indices,CV_SORT_DESCENDING|CV_SORT_EVERY_ROW);
-  cvGetCol(indices,indtop1,0);
-  cvSort(expected,0,indtop1true,CV_SORT_DESCENDING|CV_SORT_EVERY_ROW);
-  CV_ASSERT( CV_MAT_TYPE(indtop1true->type) == CV_32S && CV_MAT_TYPE(expectedmat->type) == CV_32S );
-  for (int ii=0;ii<indtop1true->rows;ii++){
-    CV_MAT_ELEM(*expectedmat,int,ii,0)=CV_MAT_ELEM(*indtop1true,int,ii,0);
-  }
-  cvCmp(indtop1,expectedmat,indtop1res,CV_CMP_EQ);
-  top1=cvSum(indtop1res).val[0]*100.f/float(batch_size)/255.f;
+  CV_ASSERT( CV_MAT_TYPE(result->type)==CV_32F && CV_MAT_TYPE(expected->type)==CV_32F );
+  CV_ASSERT( result->rows==expected->rows && result->cols==expected->cols );
+  const int batch_size = result->rows, nclasses = result->cols;
+  int n_correct = 0;
+  // compare the top-1 class of each row, without allocating sort buffers
+  for (int ii=0;ii<batch_size;ii++){
+    const float * rptr = (const float*)(result->data.ptr+result->step*ii);
+    const float * eptr = (const float*)(expected->data.ptr+expected->step*ii);
+    int rloc = 0, eloc = 0;
+    for (int jj=1;jj<nclasses;jj++){
+      if (rptr[jj]>rptr[rloc]){rloc=jj;}
+      if (eptr[jj]>eptr[eloc]){eloc=jj;}
+    }
+    if (rloc==eloc){n_correct++;}
+  }
+  top1=n_correct*100.f/float(batch_size);
   __END__;
-  cvReleaseMat(&sorted);
-  cvReleaseMat(&indices);
-  cvReleaseMat(&indtop1);
-  cvReleaseMat(&expectedmat);
-  cvReleaseMat(&indtop1true);
-  cvReleaseMat(&indtop1res);
   return top1;
 }
 
@@ -436,91 +986,84 @@ float icvEvalAccuracy(CvDNNLayer * last_layer, CvMat * result, CvMat * expected)
 void icvCNNModelPredict( const CvNetwork * network, const CvMat* testdata, CvMat* result,
                                 const int batch_size )
 {
+  CvDNNExecPlan * exec_plan = 0;
+  int * stateful = 0;
   CV_FUNCNAME("icvCNNModelPredict");
   __BEGIN__;
 
   //CvDNNStatModel * cnn_model = (CvDNNStatModel*)model;
   //CvNetwork * network = cnn_model->network;
+  if ( network==0 ) { CV_ERROR( CV_StsBadArg, "Invalid model" ); }
+
   CvDNNLayer * layer = 0;
-  CvMat ** X = 0;
+  CvDNNMemoryPlan * plan = 0;
+  CvMat * X = 0;
   int nclasses, i, k;
-  float loss, min_loss = FLT_MAX;
-  float* result_data;
-  CvMat etalon;
-  int nsamples = testdata->rows;;
+  int nsamples = testdata->rows;
   CvDNNLayer * first_layer = network->first_layer;
-  const CvDNNLayer * last_layer = network->get_last_layer(network);
+  CvMat result_hdr;
+  CV_CALL(exec_plan = cvCompileNetwork((CvNetwork*)network));
+  const CvDNNExecOp * ops = exec_plan->ops;
   const int n_inputs   =
     first_layer->n_input_planes*first_layer->input_width*first_layer->input_height;
 
-  if ( network==0 ) { CV_ERROR( CV_StsBadArg, "Invalid model" ); }
+  // samples are independent sequences, stateful layers start from zero states
+  // and leave the states carried over between training batches as they are
+  if (icvIsStatefulPlan(exec_plan)){
+    CV_CALL(stateful = (int*)cvAlloc(sizeof(int)*exec_plan->n_ops));
+    for (k=0;k<exec_plan->n_ops;k++){ stateful[k] = ops[k].layer->stateful; ops[k].layer->stateful = 0; }
+  }
 
+  // result may hold a row per time step, while a sequence mode layer 
+  // writes all time steps of a sample in a row
+  if (result->rows!=nsamples){ CV_CALL(result = cvReshape(result,&result_hdr,0,nsamples)); }
   nclasses = result->rows;
   const int n_layers = network->n_layers;
   const int seq_length = first_layer->seq_length;
   
-  CvMat * samples = cvCloneMat(testdata);
-
-  // normalize image value range
-  if (icvIsConvolutionLayer(network->first_layer->next_layer)){
-    double minval, maxval;
-    cvMinMaxLoc(samples,&minval,&maxval,0,0);
-    cvAddS(samples,cvScalar(-minval),samples);
-    cvScale(samples,samples,10./((maxval-minval)*.5f));
-    cvAddS(samples,cvScalar(-1.f),samples);
+  // normalize value range by the fixed conversion of training data, applied 
+  // on each mini batch instead of a copy of full test data set, so that the
+  // output of a sample does not depend on other samples
+  const double scale = network->input_scale, shift = network->input_shift;
+
+  // activations are taken from the memory plan of the network, which is
+  // re-created only if a larger batch is requested
+  plan = network->memory_plan;
+  if (!plan || plan->batch_size<batch_size || plan->n_tensors!=n_layers+1){
+    cvReleaseNetworkMemoryPlan(&((CvNetwork*)network)->memory_plan);
+    CV_CALL(plan = cvCreateNetworkMemoryPlan(network,batch_size));
+    ((CvNetwork*)network)->memory_plan = plan;
+    fprintf(stderr,"MemoryPlan: %d activations, naive: %.1fKB, planned: %.1fKB, "
+            "max live: %.1fKB\n",plan->n_tensors,plan->naive_bytes/1024.,
+            plan->planned_bytes/1024.,plan->live_bytes/1024.);
   }
-
-  CvMat samples_reshape_hdr;
-  cvReshape(samples,&samples_reshape_hdr,0,testdata->rows*first_layer->seq_length);
-
-  CV_CALL(X = (CvMat**)cvAlloc( (n_layers+1)*sizeof(CvMat*) ));
-  memset( X, 0, (n_layers+1)*sizeof(CvMat*) );
-
-  int sidx=0; CvMat X0_hdr,Xn_hdr;
-  
-  // split full test data set into mini batches
-  X[0] = cvCreateMat( batch_size, n_inputs*first_layer->seq_length, CV_32F ); cvZero(X[0]);
-  for ( k = 0, layer = first_layer; k < n_layers; k++, layer = layer->next_layer ){
-    int n_outputs = layer->n_output_planes*layer->output_height*layer->output_width;
-    if (icvIsInputLayer(layer)){
-      CV_CALL(X[k+1] = cvCreateMat( batch_size, n_outputs*layer->seq_length, CV_32F ));
-    }else{
-      CV_CALL(X[k+1] = cvCreateMat( batch_size, n_outputs, CV_32F ));
-    }cvZero(X[k+1]);
-  }
-  for (sidx=0;sidx<nsamples-batch_size;sidx+=batch_size){
-    cvGetRows( samples, &X0_hdr, sidx, sidx+batch_size ); cvCopy(&X0_hdr,X[0]);
-    cvGetRows( result,  &Xn_hdr, sidx, sidx+batch_size );
-    for ( k = 0, layer = first_layer; k < n_layers; k++, layer = layer->next_layer ) {
-      CV_CALL(layer->forward( layer, X[k], X[k+1] ));
+  X = plan->mats;
+
+  // split full test data set into mini batches, no memory is allocated per batch
+  CvMat X0_hdr,Xn_hdr;
+  for (int sidx=0;sidx<nsamples;sidx+=batch_size){
+    const int bsize = MIN(batch_size,nsamples-sidx);
+    for ( k = 0; k <= n_layers; k++ ){
+      cvInitMatHeader(&X[k],bsize,plan->cols[k],CV_32F,plan->data+plan->offsets[k]);
+    }
+    cvGetRows( testdata, &X0_hdr, sidx, sidx+bsize );
+    cvConvertScale(&X0_hdr,&X[0],scale,shift);
+    cvGetRows( result,  &Xn_hdr, sidx, sidx+bsize );
+    for ( k = 0; k < n_layers; k++ ) {
+      layer = ops[k].layer;
+      // layers reading the output through input_layers find it in the arena
+      if (icvIsPlannedOutputLayer(layer)){ layer->Y = &X[ops[k].output]; }
+      CV_CALL(layer->forward( layer, &X[ops[k].input], &X[ops[k].output] ));
       if (layer->clear) { layer->clear( layer ); }
-    }cvCopy(X[n_layers],&Xn_hdr);
-  }
-  for ( k = 0; k <= n_layers; k++ ) { cvReleaseMat( &X[k] ); }
-
-  // rest of the data set
-  int bsize = nsamples-sidx;
-  X[0] = cvCreateMat( bsize, n_inputs*first_layer->seq_length, CV_32F ); cvZero(X[0]);
-  for ( k = 0, layer = first_layer; k < n_layers; k++, layer = layer->next_layer ){
-    int n_outputs = layer->n_output_planes*layer->output_height*layer->output_width;
-    if (icvIsInputLayer(layer)){
-      CV_CALL(X[k+1] = cvCreateMat( bsize, n_outputs*layer->seq_length, CV_32F ));
-    }else{
-      CV_CALL(X[k+1] = cvCreateMat( bsize, n_outputs, CV_32F ));
-    }cvZero(X[k+1]);
+    }cvCopy(&X[n_layers],&Xn_hdr);
   }
-  cvGetRows( samples, &X0_hdr, sidx, sidx+bsize ); cvCopy(&X0_hdr,X[0]);
-  cvGetRows( result,  &Xn_hdr, sidx, sidx+bsize );
-  for ( k = 0, layer = first_layer; k < n_layers; k++, layer = layer->next_layer ) {
-    CV_CALL(layer->forward( layer, X[k], X[k+1] ));
-    if (layer->clear) { layer->clear( layer ); }
-  }cvCopy(X[n_layers],&Xn_hdr);
-
-  cvReleaseMat(&samples);
-  for ( k = 0; k <= n_layers; k++ ) { cvReleaseMat( &X[k] ); X[k]=0; }
-  if (X){cvFree( &X );X=0;}
 
   __END__;
+
+  if (stateful){
+    for (int k=0;k<exec_plan->n_ops;k++){ exec_plan->ops[k].layer->stateful = stateful[k]; }
+    cvFree(&stateful);
+  }
 }
 
 /****************************************************************************************/
@@ -533,6 +1076,7 @@ void icvCNNModelUpdate(
     const float** out_train_data = 0;
     CvMat* responses             = 0;
     CvMat* cls_labels            = 0;
+    CvDNNDataSource * source     = 0;
 
     CV_FUNCNAME("icvCNNModelUpdate");
     __BEGIN__;
@@ -564,10 +1108,15 @@ void icvCNNModelUpdate(
       }
     }
 
-    CV_CALL( icvTrainNetwork( cnn_model->network, _train_data, responses, params) );
+    CV_CALL(source = cvCreateMatDataSource(_train_data,responses));
+    // new samples are converted the same as those the model was trained with
+    source->scale = cnn_model->network->input_scale;
+    source->shift = cnn_model->network->input_shift;
+    CV_CALL( icvTrainNetwork( cnn_model->network, source, params) );
 
     __END__;
 
+    if (source){source->release(&source);}
     cvFree( &out_train_data );
     cvReleaseMat( &responses );
 }
@@ -610,8 +1159,12 @@ ML_IMPL CvNetwork* cvCreateNetwork( CvDNNLayer* first_layer )
     CV_CALL(network = (CvNetwork*)cvAlloc( sizeof(CvNetwork) ));
     memset( network, 0, sizeof(CvNetwork) );
 
+    CV_CALL(network->workspace = cvCreateDNNWorkspace());
     network->first_layer    = first_layer;
     network->n_layers  = 1;
+    network->input_scale = 1;
+    network->input_shift = 0;
+    first_layer->workspace = network->workspace;
     network->release   = icvNetworkRelease;
     network->add_layer = icvNetworkAddLayer;
     network->get_layer = icvNetworkGetLayer;
@@ -622,8 +1175,10 @@ ML_IMPL CvNetwork* cvCreateNetwork( CvDNNLayer* first_layer )
 
     __END__;
 
-    if ( cvGetErrStatus() < 0 && network )
+    if ( cvGetErrStatus() < 0 && network ){
+        cvReleaseDNNWorkspace( &network->workspace );
         cvFree( &network );
+    }
 
     return network;
 
@@ -648,7 +1203,7 @@ void icvNetworkAddLayer( CvNetwork* network, CvDNNLayer* layer )
   if ( icvIsDenseLayer(layer) ){
     if ( ((CvDNNDenseLayer*)layer)->input_layers.size()==0 && 
          layer->n_input_planes != prev_layer->output_width*prev_layer->output_height*
-         prev_layer->n_output_planes ) {
+         prev_layer->n_output_planes*(icvIsSequenceRNNLayer(prev_layer)?prev_layer->seq_length:1) ) {
       CV_ERROR( CV_StsBadArg, "Unmatched size of the new layer" );
     }
     if ( layer->input_height != 1 || layer->output_height != 1 ||
@@ -666,6 +1221,15 @@ void icvNetworkAddLayer( CvNetwork* network, CvDNNLayer* layer )
          layer->input_width != 1  || layer->output_width != 1 ) {
       CV_ERROR( CV_StsBadArg, "Invalid size of the new layer" );
     }
+  }else if ( icvIsLSTMLayer(layer) || icvIsGRULayer(layer) ) {
+    if ( layer->n_input_planes != prev_layer->output_width*prev_layer->output_height*
+         prev_layer->n_output_planes ) {
+      CV_ERROR( CV_StsBadArg, "Unmatched size of the new layer" );
+    }
+    if ( layer->input_height != 1 || layer->output_height != 1 ||
+         layer->input_width != 1  || layer->output_width != 1 ) {
+      CV_ERROR( CV_StsBadArg, "Invalid size of the new layer" );
+    }
   }else if ( icvIsSpatialTransformLayer(layer) ) {
   }else if ( icvIsTimeDistributedLayer(layer) ) {
   }else if ( icvIsInputLayer(layer) ) {
@@ -678,8 +1242,10 @@ void icvNetworkAddLayer( CvNetwork* network, CvDNNLayer* layer )
   }
 
   layer->prev_layer = prev_layer;
+  layer->workspace = network->workspace;
   prev_layer->next_layer = layer;
   network->n_layers++;
+  cvReleaseNetworkExecPlan( &network->exec_plan );
 
   __END__;
 }
@@ -693,6 +1259,11 @@ CvDNNLayer* icvNetworkGetLayer( CvNetwork* network, const char * name )
   if ( !network ) {
     CV_ERROR( CV_StsNullPtr, "Null <network> pointer. Network must be created by user." ); 
   }
+  if (icvIsExecPlanValid(network)){
+    i = icvFindExecOp(network->exec_plan,name);
+    target_layer = i<0?0:network->exec_plan->ops[i].layer;
+    EXIT;
+  }
   n_layers = network->n_layers;
   first_layer = last_layer = network->first_layer;
   for ( i = 0, layer = first_layer; i < n_layers && layer; i++ ) {
@@ -716,6 +1287,7 @@ CvDNNLayer * cvGetCNNLastLayer(const CvNetwork * network)
   if ( !network ) {
     CV_ERROR( CV_StsNullPtr, "Null <network> pointer. Network must be created by user." ); 
   }
+  if (icvIsExecPlanValid(network)){last_layer = network->exec_plan->last_layer; EXIT;}
   n_layers = network->n_layers;
   first_layer = last_layer = network->first_layer;
   for ( i = 0, layer = first_layer; i < n_layers && layer; i++ ) {
@@ -729,6 +1301,39 @@ CvDNNLayer * cvGetCNNLastLayer(const CvNetwork * network)
   return last_layer;
 }
 
+/* Makes all layers of <network> apply their gradients by <optimizer>, or by
+   plain gradient descent if null. */
+ML_IMPL void cvSetNetworkOptimizer(CvNetwork * network, CvDNNOptimizer * optimizer)
+{
+  CV_FUNCNAME("cvSetNetworkOptimizer");
+  __BEGIN__;
+  if ( !network ) {
+    CV_ERROR( CV_StsNullPtr, "Null <network> pointer" );
+  }
+  for ( CvDNNLayer * layer = network->first_layer; layer; layer = layer->next_layer ) {
+    layer->optimizer = optimizer;
+  }
+  __END__;
+}
+
+/* Applies gradients summed by the backward passes of all layers of <network>
+   over the last <n_batches> mini batches, averaged, as the update of iteration
+   <t>, so that gradients of several mini batches can be accumulated into a 
+   single update, the same as that of one batch of all their samples. */
+ML_IMPL void cvStepNetwork(CvNetwork * network, int t, int n_batches)
+{
+  CV_FUNCNAME("cvStepNetwork");
+  __BEGIN__;
+  if ( !network ) {
+    CV_ERROR( CV_StsNullPtr, "Null <network> pointer" );
+  }
+  CV_ASSERT(t>0 && n_batches>0);
+  for ( CvDNNLayer * layer = network->first_layer; layer; layer = layer->next_layer ) {
+    if (layer->step && layer->n_grads){CV_CALL(layer->step(layer,t,n_batches));}
+  }
+  __END__;
+}
+
 /*************************************************************************/
 void icvNetworkRelease( CvNetwork** network_pptr )
 {
@@ -760,6 +1365,9 @@ void icvNetworkRelease( CvNetwork** network_pptr )
     if ( k != network->n_layers || layer)
         CV_ERROR( CV_StsBadArg, "Invalid network" );
 
+    cvReleaseNetworkMemoryPlan( &network->memory_plan );
+    cvReleaseNetworkExecPlan( &network->exec_plan );
+    cvReleaseDNNWorkspace( &network->workspace );
     cvFree( &network );
 
     __END__;
@@ -860,6 +1468,670 @@ void icvVisualizeCNNLayer(CvDNNLayer * layer, const CvMat * Y)
 }
 
 
+/*************************************************************************\
+ *                          Workspace functions                          *
+\*************************************************************************/
+ML_IMPL CvDNNWorkspace * cvCreateDNNWorkspace()
+{
+  CvDNNWorkspace * workspace = 0;
+  CV_FUNCNAME("cvCreateDNNWorkspace");
+  __BEGIN__;
+  CV_CALL(workspace = (CvDNNWorkspace*)cvAlloc(sizeof(CvDNNWorkspace)));
+  memset(workspace,0,sizeof(CvDNNWorkspace));
+  __END__;
+  return workspace;
+}
+
+ML_IMPL void cvReleaseDNNWorkspace(CvDNNWorkspace ** p_workspace)
+{
+  CV_FUNCNAME("cvReleaseDNNWorkspace");
+  __BEGIN__;
+  if (!p_workspace){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  CvDNNWorkspace * workspace = *p_workspace;
+  if (!workspace){return;}
+  CvDNNWorkspaceBuffer * buffer = workspace->buffers, * next = 0;
+  for (;buffer;buffer=next){
+    next = buffer->next;
+    // layers still holding the buffer reserve a new one at next request
+    buffer->owner->ws_slots[buffer->slot] = 0;
+    if (buffer->raw){cvFree(&buffer->raw);}
+    cvFree(&buffer);
+  }
+  cvFree(p_workspace);
+  __END__;
+}
+
+/* Returns a (rows x cols) matrix of given type reserved for <slot> of <layer>.
+   Contents are undefined at first request and kept as long as the buffer 
+   does not grow, so that a buffer filled in forward pass can be read in 
+   backward pass, and gradients can be summed over several backward passes.
+   Buffers of a layer without workspace are its own, and not shared with 
+   any other layer or thread. */
+ML_IMPL CvMat * cvGetWorkspaceMat(CvDNNLayer * layer, int slot, int rows, int cols, int type)
+{
+  CvMat * mat = 0;
+  CV_FUNCNAME("cvGetWorkspaceMat");
+  __BEGIN__;
+  if (!icvIsDNNLayer(layer)){CV_ERROR(CV_StsBadArg,"Invalid layer");}
+  CV_ASSERT(rows>0 && cols>0 && slot>=0 && slot<CV_DNN_WORKSPACE_SLOTS);
+  CvDNNWorkspaceBuffer * buffer = layer->ws_slots[slot];
+  const size_t step = cols*CV_ELEM_SIZE(type);
+  const size_t size = step*rows;
+  if (!buffer){
+    CvDNNWorkspace * workspace = layer->workspace;
+    CV_CALL(buffer = (CvDNNWorkspaceBuffer*)cvAlloc(sizeof(CvDNNWorkspaceBuffer)));
+    memset(buffer,0,sizeof(CvDNNWorkspaceBuffer));
+    buffer->owner = layer;
+    buffer->slot = slot;
+    buffer->workspace = workspace;
+    if (workspace){
+      buffer->next = workspace->buffers;
+      if (workspace->buffers){workspace->buffers->prev = buffer;}
+      workspace->buffers = buffer;
+      workspace->n_buffers++;
+    }
+    layer->ws_slots[slot] = buffer;
+  }
+  if (buffer->capacity<size){
+    CvDNNWorkspace * workspace = buffer->workspace;
+    if (buffer->raw){cvFree(&buffer->raw);}
+    CV_CALL(buffer->raw = cvAlloc(size+CV_DNN_WORKSPACE_ALIGN));
+    buffer->data = (uchar*)cvAlignPtr(buffer->raw,CV_DNN_WORKSPACE_ALIGN);
+    if (workspace){
+      workspace->total_bytes += size-buffer->capacity;
+      workspace->peak_bytes = MAX(workspace->peak_bytes,workspace->total_bytes);
+      workspace->n_allocs++;
+    }
+    buffer->capacity = size;
+  }
+  cvInitMatHeader(&buffer->mat,rows,cols,type,buffer->data,step);
+  mat = &buffer->mat;
+  __END__;
+  return mat;
+}
+
+static void icvReleaseWorkspaceBuffer(CvDNNLayer * layer, int slot)
+{
+  CvDNNWorkspaceBuffer * buffer = layer->ws_slots[slot];
+  if (!buffer){return;}
+  CvDNNWorkspace * workspace = buffer->workspace;
+  if (workspace){
+    if (buffer->prev){buffer->prev->next = buffer->next;}
+    else{workspace->buffers = buffer->next;}
+    if (buffer->next){buffer->next->prev = buffer->prev;}
+    workspace->n_buffers--;
+    workspace->total_bytes -= buffer->capacity;
+  }
+  if (buffer->raw){cvFree(&buffer->raw);}
+  cvFree(&buffer);
+  layer->ws_slots[slot] = 0;
+}
+
+/* Frees the buffers reserved for all slots of <layer>, and takes them out of
+   its workspace, as part of releasing the layer. */
+ML_IMPL void cvReleaseWorkspaceMats(CvDNNLayer * layer)
+{
+  CV_FUNCNAME("cvReleaseWorkspaceMats");
+  __BEGIN__;
+  if (!icvIsDNNLayer(layer)){CV_ERROR(CV_StsBadArg,"Invalid layer");}
+  for (int slot=0;slot<CV_DNN_WORKSPACE_SLOTS;slot++){ icvReleaseWorkspaceBuffer(layer,slot); }
+  __END__;
+}
+
+/* Frees the buffers of slots in layer->ws_scratch, filled again by the next
+   forward pass, while gradients summed by the layer and copies of its output
+   read by other layers are kept. Checkpointed training frees them between 
+   segments, which are recomputed anyway. */
+ML_IMPL void cvReleaseWorkspaceScratch(CvDNNLayer * layer)
+{
+  CV_FUNCNAME("cvReleaseWorkspaceScratch");
+  __BEGIN__;
+  if (!icvIsDNNLayer(layer)){CV_ERROR(CV_StsBadArg,"Invalid layer");}
+  for (int slot=0;slot<CV_DNN_WORKSPACE_SLOTS;slot++){
+    if (layer->ws_scratch&(1u<<slot)){ icvReleaseWorkspaceBuffer(layer,slot); }
+  }
+  __END__;
+}
+
+/*************************************************************************\
+ *                       Execution plan functions                        *
+\*************************************************************************/
+static unsigned icvHashLayerName(const char * name)
+{
+  unsigned hash = 5381;
+  for (;*name;name++){ hash = hash*33+uchar(*name); }
+  return hash;
+}
+
+/* Index of the op of the layer named <name>, -1 if not found. */
+static int icvFindExecOp(const CvDNNExecPlan * plan, const char * name)
+{
+  const int mask = plan->hash_size-1;
+  for (int hi=icvHashLayerName(name)&mask;plan->hash_table[hi]>=0;hi=(hi+1)&mask){
+    const int oi = plan->hash_table[hi];
+    if (!strcmp(plan->ops[oi].layer->name,name)){return oi;}
+  }
+  return -1;
+}
+
+/* Index of the op of <layer>, layers sharing a name with a preceding layer
+   are not in the hashed index and are searched for. Dense layers without
+   side input keep a null entry in input_layers. */
+static int icvFindExecLayer(const CvDNNExecPlan * plan, CvDNNLayer * layer)
+{
+  if (!layer){return -1;}
+  int oi = icvFindExecOp(plan,layer->name);
+  if (oi>=0 && plan->ops[oi].layer==layer){return oi;}
+  for (oi=0;oi<plan->n_ops;oi++){ if (plan->ops[oi].layer==layer){return oi;} }
+  return -1;
+}
+
+static int icvIsExecPlanValid(const CvNetwork * network)
+{
+  return network->exec_plan && network->exec_plan->n_ops==network->n_layers;
+}
+
+/* Returns the execution plan of <network>, compiled if the network has none
+   or layers were added since. X[k+1] is the output of the k-th op, and the 
+   lifetime of activations is extended along the side edges (input_layers of
+   the reader, output_layers of the producer), which are required to follow
+   the order of the layer list. */
+ML_IMPL CvDNNExecPlan * cvCompileNetwork(CvNetwork * network)
+{
+  CvDNNExecPlan * plan = 0;
+  CV_FUNCNAME("cvCompileNetwork");
+  __BEGIN__;
+  int n_ops, oi, ii, hi, mask;
+  CvDNNLayer * layer = 0;
+  if (!network || !network->first_layer){CV_ERROR(CV_StsBadArg,"Invalid network");}
+  if (icvIsExecPlanValid(network)){plan = network->exec_plan; EXIT;}
+  cvReleaseNetworkExecPlan(&network->exec_plan);
+  n_ops = network->n_layers;
+
+  CV_CALL(plan = (CvDNNExecPlan*)cvAlloc(sizeof(CvDNNExecPlan)));
+  memset(plan,0,sizeof(CvDNNExecPlan));
+  plan->n_ops = n_ops;
+  CV_CALL(plan->ops = (CvDNNExecOp*)cvAlloc(sizeof(CvDNNExecOp)*n_ops));
+  for (plan->hash_size=4;plan->hash_size<n_ops*2;plan->hash_size*=2){}
+  CV_CALL(plan->hash_table = (int*)cvAlloc(sizeof(int)*plan->hash_size));
+  for (hi=0;hi<plan->hash_size;hi++){plan->hash_table[hi]=-1;}
+  mask = plan->hash_size-1;
+
+  layer = network->first_layer;
+  for (oi=0;oi<n_ops;oi++,layer=layer->next_layer){
+    if (!layer || !icvIsDNNLayer(layer)){CV_ERROR(CV_StsBadArg,"Invalid network");}
+    CvDNNExecOp * op = &plan->ops[oi];
+    op->layer = layer;
+    op->input = oi;
+    op->output = oi+1;
+    op->last_use = oi+1;
+    // the first layer of a name is found by name, as in a linear search
+    if (icvFindExecOp(plan,layer->name)<0){
+      for (hi=icvHashLayerName(layer->name)&mask;plan->hash_table[hi]>=0;hi=(hi+1)&mask){}
+      plan->hash_table[hi] = oi;
+    }
+  }
+  plan->last_layer = plan->ops[n_ops-1].layer;
+
+  // extend lifetime along side edges
+  for (oi=0;oi<n_ops;oi++){
+    layer = plan->ops[oi].layer;
+    for (ii=0;ii<layer->input_layers.size();ii++){
+      int src = icvFindExecLayer(plan,layer->input_layers[ii]);
+      if (src<0){continue;}
+      if (src>=oi){CV_ERROR(CV_StsBadArg,"Input layer must precede the layer reading it");}
+      plan->ops[src].last_use = MAX(plan->ops[src].last_use,oi);
+    }
+    for (ii=0;ii<layer->output_layers.size();ii++){
+      int dst = icvFindExecLayer(plan,layer->output_layers[ii]);
+      if (dst<0){continue;}
+      if (dst<=oi){CV_ERROR(CV_StsBadArg,"Output layer must follow the layer it reads");}
+      plan->ops[oi].last_use = MAX(plan->ops[oi].last_use,dst);
+    }
+  }
+  network->exec_plan = plan;
+  __END__;
+
+  if (cvGetErrStatus()<0 && plan && plan!=network->exec_plan){
+    cvReleaseNetworkExecPlan(&plan);
+  }
+  return plan;
+}
+
+ML_IMPL void cvReleaseNetworkExecPlan(CvDNNExecPlan ** p_plan)
+{
+  CV_FUNCNAME("cvReleaseNetworkExecPlan");
+  __BEGIN__;
+  if (!p_plan){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  CvDNNExecPlan * plan = *p_plan;
+  if (!plan){return;}
+  if (plan->ops){cvFree(&plan->ops);}
+  if (plan->hash_table){cvFree(&plan->hash_table);}
+  cvFree(p_plan);
+  __END__;
+}
+
+/*************************************************************************\
+ *                       Memory planning functions                       *
+\*************************************************************************/
+/* Layers keeping a copy of their output in layer->Y for later layers, that
+   can be bound to the planned activation instead. */
+int icvIsPlannedOutputLayer(CvDNNLayer * layer)
+{
+  return icvIsConvolutionLayer(layer) || icvIsDenseLayer(layer) || 
+         icvIsMaxPoolingLayer(layer);
+}
+
+static int icvGetLayerIndex(CvDNNLayer ** layers, int n_layers, CvDNNLayer * layer)
+{
+  for (int li=0;li<n_layers;li++){ if (layers[li]==layer){return li;} }
+  return -1;
+}
+
+/* Plans the activations X[0..n_layers] of <network> for batches of up to 
+   <batch_size> samples. X[k+1] lives from the forward pass of the k-th op of
+   the execution plan until the last op reading it. Activations
+   are then placed largest first, each at the lowest offset not overlapping
+   any already placed activation with intersecting lifetime. */
+ML_IMPL CvDNNMemoryPlan * cvCreateNetworkMemoryPlan(const CvNetwork * network, int batch_size)
+{
+  CvDNNMemoryPlan * plan = 0;
+  CvDNNExecPlan * exec_plan = 0;
+  CvDNNLayer ** layers = 0;
+  int * order = 0;
+  CV_FUNCNAME("cvCreateNetworkMemoryPlan");
+  __BEGIN__;
+  if (!network || !network->first_layer){CV_ERROR(CV_StsBadArg,"Invalid network");}
+  CV_ASSERT(batch_size>0);
+  const int n_layers = network->n_layers;
+  const int n_tensors = n_layers+1;
+  int ii, jj, li;
+  CvDNNLayer * layer = 0;
+  CV_CALL(exec_plan = cvCompileNetwork((CvNetwork*)network));
+
+  CV_CALL(plan = (CvDNNMemoryPlan*)cvAlloc(sizeof(CvDNNMemoryPlan)));
+  memset(plan,0,sizeof(CvDNNMemoryPlan));
+  plan->n_tensors = n_tensors;
+  plan->batch_size = batch_size;
+  CV_CALL(plan->cols = (int*)cvAlloc(sizeof(int)*n_tensors));
+  CV_CALL(plan->first_use = (int*)cvAlloc(sizeof(int)*n_tensors));
+  CV_CALL(plan->last_use = (int*)cvAlloc(sizeof(int)*n_tensors));
+  CV_CALL(plan->offsets = (size_t*)cvAlloc(sizeof(size_t)*n_tensors));
+  CV_CALL(plan->sizes = (size_t*)cvAlloc(sizeof(size_t)*n_tensors));
+  CV_CALL(plan->mats = (CvMat*)cvAlloc(sizeof(CvMat)*n_tensors));
+  CV_CALL(layers = (CvDNNLayer**)cvAlloc(sizeof(CvDNNLayer*)*n_layers));
+  CV_CALL(order = (int*)cvAlloc(sizeof(int)*n_tensors));
+
+  // shape and lifetime of each activation, the last activation is read
+  // after forward pass of all layers
+  layer = network->first_layer;
+  plan->cols[0] = layer->n_input_planes*layer->input_width*layer->input_height*layer->seq_length;
+  plan->first_use[0] = 0; plan->last_use[0] = 0;
+  for (li=0;li<n_layers;li++){
+    const CvDNNExecOp * op = &exec_plan->ops[li];
+    layer = layers[li] = op->layer;
+    int n_outputs = layer->n_output_planes*layer->output_height*layer->output_width;
+    if (icvIsInputLayer(layer) || icvIsSequenceRNNLayer(layer)){ n_outputs *= layer->seq_length; }
+    plan->cols[op->output] = n_outputs;
+    plan->first_use[op->output] = li;
+    plan->last_use[op->output] = op->last_use;
+  }
+
+  for (ii=0;ii<n_tensors;ii++){
+    size_t size = size_t(batch_size)*plan->cols[ii]*sizeof(float);
+    plan->sizes[ii] = cvAlign(size,CV_DNN_WORKSPACE_ALIGN);
+    plan->naive_bytes += size;
+    if (ii>0 && icvIsPlannedOutputLayer(layers[ii-1])){ plan->naive_bytes += size; }
+    order[ii] = ii;
+  }
+  for (li=0;li<=n_layers;li++){
+    size_t live_bytes = 0;
+    for (ii=0;ii<n_tensors;ii++){
+      if (plan->first_use[ii]<=li && li<=plan->last_use[ii]){ live_bytes += plan->sizes[ii]; }
+    }
+    plan->live_bytes = MAX(plan->live_bytes,live_bytes);
+  }
+
+  // place activations largest first
+  for (ii=1;ii<n_tensors;ii++){
+    for (jj=ii;jj>0 && plan->sizes[order[jj-1]]<plan->sizes[order[jj]];jj--){
+      CV_SWAP(order[jj-1],order[jj],li);
+    }
+  }
+  for (ii=0;ii<n_tensors;ii++){
+    const int ti = order[ii];
+    size_t offset = 0;
+    for (int moved = 1; moved;){
+      moved = 0;
+      for (jj=0;jj<ii;jj++){
+        const int tj = order[jj];
+        if (plan->first_use[ti]>plan->last_use[tj] || plan->first_use[tj]>plan->last_use[ti]){continue;}
+        if (offset<plan->offsets[tj]+plan->sizes[tj] && plan->offsets[tj]<offset+plan->sizes[ti]){
+          offset = plan->offsets[tj]+plan->sizes[tj]; moved = 1;
+        }
+      }
+    }
+    plan->offsets[ti] = offset;
+    plan->planned_bytes = MAX(plan->planned_bytes,offset+plan->sizes[ti]);
+  }
+
+  CV_CALL(plan->raw = (uchar*)cvAlloc(plan->planned_bytes+CV_DNN_WORKSPACE_ALIGN));
+  plan->data = (uchar*)cvAlignPtr(plan->raw,CV_DNN_WORKSPACE_ALIGN);
+  for (ii=0;ii<n_tensors;ii++){
+    cvInitMatHeader(&plan->mats[ii],batch_size,plan->cols[ii],CV_32F,plan->data+plan->offsets[ii]);
+  }
+  __END__;
+
+  if (layers){cvFree(&layers);}
+  if (order){cvFree(&order);}
+  if (cvGetErrStatus()<0){cvReleaseNetworkMemoryPlan(&plan);}
+  return plan;
+}
+
+ML_IMPL void cvReleaseNetworkMemoryPlan(CvDNNMemoryPlan ** p_plan)
+{
+  CV_FUNCNAME("cvReleaseNetworkMemoryPlan");
+  __BEGIN__;
+  if (!p_plan){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  CvDNNMemoryPlan * plan = *p_plan;
+  if (!plan){return;}
+  if (plan->cols){cvFree(&plan->cols);}
+  if (plan->first_use){cvFree(&plan->first_use);}
+  if (plan->last_use){cvFree(&plan->last_use);}
+  if (plan->offsets){cvFree(&plan->offsets);}
+  if (plan->sizes){cvFree(&plan->sizes);}
+  if (plan->mats){cvFree(&plan->mats);}
+  if (plan->raw){cvFree(&plan->raw);}
+  cvFree(p_plan);
+  __END__;
+}
+
+/* Cuts the layers of <network> into up to <n_segments> segments of about the
+   same interior activation size, for training with batches of up to 
+   <batch_size> samples. Segments are taken in order of the execution plan,
+   and the activation crossing the cumulative share of each segment becomes
+   a boundary. */
+ML_IMPL CvDNNCheckpointPlan * cvCreateCheckpointPlan(const CvNetwork * network, int batch_size,
+                                                     int n_segments)
+{
+  CvDNNCheckpointPlan * plan = 0;
+  CvDNNExecPlan * exec_plan = 0;
+  size_t * sizes = 0;
+  CV_FUNCNAME("cvCreateCheckpointPlan");
+  __BEGIN__;
+  if (!network || !network->first_layer){CV_ERROR(CV_StsBadArg,"Invalid network");}
+  CV_ASSERT(batch_size>0 && n_segments>0);
+  const int n_layers = network->n_layers;
+  size_t total_bytes = 0, cumsum_bytes = 0;
+  int k, si;
+  CV_CALL(exec_plan = cvCompileNetwork((CvNetwork*)network));
+
+  CV_CALL(plan = (CvDNNCheckpointPlan*)cvAlloc(sizeof(CvDNNCheckpointPlan)));
+  memset(plan,0,sizeof(CvDNNCheckpointPlan));
+  plan->batch_size = batch_size;
+  CV_CALL(plan->bounds = (int*)cvAlloc(sizeof(int)*(n_layers+1)));
+  CV_CALL(plan->offsets = (size_t*)cvAlloc(sizeof(size_t)*(n_layers+1)));
+  CV_CALL(sizes = (size_t*)cvAlloc(sizeof(size_t)*(n_layers+1)));
+  memset(plan->offsets,0,sizeof(size_t)*(n_layers+1));
+  for (k=0;k<=n_layers;k++){
+    sizes[k] = cvAlign(size_t(batch_size)*icvGetTrainActivationCols(exec_plan,k)*sizeof(float),
+                       CV_DNN_WORKSPACE_ALIGN);
+    plan->naive_bytes += sizes[k];
+    if (k>0 && k<n_layers){ total_bytes += sizes[k]; }
+  }
+
+  // the network input and output are kept anyway
+  n_segments = MIN(n_segments,n_layers);
+  plan->bounds[0] = 0; si = 1;
+  for (k=1;k<n_layers;k++){
+    cumsum_bytes += sizes[k];
+    if (si<n_segments && cumsum_bytes*n_segments>=total_bytes*si){ plan->bounds[si++] = k; }
+  }
+  plan->bounds[si] = n_layers;
+  plan->n_segments = si;
+
+  // interior activations of each segment are laid out from the beginning
+  // of the shared buffer
+  plan->checkpointed_bytes = sizes[0];
+  for (si=0;si<plan->n_segments;si++){
+    size_t offset = 0;
+    for (k=plan->bounds[si]+1;k<plan->bounds[si+1];k++){
+      plan->offsets[k] = offset;
+      offset += sizes[k];
+    }
+    plan->interior_bytes = MAX(plan->interior_bytes,offset);
+    plan->checkpointed_bytes += sizes[plan->bounds[si+1]];
+  }
+  plan->checkpointed_bytes += plan->interior_bytes;
+  if (plan->interior_bytes>0){
+    CV_CALL(plan->raw = (uchar*)cvAlloc(plan->interior_bytes+CV_DNN_WORKSPACE_ALIGN));
+    plan->data = (uchar*)cvAlignPtr(plan->raw,CV_DNN_WORKSPACE_ALIGN);
+  }
+  __END__;
+
+  if (sizes){cvFree(&sizes);}
+  if (cvGetErrStatus()<0){cvReleaseCheckpointPlan(&plan);}
+  return plan;
+}
+
+ML_IMPL void cvReleaseCheckpointPlan(CvDNNCheckpointPlan ** p_plan)
+{
+  CV_FUNCNAME("cvReleaseCheckpointPlan");
+  __BEGIN__;
+  if (!p_plan){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  CvDNNCheckpointPlan * plan = *p_plan;
+  if (!plan){return;}
+  if (plan->bounds){cvFree(&plan->bounds);}
+  if (plan->offsets){cvFree(&plan->offsets);}
+  if (plan->raw){cvFree(&plan->raw);}
+  cvFree(p_plan);
+  __END__;
+}
+
+/*************************************************************************\
+ *                      Execution context functions                      *
+\*************************************************************************/
+/* Copy of layer <src> of type T for an execution context. Fields are copied
+   member-wise, so that pointers are shared with <src>, not deep-copied: the
+   copy uses the weights, transformed weights, optimizer, quantization and 
+   sub-layers (e.g. fc layers of a spatial transform) of <src>. Per-call 
+   states are reset by the caller, the lists of input and output layers are 
+   left empty, to be re-linked to the copies of those layers, and the copy
+   reserves its own workspace buffers. */
+template<typename T> static CvDNNLayer * icvCopyLayer(const CvDNNLayer * src)
+{
+  T * layer = new (cvAlloc(sizeof(T))) T(*(const T*)src);
+  layer->input_layers.clear();
+  layer->output_layers.clear();
+  memset(layer->ws_slots,0,sizeof(layer->ws_slots));
+  return (CvDNNLayer*)layer;
+}
+
+static CvDNNLayer * icvCopyContextLayer(CvDNNLayer * layer)
+{
+  if (icvIsInputLayer(layer)){return icvCopyLayer<CvDNNInputLayer>(layer);}
+  if (icvIsConvolutionLayer(layer)){return icvCopyLayer<CvDNNConvolutionLayer>(layer);}
+  if (icvIsMaxPoolingLayer(layer)){return icvCopyLayer<CvDNNMaxPoolingLayer>(layer);}
+  if (icvIsDenseLayer(layer)){return icvCopyLayer<CvDNNDenseLayer>(layer);}
+  if (icvIsSpatialTransformLayer(layer)){return icvCopyLayer<CvDNNSpatialTransformLayer>(layer);}
+  if (icvIsTimeDistributedLayer(layer)){return icvCopyLayer<CvDNNTimeDistributedLayer>(layer);}
+  if (icvIsSimpleRNNLayer(layer)){return icvCopyLayer<CvDNNSimpleRNNLayer>(layer);}
+  if (icvIsLSTMLayer(layer)){return icvCopyLayer<CvDNNLSTMLayer>(layer);}
+  if (icvIsGRULayer(layer)){return icvCopyLayer<CvDNNGRULayer>(layer);}
+  if (icvIsRepeatVectorLayer(layer)){return icvCopyLayer<CvDNNRepeatVectorLayer>(layer);}
+  if (icvIsMergeLayer(layer)){return icvCopyLayer<CvDNNMergeLayer>(layer);}
+  return 0;
+}
+
+static CvDNNLayer * icvGetContextLayer(CvDNNLayer ** shared_layers, CvDNNLayer ** layers, 
+                                       int n_layers, CvDNNLayer * shared_layer)
+{
+  int li = icvGetLayerIndex(shared_layers,n_layers,shared_layer);
+  return li<0?shared_layer:layers[li];
+}
+
+/* Creates an execution context for inference on <network>. Cached weights 
+   transforms of convolution layers are computed here, so that all contexts 
+   share them; contexts should therefore be created before running them in 
+   parallel, and weights should not be updated while contexts are in use. */
+ML_IMPL CvDNNExecContext * cvCreateDNNExecContext(CvNetwork * network)
+{
+  CvDNNExecContext * context = 0;
+  CvDNNLayer ** shared_layers = 0;
+  CvDNNLayer ** layers = 0;
+  CV_FUNCNAME("cvCreateDNNExecContext");
+  __BEGIN__;
+  int n_layers, li, ii;
+  CvDNNLayer * shared_layer = 0;
+  if (!network || !network->first_layer){CV_ERROR(CV_StsBadArg,"Invalid network");}
+  n_layers = network->n_layers;
+  shared_layer = network->first_layer;
+
+  CV_CALL(context = (CvDNNExecContext*)cvAlloc(sizeof(CvDNNExecContext)));
+  memset(context,0,sizeof(CvDNNExecContext));
+  context->shared_network = network;
+  CV_CALL(context->network = (CvNetwork*)cvAlloc(sizeof(CvNetwork)));
+  memset(context->network,0,sizeof(CvNetwork));
+  context->network->n_layers = n_layers;
+  context->network->get_layer = network->get_layer;
+  context->network->get_last_layer = network->get_last_layer;
+  context->network->eval = network->eval;
+  context->network->input_scale = network->input_scale;
+  context->network->input_shift = network->input_shift;
+  CV_CALL(context->network->workspace = cvCreateDNNWorkspace());
+
+  CV_CALL(shared_layers = (CvDNNLayer**)cvAlloc(sizeof(CvDNNLayer*)*n_layers));
+  CV_CALL(layers = (CvDNNLayer**)cvAlloc(sizeof(CvDNNLayer*)*n_layers));
+  memset(layers,0,sizeof(CvDNNLayer*)*n_layers);
+  for (li=0;li<n_layers;li++,shared_layer=shared_layer->next_layer){
+    if (!shared_layer){CV_ERROR(CV_StsBadArg,"Invalid network");}
+    shared_layers[li] = shared_layer;
+  }
+
+  // copy layers, dropping per-call states of the shared layers
+  for (li=0;li<n_layers;li++){
+    shared_layer = shared_layers[li];
+    if (icvIsConvolutionLayer(shared_layer)){CV_CALL(icvCNNConvolutionPrepare(shared_layer));}
+    CvDNNLayer * layer = 0;
+    CV_CALL(layer = icvCopyContextLayer(shared_layer));
+    if (!layer){CV_ERROR(CV_StsBadArg,"Unsupported layer type");}
+    layer->shared_layer = shared_layer;
+    layer->workspace = context->network->workspace;
+    layer->Y = layer->dE_dW = layer->dE_dX = layer->dY_dX = 0;
+    layer->n_grads = 0;
+    layer->n_carried = 0;
+    if (icvIsConvolutionLayer(layer)){
+      CvDNNConvolutionLayer * conv_layer = (CvDNNConvolutionLayer*)layer;
+      conv_layer->WX = conv_layer->sumX = conv_layer->Xcol = 0;
+    }else if (icvIsMaxPoolingLayer(layer)){
+      CvDNNMaxPoolingLayer * pool_layer = (CvDNNMaxPoolingLayer*)layer;
+      pool_layer->WX = pool_layer->sumX = pool_layer->mask = 0;
+    }else if (icvIsDenseLayer(layer)){
+      ((CvDNNDenseLayer*)layer)->WX = 0;
+    }else if (icvIsSimpleRNNLayer(layer)){
+      CvDNNSimpleRNNLayer * rnn_layer = (CvDNNSimpleRNNLayer*)layer;
+      rnn_layer->dE_dY = rnn_layer->H = rnn_layer->WX = rnn_layer->WH = rnn_layer->dH = 0;
+      rnn_layer->dWxh = rnn_layer->dWhh = rnn_layer->dWhy = 0;
+      rnn_layer->loss = 0;
+    }else if (icvIsLSTMLayer(layer)){
+      CvDNNLSTMLayer * lstm_layer = (CvDNNLSTMLayer*)layer;
+      lstm_layer->gates = lstm_layer->C = lstm_layer->H = 0;
+    }else if (icvIsGRULayer(layer)){
+      CvDNNGRULayer * gru_layer = (CvDNNGRULayer*)layer;
+      gru_layer->gates = gru_layer->HH = gru_layer->H = 0;
+    }else if (icvIsSpatialTransformLayer(layer)){
+      ((CvDNNSpatialTransformLayer*)layer)->G = 0;
+    }
+    layers[li] = layer;
+  }
+
+  // link the copies the same way as the shared layers
+  for (li=0;li<n_layers;li++){
+    CvDNNLayer * layer = layers[li];
+    shared_layer = shared_layers[li];
+    layer->prev_layer = li>0?layers[li-1]:0;
+    layer->next_layer = li<n_layers-1?layers[li+1]:0;
+    if (shared_layer->ref_layer){
+      layer->ref_layer = icvGetContextLayer(shared_layers,layers,n_layers,shared_layer->ref_layer);
+    }
+    for (ii=0;ii<shared_layer->input_layers.size();ii++){
+      layer->input_layers.push_back(
+        icvGetContextLayer(shared_layers,layers,n_layers,shared_layer->input_layers[ii]));
+    }
+    for (ii=0;ii<shared_layer->output_layers.size();ii++){
+      layer->output_layers.push_back(
+        icvGetContextLayer(shared_layers,layers,n_layers,shared_layer->output_layers[ii]));
+    }
+  }
+  context->network->first_layer = layers[0];
+  __END__;
+
+  if (cvGetErrStatus()<0 && context){
+    // link copies made so far, for being released with the context
+    if (context->network && layers){
+      int li = 0;
+      for (;li<network->n_layers && layers[li];li++){
+        layers[li]->next_layer = (li<network->n_layers-1)?layers[li+1]:0;
+      }
+      context->network->n_layers = li;
+      context->network->first_layer = li>0?layers[0]:0;
+    }
+    cvReleaseDNNExecContext(&context);
+  }
+  if (shared_layers){cvFree(&shared_layers);}
+  if (layers){cvFree(&layers);}
+  return context;
+}
+
+ML_IMPL void cvReleaseDNNExecContext(CvDNNExecContext ** p_context)
+{
+  CV_FUNCNAME("cvReleaseDNNExecContext");
+  __BEGIN__;
+  CvDNNExecContext * context = 0;
+  CvNetwork * network = 0;
+  if (!p_context){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  context = *p_context;
+  if (!context){EXIT;}
+  network = context->network;
+  if (network){
+    CvDNNLayer * layer = network->first_layer, * next_layer = 0;
+    for (int li=0;li<network->n_layers && layer;li++,layer=next_layer){
+      next_layer = layer->next_layer;
+      // weights transforms computed by the copy itself
+      if (icvIsConvolutionLayer(layer)){
+        CvDNNConvolutionLayer * conv_layer = (CvDNNConvolutionLayer*)layer;
+        CvDNNConvolutionLayer * shared_layer = (CvDNNConvolutionLayer*)layer->shared_layer;
+        if (conv_layer->Wt && conv_layer->Wt!=shared_layer->Wt){cvReleaseMat(&conv_layer->Wt);}
+        if (conv_layer->Wt_src && conv_layer->Wt_src!=shared_layer->Wt_src){
+          cvReleaseMat(&conv_layer->Wt_src);
+        }
+      }
+      cvReleaseWorkspaceMats(layer);
+      layer->input_layers.clear();
+      layer->output_layers.clear();
+      cvFree(&layer);
+    }
+    cvReleaseNetworkMemoryPlan(&network->memory_plan);
+    cvReleaseNetworkExecPlan(&network->exec_plan);
+    cvReleaseDNNWorkspace(&network->workspace);
+    cvFree(&context->network);
+  }
+  cvFree(p_context);
+  __END__;
+}
+
+/* Same as icvCNNModelPredict, with activations and scratch buffers taken from
+   <context>, so that contexts of the same network can be used concurrently. */
+ML_IMPL void cvDNNPredict(CvDNNExecContext * context, const CvMat * samples, CvMat * result,
+                          int batch_size)
+{
+  CV_FUNCNAME("cvDNNPredict");
+  __BEGIN__;
+  if (!context || !context->network){CV_ERROR(CV_StsBadArg,"Invalid context");}
+  CV_CALL(icvCNNModelPredict(context->network,samples,result,batch_size));
+  __END__;
+}
+
 /*************************************************************************\
  *                           Utility functions                           *
 \*************************************************************************/
@@ -874,9 +2146,7 @@ void cvTanh(CvMat * src, CvMat * dst)
   if (CV_MAT_TYPE(src->type)==CV_32F){
     float * srcptr = src->data.fl;
     float * dstptr = dst->data.fl;
-    for (ii=0;ii<elemsize;ii++){
-      dstptr[ii] = tanh(srcptr[ii]);
-    }
+    icvTanh_32f(srcptr,dstptr,elemsize);
   }else if (CV_MAT_TYPE(src->type)==CV_64F){
     double * srcptr = src->data.db;
     double * dstptr = dst->data.db;
@@ -900,8 +2170,9 @@ void cvTanhDer(CvMat * src, CvMat * dst) {
   if (CV_MAT_TYPE(src->type)==CV_32F){
     float * srcptr = src->data.fl;
     float * dstptr = dst->data.fl;
+    icvTanh_32f(srcptr,dstptr,elemsize);
     for (ii=0;ii<elemsize;ii++){
-      dstptr[ii] = 1.f-pow(tanh(srcptr[ii]),2);
+      dstptr[ii] = 1.f-dstptr[ii]*dstptr[ii];
     }
   }else if (CV_MAT_TYPE(src->type)==CV_64F){
     double * srcptr = src->data.db;
@@ -1059,6 +2330,9 @@ void icvNetworkRead( CvNetwork * network, CvFileStorage * fs )
   const int n_layers = network->n_layers;
   CvDNNLayer * layer = network->first_layer;
   CvFileNode * root = cvGetRootFileNode( fs );
+  // kept as they are for weights saved without input conversion
+  network->input_scale = cvReadRealByName(fs,root,"input_scale",network->input_scale);
+  network->input_shift = cvReadRealByName(fs,root,"input_shift",network->input_shift);
   for (int ii=0;ii<n_layers;ii++,layer=layer->next_layer){
     if (icvIsSimpleRNNLayer(layer)){
       CvDNNSimpleRNNLayer * rnnlayer = (CvDNNSimpleRNNLayer*)(layer->ref_layer?layer->ref_layer:layer);
@@ -1070,7 +2344,19 @@ void icvNetworkRead( CvNetwork * network, CvFileStorage * fs )
       cvCopy((CvMat*)cvReadByName(fs,root,hhstr),rnnlayer->Whh);
       cvCopy((CvMat*)cvReadByName(fs,root,hystr),rnnlayer->Why);
     }else{
-      cvCopy((CvMat*)cvReadByName(fs,root,layer->name),layer->weights);
+      // quantized weights saved with the layer replace its current ones, 
+      // 16 bit weights are saved in place of float weights
+      char qstr[1024];
+      sprintf(qstr,"%s_quant",layer->name);
+      CvFileNode * qnode = cvGetFileNodeByName(fs,root,qstr);
+      CvMat * weights = (CvMat*)cvReadByName(fs,root,layer->name);
+      CV_CALL(icvDequantizeLayer(layer));
+      if (weights || !qnode){cvCopy(weights,layer->weights);}
+      if (weights){cvReleaseMat(&weights);}
+      if (qnode){
+        CV_CALL(layer->quant = icvReadQuantization(fs,qnode));
+        if (layer->quant->state!=CV_DNN_QUANT_INT8){cvReleaseMat(&layer->weights);}
+      }
     }
   }
   __END__;
@@ -1085,6 +2371,8 @@ void icvNetworkWrite( CvNetwork * network, CvFileStorage * fs )
   __BEGIN__;
   const int n_layers = network->n_layers;
   CvDNNLayer * layer = (CvDNNLayer*)network->first_layer;
+  CV_CALL(cvWriteReal(fs,"input_scale",network->input_scale));
+  CV_CALL(cvWriteReal(fs,"input_shift",network->input_shift));
   for (int ii=0;ii<n_layers;ii++,layer=layer->next_layer){
     if (icvIsSimpleRNNLayer(layer)){
       CvDNNSimpleRNNLayer * rnnlayer = (CvDNNSimpleRNNLayer*)layer;
@@ -1099,6 +2387,11 @@ void icvNetworkWrite( CvNetwork * network, CvFileStorage * fs )
       }else{CV_ASSERT(!rnnlayer->Wxh && !rnnlayer->Whh && !rnnlayer->Why);}
     }else{
       if (layer->weights){cvWrite(fs,layer->name,layer->weights);}
+      if (layer->quant){
+        char qstr[1024];
+        sprintf(qstr,"%s_quant",layer->name);
+        CV_CALL(icvWriteQuantization(fs,qstr,layer->quant));
+      }
     }
   }
   __END__;
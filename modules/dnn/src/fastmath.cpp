@@ -0,0 +1,558 @@
+/** -*- c++ -*-
+ *
+ * \file   fastmath.cpp
+ * \date   Sat Oct 17 23:52:18 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  vectorized exp, tanh and logistic functions for float arrays
+ */
+
+#include "_dnn.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ICV_DNN_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define ICV_DNN_X86_DISPATCH 0
+#endif
+
+// exp(x) = 2^n*exp(r) with r = x-n*ln(2) in [-ln(2)/2,ln(2)/2], where exp(r)
+// is approximated by the polynomial of cephes expf, relative error is below
+// 2e-7 on the clamped range. ln(2) is split in two for an exact reduction.
+#define ICV_EXP_HI      88.f
+#define ICV_EXP_LO     -87.3365447504f
+#define ICV_LOG2E       1.44269504088896341f
+#define ICV_LN2_HI      0.693359375f
+#define ICV_LN2_LO     -2.12194440e-4f
+#define ICV_EXP_P0      1.9875691500e-4f
+#define ICV_EXP_P1      1.3981999507e-3f
+#define ICV_EXP_P2      8.3334519073e-3f
+#define ICV_EXP_P3      4.1665795894e-2f
+#define ICV_EXP_P4      1.6666665459e-1f
+#define ICV_EXP_P5      5.0000001201e-1f
+
+// tanh(x) is approximated by the polynomial of cephes tanhf for |x|<0.625,
+// and by 1-2/(exp(2|x|)+1) otherwise, |x| saturates at 9 where tanh(x)==1.f
+#define ICV_TANH_SMALL  0.625f
+#define ICV_TANH_SAT    9.f
+#define ICV_TANH_P0    -5.70498872745e-3f
+#define ICV_TANH_P1     2.06390887954e-2f
+#define ICV_TANH_P2    -5.37397155531e-2f
+#define ICV_TANH_P3     1.33314422036e-1f
+#define ICV_TANH_P4    -3.33332819422e-1f
+
+/*------------------------ scalar version -----------------------------*/
+// also used for the tail of arrays in vectorized versions
+
+static inline float icvExpScalar(float x)
+{
+  union { int i; float f; } pow2n;
+  x = x<ICV_EXP_LO?ICV_EXP_LO:(x>ICV_EXP_HI?ICV_EXP_HI:x);
+  const float fx = floorf(x*ICV_LOG2E+.5f);
+  x = x-fx*ICV_LN2_HI-fx*ICV_LN2_LO;
+  const float z = x*x;
+  float y = ((((ICV_EXP_P0*x+ICV_EXP_P1)*x+ICV_EXP_P2)*x+ICV_EXP_P3)*x+ICV_EXP_P4)*x+ICV_EXP_P5;
+  y = y*z+x+1.f;
+  pow2n.i = (int(fx)+127)<<23;
+  return y*pow2n.f;
+}
+
+static inline float icvTanhScalar(float x)
+{
+  float ax = fabsf(x);
+  if (ax<ICV_TANH_SMALL){
+    const float z = x*x;
+    return ((((ICV_TANH_P0*z+ICV_TANH_P1)*z+ICV_TANH_P2)*z+ICV_TANH_P3)*z+ICV_TANH_P4)*z*x+x;
+  }
+  ax = ax>ICV_TANH_SAT?ICV_TANH_SAT:ax;
+  const float r = 1.f-2.f/(icvExpScalar(2.f*ax)+1.f);
+  return x<0?-r:r;
+}
+
+static inline float icvSigmoidScalar(float x)
+{
+  return 1.f/(1.f+icvExpScalar(-x));
+}
+
+static void icvExp_32f_c(const float * src, float * dst, int n)
+{
+  for (int ii=0;ii<n;ii++){ dst[ii] = icvExpScalar(src[ii]); }
+}
+
+static void icvTanh_32f_c(const float * src, float * dst, int n)
+{
+  for (int ii=0;ii<n;ii++){ dst[ii] = icvTanhScalar(src[ii]); }
+}
+
+static void icvSigmoid_32f_c(const float * src, float * dst, int n)
+{
+  for (int ii=0;ii<n;ii++){ dst[ii] = icvSigmoidScalar(src[ii]); }
+}
+
+/* Element <ii> of a LSTM cell, from the pre-activations of input, forget, 
+   cell and output gates, which are replaced by the gate activations. */
+static inline void icvLSTMCellScalar(float * gates, const float * bias, const float * c_prev,
+                                     float * c, float * h, int n, int ii)
+{
+  const float i = icvSigmoidScalar(gates[ii]+bias[ii]);
+  const float f = icvSigmoidScalar(gates[n+ii]+bias[n+ii]);
+  const float g = icvTanhScalar(gates[2*n+ii]+bias[2*n+ii]);
+  const float o = icvSigmoidScalar(gates[3*n+ii]+bias[3*n+ii]);
+  const float ct = (c_prev?f*c_prev[ii]:0.f)+i*g;
+  gates[ii] = i; gates[n+ii] = f; gates[2*n+ii] = g; gates[3*n+ii] = o;
+  c[ii] = ct; h[ii] = o*icvTanhScalar(ct);
+}
+
+/* Element <ii> of a GRU cell, from the input projections of reset, update
+   and candidate gates, which are replaced by the gate activations, and the 
+   recurrent projections <hh>, the reset gate applies to the latter. */
+static inline void icvGRUCellScalar(float * gates, const float * hh, const float * bias, 
+                                    const float * h_prev, float * h, int n, int ii)
+{
+  const float r = icvSigmoidScalar(gates[ii]+bias[ii]+hh[ii]);
+  const float z = icvSigmoidScalar(gates[n+ii]+bias[n+ii]+hh[n+ii]);
+  const float g = icvTanhScalar(gates[2*n+ii]+bias[2*n+ii]+r*hh[2*n+ii]);
+  gates[ii] = r; gates[n+ii] = z; gates[2*n+ii] = g;
+  h[ii] = g+z*((h_prev?h_prev[ii]:0.f)-g);
+}
+
+static void icvLSTMCell_32f_c(float * gates, const float * bias, const float * c_prev,
+                              float * c, float * h, int n)
+{
+  for (int ii=0;ii<n;ii++){ icvLSTMCellScalar(gates,bias,c_prev,c,h,n,ii); }
+}
+
+static void icvGRUCell_32f_c(float * gates, const float * hh, const float * bias, 
+                             const float * h_prev, float * h, int n)
+{
+  for (int ii=0;ii<n;ii++){ icvGRUCellScalar(gates,hh,bias,h_prev,h,n,ii); }
+}
+
+/* Point <ii> of a row of the sampling grid, at (x0+ii*dx,y0+ii*dy) of all 
+   <nchannels> planes of <src>, pixels outside the image are zeros. Points 
+   far outside are clamped next to the image, where all corners are zeros. */
+static inline void icvBilinearSampleScalar(const float * src, int height, int width, int nchannels,
+                                           float x0, float y0, float dx, float dy, 
+                                           float * dst, int dst_step, int ii)
+{
+  const float x = MIN(MAX(x0+ii*dx,-2.f),float(width));
+  const float y = MIN(MAX(y0+ii*dy,-2.f),float(height));
+  const int xi = cvFloor(x), yi = cvFloor(y);
+  const float wx = x-xi, wy = y-yi;
+  const int vx0 = xi>=0 && xi<width, vx1 = xi+1>=0 && xi+1<width;
+  const int vy0 = yi>=0 && yi<height, vy1 = yi+1>=0 && yi+1<height;
+  const int plane = height*width;
+  const float * ptr = src+yi*width+xi;
+  for (int ci=0;ci<nchannels;ci++,ptr+=plane){
+    const float v00 = vy0&&vx0?ptr[0]:0.f, v01 = vy0&&vx1?ptr[1]:0.f;
+    const float v10 = vy1&&vx0?ptr[width]:0.f, v11 = vy1&&vx1?ptr[width+1]:0.f;
+    const float top = v00+wx*(v01-v00), bottom = v10+wx*(v11-v10);
+    dst[ci*dst_step+ii] = top+wy*(bottom-top);
+  }
+}
+
+static void icvBilinearSample_32f_c(const float * src, int height, int width, int nchannels,
+                                    float x0, float y0, float dx, float dy, 
+                                    float * dst, int dst_step, int n)
+{
+  for (int ii=0;ii<n;ii++){ 
+    icvBilinearSampleScalar(src,height,width,nchannels,x0,y0,dx,dy,dst,dst_step,ii); 
+  }
+}
+
+#if ICV_DNN_X86_DISPATCH
+
+/*------------------------ SSE2 version -------------------------------*/
+
+__attribute__((target("sse2")))
+static inline __m128 icvExp_sse2(__m128 x)
+{
+  const __m128 one = _mm_set1_ps(1.f);
+  x = _mm_min_ps(_mm_max_ps(x,_mm_set1_ps(ICV_EXP_LO)),_mm_set1_ps(ICV_EXP_HI));
+  // floor(x*log2(e)+.5), rounding toward zero and correcting negative values
+  __m128 fx = _mm_add_ps(_mm_mul_ps(x,_mm_set1_ps(ICV_LOG2E)),_mm_set1_ps(.5f));
+  __m128 tx = _mm_cvtepi32_ps(_mm_cvttps_epi32(fx));
+  fx = _mm_sub_ps(tx,_mm_and_ps(_mm_cmpgt_ps(tx,fx),one));
+  x = _mm_sub_ps(x,_mm_mul_ps(fx,_mm_set1_ps(ICV_LN2_HI)));
+  x = _mm_sub_ps(x,_mm_mul_ps(fx,_mm_set1_ps(ICV_LN2_LO)));
+  const __m128 z = _mm_mul_ps(x,x);
+  __m128 y = _mm_set1_ps(ICV_EXP_P0);
+  y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(ICV_EXP_P1));
+  y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(ICV_EXP_P2));
+  y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(ICV_EXP_P3));
+  y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(ICV_EXP_P4));
+  y = _mm_add_ps(_mm_mul_ps(y,x),_mm_set1_ps(ICV_EXP_P5));
+  y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y,z),x),one);
+  __m128i pow2n = _mm_add_epi32(_mm_cvttps_epi32(fx),_mm_set1_epi32(127));
+  pow2n = _mm_slli_epi32(pow2n,23);
+  return _mm_mul_ps(y,_mm_castsi128_ps(pow2n));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 icvTanh_sse2(__m128 x)
+{
+  const __m128 signmask = _mm_set1_ps(-0.f);
+  const __m128 sign = _mm_and_ps(x,signmask);
+  const __m128 ax = _mm_andnot_ps(signmask,x);
+  // polynomial for small |x|
+  const __m128 z = _mm_mul_ps(x,x);
+  __m128 ps = _mm_set1_ps(ICV_TANH_P0);
+  ps = _mm_add_ps(_mm_mul_ps(ps,z),_mm_set1_ps(ICV_TANH_P1));
+  ps = _mm_add_ps(_mm_mul_ps(ps,z),_mm_set1_ps(ICV_TANH_P2));
+  ps = _mm_add_ps(_mm_mul_ps(ps,z),_mm_set1_ps(ICV_TANH_P3));
+  ps = _mm_add_ps(_mm_mul_ps(ps,z),_mm_set1_ps(ICV_TANH_P4));
+  ps = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(ps,z),x),x);
+  // 1-2/(exp(2|x|)+1) with sign of x for large |x|
+  const __m128 one = _mm_set1_ps(1.f);
+  const __m128 sat = _mm_min_ps(ax,_mm_set1_ps(ICV_TANH_SAT));
+  const __m128 e = icvExp_sse2(_mm_add_ps(sat,sat));
+  __m128 pl = _mm_sub_ps(one,_mm_div_ps(_mm_set1_ps(2.f),_mm_add_ps(e,one)));
+  pl = _mm_or_ps(pl,sign);
+  const __m128 small = _mm_cmplt_ps(ax,_mm_set1_ps(ICV_TANH_SMALL));
+  return _mm_or_ps(_mm_and_ps(small,ps),_mm_andnot_ps(small,pl));
+}
+
+__attribute__((target("sse2")))
+static inline __m128 icvSigmoid_sse2(__m128 x)
+{
+  const __m128 one = _mm_set1_ps(1.f);
+  return _mm_div_ps(one,_mm_add_ps(one,icvExp_sse2(_mm_sub_ps(_mm_setzero_ps(),x))));
+}
+
+__attribute__((target("sse2")))
+static void icvExp_32f_sse2(const float * src, float * dst, int n)
+{
+  int ii = 0;
+  for (;ii<=n-4;ii+=4){ _mm_storeu_ps(dst+ii,icvExp_sse2(_mm_loadu_ps(src+ii))); }
+  for (;ii<n;ii++){ dst[ii] = icvExpScalar(src[ii]); }
+}
+
+__attribute__((target("sse2")))
+static void icvTanh_32f_sse2(const float * src, float * dst, int n)
+{
+  int ii = 0;
+  for (;ii<=n-4;ii+=4){ _mm_storeu_ps(dst+ii,icvTanh_sse2(_mm_loadu_ps(src+ii))); }
+  for (;ii<n;ii++){ dst[ii] = icvTanhScalar(src[ii]); }
+}
+
+__attribute__((target("sse2")))
+static void icvSigmoid_32f_sse2(const float * src, float * dst, int n)
+{
+  int ii = 0;
+  for (;ii<=n-4;ii+=4){ _mm_storeu_ps(dst+ii,icvSigmoid_sse2(_mm_loadu_ps(src+ii))); }
+  for (;ii<n;ii++){ dst[ii] = icvSigmoidScalar(src[ii]); }
+}
+
+/*------------------------ AVX2 version -------------------------------*/
+
+__attribute__((target("avx2,fma")))
+static inline __m256 icvExp_avx2(__m256 x)
+{
+  x = _mm256_min_ps(_mm256_max_ps(x,_mm256_set1_ps(ICV_EXP_LO)),_mm256_set1_ps(ICV_EXP_HI));
+  const __m256 fx = _mm256_floor_ps(_mm256_fmadd_ps(x,_mm256_set1_ps(ICV_LOG2E),_mm256_set1_ps(.5f)));
+  x = _mm256_fnmadd_ps(fx,_mm256_set1_ps(ICV_LN2_HI),x);
+  x = _mm256_fnmadd_ps(fx,_mm256_set1_ps(ICV_LN2_LO),x);
+  const __m256 z = _mm256_mul_ps(x,x);
+  __m256 y = _mm256_set1_ps(ICV_EXP_P0);
+  y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(ICV_EXP_P1));
+  y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(ICV_EXP_P2));
+  y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(ICV_EXP_P3));
+  y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(ICV_EXP_P4));
+  y = _mm256_fmadd_ps(y,x,_mm256_set1_ps(ICV_EXP_P5));
+  y = _mm256_add_ps(_mm256_fmadd_ps(y,z,x),_mm256_set1_ps(1.f));
+  __m256i pow2n = _mm256_add_epi32(_mm256_cvttps_epi32(fx),_mm256_set1_epi32(127));
+  pow2n = _mm256_slli_epi32(pow2n,23);
+  return _mm256_mul_ps(y,_mm256_castsi256_ps(pow2n));
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 icvTanh_avx2(__m256 x)
+{
+  const __m256 signmask = _mm256_set1_ps(-0.f);
+  const __m256 sign = _mm256_and_ps(x,signmask);
+  const __m256 ax = _mm256_andnot_ps(signmask,x);
+  const __m256 z = _mm256_mul_ps(x,x);
+  __m256 ps = _mm256_set1_ps(ICV_TANH_P0);
+  ps = _mm256_fmadd_ps(ps,z,_mm256_set1_ps(ICV_TANH_P1));
+  ps = _mm256_fmadd_ps(ps,z,_mm256_set1_ps(ICV_TANH_P2));
+  ps = _mm256_fmadd_ps(ps,z,_mm256_set1_ps(ICV_TANH_P3));
+  ps = _mm256_fmadd_ps(ps,z,_mm256_set1_ps(ICV_TANH_P4));
+  ps = _mm256_fmadd_ps(_mm256_mul_ps(ps,z),x,x);
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 sat = _mm256_min_ps(ax,_mm256_set1_ps(ICV_TANH_SAT));
+  const __m256 e = icvExp_avx2(_mm256_add_ps(sat,sat));
+  __m256 pl = _mm256_sub_ps(one,_mm256_div_ps(_mm256_set1_ps(2.f),_mm256_add_ps(e,one)));
+  pl = _mm256_or_ps(pl,sign);
+  const __m256 small = _mm256_cmp_ps(ax,_mm256_set1_ps(ICV_TANH_SMALL),_CMP_LT_OQ);
+  return _mm256_blendv_ps(pl,ps,small);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256 icvSigmoid_avx2(__m256 x)
+{
+  const __m256 one = _mm256_set1_ps(1.f);
+  return _mm256_div_ps(one,_mm256_add_ps(one,icvExp_avx2(_mm256_sub_ps(_mm256_setzero_ps(),x))));
+}
+
+__attribute__((target("avx2,fma")))
+static void icvExp_32f_avx2(const float * src, float * dst, int n)
+{
+  int ii = 0;
+  for (;ii<=n-8;ii+=8){ _mm256_storeu_ps(dst+ii,icvExp_avx2(_mm256_loadu_ps(src+ii))); }
+  for (;ii<n;ii++){ dst[ii] = icvExpScalar(src[ii]); }
+}
+
+__attribute__((target("avx2,fma")))
+static void icvTanh_32f_avx2(const float * src, float * dst, int n)
+{
+  int ii = 0;
+  for (;ii<=n-8;ii+=8){ _mm256_storeu_ps(dst+ii,icvTanh_avx2(_mm256_loadu_ps(src+ii))); }
+  for (;ii<n;ii++){ dst[ii] = icvTanhScalar(src[ii]); }
+}
+
+__attribute__((target("avx2,fma")))
+static void icvSigmoid_32f_avx2(const float * src, float * dst, int n)
+{
+  int ii = 0;
+  for (;ii<=n-8;ii+=8){ _mm256_storeu_ps(dst+ii,icvSigmoid_avx2(_mm256_loadu_ps(src+ii))); }
+  for (;ii<n;ii++){ dst[ii] = icvSigmoidScalar(src[ii]); }
+}
+
+// all gates of 8 cells are activated and the states updated in registers
+__attribute__((target("avx2,fma")))
+static void icvLSTMCell_32f_avx2(float * gates, const float * bias, const float * c_prev,
+                                 float * c, float * h, int n)
+{
+  float * gi = gates, * gf = gates+n, * gg = gates+2*n, * go = gates+3*n;
+  int ii = 0;
+  for (;ii<=n-8;ii+=8){
+    const __m256 i = icvSigmoid_avx2(_mm256_add_ps(_mm256_loadu_ps(gi+ii),_mm256_loadu_ps(bias+ii)));
+    const __m256 f = icvSigmoid_avx2(_mm256_add_ps(_mm256_loadu_ps(gf+ii),_mm256_loadu_ps(bias+n+ii)));
+    const __m256 g = icvTanh_avx2(_mm256_add_ps(_mm256_loadu_ps(gg+ii),_mm256_loadu_ps(bias+2*n+ii)));
+    const __m256 o = icvSigmoid_avx2(_mm256_add_ps(_mm256_loadu_ps(go+ii),_mm256_loadu_ps(bias+3*n+ii)));
+    const __m256 cp = c_prev?_mm256_loadu_ps(c_prev+ii):_mm256_setzero_ps();
+    const __m256 ct = _mm256_fmadd_ps(f,cp,_mm256_mul_ps(i,g));
+    _mm256_storeu_ps(gi+ii,i); _mm256_storeu_ps(gf+ii,f);
+    _mm256_storeu_ps(gg+ii,g); _mm256_storeu_ps(go+ii,o);
+    _mm256_storeu_ps(c+ii,ct);
+    _mm256_storeu_ps(h+ii,_mm256_mul_ps(o,icvTanh_avx2(ct)));
+  }
+  for (;ii<n;ii++){ icvLSTMCellScalar(gates,bias,c_prev,c,h,n,ii); }
+}
+
+__attribute__((target("avx2,fma")))
+static void icvGRUCell_32f_avx2(float * gates, const float * hh, const float * bias, 
+                                const float * h_prev, float * h, int n)
+{
+  float * gr = gates, * gz = gates+n, * gg = gates+2*n;
+  int ii = 0;
+  for (;ii<=n-8;ii+=8){
+    const __m256 r = icvSigmoid_avx2(_mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(gr+ii),
+      _mm256_loadu_ps(bias+ii)),_mm256_loadu_ps(hh+ii)));
+    const __m256 z = icvSigmoid_avx2(_mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(gz+ii),
+      _mm256_loadu_ps(bias+n+ii)),_mm256_loadu_ps(hh+n+ii)));
+    const __m256 g = icvTanh_avx2(_mm256_fmadd_ps(r,_mm256_loadu_ps(hh+2*n+ii),
+      _mm256_add_ps(_mm256_loadu_ps(gg+ii),_mm256_loadu_ps(bias+2*n+ii))));
+    const __m256 hp = h_prev?_mm256_loadu_ps(h_prev+ii):_mm256_setzero_ps();
+    _mm256_storeu_ps(gr+ii,r); _mm256_storeu_ps(gz+ii,z); _mm256_storeu_ps(gg+ii,g);
+    _mm256_storeu_ps(h+ii,_mm256_fmadd_ps(z,_mm256_sub_ps(hp,g),g));
+  }
+  for (;ii<n;ii++){ icvGRUCellScalar(gates,hh,bias,h_prev,h,n,ii); }
+}
+
+// corners of 8 points are gathered with the out-of-image ones masked out,
+// and weighted in registers for each channel
+__attribute__((target("avx2,fma")))
+static void icvBilinearSample_32f_avx2(const float * src, int height, int width, int nchannels,
+                                       float x0, float y0, float dx, float dy, 
+                                       float * dst, int dst_step, int n)
+{
+  const int plane = height*width;
+  const __m256 lane = _mm256_setr_ps(0.f,1.f,2.f,3.f,4.f,5.f,6.f,7.f);
+  const __m256 xmin = _mm256_set1_ps(-2.f), xmax = _mm256_set1_ps(float(width));
+  const __m256 ymax = _mm256_set1_ps(float(height));
+  const __m256i minus1 = _mm256_set1_epi32(-1), one = _mm256_set1_epi32(1);
+  const __m256i w = _mm256_set1_epi32(width), h = _mm256_set1_epi32(height);
+  int ii = 0;
+  for (;ii<=n-8;ii+=8){
+    const __m256 j = _mm256_add_ps(_mm256_set1_ps(float(ii)),lane);
+    const __m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_fmadd_ps(j,_mm256_set1_ps(dx),
+                                   _mm256_set1_ps(x0)),xmin),xmax);
+    const __m256 y = _mm256_min_ps(_mm256_max_ps(_mm256_fmadd_ps(j,_mm256_set1_ps(dy),
+                                   _mm256_set1_ps(y0)),xmin),ymax);
+    const __m256 xf = _mm256_floor_ps(x), yf = _mm256_floor_ps(y);
+    const __m256 wx = _mm256_sub_ps(x,xf), wy = _mm256_sub_ps(y,yf);
+    const __m256i xi = _mm256_cvttps_epi32(xf), yi = _mm256_cvttps_epi32(yf);
+    const __m256i xi1 = _mm256_add_epi32(xi,one), yi1 = _mm256_add_epi32(yi,one);
+    const __m256i vx0 = _mm256_and_si256(_mm256_cmpgt_epi32(xi,minus1),_mm256_cmpgt_epi32(w,xi));
+    const __m256i vx1 = _mm256_and_si256(_mm256_cmpgt_epi32(xi1,minus1),_mm256_cmpgt_epi32(w,xi1));
+    const __m256i vy0 = _mm256_and_si256(_mm256_cmpgt_epi32(yi,minus1),_mm256_cmpgt_epi32(h,yi));
+    const __m256i vy1 = _mm256_and_si256(_mm256_cmpgt_epi32(yi1,minus1),_mm256_cmpgt_epi32(h,yi1));
+    const __m256 m00 = _mm256_castsi256_ps(_mm256_and_si256(vy0,vx0));
+    const __m256 m01 = _mm256_castsi256_ps(_mm256_and_si256(vy0,vx1));
+    const __m256 m10 = _mm256_castsi256_ps(_mm256_and_si256(vy1,vx0));
+    const __m256 m11 = _mm256_castsi256_ps(_mm256_and_si256(vy1,vx1));
+    const __m256i idx00 = _mm256_add_epi32(_mm256_mullo_epi32(yi,w),xi);
+    const __m256i idx01 = _mm256_add_epi32(idx00,one);
+    const __m256i idx10 = _mm256_add_epi32(idx00,w);
+    const __m256i idx11 = _mm256_add_epi32(idx10,one);
+    const float * ptr = src;
+    for (int ci=0;ci<nchannels;ci++,ptr+=plane){
+      const __m256 zero = _mm256_setzero_ps();
+      const __m256 v00 = _mm256_mask_i32gather_ps(zero,ptr,idx00,m00,4);
+      const __m256 v01 = _mm256_mask_i32gather_ps(zero,ptr,idx01,m01,4);
+      const __m256 v10 = _mm256_mask_i32gather_ps(zero,ptr,idx10,m10,4);
+      const __m256 v11 = _mm256_mask_i32gather_ps(zero,ptr,idx11,m11,4);
+      const __m256 top = _mm256_fmadd_ps(wx,_mm256_sub_ps(v01,v00),v00);
+      const __m256 bottom = _mm256_fmadd_ps(wx,_mm256_sub_ps(v11,v10),v10);
+      _mm256_storeu_ps(dst+ci*dst_step+ii,_mm256_fmadd_ps(wy,_mm256_sub_ps(bottom,top),top));
+    }
+  }
+  for (;ii<n;ii++){ 
+    icvBilinearSampleScalar(src,height,width,nchannels,x0,y0,dx,dy,dst,dst_step,ii); 
+  }
+}
+
+#endif // ICV_DNN_X86_DISPATCH
+
+/*------------------------ runtime dispatch ---------------------------*/
+
+typedef void (*CvDNNMathFunc)(const float * src, float * dst, int n);
+typedef void (*CvDNNLSTMCellFunc)(float * gates, const float * bias, const float * c_prev,
+                                  float * c, float * h, int n);
+typedef void (*CvDNNGRUCellFunc)(float * gates, const float * hh, const float * bias, 
+                                 const float * h_prev, float * h, int n);
+typedef void (*CvDNNBilinearSampleFunc)(const float * src, int height, int width, int nchannels,
+                                        float x0, float y0, float dx, float dy, 
+                                        float * dst, int dst_step, int n);
+
+typedef struct CvDNNMathFuncTab
+{
+  int level;
+  CvDNNMathFunc exp;
+  CvDNNMathFunc tanh;
+  CvDNNMathFunc sigmoid;
+  CvDNNLSTMCellFunc lstm;
+  CvDNNGRUCellFunc gru;
+  CvDNNBilinearSampleFunc bilinear;
+}CvDNNMathFuncTab;
+
+// gated cells and bilinear sampling have no SSE2 version, they are scalar 
+// at this level
+static CvDNNMathFuncTab icvMathFuncTab(int level)
+{
+  CvDNNMathFuncTab tab = {CV_DNN_FASTMATH_SCALAR,icvExp_32f_c,icvTanh_32f_c,icvSigmoid_32f_c,
+                          icvLSTMCell_32f_c,icvGRUCell_32f_c,icvBilinearSample_32f_c};
+#if ICV_DNN_X86_DISPATCH
+  if (level>=CV_DNN_FASTMATH_AVX2){
+    CvDNNMathFuncTab avx2 = {CV_DNN_FASTMATH_AVX2,icvExp_32f_avx2,icvTanh_32f_avx2,icvSigmoid_32f_avx2,
+                             icvLSTMCell_32f_avx2,icvGRUCell_32f_avx2,icvBilinearSample_32f_avx2};
+    tab = avx2;
+  }else if (level>=CV_DNN_FASTMATH_SSE2){
+    CvDNNMathFuncTab sse2 = {CV_DNN_FASTMATH_SSE2,icvExp_32f_sse2,icvTanh_32f_sse2,icvSigmoid_32f_sse2,
+                             icvLSTMCell_32f_c,icvGRUCell_32f_c,icvBilinearSample_32f_c};
+    tab = sse2;
+  }
+#endif
+  return tab;
+}
+
+static int icvDetectFastMathLevel()
+{
+#if ICV_DNN_X86_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){return CV_DNN_FASTMATH_AVX2;}
+  if (__builtin_cpu_supports("sse2")){return CV_DNN_FASTMATH_SSE2;}
+#endif
+  return CV_DNN_FASTMATH_SCALAR;
+}
+
+// resolved once, on first use
+static CvDNNMathFuncTab & icvGetMathFuncTab()
+{
+  static CvDNNMathFuncTab tab = icvMathFuncTab(icvDetectFastMathLevel());
+  return tab;
+}
+
+void icvExp_32f( const float * src, float * dst, int n ){ icvGetMathFuncTab().exp(src,dst,n); }
+void icvTanh_32f( const float * src, float * dst, int n ){ icvGetMathFuncTab().tanh(src,dst,n); }
+void icvSigmoid_32f( const float * src, float * dst, int n ){ icvGetMathFuncTab().sigmoid(src,dst,n); }
+
+/* Gate activations and state update of <n> LSTM cells in a single pass, 
+   <gates> holds pre-activations of input, forget, cell and output gates 
+   without <bias>, and is replaced by the gate activations. <c_prev> is null
+   at the first time step. */
+void icvLSTMCell_32f( float * gates, const float * bias, const float * c_prev, 
+                      float * c, float * h, int n )
+{
+  icvGetMathFuncTab().lstm(gates,bias,c_prev,c,h,n);
+}
+
+/* Gate activations and state update of <n> GRU cells in a single pass, 
+   <gates> holds input projections of reset, update and candidate gates 
+   without <bias>, and is replaced by the gate activations, <hh> holds the
+   recurrent projections. <h_prev> is null at the first time step. */
+void icvGRUCell_32f( float * gates, const float * hh, const float * bias, const float * h_prev,
+                     float * h, int n )
+{
+  icvGetMathFuncTab().gru(gates,hh,bias,h_prev,h,n);
+}
+
+/* Bilinear samples of <nchannels> planes of a (<height> x <width>) image at
+   <n> points (x0+ii*dx,y0+ii*dy), in pixels, which make a row of an affine 
+   sampling grid. The samples of plane ci are written to dst+ci*dst_step, 
+   pixels outside the image are zeros. */
+void icvBilinearSample_32f( const float * src, int height, int width, int nchannels,
+                            float x0, float y0, float dx, float dy, float * dst, int dst_step, int n )
+{
+  icvGetMathFuncTab().bilinear(src,height,width,nchannels,x0,y0,dx,dy,dst,dst_step,n);
+}
+
+/* Selects the instruction set used by the vectorized functions, capped by
+   what the processor supports, and returns the one actually selected.
+   Not meant to be called while other threads are running these functions. */
+ML_IMPL int cvSetFastMathLevel(int level)
+{
+  const int supported = icvDetectFastMathLevel();
+  icvGetMathFuncTab() = icvMathFuncTab(level<supported?level:supported);
+  return icvGetMathFuncTab().level;
+}
+
+ML_IMPL int cvGetFastMathLevel()
+{
+  return icvGetMathFuncTab().level;
+}
+
+ML_IMPL void cvFastExp(const CvMat * src, CvMat * dst)
+{
+  CV_FUNCNAME("cvFastExp");
+  __BEGIN__;
+  CV_ASSERT(CV_ARE_SIZES_EQ(src,dst) && CV_ARE_TYPES_EQ(src,dst));
+  if (CV_MAT_TYPE(src->type)==CV_32F){
+    for (int ri=0;ri<src->rows;ri++){
+      icvExp_32f((const float*)(src->data.ptr+src->step*ri),
+                 (float*)(dst->data.ptr+dst->step*ri),src->cols);
+    }
+  }else if (CV_MAT_TYPE(src->type)==CV_64F){
+    CV_CALL(cvExp(src,dst));
+  }else{
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
+  }
+  __END__;
+}
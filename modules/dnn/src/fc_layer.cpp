@@ -27,6 +27,25 @@
 
 void icvCNNDenseClear( CvDNNLayer * p_layer );
 
+// slots of scratch buffers taken from workspace arena
+#define ICV_DENSE_WS_X          0
+#define ICV_DENSE_WS_BIAS       1
+#define ICV_DENSE_WS_WX         2
+#define ICV_DENSE_WS_Y          3
+#define ICV_DENSE_WS_DEDX       4
+#define ICV_DENSE_WS_DEDY       5
+#define ICV_DENSE_WS_DEDY_AFDER 6
+#define ICV_DENSE_WS_DEDW       7
+#define ICV_DENSE_WS_XCOL       8
+#define ICV_DENSE_WS_XQ         9
+#define ICV_DENSE_WS_ACC       10
+// all but the copy of output, gradient wrt side input and the gradient store
+// are filled again in each pass
+#define ICV_DENSE_WS_SCRATCH \
+  ((1u<<ICV_DENSE_WS_X)|(1u<<ICV_DENSE_WS_BIAS)|(1u<<ICV_DENSE_WS_WX)|(1u<<ICV_DENSE_WS_DEDY)| \
+   (1u<<ICV_DENSE_WS_DEDY_AFDER)|(1u<<ICV_DENSE_WS_XCOL)|(1u<<ICV_DENSE_WS_XQ)|           \
+   (1u<<ICV_DENSE_WS_ACC))
+
 /*************************************************************************/
 ML_IMPL
 CvDNNLayer * cvCreateDenseLayer( 
@@ -43,6 +62,8 @@ CvDNNLayer * cvCreateDenseLayer(
   if ( init_learn_rate <= 0) {
     CV_ERROR( CV_StsBadArg, "Incorrect parameters" );
   }
+  const int activation_type = cvGetActivationType(activation);
+  if ( activation_type<0 ) { CV_ERROR( CV_StsBadArg, "Unknown activation type" ); }
 
   fprintf(stderr,"DenseLayer(%s): input (%d), output (%d)\n", name,
           n_inputs,n_outputs);
@@ -56,8 +77,11 @@ CvDNNLayer * cvCreateDenseLayer(
   layer->dE_dW = 0;
   layer->seq_length = 1;
   layer->clear = icvCNNDenseClear;
+  layer->step = icvCNNDenseStep;
+  layer->ws_scratch = ICV_DENSE_WS_SCRATCH;
 
   strcpy(layer->activation,activation);
+  layer->activation_type = activation_type;
   layer->visualize = visualize;
   layer->input_layers.push_back((CvDNNLayer*)input_layer);
 
@@ -81,7 +105,6 @@ CvDNNLayer * cvCreateDenseLayer(
   __END__;
 
   if ( cvGetErrStatus() < 0 && layer ){
-    cvReleaseMat( &layer->WX );
     cvReleaseMat( &layer->weights );
     cvFree( &layer );
   }
@@ -121,13 +144,13 @@ void icvCNNDenseForward( CvDNNLayer* _layer, const CvMat* _X, CvMat* _Y )
     }
     CvMat * Xsrc = input_layer->Y;
     if (layer->n_output_planes*seq_length==Y->cols){
-      X = cvCreateMat(batch_size,n_inputs*seq_length,dtype);
+      CV_CALL(X = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_X,batch_size,n_inputs*seq_length,dtype));
       CV_ASSERT(n_inputs*seq_length*batch_size==Xsrc->rows*Xsrc->cols);
       cvCopy(Xsrc,X);
       n_outputs=layer->n_output_planes/seq_length;
       CV_ASSERT(n_outputs*seq_length==layer->n_output_planes);
     }else{
-      X = cvCreateMat(batch_size,n_inputs,dtype);
+      CV_CALL(X = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_X,batch_size,n_inputs,dtype));
       CV_ASSERT(n_inputs*seq_length*batch_size==Xsrc->rows*Xsrc->cols);
       CvMat X_submat; 
       if (icvIsSimpleRNNLayer(input_layer)){
@@ -138,10 +161,11 @@ void icvCNNDenseForward( CvDNNLayer* _layer, const CvMat* _X, CvMat* _Y )
       cvCopy(&X_submat,X);
       seq_length=1;
     }
-  }else if (icvIsSimpleRNNLayer(layer->prev_layer) && n_inputs*seq_length!=X->rows){
+  }else if (icvIsSimpleRNNLayer(layer->prev_layer) && !icvIsSequenceRNNLayer(layer->prev_layer) &&
+            n_inputs*seq_length!=X->rows){
     CvDNNSimpleRNNLayer * rnn_layer = ((CvDNNSimpleRNNLayer*)layer->prev_layer);
     CV_ASSERT(X->cols==rnn_layer->seq_length*n_inputs);
-    X = cvCreateMat(batch_size,n_inputs,dtype);
+    CV_CALL(X = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_X,batch_size,n_inputs,dtype));
     CvMat X_submat;
     cvGetSubRect(_X,&X_submat,cvRect(n_inputs*rnn_layer->time_index,0,n_inputs,batch_size));
     cvCopy(&X_submat,X);
@@ -151,33 +175,59 @@ void icvCNNDenseForward( CvDNNLayer* _layer, const CvMat* _X, CvMat* _Y )
   CV_ASSERT(Y->rows == batch_size && Y->cols == layer->n_output_planes);
   CV_ASSERT(cvCountNAN(X)<1);
 
-  CvRect roi = cvRect(0, 0, weights->cols-1, weights->rows );
-  CV_CALL(cvGetSubRect( weights, &sub_weights, roi));
-  CV_CALL(cvGetCol( weights, &biascol, weights->cols-1));
-  CvMat * bias = cvCreateMat(biascol.rows,batch_size,dtype); 
-  cvRepeat(&biascol,bias);
-  layer->WX = cvCreateMat( batch_size, n_outputs, dtype ); cvZero( layer->WX );
-  CV_CALL(cvGEMM( X, &sub_weights, 1, bias, 1, layer->WX, CV_GEMM_B_T+CV_GEMM_C_T ));
-  if (bias){cvReleaseMat(&bias);bias=0;}
-
-  if (!strcmp(layer->activation,"none")){ // do nothing
-  }else if (!strcmp(layer->activation,"tanh")){ CV_CALL(cvTanh( layer->WX, Y ));
-  }else if (!strcmp(layer->activation,"sigmoid")){ CV_CALL(cvSigmoid( layer->WX, Y ));
-  }else if (!strcmp(layer->activation,"relu")){ CV_CALL(cvReLU( layer->WX, Y ));
-  }else if (!strcmp(layer->activation,"softmax")){
-    cvSoftmax( layer->WX, Y ); CV_ASSERT(Y->rows == batch_size && Y->cols == layer->n_output_planes);
-  }else{CV_ERROR(CV_StsBadArg,"Unknown activation type");}
-
-  if (layer->Y){
-    if (layer->Y->rows==Y->rows){cvCopy(Y,layer->Y);}else{cvReleaseMat(&layer->Y);layer->Y=cvCloneMat(Y);}
-  }else{layer->Y=cvCloneMat(Y);}
-  if (layer->visualize==1){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
-  else if (layer->visualize==2){fprintf(stderr,"\n");cvPrintf(stderr,"%f ",Y);}
+  CV_CALL(layer->WX = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_WX,batch_size,n_outputs,dtype));
+  if (layer->quant && layer->quant->state==CV_DNN_QUANT_INT8){
+    // int8 rows of X times int8 weights, dequantized with per output scale
+    // and bias, ReLU is applied in the same pass
+    CvDNNQuantization * quant = layer->quant;
+    const int kpad = quant->W->cols;
+    const int relu = layer->activation_type==CV_DNN_ACTIVATION_RELU;
+    CV_ASSERT(quant->W->rows==n_outputs && kpad>=X->cols);
+    CvMat * Xq = 0, * acc = 0;
+    CV_CALL(Xq = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_XQ,batch_size,kpad,CV_8S));
+    CV_CALL(acc = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_ACC,batch_size,n_outputs,CV_32S));
+    for (int si=0;si<batch_size;si++){
+      schar * qptr = (schar*)(Xq->data.ptr+Xq->step*si);
+      icvQuantizeInt8((const float*)(X->data.ptr+X->step*si),quant->xscale,qptr,X->cols);
+      memset(qptr+X->cols,0,kpad-X->cols);
+    }
+    CV_CALL(cvGEMMInt8( Xq, quant->W, acc ));
+    CvMat * dst = relu?Y:layer->WX;
+    for (int si=0;si<batch_size;si++){
+      icvDequantizeInt32((const int*)(acc->data.ptr+acc->step*si),quant->scale->data.fl,
+                         quant->bias->data.fl,1,relu,(float*)(dst->data.ptr+dst->step*si),n_outputs);
+    }
+    if (!relu){ CV_CALL(cvActivate( layer->activation_type, layer->WX, 0, layer->WX, Y )); }
+  }else if (layer->quant && (layer->quant->state==CV_DNN_QUANT_FP16 || 
+                             layer->quant->state==CV_DNN_QUANT_BF16)){
+    // weights are read as 16 bit floats, widened while accumulating, float
+    // weights are released while the layer is quantized
+    CV_CALL(cvGEMMFloat16( X, layer->quant->W, layer->quant->state, layer->WX ));
+    CV_CALL(cvActivate( layer->activation_type, layer->WX, layer->quant->bias, layer->WX, Y ));
+  }else{
+    CvRect roi = cvRect(0, 0, weights->cols-1, weights->rows );
+    CV_CALL(cvGetSubRect( weights, &sub_weights, roi));
+    CV_CALL(cvGetCol( weights, &biascol, weights->cols-1));
+    // bias is added in the activation epilogue, read from a contiguous
+    // copy of the bias column instead of being repeated for each sample
+    CvMat * bias = 0;
+    CV_CALL(bias = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_BIAS,1,biascol.rows,dtype));
+    cvTranspose(&biascol,bias);
+    CV_CALL(cvGEMM( X, &sub_weights, 1, 0, 0, layer->WX, CV_GEMM_B_T ));
+    CV_CALL(cvActivate( layer->activation_type, layer->WX, bias, layer->WX, Y ));
+    if (layer->quant && layer->quant->state==CV_DNN_QUANT_CALIBRATE){
+      icvCalibrateQuantization(layer->quant, X);
+    }
+  }
 
-  if ( (input_layer && icvIsSimpleRNNLayer(input_layer)) ||
-       (icvIsSimpleRNNLayer(layer->prev_layer) && n_inputs*seq_length!=X->cols) ){
-    CV_ASSERT(X!=_X); if (X) { cvReleaseMat(&X); X = 0; }
+  // keep a copy of output for layers reading it via input_layers, unless
+  // the output itself has been bound to layer->Y in prediction or training
+  if (layer->Y!=Y){
+    CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_Y,Y->rows,Y->cols,dtype));
+    cvCopy(Y,layer->Y);
   }
+  if (layer->visualize==1){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
+  else if (layer->visualize==2){fprintf(stderr,"\n");cvPrintf(stderr,"%f ",Y);}
   __END__;
 }
 
@@ -192,7 +242,7 @@ void icvCNNDenseForward( CvDNNLayer* _layer, const CvMat* _X, CvMat* _Y )
    Input parameter <dE_dY> is the partial derivative of the
    loss function with respect to the planes components
    of the current layer. */
-void icvCNNDenseBackward(CvDNNLayer * _layer, int t,
+void icvCNNDenseBackward(CvDNNLayer * _layer, int /*t*/,
                                const CvMat * _X, const CvMat * _dE_dY, CvMat * _dE_dX )
 {
   CvMat* dE_dY_afder = 0;
@@ -231,28 +281,24 @@ void icvCNNDenseBackward(CvDNNLayer * _layer, int t,
       n_inputs = input_layer->n_output_planes*input_layer->output_height*input_layer->output_width;
     }
     CvMat X_submat; CvMat * Xsrc = input_layer->Y;
-    X = cvCreateMat(batch_size,n_inputs,dtype);
+    CV_CALL(X = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_X,batch_size,n_inputs,dtype));
     CV_ASSERT(n_inputs*seq_length*batch_size==Xsrc->rows*Xsrc->cols);
     cvGetRows(Xsrc,&X_submat,batch_size*time_index,batch_size*(time_index+1));
     cvCopy(&X_submat,X); 
     // initialize dE_dX in layer member variable
-    if (!layer->dE_dX){
-      layer->dE_dX = cvCreateMat(batch_size, n_inputs, dtype); 
-    }else{CV_ASSERT(layer->dE_dX->rows==batch_size && layer->dE_dX->cols==n_inputs);}
+    CV_CALL(layer->dE_dX = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_DEDX,batch_size,n_inputs,dtype));
     cvZero(layer->dE_dX);
     seq_length=1; dE_dX = layer->dE_dX;
-  }else if (icvIsSimpleRNNLayer(layer->prev_layer)){
+  }else if (icvIsSimpleRNNLayer(layer->prev_layer) && !icvIsSequenceRNNLayer(layer->prev_layer)){
     CvDNNSimpleRNNLayer * rnn_layer = (CvDNNSimpleRNNLayer*)layer->prev_layer;
     if (X->rows!=n_inputs){
       CV_ASSERT(X->rows==rnn_layer->seq_length*n_inputs);
-      X = cvCreateMat(n_inputs,batch_size,dtype);
+      CV_CALL(X = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_X,n_inputs,batch_size,dtype));
       CvMat X_submat;
       cvGetSubRect(_X,&X_submat,cvRect(0,n_inputs*rnn_layer->time_index,batch_size,n_inputs));
       cvCopy(&X_submat,X);
       // initialize dE_dX in layer member variable
-      if (!layer->dE_dX) { 
-        layer->dE_dX = cvCreateMat(batch_size, n_inputs, dtype); 
-      }else{CV_ASSERT(layer->dE_dX->rows==batch_size && layer->dE_dX->cols==n_inputs);}
+      CV_CALL(layer->dE_dX = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_DEDX,batch_size,n_inputs,dtype));
       cvZero(layer->dE_dX);
       dE_dX = layer->dE_dX;
     }
@@ -274,7 +320,7 @@ void icvCNNDenseBackward(CvDNNLayer * _layer, int t,
         }
       }
       if (layer_index>=0){
-        dE_dY = cvCreateMat(batch_size,output_layer_size,CV_32F);
+        CV_CALL(dE_dY = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_DEDY,batch_size,output_layer_size,CV_32F));
         CvMat dE_dX_submat; 
         cvGetCols(output_layer->dE_dX,&dE_dX_submat,output_layer_index,output_layer_index+output_layer_size);
         cvCopy(&dE_dX_submat,dE_dY);
@@ -286,48 +332,50 @@ void icvCNNDenseBackward(CvDNNLayer * _layer, int t,
   CV_ASSERT(dE_dY->rows == batch_size && dE_dY->cols == n_outputs );
   CV_ASSERT(dE_dX->rows == batch_size && dE_dX->cols == n_inputs );
 
-  CV_CALL(dE_dY_afder = cvCreateMat( batch_size, n_outputs, dtype ));
-
-  // compute (tanh'(WX))*dE_dY
-  if (!strcmp(layer->activation,"none")){
-  }else if (!strcmp(layer->activation,"tanh")){ 
-    cvTanhDer(layer->WX,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"sigmoid")){ 
-    cvSigmoidDer(layer->WX,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"softmax")){ 
-    cvSoftmaxDer(layer->WX,(CvMat*)dE_dY,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"relu")){ 
-    cvReLUDer(layer->WX,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY,dE_dY_afder);
-  }else{CV_ASSERT(false);}
+  CV_CALL(dE_dY_afder = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_DEDY_AFDER,batch_size,n_outputs,dtype));
+
+  // compute f'(WX)*dE_dY
+  CV_CALL(cvActivateDer(layer->activation_type,layer->WX,dE_dY,dE_dY_afder));
 
   // compute dE_dX=dE_dY_afder*W
   CV_CALL(cvGetCols( weights, &sub_weights, 0, weights->cols-1 ));
   CV_CALL(cvGEMM( dE_dY_afder, &sub_weights, 1, 0, 1, dE_dX));
   
-  // compute dE_dW=dE_dY*X
+  // sum dE_dW=dE_dY*X into the gradient store, applied by icvCNNDenseStep
   CV_ASSERT( dE_dY->rows == batch_size && dE_dY->cols == n_outputs );
-  dE_dW = cvCreateMat(n_outputs,n_inputs+1,dtype); cvZero(dE_dW);
-  CvMat * Xcol = cvCreateMat(X->rows,X->cols+1,dtype); 
+  CV_CALL(dE_dW = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_DEDW,n_outputs,n_inputs+1,dtype));
+  CvMat * Xcol = 0;
+  CV_CALL(Xcol = cvGetWorkspaceMat(_layer,ICV_DENSE_WS_XCOL,X->rows,X->cols+1,dtype));
   cvSet(Xcol,cvScalar(1)); // all ones on last row
   CvMat Xcol_submat; cvGetCols(Xcol,&Xcol_submat,0,X->cols); cvCopy(X,&Xcol_submat);
-  cvGEMM(dE_dY,Xcol,1,0,1,dE_dW,CV_GEMM_A_T);
-  cvReleaseMat(&Xcol);
-
-  // copy `dE_dW` into layer variable for gradient checking
-  if (!layer->dE_dW){layer->dE_dW = cvCloneMat(dE_dW);}else{cvCopy(dE_dW,layer->dE_dW);}
+  if (layer->n_grads){
+    cvGEMM(dE_dY,Xcol,1,dE_dW,1,dE_dW,CV_GEMM_A_T);
+  }else{
+    cvGEMM(dE_dY,Xcol,1,0,0,dE_dW,CV_GEMM_A_T);
+  }
+  layer->dE_dW = dE_dW;
+  layer->n_grads++;
   if (input_layer){
-    if (layer->dE_dX){cvCopy(dE_dX,layer->dE_dX);}else{layer->dE_dX=cvCloneMat(dE_dX);}
+    CV_ASSERT(dE_dX==layer->dE_dX);
   }else{
     if (layer->dE_dX){
       CV_ERROR(CV_StsBadArg, "layer->dE_dX should not be initialize if the layer don't have input_layer defined.");
     }
   }
 
-  // 2) update weights
+  layer->WX = 0;
+  __END__;
+}
+
+/* Applies gradient <dE_dW> to the weights at iteration <t> by the optimizer
+   of the layer, with the learning rate decreasing as given by layer->decay_type. */
+void icvCNNDenseUpdate( CvDNNLayer * layer, const CvMat * dE_dW, int t )
+{
+  CV_FUNCNAME("icvCNNDenseUpdate");
+  __BEGIN__;
+  CvMat * weights = layer->weights;
   float eta;
+  CV_ASSERT(CV_ARE_SIZES_EQ(dE_dW,weights));
   if ( layer->decay_type == CV_DNN_LEARN_RATE_DECREASE_LOG_INV ){
     eta = -layer->init_learn_rate/logf(1+(float)t);
   }else if ( layer->decay_type == CV_DNN_LEARN_RATE_DECREASE_SQRT_INV ){
@@ -335,14 +383,21 @@ void icvCNNDenseBackward(CvDNNLayer * _layer, int t,
   }else{
     eta = -layer->init_learn_rate/(float)t;
   }
-  cvScaleAdd( dE_dW, cvRealScalar(eta), weights, weights );
-
-  // if (output_layer && dE_dY){cvReleaseMat(&dE_dY);dE_dY=0;}
-  if (layer->WX){ cvReleaseMat(&layer->WX);layer->WX=0; }
+  CV_CALL(cvOptimizerUpdate( layer->optimizer, weights, dE_dW, -eta ));
   __END__;
+}
 
-  cvReleaseMat( &dE_dY_afder );
-  cvReleaseMat( &dE_dW );
+/* Applies gradients summed in the store of the layer since last step,
+   averaged over the n_batches mini batches they were accumulated from. */
+void icvCNNDenseStep( CvDNNLayer * layer, int t, int n_batches )
+{
+  CV_FUNCNAME("icvCNNDenseStep");
+  __BEGIN__;
+  if (!layer->n_grads){EXIT;}
+  if (n_batches>1){ cvScale(layer->dE_dW,layer->dE_dW,1./n_batches); }
+  CV_CALL(icvCNNDenseUpdate(layer,layer->dE_dW,t));
+  layer->n_grads = 0;
+  __END__;
 }
 
 
@@ -364,8 +419,9 @@ void icvCNNDenseRelease( CvDNNLayer** p_layer )
   if ( !icvIsDenseLayer((CvDNNLayer*)layer) )
       CV_ERROR( CV_StsBadArg, "Invalid layer" );
 
-  cvReleaseMat( &layer->WX );
   cvReleaseMat( &layer->weights );
+  icvReleaseQuantization( &layer->quant );
+  cvReleaseWorkspaceMats( *p_layer );
   cvFree( p_layer );
 
   __END__;
@@ -388,7 +444,8 @@ void icvCNNDenseClear( CvDNNLayer * p_layer )
   if ( !icvIsDenseLayer((CvDNNLayer*)layer) )
       CV_ERROR( CV_StsBadArg, "Invalid layer" );
 
-  if (layer->WX) { cvReleaseMat( &layer->WX ); layer->WX=0; }
+  // WX is held by workspace arena, just forget about it
+  layer->WX=0;
 
   __END__;
 }
@@ -0,0 +1,291 @@
+/** -*- c++ -*-
+ *
+ * \file   gru_layer.cpp
+ * \date   Sun Oct 18 19:48:05 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  gated recurrent unit (GRU) layer, running the whole sequence
+ */
+
+#include "_dnn.h"
+
+// slots of buffers taken from workspace arena, states kept from forward to
+// backward pass
+#define ICV_GRU_WS_GATES          0
+#define ICV_GRU_WS_HH             1
+#define ICV_GRU_WS_H              2
+#define ICV_GRU_WS_DEDW           3
+// scratch buffers within a single forward or backward call
+#define ICV_GRU_WS_BIAS           4
+#define ICV_GRU_WS_DH             5
+#define ICV_GRU_WS_DGATES         6
+#define ICV_GRU_WS_DHH            7
+// initial states of a stateful layer, and the last states carried over to
+// next batch
+#define ICV_GRU_WS_H0             8
+#define ICV_GRU_WS_CARRY          9
+
+ML_IMPL CvDNNLayer* cvCreateGRULayer(
+    const int dtype, const char * name,
+    int n_inputs, int n_outputs, int seq_length,
+    float init_learn_rate, int update_rule, CvMat * weights )
+{
+  CvDNNGRULayer* layer = 0;
+
+  CV_FUNCNAME("cvCreateGRULayer");
+  __BEGIN__;
+
+  if ( init_learn_rate <= 0) { CV_ERROR( CV_StsBadArg, "Incorrect parameters" ); }
+  if ( dtype != CV_32F ) { CV_ERROR( CV_StsBadArg, "GRU layer supports CV_32F only" ); }
+
+  fprintf(stderr,"GRULayer(%s): input(%d), output(%d), seq_length(%d)\n", name,
+          n_inputs, n_outputs, seq_length);
+
+  CV_CALL(layer = (CvDNNGRULayer*)icvCreateLayer( ICV_DNN_GRU_LAYER, dtype, name,
+      sizeof(CvDNNGRULayer), n_inputs, 1, 1, n_outputs, 1, 1,
+      init_learn_rate, update_rule,
+      icvCNNGRURelease, icvCNNGRUForward, icvCNNGRUBackward ));
+
+  layer->step = icvCNNGatedRecurrentStep;
+  layer->time_index = CV_DNN_RNN_SEQUENCE;
+  layer->seq_length = seq_length;
+
+  CV_CALL(layer->weights = cvCreateMat( n_outputs*3, n_inputs+n_outputs+1, CV_32F ));
+  if ( weights ){
+    if ( !CV_ARE_SIZES_EQ( weights, layer->weights ) ) {
+      CV_ERROR( CV_StsBadSize, "Invalid size of initial weights matrix" );
+    }
+    CV_CALL(cvCopy( weights, layer->weights ));
+  }else{
+    CvRNG rng = cvRNG( -1 );
+    cvRandArr( &rng, layer->weights, CV_RAND_UNI,
+               cvScalar(-1.f/sqrt(n_outputs)), cvScalar(1.f/sqrt(n_outputs)) );
+    for (int ii=0;ii<n_outputs*3;ii++){ CV_MAT_ELEM(*layer->weights,float,ii,n_inputs+n_outputs)=0; }
+  }
+
+  __END__;
+
+  if ( cvGetErrStatus() < 0 && layer ){
+    cvReleaseMat( &layer->weights );
+    cvFree( &layer );
+  }
+
+  return (CvDNNLayer*)layer;
+}
+
+void icvCNNGRURelease( CvDNNLayer** p_layer )
+{
+  CV_FUNCNAME("icvCNNGRURelease");
+  __BEGIN__;
+
+  CvDNNGRULayer* layer = 0;
+
+  if ( !p_layer ) { CV_ERROR( CV_StsNullPtr, "Null double pointer" ); }
+
+  layer = *(CvDNNGRULayer**)p_layer;
+
+  if ( !layer ) { return; }
+  if ( !icvIsGRULayer((CvDNNLayer*)layer) ) {
+    CV_ERROR( CV_StsBadArg, "Invalid layer" );
+  }
+
+  cvReleaseMat( &layer->weights );
+  cvReleaseWorkspaceMats( *p_layer );
+  cvFree( p_layer );
+
+  __END__;
+}
+
+/****************************************************************************************/
+/* Input projections of all gates at all time steps are computed by a single
+   GEMM, then each time step takes a single GEMM for the recurrent projections
+   of all gates, kept apart from the input projections as the reset gate
+   applies to the recurrent projection of the candidate gate. */
+void icvCNNGRUForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y )
+{
+  CV_FUNCNAME("icvCNNGRUForward");
+  if ( !icvIsGRULayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  __BEGIN__;
+
+  CvDNNGRULayer * layer = (CvDNNGRULayer*)_layer;
+  const int seq_length = layer->seq_length;
+  const int n_inputs = layer->n_input_planes;
+  const int n_hiddens = layer->n_output_planes;
+  const int n_gates = n_hiddens*3;
+  const int batch_size = X->rows;
+  CvMat Wx, Wh, biascol, Xr, Gr, G_curr, HH_curr, H_prev, H_curr;
+  CvMat * bias = 0, * H0 = 0;
+  int ti, bi;
+
+  CV_ASSERT(CV_MAT_TYPE(X->type)==CV_32F && CV_MAT_TYPE(Y->type)==CV_32F);
+  CV_ASSERT(X->cols==n_inputs*seq_length && CV_IS_MAT_CONT(X->type));
+  CV_ASSERT(Y->rows==batch_size && Y->cols==n_hiddens*seq_length);
+
+  CV_CALL(layer->gates = cvGetWorkspaceMat(_layer,ICV_GRU_WS_GATES,batch_size,n_gates*seq_length,CV_32F));
+  CV_CALL(layer->HH = cvGetWorkspaceMat(_layer,ICV_GRU_WS_HH,batch_size,n_gates*seq_length,CV_32F));
+  CV_CALL(layer->H = cvGetWorkspaceMat(_layer,ICV_GRU_WS_H,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(bias = cvGetWorkspaceMat(_layer,ICV_GRU_WS_BIAS,1,n_gates,CV_32F));
+  CV_CALL(cvGetCols( layer->weights, &Wx, 0, n_inputs ));
+  CV_CALL(cvGetCols( layer->weights, &Wh, n_inputs, n_inputs+n_hiddens ));
+  CV_CALL(cvGetCol( layer->weights, &biascol, n_inputs+n_hiddens ));
+  cvTranspose(&biascol,bias);
+
+  // initial states of a stateful layer, carried over from last batch
+  if (layer->stateful){
+    CV_CALL(H0 = cvGetWorkspaceMat(_layer,ICV_GRU_WS_H0,batch_size,n_hiddens,CV_32F));
+    if (layer->n_carried==batch_size){
+      CV_CALL(cvCopy(cvGetWorkspaceMat(_layer,ICV_GRU_WS_CARRY,batch_size,n_hiddens,CV_32F),H0));
+    }else{ cvZero(H0); }
+  }
+
+  // gates = Wx * X for all time steps
+  cvReshape(X,&Xr,0,batch_size*seq_length);
+  cvReshape(layer->gates,&Gr,0,batch_size*seq_length);
+  CV_CALL(cvGEMM( &Xr, &Wx, 1, 0, 0, &Gr, CV_GEMM_B_T ));
+
+  for (ti=0;ti<seq_length;ti++){
+    cvGetCols(layer->gates,&G_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(layer->HH,&HH_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(layer->H,&H_curr,n_hiddens*ti,n_hiddens*(ti+1));
+    // HH = Wh * H_prev
+    if (ti>0){ cvGetCols(layer->H,&H_prev,n_hiddens*(ti-1),n_hiddens*ti); }
+    else if (H0){ H_prev = *H0; }
+    if (ti>0 || H0){
+      CV_CALL(cvGEMM( &H_prev, &Wh, 1, 0, 0, &HH_curr, CV_GEMM_B_T ));
+    }else{
+      cvZero(&HH_curr);
+    }
+    for (bi=0;bi<batch_size;bi++){
+      icvGRUCell_32f((float*)(G_curr.data.ptr+G_curr.step*bi),
+                     (float*)(HH_curr.data.ptr+HH_curr.step*bi),bias->data.fl,
+                     (ti>0 || H0)?(float*)(H_prev.data.ptr+H_prev.step*bi):0,
+                     (float*)(H_curr.data.ptr+H_curr.step*bi),n_hiddens);
+    }
+  }
+  if (layer->stateful){
+    CV_CALL(cvCopy(&H_curr,cvGetWorkspaceMat(_layer,ICV_GRU_WS_CARRY,batch_size,n_hiddens,CV_32F)));
+    layer->n_carried = batch_size;
+  }
+  CV_CALL(cvCopy(layer->H,Y));
+
+  __END__;
+}
+
+/* Gradients of the gate pre-activations <dgates> and of the recurrent
+   projections <dhh> of a time step, from gradient <dh> of the hidden state,
+   the part of <dh> passed directly to previous hidden state is added to <dh_prev>. */
+static void icvGRUCellBackward( const float * gates, const float * hh, const float * h_prev,
+                                const float * dh, float * dh_prev, float * dgates, float * dhh, int n )
+{
+  for (int ii=0;ii<n;ii++){
+    const float r = gates[ii], z = gates[n+ii], g = gates[2*n+ii];
+    const float hp = h_prev?h_prev[ii]:0.f;
+    const float dn = dh[ii]*(1.f-z)*(1.f-g*g);
+    const float dz = dh[ii]*(hp-g)*z*(1.f-z);
+    const float dr = dn*hh[2*n+ii]*r*(1.f-r);
+    dgates[ii] = dr; dgates[n+ii] = dz; dgates[2*n+ii] = dn;
+    dhh[ii] = dr; dhh[n+ii] = dz; dhh[2*n+ii] = dn*r;
+    if (dh_prev){ dh_prev[ii] += dh[ii]*z; }
+  }
+}
+
+/****************************************************************************************/
+/* Back propagation through the whole sequence, gradients of all time steps
+   and samples are summed into dE_dW, which is applied by icvCNNGatedRecurrentStep. */
+void icvCNNGRUBackward( CvDNNLayer* _layer, int /*t*/,
+                        const CvMat * X, const CvMat * dE_dY, CvMat * dE_dX )
+{
+  CV_FUNCNAME( "icvCNNGRUBackward" );
+  if ( !icvIsGRULayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  __BEGIN__;
+
+  CvDNNGRULayer * layer = (CvDNNGRULayer*)_layer;
+  const int seq_length = layer->seq_length;
+  const int n_inputs = layer->n_input_planes;
+  const int n_hiddens = layer->n_output_planes;
+  const int n_gates = n_hiddens*3;
+  const int batch_size = X->rows;
+  CvMat Wx, Wh, dWx, dWh, dbiascol, dbias_hdr, Xr, dXr, dGr;
+  CvMat G_curr, dG_curr, HH_curr, H_prev, dH_prev, dH_curr;
+  CvMat * dE_dW = 0, * dH = 0, * dG = 0, * dHH = 0, * dbias = 0, * H0 = 0;
+  int ti, bi;
+
+  CV_ASSERT(layer->gates && layer->HH && layer->H && layer->H->rows==batch_size);
+  CV_ASSERT(dE_dY->rows==batch_size && dE_dY->cols==n_hiddens*seq_length);
+  CV_ASSERT(dE_dX->rows==batch_size && dE_dX->cols==n_inputs*seq_length && CV_IS_MAT_CONT(dE_dX->type));
+
+  // gradient store, summed over all sequences passed backward since last step
+  CV_CALL(dE_dW = cvGetWorkspaceMat(_layer,ICV_GRU_WS_DEDW,layer->weights->rows,layer->weights->cols,CV_32F));
+  if (!layer->n_grads){ cvZero(dE_dW); }
+  CV_CALL(dH = cvGetWorkspaceMat(_layer,ICV_GRU_WS_DH,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(dG = cvGetWorkspaceMat(_layer,ICV_GRU_WS_DGATES,batch_size,n_gates*seq_length,CV_32F));
+  CV_CALL(dHH = cvGetWorkspaceMat(_layer,ICV_GRU_WS_DHH,batch_size,n_gates,CV_32F));
+  CV_CALL(dbias = cvGetWorkspaceMat(_layer,ICV_GRU_WS_BIAS,1,n_gates,CV_32F));
+  if (layer->stateful){ CV_CALL(H0 = cvGetWorkspaceMat(_layer,ICV_GRU_WS_H0,batch_size,n_hiddens,CV_32F)); }
+  CV_CALL(cvGetCols( layer->weights, &Wx, 0, n_inputs ));
+  CV_CALL(cvGetCols( layer->weights, &Wh, n_inputs, n_inputs+n_hiddens ));
+  CV_CALL(cvGetCols( dE_dW, &dWx, 0, n_inputs ));
+  CV_CALL(cvGetCols( dE_dW, &dWh, n_inputs, n_inputs+n_hiddens ));
+  CV_CALL(cvGetCol( dE_dW, &dbiascol, n_inputs+n_hiddens ));
+  cvCopy(dE_dY,dH);
+
+  // back through time, dH_{t-1} += dH_t * z_t + dHH_t * Wh within a window
+  // of truncated back propagation
+  for (ti=seq_length-1;ti>=0;ti--){
+    const int connected = icvIsBPTTConnected(_layer,ti);
+    cvGetCols(layer->gates,&G_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(layer->HH,&HH_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(dG,&dG_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(dH,&dH_curr,n_hiddens*ti,n_hiddens*(ti+1));
+    if (ti>0){
+      cvGetCols(layer->H,&H_prev,n_hiddens*(ti-1),n_hiddens*ti);
+      cvGetCols(dH,&dH_prev,n_hiddens*(ti-1),n_hiddens*ti);
+    }else if (H0){ H_prev = *H0; }
+    for (bi=0;bi<batch_size;bi++){
+      icvGRUCellBackward((float*)(G_curr.data.ptr+G_curr.step*bi),
+                         (float*)(HH_curr.data.ptr+HH_curr.step*bi),
+                         (ti>0 || H0)?(float*)(H_prev.data.ptr+H_prev.step*bi):0,
+                         (float*)(dH_curr.data.ptr+dH_curr.step*bi),
+                         connected?(float*)(dH_prev.data.ptr+dH_prev.step*bi):0,
+                         (float*)(dG_curr.data.ptr+dG_curr.step*bi),
+                         (float*)(dHH->data.ptr+dHH->step*bi),n_hiddens);
+    }
+    // dH_prev += dHH * Wh, dWh += dHH' * H_prev
+    if (connected){
+      CV_CALL(cvGEMM( dHH, &Wh, 1, &dH_prev, 1, &dH_prev, 0 ));
+    }
+    if (ti>0 || H0){
+      CV_CALL(cvGEMM( dHH, &H_prev, 1, &dWh, 1, &dWh, CV_GEMM_A_T ));
+    }
+  }
+
+  // dWx += dgates' * X, dbias += dgates and dE_dX = dgates * Wx for all time steps
+  cvReshape(X,&Xr,0,batch_size*seq_length);
+  cvReshape(dE_dX,&dXr,0,batch_size*seq_length);
+  cvReshape(dG,&dGr,0,batch_size*seq_length);
+  CV_CALL(cvGEMM( &dGr, &Xr, 1, &dWx, 1, &dWx, CV_GEMM_A_T ));
+  cvReduce(&dGr,dbias,0,CV_REDUCE_SUM);
+  cvAdd(&dbiascol,cvReshape(dbias,&dbias_hdr,0,n_gates),&dbiascol);
+  CV_CALL(cvGEMM( &dGr, &Wx, 1, 0, 0, &dXr, 0 ));
+
+  layer->dE_dW = dE_dW;
+  layer->n_grads++;
+
+  __END__;
+}
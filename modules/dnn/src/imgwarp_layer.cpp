@@ -24,7 +24,13 @@
  */
  
 #include "_dnn.h"
-#include "cvimgwarp.h"
+
+// slots of workspace buffers: copy of output, affine sampling grid of each 
+// sample and its gradient, gradient of the image read through input_layers
+#define ICV_STN_WS_Y      0
+#define ICV_STN_WS_G      1
+#define ICV_STN_WS_DG     2
+#define ICV_STN_WS_DEDI   3
 
 /*-------------- functions for image cropping layer ------------------*/
 void icvCNNSpatialTransformRelease( CvDNNLayer** p_layer );
@@ -83,6 +89,105 @@ CvDNNLayer * cvCreateSpatialTransformLayer(
 }
 
 
+/* Transform parameters given by <X> are either a translation (2 values, in
+   [0,1] of the room left around the output window), an attention window of
+   scale and translation (3 values) or an affine transform (6 values), both in
+   coordinates normalized to [-1,1]. Otherwise <X> is the image itself, which
+   is resized to the output. */
+CV_INLINE int icvIsSpatialTransformParams( const CvMat * X )
+{
+  return X->cols==2 || X->cols==3 || X->cols==6;
+}
+
+/* Affine sampling grid <theta> of a sample, mapping pixel (u,v) of the output
+   to pixel (theta[0]*u+theta[1]*v+theta[2],theta[3]*u+theta[4]*v+theta[5]) 
+   of the image, from the <n_params> transform parameters <p> of the sample. */
+static void icvGetAffineGrid( const CvDNNSpatialTransformLayer * layer, const float * p, 
+                              int n_params, float * theta )
+{
+  const int Wi = layer->input_width, Hi = layer->input_height;
+  const int Wo = layer->output_width, Ho = layer->output_height;
+  const float sx = (Wi-1)*.5f, sy = (Hi-1)*.5f, ax = 2.f/(Wo-1), ay = 2.f/(Ho-1);
+  if (n_params==2){
+    theta[0] = 1.f; theta[1] = 0.f; theta[2] = float(Wi-Wo)*p[0];
+    theta[3] = 0.f; theta[4] = 1.f; theta[5] = float(Hi-Ho)*p[1];
+  }else if (n_params==3 || n_params==6){
+    const float A[6] = {p[0],n_params==3?0.f:p[1],n_params==3?p[1]:p[2],
+                        n_params==3?0.f:p[3],n_params==3?p[0]:p[4],n_params==3?p[2]:p[5]};
+    theta[0] = sx*ax*A[0]; theta[1] = sx*ay*A[1]; theta[2] = sx*(A[2]+1.f-A[0]-A[1]);
+    theta[3] = sy*ax*A[3]; theta[4] = sy*ay*A[4]; theta[5] = sy*(A[5]+1.f-A[3]-A[4]);
+  }else{
+    theta[0] = float(Wi)/Wo; theta[1] = 0.f; theta[2] = 0.f;
+    theta[3] = 0.f; theta[4] = float(Hi)/Ho; theta[5] = 0.f;
+  }
+}
+
+/* Gradient <dp> of the transform parameters of a sample, from gradient 
+   <dtheta> of its sampling grid, see icvGetAffineGrid. */
+static void icvAffineGridBackward( const CvDNNSpatialTransformLayer * layer, const float * dtheta,
+                                   int n_params, float * dp )
+{
+  const int Wi = layer->input_width, Hi = layer->input_height;
+  const int Wo = layer->output_width, Ho = layer->output_height;
+  const float sx = (Wi-1)*.5f, sy = (Hi-1)*.5f, ax = 2.f/(Wo-1), ay = 2.f/(Ho-1);
+  if (n_params==2){
+    dp[0] = float(Wi-Wo)*dtheta[2];
+    dp[1] = float(Hi-Ho)*dtheta[5];
+  }else{
+    const float dA[6] = {sx*(ax*dtheta[0]-dtheta[2]),sx*(ay*dtheta[1]-dtheta[2]),sx*dtheta[2],
+                         sy*(ax*dtheta[3]-dtheta[5]),sy*(ay*dtheta[4]-dtheta[5]),sy*dtheta[5]};
+    if (n_params==3){
+      dp[0] = dA[0]+dA[4]; dp[1] = dA[2]; dp[2] = dA[5];
+    }else{
+      for (int ii=0;ii<6;ii++){ dp[ii] = dA[ii]; }
+    }
+  }
+}
+
+/* Back propagates <dY>, gradient of the bilinear samples of all <nchannels> 
+   planes of image <src> on the sampling grid <theta>, to the image, summed 
+   into <dI>, and to the grid, written to <dtheta>. */
+static void icvBilinearSampleBackward( const float * src, const float * dY, 
+                                       int height, int width, int nchannels,
+                                       int output_height, int output_width, 
+                                       const float * theta, float * dI, float * dtheta )
+{
+  const int plane = height*width, output_plane = output_height*output_width;
+  double g[6] = {0,0,0,0,0,0};
+  for (int v=0;v<output_height;v++){
+    const float x0 = theta[1]*v+theta[2], y0 = theta[4]*v+theta[5];
+    for (int u=0;u<output_width;u++){
+      // same clamping as the forward pass, see icvBilinearSample_32f
+      const float x = MIN(MAX(x0+u*theta[0],-2.f),float(width));
+      const float y = MIN(MAX(y0+u*theta[3],-2.f),float(height));
+      const int xi = cvFloor(x), yi = cvFloor(y);
+      const float wx = x-xi, wy = y-yi;
+      const int vx0 = xi>=0 && xi<width, vx1 = xi+1>=0 && xi+1<width;
+      const int vy0 = yi>=0 && yi<height, vy1 = yi+1>=0 && yi+1<height;
+      const int offset = yi*width+xi;
+      float gx = 0, gy = 0;
+      for (int ci=0;ci<nchannels;ci++){
+        const float * ptr = src+ci*plane+offset;
+        float * dptr = dI+ci*plane+offset;
+        const float d = dY[ci*output_plane+v*output_width+u];
+        const float v00 = vy0&&vx0?ptr[0]:0.f, v01 = vy0&&vx1?ptr[1]:0.f;
+        const float v10 = vy1&&vx0?ptr[width]:0.f, v11 = vy1&&vx1?ptr[width+1]:0.f;
+        gx += d*((1.f-wy)*(v01-v00)+wy*(v11-v10));
+        gy += d*((1.f-wx)*(v10-v00)+wx*(v11-v01));
+        if (vy0&&vx0){ dptr[0] += d*(1.f-wx)*(1.f-wy); }
+        if (vy0&&vx1){ dptr[1] += d*wx*(1.f-wy); }
+        if (vy1&&vx0){ dptr[width] += d*(1.f-wx)*wy; }
+        if (vy1&&vx1){ dptr[width+1] += d*wx*wy; }
+      }
+      g[0] += gx*u; g[1] += gx*v; g[2] += gx;
+      g[3] += gy*u; g[4] += gy*v; g[5] += gy;
+    }
+  }
+  for (int ii=0;ii<6;ii++){ dtheta[ii] = float(g[ii]); }
+}
+
+/* All samples and channels of the mini batch are warped in a single pass, 
+   each row of a sampling grid by a vectorized bilinear sampler. */
 void icvCNNSpatialTransformForward( CvDNNLayer * _layer, const CvMat* X, CvMat* Y )
 {
   CV_FUNCNAME("icvCNNSpatialTransformForward");
@@ -91,61 +196,50 @@ void icvCNNSpatialTransformForward( CvDNNLayer * _layer, const CvMat* X, CvMat*
   CvDNNSpatialTransformLayer * layer = (CvDNNSpatialTransformLayer*)_layer;
   const CvDNNInputLayer * input_layer = 
     (CvDNNInputLayer*)(layer->input_layers.size()>0?layer->input_layers[0]:0);
-  const int time_index = layer->time_index;
   const int input_seqlen = input_layer->seq_length;
   const int input_height = layer->input_height;
   const int input_width = layer->input_width;
-  const int n_outputs = Y->cols;
   const int output_seqlen = layer->seq_length;
   const int output_height = layer->output_height;
   const int output_width = layer->output_width;
   const int batch_size = X->rows/input_seqlen;
   CV_ASSERT(Y->cols==layer->n_output_planes*layer->output_height*layer->output_width);
   CV_ASSERT(batch_size*input_seqlen==X->rows && batch_size*output_seqlen==Y->rows); // batch_size
-  CvMat * input_data = input_layer->Y;
-  CV_ASSERT(CV_MAT_TYPE(input_data->type)==CV_32F);
-  CV_ASSERT(output_height==output_width && output_height>1 && output_width>1);
+  CV_ASSERT(output_height>1 && output_width>1);
+  const int n_params = icvIsSpatialTransformParams(X)?X->cols:0;
+  const CvMat * I = n_params?input_layer->Y:X;
+  const int nchannels = I->cols/(input_height*input_width);
+  CV_ASSERT(CV_MAT_TYPE(I->type)==CV_32F && CV_MAT_TYPE(X->type)==CV_32F && 
+            CV_MAT_TYPE(Y->type)==CV_32F);
+  CV_ASSERT(I->rows==Y->rows && I->cols==input_height*input_width*nchannels);
+  CV_ASSERT(Y->cols==output_height*output_width*nchannels);
 
-  // icvCNNDenseForward(_layer,X,Y);
-  
-  { // image processing
-    CvMat * I = input_data;
-    CvMat * p = cvCreateMat(2,3,CV_32F); cvZero(p);
-    if (X->cols==2){ CV_ASSERT(X->rows==1); // translation only
-      CV_ASSERT(CV_MAT_ELEM(*X,float,0,0)>=0.f && CV_MAT_ELEM(*X,float,0,0)<=1.f && 
-                CV_MAT_ELEM(*X,float,0,1)>=0.f && CV_MAT_ELEM(*X,float,0,1)<=1.f);
-      float tx = float(input_width -output_width )*CV_MAT_ELEM(*X,float,0,0);
-      float ty = float(input_height-output_height)*CV_MAT_ELEM(*X,float,0,1);
-      CV_MAT_ELEM(*p,float,0,0)=CV_MAT_ELEM(*p,float,1,1)=1.f;
-      CV_MAT_ELEM(*p,float,0,2)=tx;
-      CV_MAT_ELEM(*p,float,1,2)=ty; // fprintf(stderr,"--\n"); cvPrintf(stderr,"%f ",p);
-      int nchannels=I->cols/(input_height*input_width);
-      CV_ASSERT(I->cols==input_height*input_width*nchannels && CV_MAT_TYPE(I->type)==CV_32F);
-      CV_ASSERT(Y->cols==output_height*output_width*nchannels && CV_MAT_TYPE(Y->type)==CV_32F);
-      for (int chidx=0; chidx<nchannels; chidx++){
-        CvMat srchdr = cvMat(input_height,input_width,CV_32F,I->data.fl+input_height*input_width*chidx);
-        CvMat dsthdr = cvMat(output_height,output_width,CV_32F,Y->data.fl+output_height*output_width*chidx);
-        icvWarp(&srchdr,&dsthdr,p);
-      }
-      // CV_SHOW(&srchdr); CV_SHOW(&dsthdr);
-    }else if (X->cols==3){ CV_ASSERT(X->rows==1); // crop and resize
-    }else{ // resize image
-      float scale = float(output_height)/float(input_height);
-      CV_MAT_ELEM(*p,float,0,0)=1./scale;
-      CV_MAT_ELEM(*p,float,1,1)=1./scale;
-      CV_ASSERT(I->cols==input_height*input_width && CV_MAT_TYPE(I->type)==CV_32F);
-      CV_ASSERT(Y->cols==output_height*output_width && CV_MAT_TYPE(Y->type)==CV_32F);
-      CvMat srchdr = cvMat(input_height,input_width,CV_32F,I->data.ptr);
-      CvMat dsthdr = cvMat(output_height,output_width,CV_32F,Y->data.ptr);
-      icvWarp(&srchdr,&dsthdr,p); // CV_SHOW(&srchdr); CV_SHOW(&dsthdr);
+  // sampling grids are kept for backward pass
+  CV_CALL(layer->G = cvGetWorkspaceMat(_layer,ICV_STN_WS_G,Y->rows,6,CV_32F));
+  for (int bi=0;bi<Y->rows;bi++){
+    icvGetAffineGrid(layer,n_params?(const float*)(X->data.ptr+X->step*bi):0,n_params,
+                     layer->G->data.fl+bi*6);
+  }
+#pragma omp parallel for
+  for (int bi=0;bi<Y->rows;bi++){
+    const float * theta = layer->G->data.fl+bi*6;
+    const float * src = (const float*)(I->data.ptr+I->step*bi);
+    float * dst = (float*)(Y->data.ptr+Y->step*bi);
+    for (int v=0;v<output_height;v++){
+      icvBilinearSample_32f(src,input_height,input_width,nchannels,
+                            theta[1]*v+theta[2],theta[4]*v+theta[5],theta[0],theta[3],
+                            dst+v*output_width,output_height*output_width,output_width);
     }
-    cvReleaseMat(&p);
   }
-  if (layer->Y){cvCopy(Y,layer->Y);}else{layer->Y=cvCloneMat(Y);}
+  CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_STN_WS_Y,Y->rows,Y->cols,CV_32F));
+  cvCopy(Y,layer->Y);
   if (layer->visualize){ icvVisualizeCNNLayer((CvDNNLayer*)layer, Y); }
   __END__;
 }
 
+/* Gradients of the transform parameters go to <dE_dX>, gradient of the image
+   read through input_layers is left in layer->dE_dX; if the image is resized,
+   <dE_dX> is its gradient. */
 void icvCNNSpatialTransformBackward( CvDNNLayer* _layer, int t, 
                                        const CvMat * X, const CvMat* dE_dY, CvMat* dE_dX )
 {
@@ -155,41 +249,57 @@ void icvCNNSpatialTransformBackward( CvDNNLayer* _layer, int t,
   CvDNNSpatialTransformLayer * layer = (CvDNNSpatialTransformLayer*)_layer;
   const CvDNNInputLayer * input_layer = 
     (CvDNNInputLayer*)(layer->input_layers.size()>0?layer->input_layers[0]:0);
-  const CvMat * I = input_layer->Y;
-  // CV_ASSERT(I->rows==dE_dX->rows && I->cols==dE_dX->cols);
-  const int time_index = layer->time_index;
   const int input_seqlen = input_layer->seq_length;
   const int input_height = layer->input_height;
   const int input_width = layer->input_width;
-  const int n_outputs = dE_dY->cols;
   const int output_seqlen = layer->seq_length;
   const int output_height = layer->output_height;
   const int output_width = layer->output_width;
   const int batch_size = X->rows/input_seqlen;
   CV_ASSERT(dE_dY->cols==layer->n_output_planes*layer->output_height*layer->output_width);
   CV_ASSERT(batch_size*input_seqlen==X->rows && batch_size*output_seqlen==dE_dY->rows);
-  CV_ASSERT(CV_MAT_TYPE(I->type)==CV_32F);
-  CV_ASSERT(output_height==output_width && output_height>1 && output_width>1);
-  CvMat * p = cvCreateMat(2,3,CV_32F); cvZero(p);
-  CvMat * M = cvCreateMat(3,3,CV_32F); cvZero(M);
-  CvMat * invM = cvCreateMat(3,3,CV_32F); cvZero(invM);
-  if (X->cols==2){ CV_ASSERT(X->rows==1); // translation only
-    CV_ASSERT(CV_MAT_ELEM(*X,float,0,0)>=0.f && CV_MAT_ELEM(*X,float,0,0)<=1.f && 
-              CV_MAT_ELEM(*X,float,0,1)>=0.f && CV_MAT_ELEM(*X,float,0,1)<=1.f);
-    float tx=float(input_width -output_width )*CV_MAT_ELEM(*X,float,0,0);
-    float ty=float(input_height-output_height)*CV_MAT_ELEM(*X,float,0,1);
-    CV_MAT_ELEM(*M,float,0,0)=CV_MAT_ELEM(*M,float,1,1)=CV_MAT_ELEM(*M,float,2,2)=1.f;
-    CV_MAT_ELEM(*M,float,0,2)=tx; CV_MAT_ELEM(*M,float,1,2)=ty;
-    cvInvert(M,invM);
-    memcpy(p->data.fl,M->data.fl,sizeof(float)*6); // cvPrintf(stderr,"%f ",p);
-    // CvMat srchdr = cvMat(input_height,input_width,CV_32F,I->data.ptr);
-    // CvMat dsthdr = cvMat(output_height,output_width,CV_32F,Y->data.ptr);
-    // icvWarp(&srchdr,&dsthdr,p); // CV_SHOW(&srchdr); CV_SHOW(&dsthdr);
-  }else{CV_ERROR(CV_StsBadArg,"invalid layer definition.");}
-  cvReleaseMat(&M);
-  cvReleaseMat(&invM);
-  cvReleaseMat(&p);
+  CV_ASSERT(CV_ARE_SIZES_EQ(X,dE_dX) && CV_MAT_TYPE(dE_dX->type)==CV_32F);
+  const int n_params = icvIsSpatialTransformParams(X)?X->cols:0;
+  const CvMat * I = n_params?input_layer->Y:X;
+  const int nchannels = I->cols/(input_height*input_width);
+  CV_ASSERT(layer->G && layer->G->rows==dE_dY->rows && I->rows==dE_dY->rows);
+  CV_ASSERT(dE_dY->cols==output_height*output_width*nchannels);
+  CvMat * dI = dE_dX;
+  CvMat * dG = 0;
+  if (n_params){
+    CV_CALL(layer->dE_dX = cvGetWorkspaceMat(_layer,ICV_STN_WS_DEDI,I->rows,I->cols,CV_32F));
+    dI = layer->dE_dX;
+  }
+  CV_CALL(dG = cvGetWorkspaceMat(_layer,ICV_STN_WS_DG,dE_dY->rows,6,CV_32F));
+  cvZero(dI);
+
+  // samples are independent, image gradients are summed in rows of their own
+#pragma omp parallel for
+  for (int bi=0;bi<dE_dY->rows;bi++){
+    icvBilinearSampleBackward((const float*)(I->data.ptr+I->step*bi),
+                              (const float*)(dE_dY->data.ptr+dE_dY->step*bi),
+                              input_height,input_width,nchannels,output_height,output_width,
+                              layer->G->data.fl+bi*6,(float*)(dI->data.ptr+dI->step*bi),
+                              dG->data.fl+bi*6);
+  }
+  for (int bi=0;n_params && bi<dE_dY->rows;bi++){
+    icvAffineGridBackward(layer,dG->data.fl+bi*6,n_params,
+                          (float*)(dE_dX->data.ptr+dE_dX->step*bi));
+  }
   __END__;
 }
 
-void icvCNNSpatialTransformRelease( CvDNNLayer** p_layer ){}
+void icvCNNSpatialTransformRelease( CvDNNLayer** p_layer )
+{
+  CV_FUNCNAME("icvCNNSpatialTransformRelease");
+  __BEGIN__;
+  if ( !p_layer ) { CV_ERROR( CV_StsNullPtr, "Null double pointer" ); }
+  CvDNNSpatialTransformLayer * layer = *(CvDNNSpatialTransformLayer**)p_layer;
+  if ( !layer ) { return; }
+  if ( !icvIsSpatialTransformLayer((CvDNNLayer*)layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  if ( layer->fc1_layer ) { layer->fc1_layer->release( &layer->fc1_layer ); }
+  if ( layer->fc2_layer ) { layer->fc2_layer->release( &layer->fc2_layer ); }
+  cvReleaseWorkspaceMats( *p_layer );
+  cvFree( p_layer );
+  __END__;
+}
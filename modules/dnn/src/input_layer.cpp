@@ -25,6 +25,9 @@
  
 #include "_dnn.h"
 
+// slot of workspace buffer keeping a copy of output
+#define ICV_INPUT_WS_Y   0
+
 CvDNNLayer * cvCreateInputLayer( 
     const int dtype, const char * name, 
     int n_input_planes, int input_height, int input_width, int seq_length,
@@ -70,16 +73,8 @@ void icvCNNInputForward( CvDNNLayer * _layer, const CvMat * X, CvMat * Y )
   __BEGIN__;
   CvDNNInputLayer * layer = (CvDNNInputLayer*)_layer;
   CV_ASSERT(cvCountNAN((CvMat*)X)<1);
-  if (!layer->Y){
-    layer->Y = cvCloneMat(X);
-  }else{
-    if (X->cols==layer->Y->cols && X->rows==layer->Y->rows){
-      cvCopy(X,layer->Y);
-    }else{
-      cvReleaseMat(&layer->Y);
-      layer->Y = cvCloneMat(X);
-    }
-  }
+  CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_INPUT_WS_Y,X->rows,X->cols,CV_MAT_TYPE(X->type)));
+  cvCopy(X,layer->Y);
   cvCopy(X,Y);
   CV_ASSERT(cvCountNAN(Y)<1);
   if (layer->visualize){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
@@ -92,5 +87,8 @@ void icvCNNInputBackward( CvDNNLayer * layer, int t,
   cvZero(dE_dX);
 }
 
-void icvCNNInputRelease( CvDNNLayer** p_layer ){}
+void icvCNNInputRelease( CvDNNLayer** p_layer )
+{
+  if (p_layer && *p_layer){cvReleaseWorkspaceMats(*p_layer);}
+}
 
@@ -0,0 +1,304 @@
+/** -*- c++ -*-
+ *
+ * \file   loader.cpp
+ * \date   Sat Oct 17 23:40:12 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  training data sources and mini-batch loader with prefetching
+ */
+
+#include "_dnn.h"
+#include "cnn.h"
+
+#if !defined(WIN32) && !defined(WIN64)
+#define ICV_DNN_LOADER_THREAD 1
+#include <pthread.h>
+#endif
+
+// data source reading rows of matrices, e.g. mapped from tensor files
+typedef struct CvDNNMatDataSource
+{
+  CV_DNN_DATA_SOURCE_FIELDS();
+  const CvMat * samples;
+  const CvMat * responses;
+}CvDNNMatDataSource;
+
+// Ring of <n_slots> batches, filled in order by the producer and consumed in
+// the same order; <count> slots starting from <head> are ready.
+struct CvDNNBatchLoader
+{
+  CvDNNDataSource * source;
+  // indices of samples to be loaded, shuffled at the beginning of each epoch
+  // unless <shuffle> is zero
+  CvMat * sample_idx;
+  // indices of a batch wrapping around the end of an epoch
+  CvMat * batch_idx;
+  // position of the next batch within the epoch
+  int pos;
+  int batch_size;
+  int shuffle;
+  CvRNG rng;
+  int n_slots;
+  CvMat ** X;
+  CvMat ** Y;
+  int head;
+  int count;
+  int stop;
+  // set by the producer if a batch could not be read
+  int failed;
+#ifdef ICV_DNN_LOADER_THREAD
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+};
+
+/*************************************************************************\
+ *                          Matrix data source                           *
+\*************************************************************************/
+static void icvMatDataSourceRead(CvDNNDataSource * _source, const int * idx, int count,
+                                 CvMat * X, CvMat * Y)
+{
+  CV_FUNCNAME("icvMatDataSourceRead");
+  __BEGIN__;
+  CvDNNMatDataSource * source = (CvDNNMatDataSource*)_source;
+  CvMat src_hdr, dst_hdr;
+  CV_ASSERT(X->rows>=count && X->cols==source->n_inputs);
+  CV_ASSERT(Y->rows>=count && Y->cols==source->n_outputs);
+  for (int ii=0;ii<count;ii++){
+    CV_ASSERT(idx[ii]>=0 && idx[ii]<source->n_samples);
+    cvGetRow(source->samples,&src_hdr,idx[ii]);
+    cvGetRow(X,&dst_hdr,ii);
+    cvConvertScale(&src_hdr,&dst_hdr,source->scale,source->shift);
+    cvGetRow(source->responses,&src_hdr,idx[ii]);
+    cvGetRow(Y,&dst_hdr,ii);
+    cvConvert(&src_hdr,&dst_hdr);
+  }
+  __END__;
+}
+
+static void icvMatDataSourceRelease(CvDNNDataSource ** p_source)
+{
+  if (p_source && *p_source){cvFree(p_source);}
+}
+
+/* Creates a source reading rows of <samples> and <responses>, both kept by
+   the caller, which may be of any depth. */
+ML_IMPL CvDNNDataSource * cvCreateMatDataSource(const CvMat * samples, const CvMat * responses)
+{
+  CvDNNMatDataSource * source = 0;
+  CV_FUNCNAME("cvCreateMatDataSource");
+  __BEGIN__;
+  if (!CV_IS_MAT(samples) || !CV_IS_MAT(responses)){CV_ERROR(CV_StsBadArg,"Invalid matrix");}
+  if (samples->rows!=responses->rows){
+    CV_ERROR(CV_StsUnmatchedSizes,"Number of samples and responses must be the same");
+  }
+  if (CV_MAT_CN(samples->type)!=1 || CV_MAT_CN(responses->type)!=1){
+    CV_ERROR(CV_StsUnsupportedFormat,"Single channel matrices are expected");
+  }
+  CV_CALL(source = (CvDNNMatDataSource*)cvAlloc(sizeof(CvDNNMatDataSource)));
+  memset(source,0,sizeof(CvDNNMatDataSource));
+  source->n_samples = samples->rows;
+  source->n_inputs = samples->cols;
+  source->n_outputs = responses->cols;
+  source->scale = 1;
+  source->shift = 0;
+  source->read = icvMatDataSourceRead;
+  source->release = icvMatDataSourceRelease;
+  source->samples = samples;
+  source->responses = responses;
+  __END__;
+  return (CvDNNDataSource*)source;
+}
+
+/*************************************************************************\
+ *                          Mini-batch loader                            *
+\*************************************************************************/
+/* Reads the next batch into slot <si>, samples of the last batch of an epoch
+   wrap around to the first ones of the same epoch. */
+static void icvBatchLoaderFill(CvDNNBatchLoader * loader, int si)
+{
+  CV_FUNCNAME("icvBatchLoaderFill");
+  __BEGIN__;
+  const int n_samples = loader->sample_idx->cols;
+  const int batch_size = loader->batch_size;
+  int * idx = loader->sample_idx->data.i;
+  if (loader->pos==0 && loader->shuffle){cvRandShuffle(loader->sample_idx,&loader->rng,1.f);}
+  if (loader->pos+batch_size<=n_samples){
+    CV_CALL(loader->source->read(loader->source,idx+loader->pos,batch_size,
+                                 loader->X[si],loader->Y[si]));
+  }else{
+    int * batch_idx = loader->batch_idx->data.i;
+    for (int ii=0;ii<batch_size;ii++){batch_idx[ii]=idx[(loader->pos+ii)%n_samples];}
+    CV_CALL(loader->source->read(loader->source,batch_idx,batch_size,
+                                 loader->X[si],loader->Y[si]));
+  }
+  loader->pos += batch_size;
+  if (loader->pos>=n_samples){loader->pos=0;}
+  __END__;
+}
+
+#ifdef ICV_DNN_LOADER_THREAD
+static void * icvBatchLoaderThread(void * arg)
+{
+  CvDNNBatchLoader * loader = (CvDNNBatchLoader*)arg;
+  pthread_mutex_lock(&loader->mutex);
+  while (!loader->stop){
+    if (loader->count==loader->n_slots || loader->failed){
+      pthread_cond_wait(&loader->cond,&loader->mutex); continue;
+    }
+    // the slot is not visible to the consumer until it is counted
+    const int si = (loader->head+loader->count)%loader->n_slots;
+    int success = 1;
+    pthread_mutex_unlock(&loader->mutex);
+    // errors are reported to the consumer, instead of leaving the thread
+    try{ icvBatchLoaderFill(loader,si); }catch(...){ success = 0; }
+    pthread_mutex_lock(&loader->mutex);
+    if (success){loader->count++;}else{loader->failed=1;}
+    pthread_cond_broadcast(&loader->cond);
+  }
+  pthread_mutex_unlock(&loader->mutex);
+  return 0;
+}
+#endif
+
+/* Creates a loader of shuffled mini batches from the samples of <source>
+   listed in <sample_idx> (all samples if null). Up to <n_prefetch> batches
+   are read ahead by a background thread, shuffling is done on indices with
+   a copy of <rng>, samples are never moved. Samples are read in order of 
+   <sample_idx> if <rng> is null. */
+ML_IMPL CvDNNBatchLoader * cvCreateBatchLoader(
+    CvDNNDataSource * source, const CvMat * sample_idx, int batch_size, int n_prefetch,
+    CvRNG * rng)
+{
+  CvDNNBatchLoader * loader = 0;
+  CV_FUNCNAME("cvCreateBatchLoader");
+  __BEGIN__;
+  int ii;
+  if (!source || !source->read){CV_ERROR(CV_StsBadArg,"Invalid data source");}
+  if (batch_size<1 || n_prefetch<1){CV_ERROR(CV_StsOutOfRange,"Invalid batch size or prefetch depth");}
+  if (sample_idx && (!CV_IS_MAT(sample_idx) || CV_MAT_TYPE(sample_idx->type)!=CV_32S ||
+                     sample_idx->rows!=1 || sample_idx->cols<1)){
+    CV_ERROR(CV_StsBadArg,"Sample indices are expected as a row of integers");
+  }
+  CV_CALL(loader = (CvDNNBatchLoader*)cvAlloc(sizeof(CvDNNBatchLoader)));
+  memset(loader,0,sizeof(CvDNNBatchLoader));
+  loader->source = source;
+  loader->batch_size = batch_size;
+  loader->shuffle = rng!=0;
+  loader->rng = rng?*rng:cvRNG(-1);
+  loader->n_slots = n_prefetch;
+  if (sample_idx){
+    CV_CALL(loader->sample_idx = cvCloneMat(sample_idx));
+  }else{
+    CV_CALL(loader->sample_idx = cvCreateMat(1,source->n_samples,CV_32S));
+    for (ii=0;ii<source->n_samples;ii++){loader->sample_idx->data.i[ii]=ii;}
+  }
+  CV_CALL(loader->batch_idx = cvCreateMat(1,batch_size,CV_32S));
+  CV_CALL(loader->X = (CvMat**)cvAlloc(sizeof(CvMat*)*n_prefetch));
+  CV_CALL(loader->Y = (CvMat**)cvAlloc(sizeof(CvMat*)*n_prefetch));
+  memset(loader->X,0,sizeof(CvMat*)*n_prefetch);
+  memset(loader->Y,0,sizeof(CvMat*)*n_prefetch);
+  for (ii=0;ii<n_prefetch;ii++){
+    CV_CALL(loader->X[ii] = cvCreateMat(batch_size,source->n_inputs,CV_32F));
+    CV_CALL(loader->Y[ii] = cvCreateMat(batch_size,source->n_outputs,CV_32F));
+  }
+#ifdef ICV_DNN_LOADER_THREAD
+  pthread_mutex_init(&loader->mutex,0);
+  pthread_cond_init(&loader->cond,0);
+  if (pthread_create(&loader->thread,0,icvBatchLoaderThread,loader)){
+    pthread_cond_destroy(&loader->cond);
+    pthread_mutex_destroy(&loader->mutex);
+    loader->n_slots = 0;
+    CV_ERROR(CV_StsError,"Failed to start loader thread");
+  }
+#endif
+  __END__;
+  if (cvGetErrStatus()<0 && loader){
+    // the thread is not running, slots are released without stopping it
+    if (loader->X){for (int ii=0;ii<n_prefetch;ii++){cvReleaseMat(&loader->X[ii]);}}
+    if (loader->Y){for (int ii=0;ii<n_prefetch;ii++){cvReleaseMat(&loader->Y[ii]);}}
+    cvFree(&loader->X); cvFree(&loader->Y);
+    cvReleaseMat(&loader->sample_idx);
+    cvReleaseMat(&loader->batch_idx);
+    cvFree(&loader);
+  }
+  return loader;
+}
+
+/* Copies the next batch into <X> and <Y>, waiting for it to be loaded. */
+ML_IMPL void cvGetNextBatch(CvDNNBatchLoader * loader, CvMat * X, CvMat * Y)
+{
+  CV_FUNCNAME("cvGetNextBatch");
+  __BEGIN__;
+  int failed = 0;
+  if (!loader){CV_ERROR(CV_StsNullPtr,"Null loader");}
+#ifdef ICV_DNN_LOADER_THREAD
+  pthread_mutex_lock(&loader->mutex);
+  while (loader->count==0 && !loader->failed){pthread_cond_wait(&loader->cond,&loader->mutex);}
+  failed = loader->count==0;
+  pthread_mutex_unlock(&loader->mutex);
+#else
+  CV_CALL(icvBatchLoaderFill(loader,loader->head));
+  loader->count = 1;
+#endif
+  if (failed){CV_ERROR(CV_StsError,"Failed to read training batch");}
+  // the slot is kept by the consumer until it is released below
+  cvCopy(loader->X[loader->head],X);
+  cvCopy(loader->Y[loader->head],Y);
+#ifdef ICV_DNN_LOADER_THREAD
+  pthread_mutex_lock(&loader->mutex);
+#endif
+  loader->head = (loader->head+1)%loader->n_slots;
+  loader->count--;
+#ifdef ICV_DNN_LOADER_THREAD
+  pthread_cond_broadcast(&loader->cond);
+  pthread_mutex_unlock(&loader->mutex);
+#endif
+  __END__;
+}
+
+ML_IMPL void cvReleaseBatchLoader(CvDNNBatchLoader ** p_loader)
+{
+  CV_FUNCNAME("cvReleaseBatchLoader");
+  __BEGIN__;
+  CvDNNBatchLoader * loader = 0;
+  if (!p_loader){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  loader = *p_loader;
+  if (!loader){EXIT;}
+#ifdef ICV_DNN_LOADER_THREAD
+  pthread_mutex_lock(&loader->mutex);
+  loader->stop = 1;
+  pthread_cond_broadcast(&loader->cond);
+  pthread_mutex_unlock(&loader->mutex);
+  pthread_join(loader->thread,0);
+  pthread_cond_destroy(&loader->cond);
+  pthread_mutex_destroy(&loader->mutex);
+#endif
+  for (int ii=0;ii<loader->n_slots;ii++){
+    cvReleaseMat(&loader->X[ii]);
+    cvReleaseMat(&loader->Y[ii]);
+  }
+  cvFree(&loader->X);
+  cvFree(&loader->Y);
+  cvReleaseMat(&loader->sample_idx);
+  cvReleaseMat(&loader->batch_idx);
+  cvFree(p_loader);
+  __END__;
+}
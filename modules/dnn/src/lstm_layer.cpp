@@ -0,0 +1,322 @@
+/** -*- c++ -*-
+ *
+ * \file   lstm_layer.cpp
+ * \date   Sun Oct 18 19:02:41 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  long short-term memory (LSTM) layer, running the whole sequence
+ */
+
+#include "_dnn.h"
+
+// slots of buffers taken from workspace arena, states kept from forward to
+// backward pass
+#define ICV_LSTM_WS_GATES         0
+#define ICV_LSTM_WS_C             1
+#define ICV_LSTM_WS_H             2
+#define ICV_LSTM_WS_DEDW          3
+// scratch buffers within a single forward or backward call
+#define ICV_LSTM_WS_BIAS          4
+#define ICV_LSTM_WS_DH            5
+#define ICV_LSTM_WS_DGATES        6
+#define ICV_LSTM_WS_DC            7
+// initial states [H|C] of a stateful layer, and the last states carried
+// over to next batch
+#define ICV_LSTM_WS_H0            8
+#define ICV_LSTM_WS_CARRY         9
+
+ML_IMPL CvDNNLayer* cvCreateLSTMLayer(
+    const int dtype, const char * name,
+    int n_inputs, int n_outputs, int seq_length,
+    float init_learn_rate, int update_rule, CvMat * weights )
+{
+  CvDNNLSTMLayer* layer = 0;
+
+  CV_FUNCNAME("cvCreateLSTMLayer");
+  __BEGIN__;
+
+  if ( init_learn_rate <= 0) { CV_ERROR( CV_StsBadArg, "Incorrect parameters" ); }
+  if ( dtype != CV_32F ) { CV_ERROR( CV_StsBadArg, "LSTM layer supports CV_32F only" ); }
+
+  fprintf(stderr,"LSTMLayer(%s): input(%d), output(%d), seq_length(%d)\n", name,
+          n_inputs, n_outputs, seq_length);
+
+  CV_CALL(layer = (CvDNNLSTMLayer*)icvCreateLayer( ICV_DNN_LSTM_LAYER, dtype, name,
+      sizeof(CvDNNLSTMLayer), n_inputs, 1, 1, n_outputs, 1, 1,
+      init_learn_rate, update_rule,
+      icvCNNLSTMRelease, icvCNNLSTMForward, icvCNNLSTMBackward ));
+
+  layer->step = icvCNNGatedRecurrentStep;
+  layer->time_index = CV_DNN_RNN_SEQUENCE;
+  layer->seq_length = seq_length;
+
+  CV_CALL(layer->weights = cvCreateMat( n_outputs*4, n_inputs+n_outputs+1, CV_32F ));
+  if ( weights ){
+    if ( !CV_ARE_SIZES_EQ( weights, layer->weights ) ) {
+      CV_ERROR( CV_StsBadSize, "Invalid size of initial weights matrix" );
+    }
+    CV_CALL(cvCopy( weights, layer->weights ));
+  }else{
+    CvRNG rng = cvRNG( -1 );
+    cvRandArr( &rng, layer->weights, CV_RAND_UNI,
+               cvScalar(-1.f/sqrt(n_outputs)), cvScalar(1.f/sqrt(n_outputs)) );
+    // zero bias, except for forget gates which keep the cell state at first
+    for (int ii=0;ii<n_outputs*4;ii++){
+      CV_MAT_ELEM(*layer->weights,float,ii,n_inputs+n_outputs)=(ii/n_outputs==1)?1.f:0.f;
+    }
+  }
+
+  __END__;
+
+  if ( cvGetErrStatus() < 0 && layer ){
+    cvReleaseMat( &layer->weights );
+    cvFree( &layer );
+  }
+
+  return (CvDNNLayer*)layer;
+}
+
+/* Applies gradients summed in the store of a LSTM or GRU layer since last
+   step, averaged over the n_batches mini batches and clipped to [-5,5]
+   elementwise as for SimpleRNN layers. */
+void icvCNNGatedRecurrentStep( CvDNNLayer * layer, int t, int n_batches )
+{
+  CV_FUNCNAME("icvCNNGatedRecurrentStep");
+  __BEGIN__;
+  if (!layer->n_grads){EXIT;}
+  CV_ASSERT(cvCountNAN(layer->dE_dW)<1);
+  if (n_batches>1){ cvScale(layer->dE_dW,layer->dE_dW,1./n_batches); }
+  cvMaxS(layer->dE_dW,-5,layer->dE_dW); cvMinS(layer->dE_dW,5,layer->dE_dW);
+  CV_CALL(icvCNNDenseUpdate(layer,layer->dE_dW,t));
+  layer->n_grads = 0;
+  __END__;
+}
+
+void icvCNNLSTMRelease( CvDNNLayer** p_layer )
+{
+  CV_FUNCNAME("icvCNNLSTMRelease");
+  __BEGIN__;
+
+  CvDNNLSTMLayer* layer = 0;
+
+  if ( !p_layer ) { CV_ERROR( CV_StsNullPtr, "Null double pointer" ); }
+
+  layer = *(CvDNNLSTMLayer**)p_layer;
+
+  if ( !layer ) { return; }
+  if ( !icvIsLSTMLayer((CvDNNLayer*)layer) ) {
+    CV_ERROR( CV_StsBadArg, "Invalid layer" );
+  }
+
+  cvReleaseMat( &layer->weights );
+  cvReleaseWorkspaceMats( *p_layer );
+  cvFree( p_layer );
+
+  __END__;
+}
+
+/****************************************************************************************/
+/* Input projections of all gates at all time steps are computed by a single
+   GEMM, then each time step takes a single GEMM for the recurrent projections
+   of all gates, and a fused pass for the gate activations and state update.
+   Rows of <X>, <Y> and the states kept for backward pass hold the time steps
+   of a sample one after another. */
+void icvCNNLSTMForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y )
+{
+  CV_FUNCNAME("icvCNNLSTMForward");
+  if ( !icvIsLSTMLayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  __BEGIN__;
+
+  CvDNNLSTMLayer * layer = (CvDNNLSTMLayer*)_layer;
+  const int seq_length = layer->seq_length;
+  const int n_inputs = layer->n_input_planes;
+  const int n_hiddens = layer->n_output_planes;
+  const int n_gates = n_hiddens*4;
+  const int batch_size = X->rows;
+  CvMat Wx, Wh, biascol, Xr, Gr, G_curr, C_prev, C_curr, H_prev, H_curr;
+  CvMat * bias = 0, * H0 = 0;
+  int ti, bi;
+
+  CV_ASSERT(CV_MAT_TYPE(X->type)==CV_32F && CV_MAT_TYPE(Y->type)==CV_32F);
+  CV_ASSERT(X->cols==n_inputs*seq_length && CV_IS_MAT_CONT(X->type));
+  CV_ASSERT(Y->rows==batch_size && Y->cols==n_hiddens*seq_length);
+
+  CV_CALL(layer->gates = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_GATES,batch_size,n_gates*seq_length,CV_32F));
+  CV_CALL(layer->C = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_C,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(layer->H = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_H,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(bias = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_BIAS,1,n_gates,CV_32F));
+  CV_CALL(cvGetCols( layer->weights, &Wx, 0, n_inputs ));
+  CV_CALL(cvGetCols( layer->weights, &Wh, n_inputs, n_inputs+n_hiddens ));
+  CV_CALL(cvGetCol( layer->weights, &biascol, n_inputs+n_hiddens ));
+  cvTranspose(&biascol,bias);
+
+  // initial states of a stateful layer, carried over from last batch
+  if (layer->stateful){
+    CV_CALL(H0 = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_H0,batch_size,n_hiddens*2,CV_32F));
+    if (layer->n_carried==batch_size){
+      CV_CALL(cvCopy(cvGetWorkspaceMat(_layer,ICV_LSTM_WS_CARRY,batch_size,n_hiddens*2,CV_32F),H0));
+    }else{ cvZero(H0); }
+  }
+
+  // gates = Wx * X for all time steps
+  cvReshape(X,&Xr,0,batch_size*seq_length);
+  cvReshape(layer->gates,&Gr,0,batch_size*seq_length);
+  CV_CALL(cvGEMM( &Xr, &Wx, 1, 0, 0, &Gr, CV_GEMM_B_T ));
+
+  for (ti=0;ti<seq_length;ti++){
+    cvGetCols(layer->gates,&G_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(layer->C,&C_curr,n_hiddens*ti,n_hiddens*(ti+1));
+    cvGetCols(layer->H,&H_curr,n_hiddens*ti,n_hiddens*(ti+1));
+    // gates += Wh * H_prev
+    if (ti>0){
+      cvGetCols(layer->C,&C_prev,n_hiddens*(ti-1),n_hiddens*ti);
+      cvGetCols(layer->H,&H_prev,n_hiddens*(ti-1),n_hiddens*ti);
+    }else if (H0){
+      cvGetCols(H0,&H_prev,0,n_hiddens);
+      cvGetCols(H0,&C_prev,n_hiddens,n_hiddens*2);
+    }
+    if (ti>0 || H0){
+      CV_CALL(cvGEMM( &H_prev, &Wh, 1, &G_curr, 1, &G_curr, CV_GEMM_B_T ));
+    }
+    for (bi=0;bi<batch_size;bi++){
+      icvLSTMCell_32f((float*)(G_curr.data.ptr+G_curr.step*bi),bias->data.fl,
+                      (ti>0 || H0)?(float*)(C_prev.data.ptr+C_prev.step*bi):0,
+                      (float*)(C_curr.data.ptr+C_curr.step*bi),
+                      (float*)(H_curr.data.ptr+H_curr.step*bi),n_hiddens);
+    }
+  }
+  if (layer->stateful){
+    CvMat * carry = 0; CvMat carry_hdr;
+    CV_CALL(carry = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_CARRY,batch_size,n_hiddens*2,CV_32F));
+    CV_CALL(cvCopy(&H_curr,cvGetCols(carry,&carry_hdr,0,n_hiddens)));
+    CV_CALL(cvCopy(&C_curr,cvGetCols(carry,&carry_hdr,n_hiddens,n_hiddens*2)));
+    layer->n_carried = batch_size;
+  }
+  CV_CALL(cvCopy(layer->H,Y));
+
+  __END__;
+}
+
+/* Gradients of the gate pre-activations of a time step, from gradient <dh>
+   of the hidden state and <dc> of the cell state carried from next time
+   step, <dc> is replaced by the one carried to previous time step. */
+static void icvLSTMCellBackward( const float * gates, const float * c_prev, const float * c,
+                                 const float * dh, float * dc, float * dgates, int n )
+{
+  for (int ii=0;ii<n;ii++){
+    const float i = gates[ii], f = gates[n+ii], g = gates[2*n+ii], o = gates[3*n+ii];
+    const float tc = tanhf(c[ii]);
+    const float dct = dc[ii]+dh[ii]*o*(1.f-tc*tc);
+    dgates[ii]     = dct*g*i*(1.f-i);
+    dgates[n+ii]   = c_prev?dct*c_prev[ii]*f*(1.f-f):0.f;
+    dgates[2*n+ii] = dct*i*(1.f-g*g);
+    dgates[3*n+ii] = dh[ii]*tc*o*(1.f-o);
+    dc[ii] = dct*f;
+  }
+}
+
+/****************************************************************************************/
+/* Back propagation through the whole sequence, gradients of all time steps
+   and samples are summed into dE_dW, which is applied by icvCNNGatedRecurrentStep. */
+void icvCNNLSTMBackward( CvDNNLayer* _layer, int /*t*/,
+                         const CvMat * X, const CvMat * dE_dY, CvMat * dE_dX )
+{
+  CV_FUNCNAME( "icvCNNLSTMBackward" );
+  if ( !icvIsLSTMLayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  __BEGIN__;
+
+  CvDNNLSTMLayer * layer = (CvDNNLSTMLayer*)_layer;
+  const int seq_length = layer->seq_length;
+  const int n_inputs = layer->n_input_planes;
+  const int n_hiddens = layer->n_output_planes;
+  const int n_gates = n_hiddens*4;
+  const int batch_size = X->rows;
+  CvMat Wx, Wh, dWx, dWh, dbiascol, dbias_hdr, Xr, dXr, dGr;
+  CvMat G_curr, dG_curr, dG_next, C_prev, C_curr, H_prev, dH_curr;
+  CvMat * dE_dW = 0, * dH = 0, * dG = 0, * dC = 0, * dbias = 0, * H0 = 0;
+  int ti, bi;
+
+  CV_ASSERT(layer->gates && layer->C && layer->H && layer->H->rows==batch_size);
+  CV_ASSERT(dE_dY->rows==batch_size && dE_dY->cols==n_hiddens*seq_length);
+  CV_ASSERT(dE_dX->rows==batch_size && dE_dX->cols==n_inputs*seq_length && CV_IS_MAT_CONT(dE_dX->type));
+
+  // gradient store, summed over all sequences passed backward since last step
+  CV_CALL(dE_dW = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_DEDW,layer->weights->rows,layer->weights->cols,CV_32F));
+  if (!layer->n_grads){ cvZero(dE_dW); }
+  CV_CALL(dH = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_DH,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(dG = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_DGATES,batch_size,n_gates*seq_length,CV_32F));
+  CV_CALL(dC = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_DC,batch_size,n_hiddens,CV_32F));
+  CV_CALL(dbias = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_BIAS,1,n_gates,CV_32F));
+  if (layer->stateful){ CV_CALL(H0 = cvGetWorkspaceMat(_layer,ICV_LSTM_WS_H0,batch_size,n_hiddens*2,CV_32F)); }
+  CV_CALL(cvGetCols( layer->weights, &Wx, 0, n_inputs ));
+  CV_CALL(cvGetCols( layer->weights, &Wh, n_inputs, n_inputs+n_hiddens ));
+  CV_CALL(cvGetCols( dE_dW, &dWx, 0, n_inputs ));
+  CV_CALL(cvGetCols( dE_dW, &dWh, n_inputs, n_inputs+n_hiddens ));
+  CV_CALL(cvGetCol( dE_dW, &dbiascol, n_inputs+n_hiddens ));
+  cvCopy(dE_dY,dH);
+  cvZero(dC);
+
+  // back through time, dH_t += dgates_{t+1} * Wh within a window of truncated
+  // back propagation, where the cell state gradient is carried as well
+  for (ti=seq_length-1;ti>=0;ti--){
+    cvGetCols(layer->gates,&G_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(dG,&dG_curr,n_gates*ti,n_gates*(ti+1));
+    cvGetCols(layer->C,&C_curr,n_hiddens*ti,n_hiddens*(ti+1));
+    cvGetCols(dH,&dH_curr,n_hiddens*ti,n_hiddens*(ti+1));
+    if (ti<seq_length-1){
+      if (icvIsBPTTConnected(_layer,ti+1)){
+        cvGetCols(dG,&dG_next,n_gates*(ti+1),n_gates*(ti+2));
+        CV_CALL(cvGEMM( &dG_next, &Wh, 1, &dH_curr, 1, &dH_curr, 0 ));
+      }else{ cvZero(dC); }
+    }
+    if (ti>0){
+      cvGetCols(layer->C,&C_prev,n_hiddens*(ti-1),n_hiddens*ti);
+      cvGetCols(layer->H,&H_prev,n_hiddens*(ti-1),n_hiddens*ti);
+    }else if (H0){
+      cvGetCols(H0,&H_prev,0,n_hiddens);
+      cvGetCols(H0,&C_prev,n_hiddens,n_hiddens*2);
+    }
+    for (bi=0;bi<batch_size;bi++){
+      icvLSTMCellBackward((float*)(G_curr.data.ptr+G_curr.step*bi),
+                          (ti>0 || H0)?(float*)(C_prev.data.ptr+C_prev.step*bi):0,
+                          (float*)(C_curr.data.ptr+C_curr.step*bi),
+                          (float*)(dH_curr.data.ptr+dH_curr.step*bi),
+                          (float*)(dC->data.ptr+dC->step*bi),
+                          (float*)(dG_curr.data.ptr+dG_curr.step*bi),n_hiddens);
+    }
+    // dWh += dgates_t' * H_prev
+    if (ti>0 || H0){
+      CV_CALL(cvGEMM( &dG_curr, &H_prev, 1, &dWh, 1, &dWh, CV_GEMM_A_T ));
+    }
+  }
+
+  // dWx += dgates' * X, dbias += dgates and dE_dX = dgates * Wx for all time steps
+  cvReshape(X,&Xr,0,batch_size*seq_length);
+  cvReshape(dE_dX,&dXr,0,batch_size*seq_length);
+  cvReshape(dG,&dGr,0,batch_size*seq_length);
+  CV_CALL(cvGEMM( &dGr, &Xr, 1, &dWx, 1, &dWx, CV_GEMM_A_T ));
+  cvReduce(&dGr,dbias,0,CV_REDUCE_SUM);
+  cvAdd(&dbiascol,cvReshape(dbias,&dbias_hdr,0,n_gates),&dbiascol);
+  CV_CALL(cvGEMM( &dGr, &Wx, 1, 0, 0, &dXr, 0 ));
+
+  layer->dE_dW = dE_dW;
+  layer->n_grads++;
+
+  __END__;
+}
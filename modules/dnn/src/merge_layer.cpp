@@ -92,4 +92,7 @@ void icvCNNMergeBackward( CvDNNLayer* layer, int t,
   __END__;
 }
 
-void icvCNNMergeRelease( CvDNNLayer** p_layer ){}
+void icvCNNMergeRelease( CvDNNLayer** p_layer )
+{
+  if (p_layer && *p_layer){cvReleaseWorkspaceMats(*p_layer);}
+}
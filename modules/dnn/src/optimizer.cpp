@@ -0,0 +1,283 @@
+/** -*- c++ -*-
+ *
+ * \file   optimizer.cpp
+ * \date   Sun Oct 18 09:41:26 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  momentum, Nesterov and Adam(W) optimizers, each applied to the
+ *         weights by a single fused pass
+ */
+
+#include "_dnn.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ICV_DNN_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define ICV_DNN_X86_DISPATCH 0
+#endif
+
+// factors of an update, shared by all elements of the weights
+typedef struct CvDNNOptimizerStep
+{
+  float lr;
+  float mu;
+  float beta2;
+  float epsilon;
+  float l2;     // added to gradient as l2*w
+  float decay;  // decoupled weight decay, w -= decay*w
+  float mscale; // learning rate over bias correction of first moment
+  float vscale; // inverse bias correction of second moment
+}CvDNNOptimizerStep;
+
+ML_IMPL int cvGetOptimizerType(const char * optimizer)
+{
+  if (!optimizer){return -1;}
+  if (!strcmp(optimizer,"sgd")){return CV_DNN_OPTIMIZER_SGD;}
+  if (!strcmp(optimizer,"momentum")){return CV_DNN_OPTIMIZER_MOMENTUM;}
+  if (!strcmp(optimizer,"nesterov")){return CV_DNN_OPTIMIZER_NESTEROV;}
+  if (!strcmp(optimizer,"adam")){return CV_DNN_OPTIMIZER_ADAM;}
+  if (!strcmp(optimizer,"adamw")){return CV_DNN_OPTIMIZER_ADAMW;}
+  return -1;
+}
+
+/*------------------------ scalar version -----------------------------*/
+// also used for double weights and for the tail of rows in vectorized version
+
+/* Momentum:  m = mu*m+g, w -= lr*m
+   Nesterov:  m = mu*m+g, w -= lr*(g+mu*m)
+   Adam(W):   m = b1*m+(1-b1)*g, v = b2*v+(1-b2)*g^2, w -= lr*m'/(sqrt(v')+eps),
+              with m' and v' corrected for their zero initialization.
+   Gradient g has l2*w added, AdamW decays the weights by lr*decay instead. */
+template<typename T>
+static void icvOptimizerUpdateRow(int type, const CvDNNOptimizerStep & s,
+                                  T * w, const T * g, T * m, T * v, int n)
+{
+  int j;
+  const T lr = s.lr, mu = s.mu, l2 = s.l2;
+  switch (type){
+  case CV_DNN_OPTIMIZER_SGD:
+    for (j=0;j<n;j++){ w[j] -= lr*(g[j]+l2*w[j]); } break;
+  case CV_DNN_OPTIMIZER_MOMENTUM:
+    for (j=0;j<n;j++){ T gj = g[j]+l2*w[j]; m[j] = mu*m[j]+gj; w[j] -= lr*m[j]; } break;
+  case CV_DNN_OPTIMIZER_NESTEROV:
+    for (j=0;j<n;j++){ T gj = g[j]+l2*w[j]; m[j] = mu*m[j]+gj; w[j] -= lr*(gj+mu*m[j]); } break;
+  case CV_DNN_OPTIMIZER_ADAM:
+  case CV_DNN_OPTIMIZER_ADAMW:{
+    const T b1 = s.mu, b2 = s.beta2, eps = s.epsilon, keep = T(1)-T(s.decay);
+    const T mscale = s.mscale, vscale = s.vscale;
+    for (j=0;j<n;j++){
+      T gj = g[j]+l2*w[j];
+      m[j] = b1*m[j]+(T(1)-b1)*gj;
+      v[j] = b2*v[j]+(T(1)-b2)*gj*gj;
+      w[j] = keep*w[j]-mscale*m[j]/(sqrt(v[j]*vscale)+eps);
+    }
+  } break;
+  }
+}
+
+/*------------------------ AVX2 version -------------------------------*/
+#if ICV_DNN_X86_DISPATCH
+
+__attribute__((target("avx2,fma")))
+static void icvOptimizerUpdateRow_avx2(int type, const CvDNNOptimizerStep & s,
+                                       float * w, const float * g, float * m, float * v, int n)
+{
+  int j = 0;
+  const __m256 lr = _mm256_set1_ps(s.lr), mu = _mm256_set1_ps(s.mu), l2 = _mm256_set1_ps(s.l2);
+  switch (type){
+  case CV_DNN_OPTIMIZER_SGD:
+    for (;j<=n-8;j+=8){
+      __m256 wj = _mm256_loadu_ps(w+j);
+      __m256 gj = _mm256_fmadd_ps(l2,wj,_mm256_loadu_ps(g+j));
+      _mm256_storeu_ps(w+j,_mm256_fnmadd_ps(lr,gj,wj));
+    } break;
+  case CV_DNN_OPTIMIZER_MOMENTUM:
+  case CV_DNN_OPTIMIZER_NESTEROV:{
+    const int nesterov = type==CV_DNN_OPTIMIZER_NESTEROV;
+    for (;j<=n-8;j+=8){
+      __m256 wj = _mm256_loadu_ps(w+j);
+      __m256 gj = _mm256_fmadd_ps(l2,wj,_mm256_loadu_ps(g+j));
+      __m256 mj = _mm256_fmadd_ps(mu,_mm256_loadu_ps(m+j),gj);
+      _mm256_storeu_ps(m+j,mj);
+      __m256 dj = nesterov?_mm256_fmadd_ps(mu,mj,gj):mj;
+      _mm256_storeu_ps(w+j,_mm256_fnmadd_ps(lr,dj,wj));
+    }
+  } break;
+  case CV_DNN_OPTIMIZER_ADAM:
+  case CV_DNN_OPTIMIZER_ADAMW:{
+    const __m256 b1 = mu, b2 = _mm256_set1_ps(s.beta2), eps = _mm256_set1_ps(s.epsilon);
+    const __m256 c1 = _mm256_set1_ps(1.f-s.mu), c2 = _mm256_set1_ps(1.f-s.beta2);
+    const __m256 keep = _mm256_set1_ps(1.f-s.decay);
+    const __m256 mscale = _mm256_set1_ps(s.mscale), vscale = _mm256_set1_ps(s.vscale);
+    for (;j<=n-8;j+=8){
+      __m256 wj = _mm256_loadu_ps(w+j);
+      __m256 gj = _mm256_fmadd_ps(l2,wj,_mm256_loadu_ps(g+j));
+      __m256 mj = _mm256_fmadd_ps(b1,_mm256_loadu_ps(m+j),_mm256_mul_ps(c1,gj));
+      __m256 vj = _mm256_fmadd_ps(b2,_mm256_loadu_ps(v+j),_mm256_mul_ps(c2,_mm256_mul_ps(gj,gj)));
+      _mm256_storeu_ps(m+j,mj);
+      _mm256_storeu_ps(v+j,vj);
+      __m256 den = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(vj,vscale)),eps);
+      __m256 dj = _mm256_div_ps(_mm256_mul_ps(mscale,mj),den);
+      _mm256_storeu_ps(w+j,_mm256_sub_ps(_mm256_mul_ps(keep,wj),dj));
+    }
+  } break;
+  }
+  if (j<n){icvOptimizerUpdateRow<float>(type,s,w+j,g+j,m?m+j:0,v?v+j:0,n-j);}
+}
+
+#endif // ICV_DNN_X86_DISPATCH
+
+/*------------------------ optimizer states ---------------------------*/
+
+ML_IMPL CvDNNOptimizer * cvCreateDNNOptimizer(int type, float momentum, float beta2, float epsilon,
+                                              float weight_decay)
+{
+  CvDNNOptimizer * optimizer = 0;
+  CV_FUNCNAME("cvCreateDNNOptimizer");
+  __BEGIN__;
+  if (type<CV_DNN_OPTIMIZER_SGD || type>CV_DNN_OPTIMIZER_ADAMW){
+    CV_ERROR(CV_StsBadArg,"Unknown optimizer type");
+  }
+  if (momentum<0 || momentum>=1 || beta2<0 || beta2>=1 || epsilon<0 || weight_decay<0){
+    CV_ERROR(CV_StsOutOfRange,"Invalid optimizer parameters");
+  }
+  CV_CALL(optimizer = (CvDNNOptimizer*)cvAlloc(sizeof(CvDNNOptimizer)));
+  memset(optimizer,0,sizeof(CvDNNOptimizer));
+  optimizer->type = type;
+  optimizer->momentum = momentum;
+  optimizer->beta2 = beta2;
+  optimizer->epsilon = epsilon;
+  optimizer->weight_decay = weight_decay;
+  __END__;
+  return optimizer;
+}
+
+ML_IMPL void cvReleaseDNNOptimizer(CvDNNOptimizer ** p_optimizer)
+{
+  CV_FUNCNAME("cvReleaseDNNOptimizer");
+  __BEGIN__;
+  if (!p_optimizer){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  CvDNNOptimizer * optimizer = *p_optimizer;
+  if (!optimizer){return;}
+  CvDNNOptimizerState * state = optimizer->states, * next = 0;
+  for (;state;state=next){
+    next = state->next;
+    if (state->m){cvReleaseMat(&state->m);}
+    if (state->v){cvReleaseMat(&state->v);}
+    cvFree(&state);
+  }
+  cvFree(p_optimizer);
+  __END__;
+}
+
+static CvDNNOptimizerState * icvFindOptimizerState(CvDNNOptimizer * optimizer, const CvMat * weights)
+{
+  CvDNNOptimizerState * state = optimizer->states;
+  for (;state;state=state->next){if (state->owner==weights->data.ptr){break;}}
+  return state;
+}
+
+/* Returns the state kept for <weights>, created with zero moments at the first
+   update. States are only ever prepended, fully initialized, so that lookups
+   need no lock when layer copies update shared weights concurrently. */
+static CvDNNOptimizerState * icvGetOptimizerState(CvDNNOptimizer * optimizer, const CvMat * weights)
+{
+  CvDNNOptimizerState * state = icvFindOptimizerState(optimizer,weights);
+  if (state){return state;}
+#ifdef _OPENMP
+#pragma omp critical(icv_dnn_optimizer_state)
+#endif
+  {
+  state = icvFindOptimizerState(optimizer,weights);
+  if (!state){
+    const int type = CV_MAT_TYPE(weights->type), rows = weights->rows, cols = weights->cols;
+    const int adam = optimizer->type>=CV_DNN_OPTIMIZER_ADAM;
+    state = (CvDNNOptimizerState*)cvAlloc(sizeof(CvDNNOptimizerState));
+    memset(state,0,sizeof(CvDNNOptimizerState));
+    state->owner = weights->data.ptr;
+    if (optimizer->type!=CV_DNN_OPTIMIZER_SGD){state->m = cvCreateMat(rows,cols,type); cvZero(state->m);}
+    if (adam){state->v = cvCreateMat(rows,cols,type); cvZero(state->v);}
+    state->next = optimizer->states;
+    optimizer->states = state;
+  }
+  }
+  return state;
+}
+
+/* Applies gradient <dE_dW> to <weights> with the update rule of <optimizer>,
+   scaled by <learn_rate>, in a single pass over weights, gradient and state.
+   Without an optimizer, weights are updated by plain gradient descent. */
+ML_IMPL void cvOptimizerUpdate(CvDNNOptimizer * optimizer, CvMat * weights, const CvMat * dE_dW,
+                               float learn_rate)
+{
+  CV_FUNCNAME("cvOptimizerUpdate");
+  __BEGIN__;
+  CvDNNOptimizerState * state = 0;
+  CvDNNOptimizerStep step;
+  int t = 0;
+  const int type = CV_MAT_TYPE(weights->type);
+  CV_ASSERT(CV_ARE_SIZES_EQ(dE_dW,weights) && CV_ARE_TYPES_EQ(dE_dW,weights));
+  if (!optimizer){
+    cvScaleAdd( dE_dW, cvRealScalar(-learn_rate), weights, weights );
+    EXIT;
+  }
+  if (type!=CV_32F && type!=CV_64F){CV_ERROR(CV_StsBadArg,"Unsupported data type");}
+  state = icvGetOptimizerState(optimizer,weights);
+  // states are told apart by the data of the weights only, a state left by
+  // other weights at the same address must not be walked past its end
+  CV_ASSERT((!state->m || (CV_ARE_SIZES_EQ(state->m,weights) && CV_ARE_TYPES_EQ(state->m,weights))) &&
+            (!state->v || (CV_ARE_SIZES_EQ(state->v,weights) && CV_ARE_TYPES_EQ(state->v,weights))));
+  // workers may update the same weights concurrently (Hogwild), each takes 
+  // an iteration of its own for bias correction
+  t = CV_XADD(&state->t,1)+1;
+  memset(&step,0,sizeof(step));
+  step.lr = learn_rate;
+  step.mu = optimizer->momentum;
+  step.beta2 = optimizer->beta2;
+  step.epsilon = optimizer->epsilon;
+  if (optimizer->type==CV_DNN_OPTIMIZER_ADAMW){step.decay = learn_rate*optimizer->weight_decay;}
+  else{step.l2 = optimizer->weight_decay;}
+  if (optimizer->type>=CV_DNN_OPTIMIZER_ADAM){
+    step.mscale = learn_rate/(1.f-powf(optimizer->momentum,float(t)));
+    step.vscale = 1.f/(1.f-powf(optimizer->beta2,float(t)));
+  }
+  for (int ri=0;ri<weights->rows;ri++){
+    CvMat * m = state->m, * v = state->v;
+    if (type==CV_32F){
+      float * wptr = (float*)(weights->data.ptr+weights->step*ri);
+      const float * gptr = (const float*)(dE_dW->data.ptr+dE_dW->step*ri);
+      float * mptr = m?(float*)(m->data.ptr+m->step*ri):0;
+      float * vptr = v?(float*)(v->data.ptr+v->step*ri):0;
+#if ICV_DNN_X86_DISPATCH
+      if (cvGetFastMathLevel()>=CV_DNN_FASTMATH_AVX2){
+        icvOptimizerUpdateRow_avx2(optimizer->type,step,wptr,gptr,mptr,vptr,weights->cols);
+        continue;
+      }
+#endif
+      icvOptimizerUpdateRow<float>(optimizer->type,step,wptr,gptr,mptr,vptr,weights->cols);
+    }else{
+      icvOptimizerUpdateRow<double>(optimizer->type,step,
+        (double*)(weights->data.ptr+weights->step*ri),
+        (const double*)(dE_dW->data.ptr+dE_dW->step*ri),
+        m?(double*)(m->data.ptr+m->step*ri):0,v?(double*)(v->data.ptr+v->step*ri):0,weights->cols);
+    }
+  }
+  __END__;
+}
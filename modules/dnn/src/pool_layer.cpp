@@ -27,6 +27,12 @@
 
 void icvCNNMaxPoolingClear( CvDNNLayer* p_layer );
 
+// slots of scratch buffers taken from workspace arena
+#define ICV_POOL_WS_MASK        0
+#define ICV_POOL_WS_Y           1
+// the mask of max locations is filled again in each pass
+#define ICV_POOL_WS_SCRATCH     (1u<<ICV_POOL_WS_MASK)
+
 /*************************************************************************/
 ML_IMPL CvDNNLayer* cvCreateMaxPoolingLayer( 
     const int dtype, const char * name, const int visualize,
@@ -61,14 +67,7 @@ ML_IMPL CvDNNLayer* cvCreateMaxPoolingLayer(
     layer->seq_length = 1;
     layer->mask = 0;
     layer->clear= icvCNNMaxPoolingClear;
-
-    CV_CALL(layer->sumX =
-        cvCreateMat( n_output_planes*output_width*output_height, 1, CV_32FC1 ));
-    CV_CALL(layer->WX =
-        cvCreateMat( n_output_planes*output_width*output_height, 1, CV_32FC1 ));
-    
-    cvZero( layer->sumX );
-    cvZero( layer->WX );
+    layer->ws_scratch = ICV_POOL_WS_SCRATCH;
 
     CV_CALL(layer->weights = cvCreateMat( n_output_planes, 2, CV_32FC1 ));
     if ( weights )
@@ -89,7 +88,7 @@ ML_IMPL CvDNNLayer* cvCreateMaxPoolingLayer(
 
     if ( cvGetErrStatus() < 0 && layer )
     {
-        cvReleaseMat( &layer->WX );
+        cvReleaseMat( &layer->weights );
         cvFree( &layer );
     }
 
@@ -126,13 +125,10 @@ void icvCNNMaxPoolingForward( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
 
   CV_ASSERT(X->cols == nplanes*Xsize && X->rows == batch_size);
   CV_ASSERT(Y->rows == batch_size);
-  CV_ASSERT((layer->WX->cols == 1) && (layer->WX->rows == nplanes*Ysize));
 
-  CV_CALL(layer->mask = cvCreateMat(batch_size, Ysize*nplanes, CV_32S));
+  CV_CALL(layer->mask = cvGetWorkspaceMat(_layer,ICV_POOL_WS_MASK,batch_size,Ysize*nplanes,CV_32S));
   
-  // update inner variable used in back-propagation
-  cvZero( layer->sumX );
-  cvZero( layer->WX );
+  // argmax locations used in back-propagation
   cvZero( layer->mask );
   
   int * mptr = layer->mask->data.i;
@@ -167,9 +163,12 @@ void icvCNNMaxPoolingForward( CvDNNLayer* _layer, const CvMat* X, CvMat* Y )
   } // ni
   } // si
 
-  if (layer->Y){
-    if (layer->Y->rows==Y->rows){cvCopy(Y,layer->Y);}else{cvReleaseMat(&layer->Y);layer->Y=cvCloneMat(Y);}
-  }else{layer->Y=cvCloneMat(Y);}
+  // keep a copy of output for layers reading it via input_layers, unless
+  // the output itself has been bound to layer->Y in prediction or training
+  if (layer->Y!=Y){
+    CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_POOL_WS_Y,Y->rows,Y->cols,CV_32F));
+    cvCopy(Y,layer->Y);
+  }
   if (layer->visualize){icvVisualizeCNNLayer((CvDNNLayer*)layer,Y);}
 
   __END__;
@@ -215,7 +214,7 @@ void icvCNNMaxPoolingBackward(
   for ( int si = 0; si < batch_size; si++ ){
   float * dxptr = dE_dX->data.fl+dE_dX->cols*si;
   float * dyptr = dE_dY->data.fl+dE_dY->cols*si;
-  int * mptr = layer->mask->data.i;
+  int * mptr = layer->mask->data.i+layer->mask->cols*si;
   for ( int ni = 0; ni < n_outputs; ni++ ){
     for ( int yy = 0; yy < Yheight; yy++ ){
     for ( int xx = 0; xx < Ywidth; xx++ ){
@@ -231,7 +230,7 @@ void icvCNNMaxPoolingBackward(
   }
   }
   
-  if (layer->mask){cvReleaseMat(&layer->mask);layer->mask=0;}
+  layer->mask=0;
   __END__;
 
   if (dY_dX_elems){cvReleaseMat( &dY_dX_elems );dY_dX_elems=0;}
@@ -256,9 +255,8 @@ void icvCNNMaxPoolingRelease( CvDNNLayer** p_layer )
   if ( !icvIsMaxPoolingLayer((CvDNNLayer*)layer) )
       CV_ERROR( CV_StsBadArg, "Invalid layer" );
 
-  if (layer->mask){cvReleaseMat( &layer->mask); layer->mask=0;}
-  if (layer->WX){cvReleaseMat( &layer->WX ); layer->WX=0;}
   if (layer->weights){cvReleaseMat( &layer->weights); layer->weights=0;}
+  cvReleaseWorkspaceMats( *p_layer );
   cvFree( p_layer );
 
   __END__;
@@ -281,7 +279,8 @@ void icvCNNMaxPoolingClear( CvDNNLayer* p_layer )
   if ( !icvIsMaxPoolingLayer((CvDNNLayer*)layer) )
       CV_ERROR( CV_StsBadArg, "Invalid layer" );
 
-  if (layer->mask){cvReleaseMat( &layer->mask); layer->mask=0;}
+  // mask is held by workspace arena, just forget about it
+  layer->mask=0;
   // if (layer->WX){cvReleaseMat( &layer->WX ); layer->WX=0;}
   // if (layer->weights){cvReleaseMat( &layer->weights); layer->weights=0;}
   // cvFree( p_layer );
@@ -0,0 +1,720 @@
+/** -*- c++ -*-
+ *
+ * \file   pserver.cpp
+ * \date   Sat Oct 17 21:05:12 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  parameter server and its workers for distributed training over TCP
+ */
+
+#include "_dnn.h"
+#include "cnn.h"
+
+#include <algorithm>
+
+#if !defined(WIN32) && !defined(WIN64)
+#define ICV_DNN_PSERVER_SOCKETS 1
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/* Messages are a header followed by <payload_size> bytes. Header fields are
+   sent in network byte order, weights and gradients in the byte order of the
+   hosts, which are expected to be the same. */
+#define ICV_DNN_PS_MAGIC    0x444e4e50
+
+#define ICV_DNN_PS_HELLO    1 // worker -> server, sizes of weights and gradients
+#define ICV_DNN_PS_WELCOME  2 // server -> worker, worker id and initial weights
+#define ICV_DNN_PS_PUSH     3 // worker -> server, gradient of a mini batch
+#define ICV_DNN_PS_WEIGHTS  4 // server -> worker, weights once the gradient is applied
+#define ICV_DNN_PS_BYE      5 // worker -> server, training finished
+
+// attempts to connect while the server is being started, 100ms apart
+#define ICV_DNN_PS_CONNECT_RETRIES 100
+
+typedef struct CvDNNPSHeader
+{
+  int magic;
+  int type;
+  int worker_id;
+  int n_workers;
+  int clock;
+  int compression;
+  int n_weights;
+  int n_grads;
+  int payload_size;
+}CvDNNPSHeader;
+
+struct CvDNNParamServer
+{
+  CvNetwork * network;
+  CvDNNExecPlan * plan;
+  int listen_fd;
+  int port;
+  int n_workers;
+  int staleness;
+  int n_weights;
+  int n_grads;
+  float * weights;
+  // gradients summed over a round of synchronous updates
+  float * grad_sum;
+  float * grad;
+  std::vector<char> payload;
+  int * fds;
+  // number of gradients applied from each worker
+  int * clocks;
+  int * waiting;
+  int n_updates;
+  double bytes_received;
+  double bytes_uncompressed;
+};
+
+/*------------------------ half precision floats ------------------------*/
+/* Rounds to nearest even; infinities and NaNs are kept, values too large
+   for half precision become infinities, denormals are supported both ways. */
+static inline unsigned short icvFloatToHalfBits( float value )
+{
+  Cv32suf u; u.f = value;
+  const unsigned sign = (u.u>>16)&0x8000, fexp = (u.u>>23)&0xff;
+  unsigned mant = u.u&0x7fffff;
+  const int exp = int(fexp)-127+15;
+  if (fexp==0xff){return (unsigned short)(sign|0x7c00|(mant?0x200:0));}
+  if (exp>=31){return (unsigned short)(sign|0x7c00);}
+  if (exp<=0){
+    if (exp<-10){return (unsigned short)sign;}
+    mant |= 0x800000;
+    const int shift = 14-exp;
+    unsigned half = mant>>shift, rem = mant&((1u<<shift)-1), mid = 1u<<(shift-1);
+    if (rem>mid || (rem==mid && (half&1))){half++;}
+    return (unsigned short)(sign|half);
+  }
+  unsigned half = sign|(unsigned(exp)<<10)|(mant>>13), rem = mant&0x1fff;
+  // a carry out of the mantissa correctly increments the exponent
+  if (rem>0x1000 || (rem==0x1000 && (half&1))){half++;}
+  return (unsigned short)half;
+}
+
+static inline float icvHalfBitsToFloat( unsigned short half )
+{
+  Cv32suf u;
+  const unsigned sign = unsigned(half&0x8000)<<16;
+  int exp = (half>>10)&0x1f;
+  unsigned mant = half&0x3ff;
+  if (exp==0){
+    if (!mant){u.u = sign; return u.f;}
+    for (exp=1;!(mant&0x400);exp--){mant<<=1;}
+    mant &= 0x3ff;
+  }else if (exp==31){
+    u.u = sign|0x7f800000|(mant<<13); return u.f;
+  }
+  u.u = sign|(unsigned(exp-15+127)<<23)|(mant<<13);
+  return u.f;
+}
+
+void icvFloatToHalf( const float * src, unsigned short * dst, int n )
+{
+  for (int i=0;i<n;i++){dst[i] = icvFloatToHalfBits(src[i]);}
+}
+
+void icvHalfToFloat( const unsigned short * src, float * dst, int n )
+{
+  for (int i=0;i<n;i++){dst[i] = icvHalfBitsToFloat(src[i]);}
+}
+
+/* bfloat16 is the upper half of a float, rounded to nearest even; NaNs are
+   kept quiet so that rounding can not turn them into infinities. */
+void icvFloatToBFloat16( const float * src, unsigned short * dst, int n )
+{
+  for (int i=0;i<n;i++){
+    Cv32suf u; u.f = src[i];
+    if ((u.u&0x7fffffff)>0x7f800000){dst[i] = (unsigned short)((u.u>>16)|0x40); continue;}
+    dst[i] = (unsigned short)((u.u+0x7fff+((u.u>>16)&1))>>16);
+  }
+}
+
+void icvBFloat16ToFloat( const unsigned short * src, float * dst, int n )
+{
+  for (int i=0;i<n;i++){Cv32suf u; u.u = unsigned(src[i])<<16; dst[i] = u.f;}
+}
+
+/*--------------------- weights and gradients layout --------------------*/
+/* Weights updated from the gradient store of <layer>, or 0 if it has none;
+   layers sharing weights through ref_layer sum gradients in the store of 
+   the referred layer. Only layers accepted by icvIsDataParallelPlan are 
+   trained with a parameter server. */
+static CvMat * icvGetUpdatedWeights( CvDNNLayer * layer )
+{
+  if (icvIsConvolutionLayer(layer)){return layer->ref_layer?0:layer->weights;}
+  if (icvIsDenseLayer(layer)){return layer->weights;}
+  return 0;
+}
+
+/* Weights are exchanged as all weights owned by layers of <plan> in order
+   of the ops, gradients as dE_dW of all ops with a gradient store. Returns 
+   the number of values of each. */
+static void icvGetParamSizes( const CvDNNExecPlan * plan, int * n_weights, int * n_grads )
+{
+  *n_weights = *n_grads = 0;
+  for (int k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    CvMat * weights = icvGetUpdatedWeights(layer);
+    if (layer->weights){*n_weights += layer->weights->rows*layer->weights->cols;}
+    if (weights){*n_grads += weights->rows*weights->cols;}
+  }
+}
+
+static void icvCopyWeights( const CvDNNExecPlan * plan, float * buf, int to_layers )
+{
+  for (int k=0;k<plan->n_ops;k++){
+    CvMat * weights = plan->ops[k].layer->weights;
+    if (!weights){continue;}
+    const int n = weights->rows*weights->cols;
+    CV_Assert(CV_MAT_TYPE(weights->type)==CV_32F && CV_IS_MAT_CONT(weights->type));
+    if (to_layers){memcpy(weights->data.fl,buf,sizeof(float)*n);}
+    else{memcpy(buf,weights->data.fl,sizeof(float)*n);}
+    buf += n;
+  }
+}
+
+/* Applies gradients laid out as above to the weights of <plan> at iteration <t>. */
+static void icvApplyGradients( const CvDNNExecPlan * plan, float * grad, int t )
+{
+  CV_FUNCNAME("icvApplyGradients");
+  __BEGIN__;
+  for (int k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    CvMat * weights = icvGetUpdatedWeights(layer);
+    if (!weights){continue;}
+    CvMat dE_dW = cvMat(weights->rows,weights->cols,CV_32F,grad);
+    if (icvIsConvolutionLayer(layer)){CV_CALL(icvCNNConvolutionUpdate(layer,&dE_dW,t));}
+    else{CV_CALL(icvCNNDenseUpdate(layer,&dE_dW,t));}
+    grad += weights->rows*weights->cols;
+  }
+  __END__;
+}
+
+/*------------------------------- messages ------------------------------*/
+#ifdef ICV_DNN_PSERVER_SOCKETS
+static int icvSendAll( int fd, const void * buf, size_t size )
+{
+  const char * ptr = (const char*)buf;
+  while (size>0){
+    ssize_t n = send(fd,ptr,size,MSG_NOSIGNAL);
+    if (n<0 && errno==EINTR){continue;}
+    if (n<=0){return -1;}
+    ptr += n; size -= n;
+  }
+  return 0;
+}
+
+static int icvRecvAll( int fd, void * buf, size_t size )
+{
+  char * ptr = (char*)buf;
+  while (size>0){
+    ssize_t n = recv(fd,ptr,size,0);
+    if (n<0 && errno==EINTR){continue;}
+    if (n<=0){return -1;}
+    ptr += n; size -= n;
+  }
+  return 0;
+}
+
+static int icvSendMessage( int fd, const CvDNNPSHeader * header, const void * payload )
+{
+  int fields[sizeof(CvDNNPSHeader)/sizeof(int)];
+  memcpy(fields,header,sizeof(fields));
+  for (size_t i=0;i<sizeof(fields)/sizeof(int);i++){fields[i] = htonl(fields[i]);}
+  if (icvSendAll(fd,fields,sizeof(fields))<0){return -1;}
+  return header->payload_size>0?icvSendAll(fd,payload,header->payload_size):0;
+}
+
+/* Receives a message, its payload into <payload> which is resized as needed;
+   returns -1 on closed connection or malformed header, including a payload 
+   larger than <max_payload_size>, which is then not read. */
+static int icvRecvMessage( int fd, CvDNNPSHeader * header, std::vector<char> & payload,
+                           size_t max_payload_size )
+{
+  int fields[sizeof(CvDNNPSHeader)/sizeof(int)];
+  if (icvRecvAll(fd,fields,sizeof(fields))<0){return -1;}
+  for (size_t i=0;i<sizeof(fields)/sizeof(int);i++){fields[i] = ntohl(fields[i]);}
+  memcpy(header,fields,sizeof(fields));
+  if (header->magic!=ICV_DNN_PS_MAGIC || header->payload_size<0 ||
+      size_t(header->payload_size)>max_payload_size){return -1;}
+  payload.resize(MAX(header->payload_size,1));
+  return header->payload_size>0?icvRecvAll(fd,&payload[0],header->payload_size):0;
+}
+
+/* Largest push message of <n_grads> gradients, top-k compressed with all 
+   values kept (count, indices and values) or uncompressed. */
+static size_t icvGetMaxPushSize( int n_grads )
+{
+  return sizeof(int)+(sizeof(int)+sizeof(float))*size_t(n_grads);
+}
+
+static void icvInitHeader( CvDNNPSHeader * header, int type )
+{
+  memset(header,0,sizeof(CvDNNPSHeader));
+  header->magic = ICV_DNN_PS_MAGIC;
+  header->type = type;
+}
+#endif // ICV_DNN_PSERVER_SOCKETS
+
+/* Gradient <grad> from the payload of a push message; returns -1 if the
+   payload does not match its compression. */
+static int icvDecodeGradients( const CvDNNPSHeader * header, const std::vector<char> & payload,
+                               float * grad, int n_grads )
+{
+  const int size = header->payload_size;
+  if (header->compression==CV_DNN_COMPRESS_NONE){
+    if (size!=int(sizeof(float))*n_grads){return -1;}
+    memcpy(grad,&payload[0],size);
+  }else if (header->compression==CV_DNN_COMPRESS_FP16){
+    if (size!=int(sizeof(unsigned short))*n_grads){return -1;}
+    icvHalfToFloat((const unsigned short*)&payload[0],grad,n_grads);
+  }else if (header->compression==CV_DNN_COMPRESS_TOPK){
+    // number of values, their indices, then the values
+    int k = 0;
+    if (size<int(sizeof(int))){return -1;}
+    memcpy(&k,&payload[0],sizeof(int));
+    if (k<0 || k>n_grads || size!=int(sizeof(int)+(sizeof(int)+sizeof(float))*k)){return -1;}
+    const int * idx = (const int*)(&payload[0]+sizeof(int));
+    const float * val = (const float*)(idx+k);
+    memset(grad,0,sizeof(float)*n_grads);
+    for (int i=0;i<k;i++){
+      if (idx[i]<0 || idx[i]>=n_grads){return -1;}
+      grad[idx[i]] = val[i];
+    }
+  }else{
+    return -1;
+  }
+  return 0;
+}
+
+/************************************************************************ \
+ *                         Parameter server                             *
+\************************************************************************/
+ML_IMPL void cvReleaseParamServer( CvDNNParamServer ** p_server )
+{
+  CV_FUNCNAME("cvReleaseParamServer");
+  __BEGIN__;
+  CvDNNParamServer * server = 0;
+  if (!p_server){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  server = *p_server;
+  if (!server){EXIT;}
+#ifdef ICV_DNN_PSERVER_SOCKETS
+  if (server->listen_fd>=0){close(server->listen_fd);}
+  for (int w=0;server->fds && w<server->n_workers;w++){
+    if (server->fds[w]>=0){close(server->fds[w]);}
+  }
+#endif
+  if (server->weights){cvFree(&server->weights);}
+  if (server->grad_sum){cvFree(&server->grad_sum);}
+  if (server->grad){cvFree(&server->grad);}
+  if (server->fds){cvFree(&server->fds);}
+  if (server->clocks){cvFree(&server->clocks);}
+  if (server->waiting){cvFree(&server->waiting);}
+  delete server;
+  *p_server = 0;
+  __END__;
+}
+
+/* Creates a server holding the weights of <network>, listening on <port>
+   (any free port if 0) for <n_workers> workers. With <staleness> 0 updates
+   are synchronous: gradients of all workers are averaged and applied once,
+   before any worker gets the new weights. Otherwise each gradient is applied
+   as it arrives, and a worker waits for the new weights only while it is
+   more than <staleness> updates ahead of the slowest worker. */
+ML_IMPL CvDNNParamServer * cvCreateParamServer( CvNetwork * network, int port, int n_workers,
+                                                int staleness )
+{
+  CvDNNParamServer * server = 0;
+  CV_FUNCNAME("cvCreateParamServer");
+  __BEGIN__;
+#ifdef ICV_DNN_PSERVER_SOCKETS
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  int reuse = 1;
+  if (!network || !network->first_layer){CV_ERROR(CV_StsBadArg,"Invalid network");}
+  if (n_workers<1 || staleness<0 || port<0 || port>65535){
+    CV_ERROR(CV_StsOutOfRange,"Invalid number of workers, staleness or port");
+  }
+  server = new CvDNNParamServer;
+  server->network = network;
+  server->listen_fd = -1;
+  server->port = port;
+  server->n_workers = n_workers;
+  server->staleness = staleness;
+  server->weights = server->grad_sum = server->grad = 0;
+  server->fds = server->clocks = server->waiting = 0;
+  server->n_updates = 0;
+  server->bytes_received = server->bytes_uncompressed = 0;
+  CV_CALL(server->plan = cvCompileNetwork(network));
+  icvGetParamSizes(server->plan,&server->n_weights,&server->n_grads);
+  CV_CALL(server->weights = (float*)cvAlloc(sizeof(float)*MAX(server->n_weights,1)));
+  CV_CALL(server->grad_sum = (float*)cvAlloc(sizeof(float)*MAX(server->n_grads,1)));
+  CV_CALL(server->grad = (float*)cvAlloc(sizeof(float)*MAX(server->n_grads,1)));
+  CV_CALL(server->fds = (int*)cvAlloc(sizeof(int)*n_workers));
+  CV_CALL(server->clocks = (int*)cvAlloc(sizeof(int)*n_workers));
+  CV_CALL(server->waiting = (int*)cvAlloc(sizeof(int)*n_workers));
+  memset(server->grad_sum,0,sizeof(float)*MAX(server->n_grads,1));
+  for (int w=0;w<n_workers;w++){server->fds[w]=-1;server->clocks[w]=server->waiting[w]=0;}
+
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons((unsigned short)port);
+  server->listen_fd = socket(AF_INET,SOCK_STREAM,0);
+  if (server->listen_fd<0){CV_ERROR(CV_StsError,"Failed to create socket");}
+  setsockopt(server->listen_fd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
+  if (bind(server->listen_fd,(struct sockaddr*)&addr,sizeof(addr))<0 ||
+      listen(server->listen_fd,n_workers)<0 ||
+      getsockname(server->listen_fd,(struct sockaddr*)&addr,&addrlen)<0){
+    CV_ERROR(CV_StsError,"Failed to listen on the given port");
+  }
+  server->port = ntohs(addr.sin_port);
+#else
+  CV_ERROR(CV_StsNotImplemented,"Parameter server requires BSD sockets");
+#endif
+  __END__;
+  if (cvGetErrStatus()<0 && server){cvReleaseParamServer(&server);}
+  return server;
+}
+
+ML_IMPL int cvGetParamServerPort( const CvDNNParamServer * server )
+{
+  return server?server->port:-1;
+}
+
+#ifdef ICV_DNN_PSERVER_SOCKETS
+static void icvParamServerDropWorker( CvDNNParamServer * server, int w, const char * reason )
+{
+  if (reason){fprintf(stderr,"pserver: worker %d dropped, %s\n",w,reason);}
+  close(server->fds[w]);
+  server->fds[w] = -1;
+  server->waiting[w] = 0;
+}
+
+static int icvParamServerSendWeights( CvDNNParamServer * server, int w )
+{
+  CvDNNPSHeader header;
+  icvInitHeader(&header,ICV_DNN_PS_WEIGHTS);
+  header.worker_id = w;
+  header.n_workers = server->n_workers;
+  header.clock = server->n_updates;
+  header.n_weights = server->n_weights;
+  header.n_grads = server->n_grads;
+  header.payload_size = sizeof(float)*server->n_weights;
+  return icvSendMessage(server->fds[w],&header,server->weights);
+}
+
+/* Replies workers waiting for weights which may go on: all of them once every
+   worker has pushed in synchronous mode, otherwise those within <staleness>
+   updates of the slowest worker. */
+static void icvParamServerRelease( CvDNNParamServer * server )
+{
+  CV_FUNCNAME("icvParamServerRelease");
+  __BEGIN__;
+  int n_active = 0, n_waiting = 0, min_clock = INT_MAX, w;
+  for (w=0;w<server->n_workers;w++){
+    if (server->fds[w]<0){continue;}
+    n_active++; n_waiting += server->waiting[w];
+    min_clock = MIN(min_clock,server->clocks[w]);
+  }
+  if (!n_waiting){EXIT;}
+  if (!server->staleness){
+    if (n_waiting<n_active){EXIT;}
+    // mean of the gradients, as if the batches were a single one
+    for (int i=0;i<server->n_grads;i++){server->grad_sum[i] /= float(n_waiting);}
+    CV_CALL(icvApplyGradients(server->plan,server->grad_sum,++server->n_updates));
+    memset(server->grad_sum,0,sizeof(float)*server->n_grads);
+  }
+  icvCopyWeights(server->plan,server->weights,0);
+  for (w=0;w<server->n_workers;w++){
+    if (server->fds[w]<0 || !server->waiting[w]){continue;}
+    if (server->staleness && server->clocks[w]-min_clock>server->staleness){continue;}
+    server->waiting[w] = 0;
+    if (icvParamServerSendWeights(server,w)<0){icvParamServerDropWorker(server,w,"connection lost");}
+  }
+  __END__;
+}
+#endif // ICV_DNN_PSERVER_SOCKETS
+
+/* Waits for all workers to join, sends them the weights of the network, then
+   applies their gradients until all of them have finished. */
+ML_IMPL void cvRunParamServer( CvDNNParamServer * server )
+{
+  CV_FUNCNAME("cvRunParamServer");
+  __BEGIN__;
+#ifdef ICV_DNN_PSERVER_SOCKETS
+  CvDNNPSHeader header;
+  int n_joined = 0, w;
+  if (!server){CV_ERROR(CV_StsNullPtr,"Null parameter server");}
+  fprintf(stderr,"pserver: waiting for %d workers on port %d, %s updates\n",
+          server->n_workers,server->port,server->staleness?"bounded staleness":"synchronous");
+
+  // all workers start from the same weights
+  while (n_joined<server->n_workers){
+    int fd = accept(server->listen_fd,0,0), nodelay = 1;
+    if (fd<0){
+      if (errno==EINTR){continue;}
+      CV_ERROR(CV_StsError,"Failed to accept worker connection");
+    }
+    setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&nodelay,sizeof(nodelay));
+    if (icvRecvMessage(fd,&header,server->payload,0)<0 || header.type!=ICV_DNN_PS_HELLO ||
+        header.n_weights!=server->n_weights || header.n_grads!=server->n_grads){
+      fprintf(stderr,"pserver: connection rejected, not a worker of the same network\n");
+      close(fd); continue;
+    }
+    server->fds[n_joined++] = fd;
+  }
+  icvCopyWeights(server->plan,server->weights,0);
+  for (w=0;w<server->n_workers;w++){
+    icvInitHeader(&header,ICV_DNN_PS_WELCOME);
+    header.worker_id = w;
+    header.n_workers = server->n_workers;
+    header.n_weights = server->n_weights;
+    header.n_grads = server->n_grads;
+    header.payload_size = sizeof(float)*server->n_weights;
+    if (icvSendMessage(server->fds[w],&header,server->weights)<0){
+      icvParamServerDropWorker(server,w,"connection lost");
+    }
+  }
+
+  for (;;){
+    fd_set fds;
+    int max_fd = -1;
+    FD_ZERO(&fds);
+    for (w=0;w<server->n_workers;w++){
+      // a waiting worker sends nothing until it has got the weights
+      if (server->fds[w]<0 || server->waiting[w]){continue;}
+      FD_SET(server->fds[w],&fds); max_fd = MAX(max_fd,server->fds[w]);
+    }
+    if (max_fd<0){break;}
+    if (select(max_fd+1,&fds,0,0,0)<0){
+      if (errno==EINTR){continue;}
+      CV_ERROR(CV_StsError,"Failed to wait for workers");
+    }
+    for (w=0;w<server->n_workers;w++){
+      if (server->fds[w]<0 || server->waiting[w] || !FD_ISSET(server->fds[w],&fds)){continue;}
+      if (icvRecvMessage(server->fds[w],&header,server->payload,
+                         icvGetMaxPushSize(server->n_grads))<0){
+        icvParamServerDropWorker(server,w,"connection lost or malformed message"); continue;
+      }
+      if (header.type==ICV_DNN_PS_BYE){icvParamServerDropWorker(server,w,0); continue;}
+      if (header.type!=ICV_DNN_PS_PUSH ||
+          icvDecodeGradients(&header,server->payload,server->grad,server->n_grads)<0){
+        icvParamServerDropWorker(server,w,"malformed gradients"); continue;
+      }
+      server->bytes_received += header.payload_size;
+      server->bytes_uncompressed += sizeof(float)*server->n_grads;
+      if (server->staleness){
+        CV_CALL(icvApplyGradients(server->plan,server->grad,++server->n_updates));
+      }else{
+        for (int i=0;i<server->n_grads;i++){server->grad_sum[i] += server->grad[i];}
+      }
+      server->clocks[w]++;
+      server->waiting[w] = 1;
+    }
+    CV_CALL(icvParamServerRelease(server));
+  }
+  fprintf(stderr,"pserver: %d updates, %.2fMB of gradients received (%.1f%% of uncompressed)\n",
+          server->n_updates,server->bytes_received/(1<<20),
+          100.*server->bytes_received/MAX(server->bytes_uncompressed,1.));
+#else
+  CV_ERROR(CV_StsNotImplemented,"Parameter server requires BSD sockets");
+#endif
+  __END__;
+}
+
+// orders indices of values by decreasing magnitude
+struct CvDNNGreaterMagnitude
+{
+  const float * values;
+  CvDNNGreaterMagnitude(const float * _values):values(_values){}
+  bool operator()(int a, int b) const {return fabsf(values[a])>fabsf(values[b]);}
+};
+
+/************************************************************************ \
+ *                      Workers of parameter server                     *
+\************************************************************************/
+void icvCloseParamClient( CvDNNParamClient ** p_client )
+{
+  CvDNNParamClient * client = *p_client;
+  if (!client){return;}
+#ifdef ICV_DNN_PSERVER_SOCKETS
+  if (client->fd>=0){
+    CvDNNPSHeader header;
+    icvInitHeader(&header,ICV_DNN_PS_BYE);
+    header.worker_id = client->worker_id;
+    icvSendMessage(client->fd,&header,0);
+    close(client->fd);
+  }
+#endif
+  if (client->grad){cvFree(&client->grad);}
+  if (client->residual){cvFree(&client->residual);}
+  delete client;
+  *p_client = 0;
+}
+
+/* Joins the server at <host>:<port> as a worker training <plan>, whose weights
+   are replaced with those of the server. Gradients are sent with the given
+   compression; for top-k, the <topk_ratio> of largest values are sent and the
+   rest is accumulated into later gradients. */
+CvDNNParamClient * icvConnectParamServer( const char * host, int port, const CvDNNExecPlan * plan,
+                                          int compression, float topk_ratio )
+{
+  CvDNNParamClient * client = 0;
+  CV_FUNCNAME("icvConnectParamServer");
+  __BEGIN__;
+#ifdef ICV_DNN_PSERVER_SOCKETS
+  CvDNNPSHeader header;
+  struct addrinfo hints, * res = 0;
+  char port_str[16];
+  int nodelay = 1, retry;
+  if (compression<CV_DNN_COMPRESS_NONE || compression>CV_DNN_COMPRESS_TOPK ||
+      (compression==CV_DNN_COMPRESS_TOPK && (topk_ratio<=0 || topk_ratio>1))){
+    CV_ERROR(CV_StsOutOfRange,"Invalid gradient compression");
+  }
+  client = new CvDNNParamClient();
+  client->fd = -1;
+  client->compression = compression;
+  client->topk_ratio = topk_ratio;
+  icvGetParamSizes(plan,&client->n_weights,&client->n_grads);
+  CV_CALL(client->grad = (float*)cvAlloc(sizeof(float)*MAX(client->n_grads,1)));
+  if (compression==CV_DNN_COMPRESS_TOPK){
+    CV_CALL(client->residual = (float*)cvAlloc(sizeof(float)*MAX(client->n_grads,1)));
+    memset(client->residual,0,sizeof(float)*MAX(client->n_grads,1));
+  }
+
+  memset(&hints,0,sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  sprintf(port_str,"%d",port);
+  if (getaddrinfo(host,port_str,&hints,&res) || !res){
+    CV_ERROR(CV_StsBadArg,"Failed to resolve parameter server address");
+  }
+  // the server may still be starting up
+  for (retry=0;retry<ICV_DNN_PS_CONNECT_RETRIES;retry++){
+    client->fd = socket(res->ai_family,res->ai_socktype,res->ai_protocol);
+    if (client->fd>=0 && connect(client->fd,res->ai_addr,res->ai_addrlen)==0){break;}
+    if (client->fd>=0){close(client->fd);client->fd=-1;}
+    usleep(100000);
+  }
+  freeaddrinfo(res);
+  if (client->fd<0){CV_ERROR(CV_StsError,"Failed to connect to parameter server");}
+  setsockopt(client->fd,IPPROTO_TCP,TCP_NODELAY,&nodelay,sizeof(nodelay));
+
+  icvInitHeader(&header,ICV_DNN_PS_HELLO);
+  header.compression = compression;
+  header.n_weights = client->n_weights;
+  header.n_grads = client->n_grads;
+  if (icvSendMessage(client->fd,&header,0)<0 ||
+      icvRecvMessage(client->fd,&header,client->payload,
+                     sizeof(float)*size_t(client->n_weights))<0 || header.type!=ICV_DNN_PS_WELCOME ||
+      header.payload_size!=int(sizeof(float))*client->n_weights){
+    CV_ERROR(CV_StsError,"Parameter server refused the worker");
+  }
+  client->worker_id = header.worker_id;
+  client->n_workers = header.n_workers;
+  icvCopyWeights(plan,(float*)&client->payload[0],1);
+#else
+  CV_ERROR(CV_StsNotImplemented,"Parameter server requires BSD sockets");
+#endif
+  __END__;
+  if (cvGetErrStatus()<0 && client){icvCloseParamClient(&client);}
+  return client;
+}
+
+/* Sends the gradients summed in layers of <plan> over the last <n_batches> mini
+   batches, averaged, and waits for the weights the server replies with, which 
+   takes the place of a step of the layers. */
+void icvExchangeGradients( CvDNNParamClient * client, const CvDNNExecPlan * plan,
+                           int n_batches )
+{
+  CV_FUNCNAME("icvExchangeGradients");
+  __BEGIN__;
+#ifdef ICV_DNN_PSERVER_SOCKETS
+  CvDNNPSHeader header;
+  const int n_grads = client->n_grads;
+  float * grad = client->grad;
+  const void * payload = grad;
+  for (int k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    CvMat * weights = icvGetUpdatedWeights(layer);
+    if (!weights){continue;}
+    CV_ASSERT(layer->n_grads && CV_ARE_SIZES_EQ(layer->dE_dW,weights));
+    CvMat grad_hdr = cvMat(weights->rows,weights->cols,CV_32F,grad);
+    cvConvertScale(layer->dE_dW,&grad_hdr,1./n_batches);
+    layer->n_grads = 0;
+    grad += weights->rows*weights->cols;
+  }
+  grad = client->grad;
+
+  icvInitHeader(&header,ICV_DNN_PS_PUSH);
+  header.worker_id = client->worker_id;
+  header.clock = client->clock++;
+  header.compression = client->compression;
+  header.n_weights = client->n_weights;
+  header.n_grads = n_grads;
+  if (client->compression==CV_DNN_COMPRESS_NONE){
+    header.payload_size = sizeof(float)*n_grads;
+  }else if (client->compression==CV_DNN_COMPRESS_FP16){
+    client->payload.resize(MAX(sizeof(unsigned short)*n_grads,size_t(1)));
+    icvFloatToHalf(grad,(unsigned short*)&client->payload[0],n_grads);
+    header.payload_size = sizeof(unsigned short)*n_grads;
+    payload = &client->payload[0];
+  }else{
+    // largest values of gradient plus what has not been sent before
+    const int k = MIN(n_grads,MAX(1,cvRound(n_grads*client->topk_ratio)));
+    float * residual = client->residual;
+    std::vector<int> idx(n_grads);
+    for (int i=0;i<n_grads;i++){residual[i] += grad[i]; idx[i] = i;}
+    std::nth_element(idx.begin(),idx.begin()+(k-1),idx.end(),CvDNNGreaterMagnitude(residual));
+    client->payload.resize(sizeof(int)+(sizeof(int)+sizeof(float))*k);
+    int * iptr = (int*)&client->payload[0];
+    float * vptr = (float*)(iptr+1+k);
+    iptr[0] = k;
+    for (int i=0;i<k;i++){
+      iptr[1+i] = idx[i]; vptr[i] = residual[idx[i]]; residual[idx[i]] = 0;
+    }
+    header.payload_size = client->payload.size();
+    payload = &client->payload[0];
+  }
+  if (icvSendMessage(client->fd,&header,payload)<0 ||
+      icvRecvMessage(client->fd,&header,client->payload,
+                     sizeof(float)*size_t(client->n_weights))<0 || header.type!=ICV_DNN_PS_WEIGHTS ||
+      header.payload_size!=int(sizeof(float))*client->n_weights){
+    CV_ERROR(CV_StsError,"Lost connection to parameter server");
+  }
+  icvCopyWeights(plan,(float*)&client->payload[0],1);
+#else
+  CV_ERROR(CV_StsNotImplemented,"Parameter server requires BSD sockets");
+#endif
+  __END__;
+}
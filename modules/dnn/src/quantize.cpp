@@ -0,0 +1,547 @@
+/** -*- c++ -*-
+ *
+ * \file   quantize.cpp
+ * \date   Sun Oct 18 16:12:05 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  int8 post-training quantization of convolution and dense layers,
+ *         with int8 x int8 -> int32 GEMM and dequantization kernels, and
+ *         fp16/bf16 weight storage of dense layers with float accumulation
+ */
+
+#include "_dnn.h"
+#include "cnn.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ICV_DNN_X86_DISPATCH 1
+#include <immintrin.h>
+#else
+#define ICV_DNN_X86_DISPATCH 0
+#endif
+
+void icvCNNModelPredict(const CvNetwork * network, const CvMat * samples, CvMat * result, const int batch_size );
+
+/*------------------------ scalar version -----------------------------*/
+// also used for the tail of rows in vectorized version
+
+/* c[j] = dot(a,b_j) for rows b_j of B, j in [j0,j1) */
+static void icvGemmInt8Row(const schar * a, const schar * B, int bstep, int j0, int j1,
+                           int * c, int n)
+{
+  for (int j=j0;j<j1;j++){
+    const schar * b = B+bstep*j; int sum = 0;
+    for (int k=0;k<n;k++){ sum += int(a[k])*int(b[k]); }
+    c[j] = sum;
+  }
+}
+
+static void icvDequantizeInt32Row(const int * src, const float * scale, const float * bias,
+                                  int step, int relu, float * dst, int n)
+{
+  for (int j=0;j<n;j++){
+    float v = float(src[j])*scale[step*j]+bias[step*j];
+    dst[j] = (relu && v<0)?0:v;
+  }
+}
+
+static void icvFloat16ToFloat(int storage, const ushort * src, float * dst, int n)
+{
+  if (storage==CV_DNN_QUANT_BF16){icvBFloat16ToFloat(src,dst,n);}else{icvHalfToFloat(src,dst,n);}
+}
+
+/* c_ij = dot(a_i,b_j) for all rows a_i of A, rows b_j of B in [j0,j1), each
+   chunk of a row of B is converted once for all rows of A */
+static void icvGemmFloat16Rows(const CvMat * A, const ushort * B, int bstep, int storage,
+                               int j0, int j1, CvMat * C)
+{
+  const int n = A->cols, chunk = 64;
+  float buf[chunk];
+  for (int j=j0;j<j1;j++){
+    for (int i=0;i<A->rows;i++){ ((float*)(C->data.ptr+C->step*i))[j] = 0; }
+    for (int k0=0;k0<n;k0+=chunk){
+      const int len = MIN(chunk,n-k0);
+      icvFloat16ToFloat(storage,B+bstep*j+k0,buf,len);
+      for (int i=0;i<A->rows;i++){
+        const float * a = (const float*)(A->data.ptr+A->step*i)+k0;
+        float sum = 0;
+        for (int k=0;k<len;k++){ sum += a[k]*buf[k]; }
+        ((float*)(C->data.ptr+C->step*i))[j] += sum;
+      }
+    }
+  }
+}
+
+/*------------------------ AVX2 version -------------------------------*/
+#if ICV_DNN_X86_DISPATCH
+
+__attribute__((target("avx2,fma")))
+static inline int icvHorizontalSum_avx2(__m256i v)
+{
+  __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v),_mm256_extracti128_si256(v,1));
+  s = _mm_add_epi32(s,_mm_shuffle_epi32(s,_MM_SHUFFLE(1,0,3,2)));
+  s = _mm_add_epi32(s,_mm_shuffle_epi32(s,_MM_SHUFFLE(2,3,0,1)));
+  return _mm_cvtsi128_si32(s);
+}
+
+/* Rows of 16 int8 are widened to int16 and multiplied pairwise into int32
+   with vpmaddwd, 4 rows of B share each load of the row of A. */
+__attribute__((target("avx2,fma")))
+static void icvGemmInt8Row_avx2(const schar * a, const schar * B, int bstep, int j0, int j1,
+                                int * c, int n)
+{
+  int j = j0;
+  for (;j<=j1-4;j+=4){
+    const schar * b0 = B+bstep*j, * b1 = b0+bstep, * b2 = b1+bstep, * b3 = b2+bstep;
+    __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+    for (int k=0;k<n;k+=16){
+      __m256i ak = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a+k)));
+      s0 = _mm256_add_epi32(s0,_mm256_madd_epi16(ak,
+             _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b0+k)))));
+      s1 = _mm256_add_epi32(s1,_mm256_madd_epi16(ak,
+             _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b1+k)))));
+      s2 = _mm256_add_epi32(s2,_mm256_madd_epi16(ak,
+             _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b2+k)))));
+      s3 = _mm256_add_epi32(s3,_mm256_madd_epi16(ak,
+             _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b3+k)))));
+    }
+    c[j] = icvHorizontalSum_avx2(s0); c[j+1] = icvHorizontalSum_avx2(s1);
+    c[j+2] = icvHorizontalSum_avx2(s2); c[j+3] = icvHorizontalSum_avx2(s3);
+  }
+  for (;j<j1;j++){
+    const schar * b = B+bstep*j;
+    __m256i s = _mm256_setzero_si256();
+    for (int k=0;k<n;k+=16){
+      s = _mm256_add_epi32(s,_mm256_madd_epi16(
+            _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(a+k))),
+            _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(b+k)))));
+    }
+    c[j] = icvHorizontalSum_avx2(s);
+  }
+}
+
+__attribute__((target("avx2,fma")))
+static void icvDequantizeInt32Row_avx2(const int * src, const float * scale, const float * bias,
+                                       int step, int relu, float * dst, int n)
+{
+  int j = 0;
+  const __m256 zero = _mm256_setzero_ps();
+  if (step){
+    for (;j<=n-8;j+=8){
+      __m256 v = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(src+j))),
+                                 _mm256_loadu_ps(scale+j),_mm256_loadu_ps(bias+j));
+      _mm256_storeu_ps(dst+j,relu?_mm256_max_ps(v,zero):v);
+    }
+  }else{
+    const __m256 s = _mm256_set1_ps(scale[0]), b = _mm256_set1_ps(bias[0]);
+    for (;j<=n-8;j+=8){
+      __m256 v = _mm256_fmadd_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(src+j))),s,b);
+      _mm256_storeu_ps(dst+j,relu?_mm256_max_ps(v,zero):v);
+    }
+  }
+  if (j<n){icvDequantizeInt32Row(src+j,scale+step*j,bias+step*j,step,relu,dst+j,n-j);}
+}
+
+/* 8 weights widened to float in register, bfloat16 by a shift into the upper
+   half of each lane, half precision by vcvtph2ps */
+__attribute__((target("avx2,fma,f16c")))
+static inline __m256 icvLoadFloat16_avx2(int bf16, const ushort * p)
+{
+  __m128i w = _mm_loadu_si128((const __m128i*)p);
+  if (bf16){return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(w),16));}
+  return _mm256_cvtph_ps(w);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static inline float icvHorizontalSum_avx2(__m256 v)
+{
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+  s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+  s = _mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+  return _mm_cvtss_f32(s);
+}
+
+/* Each 8 weights of a row of B are converted once for 4 rows of A, the tail
+   of rows is converted by the scalar version. */
+__attribute__((target("avx2,fma,f16c")))
+static void icvGemmFloat16Rows_avx2(const CvMat * A, const ushort * B, int bstep, int storage,
+                                    int j0, int j1, CvMat * C)
+{
+  const int M = A->rows, n = A->cols, n8 = n&~7, bf16 = storage==CV_DNN_QUANT_BF16;
+  float buf[8];
+  for (int j=j0;j<j1;j++){
+    const ushort * b = B+bstep*j;
+    if (n8<n){icvFloat16ToFloat(storage,b+n8,buf,n-n8);}
+    int i = 0;
+    for (;i<=M-4;i+=4){
+      const float * a0 = (const float*)(A->data.ptr+A->step*i);
+      const float * a1 = (const float*)((const uchar*)a0+A->step);
+      const float * a2 = (const float*)((const uchar*)a1+A->step);
+      const float * a3 = (const float*)((const uchar*)a2+A->step);
+      __m256 s0 = _mm256_setzero_ps(), s1 = s0, s2 = s0, s3 = s0;
+      for (int k=0;k<n8;k+=8){
+        __m256 bk = icvLoadFloat16_avx2(bf16,b+k);
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0+k),bk,s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1+k),bk,s1);
+        s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2+k),bk,s2);
+        s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3+k),bk,s3);
+      }
+      float c0 = icvHorizontalSum_avx2(s0), c1 = icvHorizontalSum_avx2(s1);
+      float c2 = icvHorizontalSum_avx2(s2), c3 = icvHorizontalSum_avx2(s3);
+      for (int k=n8;k<n;k++){
+        c0 += a0[k]*buf[k-n8]; c1 += a1[k]*buf[k-n8]; c2 += a2[k]*buf[k-n8]; c3 += a3[k]*buf[k-n8];
+      }
+      ((float*)(C->data.ptr+C->step*i))[j] = c0;
+      ((float*)(C->data.ptr+C->step*(i+1)))[j] = c1;
+      ((float*)(C->data.ptr+C->step*(i+2)))[j] = c2;
+      ((float*)(C->data.ptr+C->step*(i+3)))[j] = c3;
+    }
+    for (;i<M;i++){
+      const float * a = (const float*)(A->data.ptr+A->step*i);
+      __m256 s = _mm256_setzero_ps();
+      for (int k=0;k<n8;k+=8){
+        s = _mm256_fmadd_ps(_mm256_loadu_ps(a+k),icvLoadFloat16_avx2(bf16,b+k),s);
+      }
+      float c = icvHorizontalSum_avx2(s);
+      for (int k=n8;k<n;k++){ c += a[k]*buf[k-n8]; }
+      ((float*)(C->data.ptr+C->step*i))[j] = c;
+    }
+  }
+}
+
+#endif // ICV_DNN_X86_DISPATCH
+
+/*------------------------ kernels ------------------------------------*/
+
+/* C = A*B^T for int8 matrices A and B, whose rows are padded with zeros to a
+   multiple of CV_DNN_QUANT_ALIGN, into int32 matrix C. */
+ML_IMPL void cvGEMMInt8(const CvMat * A, const CvMat * B, CvMat * C)
+{
+  CV_FUNCNAME("cvGEMMInt8");
+  __BEGIN__;
+  CV_ASSERT(CV_MAT_TYPE(A->type)==CV_8S && CV_MAT_TYPE(B->type)==CV_8S &&
+            CV_MAT_TYPE(C->type)==CV_32S);
+  CV_ASSERT(A->cols==B->cols && (A->cols%CV_DNN_QUANT_ALIGN)==0);
+  CV_ASSERT(C->rows==A->rows && C->cols==B->rows);
+  const int M = A->rows, N = B->rows, K = A->cols;
+#if ICV_DNN_X86_DISPATCH
+  const int avx2 = cvGetFastMathLevel()>=CV_DNN_FASTMATH_AVX2;
+#endif
+  // blocks of rows of B are distributed over threads, so that short A
+  // (weights of a few output channels) still keeps all threads busy
+  const int block = 64, nblocks = (N+block-1)/block;
+#pragma omp parallel for
+  for (int bi=0;bi<nblocks;bi++){
+    const int j0 = block*bi, j1 = MIN(j0+block,N);
+    for (int i=0;i<M;i++){
+      const schar * a = (const schar*)(A->data.ptr+A->step*i);
+      int * c = (int*)(C->data.ptr+C->step*i);
+#if ICV_DNN_X86_DISPATCH
+      if (avx2){icvGemmInt8Row_avx2(a,(const schar*)B->data.ptr,B->step,j0,j1,c,K);continue;}
+#endif
+      icvGemmInt8Row(a,(const schar*)B->data.ptr,B->step,j0,j1,c,K);
+    }
+  }
+  __END__;
+}
+
+/* C = A*B^T for float matrix A and matrix B of 16 bit floats, as given by
+   <storage> (CV_DNN_QUANT_FP16 or CV_DNN_QUANT_BF16), accumulating in float.
+   B is read once, and never converted as a whole. */
+ML_IMPL void cvGEMMFloat16(const CvMat * A, const CvMat * B, int storage, CvMat * C)
+{
+  CV_FUNCNAME("cvGEMMFloat16");
+  __BEGIN__;
+  CV_ASSERT(CV_MAT_TYPE(A->type)==CV_32F && CV_MAT_TYPE(B->type)==CV_16U &&
+            CV_MAT_TYPE(C->type)==CV_32F);
+  CV_ASSERT(storage==CV_DNN_QUANT_FP16 || storage==CV_DNN_QUANT_BF16);
+  CV_ASSERT(A->cols==B->cols && C->rows==A->rows && C->cols==B->rows);
+  const int N = B->rows;
+#if ICV_DNN_X86_DISPATCH
+  static const int f16c = (__builtin_cpu_init(),__builtin_cpu_supports("f16c"));
+  const int avx2 = f16c && cvGetFastMathLevel()>=CV_DNN_FASTMATH_AVX2;
+#endif
+  const int block = 16, nblocks = (N+block-1)/block;
+#pragma omp parallel for
+  for (int bi=0;bi<nblocks;bi++){
+    const int j0 = block*bi, j1 = MIN(j0+block,N);
+#if ICV_DNN_X86_DISPATCH
+    if (avx2){
+      icvGemmFloat16Rows_avx2(A,(const ushort*)B->data.ptr,B->step/sizeof(ushort),storage,j0,j1,C);
+      continue;
+    }
+#endif
+    icvGemmFloat16Rows(A,(const ushort*)B->data.ptr,B->step/sizeof(ushort),storage,j0,j1,C);
+  }
+  __END__;
+}
+
+/* dst = round(src/scale) saturated to [-127,127] */
+void icvQuantizeInt8( const float * src, float scale, schar * dst, int n )
+{
+  const float inv_scale = 1.f/scale;
+  for (int j=0;j<n;j++){
+    int v = cvRound(src[j]*inv_scale);
+    dst[j] = (schar)MAX(-127,MIN(127,v));
+  }
+}
+
+/* dst = src*scale+bias, followed by ReLU if <relu> is set. With zero <step>
+   scale and bias are broadcast from their first element, otherwise they are
+   taken per element. */
+void icvDequantizeInt32( const int * src, const float * scale, const float * bias, int step,
+                         int relu, float * dst, int n )
+{
+#if ICV_DNN_X86_DISPATCH
+  if (cvGetFastMathLevel()>=CV_DNN_FASTMATH_AVX2){
+    icvDequantizeInt32Row_avx2(src,scale,bias,step,relu,dst,n); return;
+  }
+#endif
+  icvDequantizeInt32Row(src,scale,bias,step,relu,dst,n);
+}
+
+/*------------------------ calibration --------------------------------*/
+
+void icvCalibrateQuantization( CvDNNQuantization * quant, const CvMat * X )
+{
+  double minval = 0, maxval = 0;
+  cvMinMaxLoc(X,&minval,&maxval);
+  quant->xmax = MAX(quant->xmax,float(MAX(-minval,maxval)));
+}
+
+void icvReleaseQuantization( CvDNNQuantization ** quant )
+{
+  if (!quant || !*quant){return;}
+  if ((*quant)->W){cvReleaseMat(&(*quant)->W);}
+  if ((*quant)->scale){cvReleaseMat(&(*quant)->scale);}
+  if ((*quant)->bias){cvReleaseMat(&(*quant)->bias);}
+  cvFree(quant);
+}
+
+/* Quantize weights (n_outputs, K+1), with bias in the last column, per output
+   channel. The output of channel c is sum(x*w) * <wscale> + bias * <bscale>. */
+static void icvQuantizeWeights( CvDNNQuantization * quant, const CvMat * weights,
+                                float wscale, float bscale )
+{
+  CV_FUNCNAME("icvQuantizeWeights");
+  __BEGIN__;
+  const int n_outputs = weights->rows, K = weights->cols-1;
+  const int kpad = cvAlign(K,CV_DNN_QUANT_ALIGN);
+  CV_ASSERT(CV_MAT_TYPE(weights->type)==CV_32F);
+  quant->xscale = quant->xmax>0?quant->xmax/127.f:1.f;
+  CV_CALL(quant->W = cvCreateMat(n_outputs,kpad,CV_8S));
+  CV_CALL(quant->scale = cvCreateMat(1,n_outputs,CV_32F));
+  CV_CALL(quant->bias = cvCreateMat(1,n_outputs,CV_32F));
+  cvZero(quant->W);
+  for (int oi=0;oi<n_outputs;oi++){
+    const float * wptr = (const float*)(weights->data.ptr+weights->step*oi);
+    float wmax = 0;
+    for (int k=0;k<K;k++){ wmax = MAX(wmax,fabsf(wptr[k])); }
+    const float ws = wmax>0?wmax/127.f:1.f;
+    icvQuantizeInt8(wptr,ws,(schar*)(quant->W->data.ptr+quant->W->step*oi),K);
+    quant->scale->data.fl[oi] = ws*quant->xscale*wscale;
+    quant->bias->data.fl[oi] = wptr[K]*bscale;
+  }
+  __END__;
+}
+
+/*------------------------ network ------------------------------------*/
+
+/* Dense weights (n_outputs, K+1) are stored as 16 bit floats, without bias */
+static void icvStoreWeightsFloat16( CvDNNQuantization * quant, const CvMat * weights, int storage )
+{
+  CV_FUNCNAME("icvStoreWeightsFloat16");
+  __BEGIN__;
+  const int n_outputs = weights->rows, K = weights->cols-1;
+  CV_ASSERT(CV_MAT_TYPE(weights->type)==CV_32F);
+  CV_CALL(quant->W = cvCreateMat(n_outputs,K,CV_16U));
+  CV_CALL(quant->bias = cvCreateMat(1,n_outputs,CV_32F));
+  for (int oi=0;oi<n_outputs;oi++){
+    const float * wptr = (const float*)(weights->data.ptr+weights->step*oi);
+    ushort * dst = (ushort*)(quant->W->data.ptr+quant->W->step*oi);
+    if (storage==CV_DNN_QUANT_BF16){icvFloatToBFloat16(wptr,dst,K);}else{icvFloatToHalf(wptr,dst,K);}
+    quant->bias->data.fl[oi] = wptr[K];
+  }
+  quant->state = storage;
+  __END__;
+}
+
+/* Float weights of a layer, released while it runs on 16 bit weights, are 
+   restored from those, with bias taken as it is. */
+static void icvRestoreWeightsFloat16( CvDNNLayer * layer )
+{
+  CV_FUNCNAME("icvRestoreWeightsFloat16");
+  __BEGIN__;
+  CvDNNQuantization * quant = layer->quant;
+  int n_outputs, K;
+  if (layer->weights || !quant || 
+      (quant->state!=CV_DNN_QUANT_FP16 && quant->state!=CV_DNN_QUANT_BF16)){EXIT;}
+  n_outputs = quant->W->rows; K = quant->W->cols;
+  CV_CALL(layer->weights = cvCreateMat(n_outputs,K+1,CV_32F));
+  for (int oi=0;oi<n_outputs;oi++){
+    const ushort * src = (const ushort*)(quant->W->data.ptr+quant->W->step*oi);
+    float * wptr = (float*)(layer->weights->data.ptr+layer->weights->step*oi);
+    if (quant->state==CV_DNN_QUANT_BF16){icvBFloat16ToFloat(src,wptr,K);}else{icvHalfToFloat(src,wptr,K);}
+    wptr[K] = quant->bias->data.fl[oi];
+  }
+  __END__;
+}
+
+/* Restores float inference of <layer>. */
+void icvDequantizeLayer( CvDNNLayer * layer )
+{
+  CV_FUNCNAME("icvDequantizeLayer");
+  __BEGIN__;
+  CV_CALL(icvRestoreWeightsFloat16(layer));
+  icvReleaseQuantization(&layer->quant);
+  __END__;
+}
+
+/* With CV_DNN_QUANT_INT8, convolution and dense layers of the network are 
+   switched to int8 inference in two steps: the range of their input is 
+   collected by a float forward pass over <samples>, then the weights of each
+   output channel are quantized with a scale of their own, and the input with
+   the scale of its collected range. With CV_DNN_QUANT_FP16 or BF16, weights of
+   dense layers are stored as 16 bit floats in place of their float weights, 
+   which are released, and <samples> are not used. Execution contexts share 
+   the weights, and are to be created once the network is quantized. */
+ML_IMPL void cvQuantizeNetwork( CvNetwork * network, int type, const CvMat * samples, int batch_size )
+{
+  CvMat * result = 0;
+  CV_FUNCNAME("cvQuantizeNetwork");
+  __BEGIN__;
+  if (!network){CV_ERROR(CV_StsNullPtr,"Null network");}
+  if (type!=CV_DNN_QUANT_INT8 && type!=CV_DNN_QUANT_FP16 && type!=CV_DNN_QUANT_BF16){
+    CV_ERROR(CV_StsBadArg,"Unknown quantization type");
+  }
+  CV_ASSERT(type!=CV_DNN_QUANT_INT8 || (samples && samples->rows>0 && batch_size>0));
+  CvDNNExecPlan * plan = 0;
+  CV_CALL(plan = cvCompileNetwork(network));
+  CvDNNLayer * last_layer = cvGetCNNLastLayer(network);
+  int k, n_quantized = 0;
+
+  for (k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    if (layer->dtype!=CV_32F || !(icvIsDenseLayer(layer) ||
+        (type==CV_DNN_QUANT_INT8 && icvIsConvolutionLayer(layer)))){continue;}
+    CV_CALL(icvDequantizeLayer(layer));
+    CV_CALL(layer->quant = (CvDNNQuantization*)cvAlloc(sizeof(CvDNNQuantization)));
+    memset(layer->quant,0,sizeof(CvDNNQuantization));
+    if (type!=CV_DNN_QUANT_INT8){
+      CV_CALL(icvStoreWeightsFloat16(layer->quant,layer->weights,type));
+      cvReleaseMat(&layer->weights);
+    }else{
+      layer->quant->state = CV_DNN_QUANT_CALIBRATE;
+    }
+    n_quantized++;
+  }
+  if (!n_quantized || type!=CV_DNN_QUANT_INT8){EXIT;}
+
+  // calibration
+  CV_CALL(result = cvCreateMat(samples->rows*MAX(last_layer->seq_length,1),
+                               last_layer->n_output_planes,CV_32F));
+  CV_CALL(icvCNNModelPredict(network,samples,result,batch_size));
+
+  for (k=0;k<plan->n_ops;k++){
+    CvDNNLayer * layer = plan->ops[k].layer;
+    CvDNNQuantization * quant = layer->quant;
+    if (!quant){continue;}
+    if (icvIsConvolutionLayer(layer)){
+      // Y = (W*Xcol + bias*n_input_planes)/(K*K)
+      CvDNNLayer * ref_layer = layer->ref_layer;
+      const int KK = ((CvDNNConvolutionLayer*)layer)->K*((CvDNNConvolutionLayer*)layer)->K;
+      CV_CALL(icvQuantizeWeights(quant,ref_layer?ref_layer->weights:layer->weights,
+                                 1.f/float(KK),float(layer->n_input_planes)/float(KK)));
+    }else{
+      CV_CALL(icvQuantizeWeights(quant,layer->weights,1.f,1.f));
+    }
+    quant->state = CV_DNN_QUANT_INT8;
+  }
+
+  __END__;
+  if (result){cvReleaseMat(&result);}
+}
+
+/* Restores float inference of all layers of the network. */
+ML_IMPL void cvDequantizeNetwork( CvNetwork * network )
+{
+  CV_FUNCNAME("cvDequantizeNetwork");
+  __BEGIN__;
+  if (!network){CV_ERROR(CV_StsNullPtr,"Null network");}
+  CvDNNLayer * layer = network->first_layer;
+  for (;layer;layer=layer->next_layer){ CV_CALL(icvDequantizeLayer(layer)); }
+  __END__;
+}
+
+/* Type of quantized inference the layers of the network run, 0 for float. */
+ML_IMPL int cvGetNetworkQuantization( const CvNetwork * network )
+{
+  int type = 0;
+  CV_FUNCNAME("cvGetNetworkQuantization");
+  __BEGIN__;
+  if (!network){CV_ERROR(CV_StsNullPtr,"Null network");}
+  CvDNNLayer * layer = network->first_layer;
+  for (;layer && !type;layer=layer->next_layer){
+    if (layer->quant && layer->quant->state!=CV_DNN_QUANT_CALIBRATE){type = layer->quant->state;}
+  }
+  __END__;
+  return type;
+}
+
+/*------------------------ persistence --------------------------------*/
+
+/* Quantized weights of a layer are written as a map named <name>, next to
+   the float weights of the network. Layers being calibrated are skipped. */
+void icvWriteQuantization( CvFileStorage * fs, const char * name, const CvDNNQuantization * quant )
+{
+  CV_FUNCNAME("icvWriteQuantization");
+  __BEGIN__;
+  if (!quant || quant->state==CV_DNN_QUANT_CALIBRATE){EXIT;}
+  CV_CALL(cvStartWriteStruct(fs,name,CV_NODE_MAP));
+  CV_CALL(cvWriteInt(fs,"state",quant->state));
+  CV_CALL(cvWriteReal(fs,"xscale",quant->xscale));
+  CV_CALL(cvWrite(fs,"W",quant->W));
+  if (quant->scale){CV_CALL(cvWrite(fs,"scale",quant->scale));}
+  CV_CALL(cvWrite(fs,"bias",quant->bias));
+  CV_CALL(cvEndWriteStruct(fs));
+  __END__;
+}
+
+/* Reads quantized weights written by icvWriteQuantization from <node>. */
+CvDNNQuantization * icvReadQuantization( CvFileStorage * fs, CvFileNode * node )
+{
+  CvDNNQuantization * quant = 0;
+  CV_FUNCNAME("icvReadQuantization");
+  __BEGIN__;
+  CV_CALL(quant = (CvDNNQuantization*)cvAlloc(sizeof(CvDNNQuantization)));
+  memset(quant,0,sizeof(CvDNNQuantization));
+  quant->state = cvReadIntByName(fs,node,"state",0);
+  quant->xscale = (float)cvReadRealByName(fs,node,"xscale",1);
+  CV_CALL(quant->W = (CvMat*)cvReadByName(fs,node,"W"));
+  CV_CALL(quant->scale = (CvMat*)cvReadByName(fs,node,"scale"));
+  CV_CALL(quant->bias = (CvMat*)cvReadByName(fs,node,"bias"));
+  if (!CV_IS_MAT(quant->W) || !CV_IS_MAT(quant->bias) || 
+      (quant->state==CV_DNN_QUANT_INT8 && !CV_IS_MAT(quant->scale)) ||
+      (quant->state!=CV_DNN_QUANT_INT8 && quant->state!=CV_DNN_QUANT_FP16 && 
+       quant->state!=CV_DNN_QUANT_BF16)){
+    CV_ERROR(CV_StsParseError,"Invalid quantized weights");
+  }
+  __END__;
+  if (cvGetErrStatus()<0){icvReleaseQuantization(&quant);}
+  return quant;
+}
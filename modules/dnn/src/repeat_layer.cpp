@@ -25,6 +25,9 @@
  
 #include "_dnn.h"
 
+// slot of workspace buffer keeping a copy of output
+#define ICV_REPEAT_WS_Y   0
+
 CvDNNLayer * cvCreateRepeatVectorLayer( 
     const int dtype, const char * name, 
     int n_input_planes, int input_height, int input_width, int seq_length, int time_index,
@@ -70,16 +73,8 @@ void icvCNNRepeatVectorForward( CvDNNLayer * _layer, const CvMat * X, CvMat * Y
   if ( !icvIsRepeatVectorLayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
   __BEGIN__;
   CvDNNRepeatVectorLayer * layer = (CvDNNRepeatVectorLayer*)_layer;
-  if (!layer->Y){
-    layer->Y = cvCloneMat(X);
-  }else{
-    if (X->cols==layer->Y->cols && X->rows==layer->Y->rows){
-      cvCopy(X,layer->Y);
-    }else{
-      cvReleaseMat(&layer->Y);
-      layer->Y = cvCloneMat(X);
-    }
-  }
+  CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_REPEAT_WS_Y,X->rows,X->cols,CV_MAT_TYPE(X->type)));
+  cvCopy(X,layer->Y);
   cvCopy(X,Y);
   __END__;
 }
@@ -126,5 +121,8 @@ void icvCNNRepeatVectorBackward( CvDNNLayer * _layer, int t,
   __END__;
 }
 
-void icvCNNRepeatVectorRelease( CvDNNLayer** p_layer ){}
+void icvCNNRepeatVectorRelease( CvDNNLayer** p_layer )
+{
+  if (p_layer && *p_layer){cvReleaseWorkspaceMats(*p_layer);}
+}
 
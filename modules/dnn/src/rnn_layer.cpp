@@ -25,6 +25,42 @@
  
 #include "_dnn.h"
 
+// slots of buffers taken from workspace arena, states kept from forward to 
+// backward pass
+#define ICV_RNN_WS_H              0
+#define ICV_RNN_WS_Y              1
+#define ICV_RNN_WS_WX             2
+#define ICV_RNN_WS_WH             3
+#define ICV_RNN_WS_DH             4
+#define ICV_RNN_WS_DWXH           5
+#define ICV_RNN_WS_DWHH           6
+#define ICV_RNN_WS_DWHY           7
+// scratch buffers within a single forward or backward call
+#define ICV_RNN_WS_WX_BATCH       8
+#define ICV_RNN_WS_WH_BATCH       9
+#define ICV_RNN_WS_H_PREV         10
+#define ICV_RNN_WS_H_CURR         11
+#define ICV_RNN_WS_WX_CURR        12
+#define ICV_RNN_WS_WH_CURR        13
+#define ICV_RNN_WS_HBIAS          14
+#define ICV_RNN_WS_YBIAS          15
+#define ICV_RNN_WS_Y_CURR         16
+#define ICV_RNN_WS_DEDY           17
+#define ICV_RNN_WS_DEDY_CURR      18
+#define ICV_RNN_WS_DEDY_AFDER     19
+#define ICV_RNN_WS_DH_CURR        20
+#define ICV_RNN_WS_DH_NEXT        21
+#define ICV_RNN_WS_DH_RAW         22
+#define ICV_RNN_WS_DWXH_CURR      23
+#define ICV_RNN_WS_DWHH_CURR      24
+#define ICV_RNN_WS_DWHY_CURR      25
+#define ICV_RNN_WS_DEDY_AFDER_T   26
+#define ICV_RNN_WS_DH_RAW_T       27
+// initial states of a stateful layer in sequence mode, and the last states
+// carried over to next batch
+#define ICV_RNN_WS_H0             28
+#define ICV_RNN_WS_CARRY          29
+
 ML_IMPL CvDNNLayer* cvCreateSimpleRNNLayer( 
     const int dtype, const char * name, const CvDNNLayer * ref_layer, 
     int n_inputs, int n_outputs, int n_hiddens, int seq_length, int time_index, 
@@ -37,6 +73,10 @@ ML_IMPL CvDNNLayer* cvCreateSimpleRNNLayer(
   __BEGIN__;
 
   if ( init_learn_rate <= 0) { CV_ERROR( CV_StsBadArg, "Incorrect parameters" ); }
+  const int activation_type = cvGetActivationType(activation);
+  if ( activation_type<0 || activation_type==CV_DNN_ACTIVATION_NONE ) {
+    CV_ERROR(CV_StsBadArg,"invalid output activation type for RNN layer, `softmax` is prefered.");
+  }
 
   fprintf(stderr,"SimpleRNNLayer(%s): input(%d), hidden(%d), output(%d), "
           "seq_length(%d), time_index(%d)\n", name,
@@ -48,6 +88,7 @@ ML_IMPL CvDNNLayer* cvCreateSimpleRNNLayer(
       icvCNNRecurrentRelease, icvCNNRecurrentForward, icvCNNRecurrentBackward ));
 
   layer->ref_layer = (CvDNNLayer*)ref_layer;
+  layer->step = ref_layer?0:icvCNNRecurrentStep;
   layer->weights = 0; // we don't use this !
   layer->time_index = time_index;
   layer->seq_length = seq_length;
@@ -56,6 +97,7 @@ ML_IMPL CvDNNLayer* cvCreateSimpleRNNLayer(
   layer->Whh = 0;
   layer->Why = 0;
   strcpy(layer->activation,activation);
+  layer->activation_type = activation_type;
   layer->H = 0;
   layer->Y = 0;
   layer->loss = 0;
@@ -63,7 +105,7 @@ ML_IMPL CvDNNLayer* cvCreateSimpleRNNLayer(
 
   int n_hiddens = layer->n_hiddens;
   if (!ref_layer){
-    CV_ASSERT(layer->time_index==0);
+    CV_ASSERT(layer->time_index==0 || layer->time_index==CV_DNN_RNN_SEQUENCE);
     CV_CALL(layer->Wxh = cvCreateMat( n_hiddens, n_inputs , CV_32F ));
     CV_CALL(layer->Whh = cvCreateMat( n_hiddens, n_hiddens+1, CV_32F ));
     CV_CALL(layer->Why = cvCreateMat( n_outputs, n_hiddens+1, CV_32F ));
@@ -98,6 +140,41 @@ ML_IMPL CvDNNLayer* cvCreateSimpleRNNLayer(
   return (CvDNNLayer*)layer;
 }
 
+/* Applies gradients summed in dWxh, dWhh and dWhy since last step, averaged
+   over the n_batches mini batches and clipped to [-5,5] elementwise. */
+void icvCNNRecurrentStep( CvDNNLayer * _layer, int t, int n_batches )
+{
+  CV_FUNCNAME("icvCNNRecurrentStep");
+  __BEGIN__;
+  CvDNNSimpleRNNLayer * layer = (CvDNNSimpleRNNLayer*)_layer;
+  CvMat layer_Whh_submat, layer_Why_submat, layer_hbiascol, layer_ybiascol;
+  CvMat layer_dWhh_submat, layer_dWhy_submat, layer_dhbiascol, layer_dybiascol;
+  if (!layer->n_grads){EXIT;}
+  CV_ASSERT(!layer->ref_layer && layer->dWxh && layer->dWhh && layer->dWhy);
+  CV_CALL(cvGetCols( layer->Whh, &layer_Whh_submat, 0, layer->Whh->cols-1));
+  CV_CALL(cvGetCols( layer->Why, &layer_Why_submat, 0, layer->Why->cols-1));
+  CV_CALL(cvGetCol(  layer->Whh, &layer_hbiascol,      layer->Whh->cols-1));
+  CV_CALL(cvGetCol(  layer->Why, &layer_ybiascol,      layer->Why->cols-1));
+  CV_CALL(cvGetCols( layer->dWhh, &layer_dWhh_submat, 0, layer->dWhh->cols-1));
+  CV_CALL(cvGetCols( layer->dWhy, &layer_dWhy_submat, 0, layer->dWhy->cols-1));
+  CV_CALL(cvGetCol(  layer->dWhh, &layer_dhbiascol,      layer->dWhh->cols-1));
+  CV_CALL(cvGetCol(  layer->dWhy, &layer_dybiascol,      layer->dWhy->cols-1));
+  {
+  float eta = -layer->init_learn_rate*cvInvSqrt(t);
+  CvMat * W[5] = {layer->Wxh,&layer_Whh_submat,&layer_Why_submat,&layer_hbiascol,&layer_ybiascol};
+  CvMat * dW[5] = {layer->dWxh,&layer_dWhh_submat,&layer_dWhy_submat,
+                   &layer_dhbiascol,&layer_dybiascol};
+  for (int ii=0;ii<5;ii++){ 
+    CV_ASSERT(cvCountNAN(dW[ii])<1 && cvCountNAN(W[ii])<1);
+    if (n_batches>1){ cvScale(dW[ii],dW[ii],1./n_batches); }
+    cvMaxS(dW[ii],-5,dW[ii]); cvMinS(dW[ii],5,dW[ii]); 
+    CV_CALL(cvOptimizerUpdate( layer->optimizer, W[ii], dW[ii], -eta ));
+  }
+  }
+  layer->n_grads = 0;
+  __END__;
+}
+
 void icvCNNRecurrentRelease( CvDNNLayer** p_layer )
 {
   CV_FUNCNAME("icvCNNRecurrentRelease");
@@ -118,16 +195,193 @@ void icvCNNRecurrentRelease( CvDNNLayer** p_layer )
   cvReleaseMat( &layer->Whh ); layer->Whh = 0;
   cvReleaseMat( &layer->Why ); layer->Why = 0;
   if (layer->dE_dY){cvReleaseMat(&layer->dE_dY);layer->dE_dY=0;}
+  cvReleaseWorkspaceMats( *p_layer );
   cvFree( p_layer );
 
   __END__;
 }
 
+/****************************************************************************************/
+/* Forward pass over the whole sequence: input projections of all time steps
+   are computed by a single GEMM, only the recurrence H_t = tanh(WX_t + Whh*H_{t-1} + bh)
+   runs per time step, and outputs of all time steps by another single GEMM.
+   Rows of <X>, <Y> and the states kept for backward pass hold the time steps
+   of a sample one after another, so that a time step is a block of columns. */
+static void icvCNNRecurrentSequenceForward( CvDNNSimpleRNNLayer * layer, const CvMat * X, CvMat * Y )
+{
+  CV_FUNCNAME("icvCNNRecurrentSequenceForward");
+  __BEGIN__;
+  CvDNNLayer * _layer = (CvDNNLayer*)layer;
+  const int seq_length = layer->seq_length;
+  const int n_inputs = layer->n_input_planes;
+  const int n_outputs = layer->n_output_planes;
+  const int n_hiddens = layer->n_hiddens;
+  const int batch_size = X->rows;
+  CvMat Whh_submat, Why_submat, hbiascol, ybiascol;
+  CvMat Xr, Hr, WXr, WHr, Yr, H_prev, H_curr, WX_curr;
+  CvMat * hbias = 0, * ybias = 0, * H0 = 0;
+  int t;
+
+  CV_ASSERT(!layer->ref_layer);
+  CV_ASSERT(X->cols==n_inputs*seq_length && CV_IS_MAT_CONT(X->type));
+  CV_ASSERT(Y->rows==batch_size && Y->cols==n_outputs*seq_length && CV_IS_MAT_CONT(Y->type));
+
+  // states of all time steps, read in backward pass
+  CV_CALL(layer->H = cvGetWorkspaceMat(_layer,ICV_RNN_WS_H,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(layer->WX = cvGetWorkspaceMat(_layer,ICV_RNN_WS_WX,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(layer->WH = cvGetWorkspaceMat(_layer,ICV_RNN_WS_WH,batch_size,n_outputs*seq_length,CV_32F));
+  
+  // bias on last column vector, added in the activation epilogue
+  CV_CALL(cvGetCols( layer->Whh, &Whh_submat, 0, n_hiddens));
+  CV_CALL(cvGetCols( layer->Why, &Why_submat, 0, n_hiddens));
+  CV_CALL(cvGetCol( layer->Whh, &hbiascol, n_hiddens));
+  CV_CALL(cvGetCol( layer->Why, &ybiascol, n_hiddens));
+  CV_CALL(hbias = cvGetWorkspaceMat(_layer,ICV_RNN_WS_HBIAS,1,n_hiddens,CV_32F));
+  CV_CALL(ybias = cvGetWorkspaceMat(_layer,ICV_RNN_WS_YBIAS,1,n_outputs,CV_32F));
+  cvTranspose(&hbiascol,hbias);
+  cvTranspose(&ybiascol,ybias);
+
+  // initial states of a stateful layer, carried over from last batch
+  if (layer->stateful){
+    CV_CALL(H0 = cvGetWorkspaceMat(_layer,ICV_RNN_WS_H0,batch_size,n_hiddens,CV_32F));
+    if (layer->n_carried==batch_size){
+      CV_CALL(cvCopy(cvGetWorkspaceMat(_layer,ICV_RNN_WS_CARRY,batch_size,n_hiddens,CV_32F),H0));
+    }else{ cvZero(H0); }
+  }
+
+  // WX = Wxh * X for all time steps
+  cvReshape(X,&Xr,0,batch_size*seq_length);
+  cvReshape(layer->WX,&WXr,0,batch_size*seq_length);
+  CV_CALL(cvGEMM( &Xr, layer->Wxh, 1, 0, 0, &WXr, CV_GEMM_B_T ));
+
+  // recurrence, pre-activation values are kept in WX
+  for (t=0;t<seq_length;t++){
+    cvGetCols(layer->WX,&WX_curr,n_hiddens*t,n_hiddens*(t+1));
+    cvGetCols(layer->H,&H_curr,n_hiddens*t,n_hiddens*(t+1));
+    if (t>0){
+      cvGetCols(layer->H,&H_prev,n_hiddens*(t-1),n_hiddens*t);
+      CV_CALL(cvGEMM( &H_prev, &Whh_submat, 1, &WX_curr, 1, &WX_curr, CV_GEMM_B_T ));
+    }else if (H0){
+      CV_CALL(cvGEMM( H0, &Whh_submat, 1, &WX_curr, 1, &WX_curr, CV_GEMM_B_T ));
+    }
+    CV_CALL(cvActivate( CV_DNN_ACTIVATION_TANH, &WX_curr, hbias, &WX_curr, &H_curr ));
+  }
+  if (layer->stateful){
+    CV_CALL(cvCopy(&H_curr,cvGetWorkspaceMat(_layer,ICV_RNN_WS_CARRY,batch_size,n_hiddens,CV_32F)));
+    layer->n_carried = batch_size;
+  }
+
+  // Y = activate(Why * H + by) for all time steps, keeping Why * H + by in WH
+  cvReshape(layer->H,&Hr,0,batch_size*seq_length);
+  cvReshape(layer->WH,&WHr,0,batch_size*seq_length);
+  cvReshape(Y,&Yr,0,batch_size*seq_length);
+  CV_CALL(cvGEMM( &Hr, &Why_submat, 1, 0, 0, &WHr, CV_GEMM_B_T ));
+  CV_CALL(cvActivate( layer->activation_type, &WHr, ybias, &WHr, &Yr ));
+  CV_ASSERT(cvCountNAN(Y)<1);
+
+  __END__;
+}
+
+/* Backward pass over the whole sequence, summing gradients of all time steps
+   and samples into dWxh, dWhh and dWhy, which are applied by icvCNNRecurrentStep. */
+static void icvCNNRecurrentSequenceBackward( CvDNNSimpleRNNLayer * layer, 
+                                             const CvMat * X, const CvMat * dE_dY, CvMat * dE_dX )
+{
+  CV_FUNCNAME("icvCNNRecurrentSequenceBackward");
+  __BEGIN__;
+  CvDNNLayer * _layer = (CvDNNLayer*)layer;
+  const int seq_length = layer->seq_length;
+  const int n_inputs = layer->n_input_planes;
+  const int n_outputs = layer->n_output_planes;
+  const int n_hiddens = layer->n_hiddens;
+  const int batch_size = X->rows;
+  CvMat Whh_submat, Why_submat, dWhh_submat, dWhy_submat, dhbiascol, dybiascol;
+  CvMat Xr, Hr, WHr, dYr, dHr, dXr, dbias_hdr, H_prev, WX_curr, dH_curr, dH_next;
+  CvMat * dE_dY_afder = 0, * dhbias = 0, * dybias = 0, * H0 = 0;
+  int t;
+
+  CV_ASSERT(layer->H && layer->WX && layer->WH && layer->H->rows==batch_size);
+  CV_ASSERT(dE_dY->rows==batch_size && dE_dY->cols==n_outputs*seq_length && CV_IS_MAT_CONT(dE_dY->type));
+  CV_ASSERT(dE_dX->rows==batch_size && dE_dX->cols==n_inputs*seq_length && CV_IS_MAT_CONT(dE_dX->type));
+
+  // gradients of weights shared by all time steps are summed, over all 
+  // sequences passed backward since last step
+  CV_CALL(layer->dH = cvGetWorkspaceMat(_layer,ICV_RNN_WS_DH,batch_size,n_hiddens*seq_length,CV_32F));
+  CV_CALL(layer->dWxh = cvGetWorkspaceMat(_layer,ICV_RNN_WS_DWXH,layer->Wxh->rows,layer->Wxh->cols,CV_32F));
+  CV_CALL(layer->dWhh = cvGetWorkspaceMat(_layer,ICV_RNN_WS_DWHH,layer->Whh->rows,layer->Whh->cols,CV_32F));
+  CV_CALL(layer->dWhy = cvGetWorkspaceMat(_layer,ICV_RNN_WS_DWHY,layer->Why->rows,layer->Why->cols,CV_32F));
+  if (!layer->n_grads){ cvZero(layer->dWxh); cvZero(layer->dWhh); cvZero(layer->dWhy); }
+  CV_CALL(dE_dY_afder = cvGetWorkspaceMat(_layer,ICV_RNN_WS_DEDY_AFDER,batch_size*seq_length,n_outputs,CV_32F));
+  CV_CALL(dhbias = cvGetWorkspaceMat(_layer,ICV_RNN_WS_HBIAS,1,n_hiddens,CV_32F));
+  CV_CALL(dybias = cvGetWorkspaceMat(_layer,ICV_RNN_WS_YBIAS,1,n_outputs,CV_32F));
+  if (layer->stateful){ CV_CALL(H0 = cvGetWorkspaceMat(_layer,ICV_RNN_WS_H0,batch_size,n_hiddens,CV_32F)); }
+
+  CV_CALL(cvGetCols( layer->Whh, &Whh_submat, 0, n_hiddens));
+  CV_CALL(cvGetCols( layer->Why, &Why_submat, 0, n_hiddens));
+  CV_CALL(cvGetCols( layer->dWhh, &dWhh_submat, 0, n_hiddens));
+  CV_CALL(cvGetCols( layer->dWhy, &dWhy_submat, 0, n_hiddens));
+  CV_CALL(cvGetCol(  layer->dWhh, &dhbiascol,      n_hiddens));
+  CV_CALL(cvGetCol(  layer->dWhy, &dybiascol,      n_hiddens));
+  cvReshape(X,&Xr,0,batch_size*seq_length);
+  cvReshape(dE_dX,&dXr,0,batch_size*seq_length);
+  cvReshape(dE_dY,&dYr,0,batch_size*seq_length);
+  cvReshape(layer->H,&Hr,0,batch_size*seq_length);
+  cvReshape(layer->WH,&WHr,0,batch_size*seq_length);
+  cvReshape(layer->dH,&dHr,0,batch_size*seq_length);
+
+  // output activation derivative, for all time steps
+  if (layer->activation_type==CV_DNN_ACTIVATION_SOFTMAX){
+    cvCopy(&dYr,dE_dY_afder);    // softmax for classification
+  }else{
+    CV_CALL(cvActivateDer(layer->activation_type,&WHr,&dYr,dE_dY_afder));
+  }
+
+  // dWhy += dy' * H, dby += dy
+  CV_CALL(cvGEMM( dE_dY_afder, &Hr, 1, &dWhy_submat, 1, &dWhy_submat, CV_GEMM_A_T ));
+  cvReduce(dE_dY_afder,dybias,0,CV_REDUCE_SUM);
+  cvAdd(&dybiascol,cvReshape(dybias,&dbias_hdr,0,n_outputs),&dybiascol);
+
+  // dH = dy * Why for all time steps
+  CV_CALL(cvGEMM( dE_dY_afder, &Why_submat, 1, 0, 0, &dHr, 0 ));
+
+  // back through time, dH_t += dH_raw_{t+1} * Whh within a window of truncated
+  // back propagation, then dH_t is replaced by dH_raw_t = tanh'(WX_t) * dH_t
+  for (t=seq_length-1;t>=0;t--){
+    cvGetCols(layer->dH,&dH_curr,n_hiddens*t,n_hiddens*(t+1));
+    cvGetCols(layer->WX,&WX_curr,n_hiddens*t,n_hiddens*(t+1));
+    if (t<seq_length-1 && icvIsBPTTConnected(_layer,t+1)){
+      cvGetCols(layer->dH,&dH_next,n_hiddens*(t+1),n_hiddens*(t+2));
+      CV_CALL(cvGEMM( &dH_next, &Whh_submat, 1, &dH_curr, 1, &dH_curr, 0 ));
+    }
+    CV_CALL(cvActivateDer( CV_DNN_ACTIVATION_TANH, &WX_curr, &dH_curr, &dH_curr ));
+    // dWhh += dH_raw_t' * H_{t-1}
+    if (t>0){
+      cvGetCols(layer->H,&H_prev,n_hiddens*(t-1),n_hiddens*t);
+      CV_CALL(cvGEMM( &dH_curr, &H_prev, 1, &dWhh_submat, 1, &dWhh_submat, CV_GEMM_A_T ));
+    }else if (H0){
+      CV_CALL(cvGEMM( &dH_curr, H0, 1, &dWhh_submat, 1, &dWhh_submat, CV_GEMM_A_T ));
+    }
+  }
+
+  // dWxh += dH_raw' * X, dbh += dH_raw and dE_dX = dH_raw * Wxh for all time steps
+  CV_CALL(cvGEMM( &dHr, &Xr, 1, layer->dWxh, 1, layer->dWxh, CV_GEMM_A_T ));
+  cvReduce(&dHr,dhbias,0,CV_REDUCE_SUM);
+  cvAdd(&dhbiascol,cvReshape(dhbias,&dbias_hdr,0,n_hiddens),&dhbiascol);
+  CV_CALL(cvGEMM( &dHr, layer->Wxh, 1, 0, 0, &dXr, 0 ));
+
+  layer->n_grads++;
+
+  __END__;
+}
+
 /****************************************************************************************/
 void icvCNNRecurrentForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y) 
 {
   CV_FUNCNAME("icvCNNRecurrentForward");
   if ( !icvIsSimpleRNNLayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  if ( icvIsSequenceRNNLayer(_layer) ){
+    icvCNNRecurrentSequenceForward((CvDNNSimpleRNNLayer*)_layer,X,Y); return;
+  }
   __BEGIN__;
 
   CvDNNSimpleRNNLayer * layer = (CvDNNSimpleRNNLayer*)_layer;
@@ -140,17 +394,17 @@ void icvCNNRecurrentForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y)
   int n_hiddens = layer->n_hiddens;
   int batch_size = X->rows;
   CvMat * WX = 0, * WH = 0, * H_prev = 0, * H_curr = 0, * WX_curr, * WH_curr;
+  // scratch buffers are dead after each call, thus shared by all time steps
+  CvDNNLayer * ws_layer = ref_layer?(CvDNNLayer*)ref_layer:_layer;
 
   CV_ASSERT(X->rows == batch_size && X->cols == layer->n_input_planes);
 
   // memory allocation
   if (!ref_layer){
-    if (!layer->H && !layer->Y && !layer->WX && !layer->WH){
-      layer->H = cvCreateMat( seq_length, n_hiddens * batch_size, CV_32F ); 
-      layer->Y = cvCreateMat( seq_length, n_outputs * batch_size, CV_32F ); 
-      layer->WX = cvCreateMat( seq_length, n_hiddens * batch_size, CV_32F );
-      layer->WH = cvCreateMat( seq_length, n_outputs * batch_size, CV_32F );
-    }
+    CV_CALL(layer->H = cvGetWorkspaceMat(_layer,ICV_RNN_WS_H,seq_length,n_hiddens*batch_size,CV_32F));
+    CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_RNN_WS_Y,seq_length,n_outputs*batch_size,CV_32F));
+    CV_CALL(layer->WX = cvGetWorkspaceMat(_layer,ICV_RNN_WS_WX,seq_length,n_hiddens*batch_size,CV_32F));
+    CV_CALL(layer->WH = cvGetWorkspaceMat(_layer,ICV_RNN_WS_WH,seq_length,n_outputs*batch_size,CV_32F));
     cvZero(layer->H);cvZero(layer->Y);cvZero(layer->WX);cvZero(layer->WH);
   }
   CvMat * Wxh = ref_layer?ref_layer->Wxh:layer->Wxh;
@@ -161,31 +415,31 @@ void icvCNNRecurrentForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y)
   CvMat * layerWX = ref_layer?ref_layer->WX:layer->WX;
   CvMat * layerWH = ref_layer?ref_layer->WH:layer->WH;
   CV_ASSERT(cvGetSize(layerH)==cvGetSize(layerWX));
-  CV_CALL(WX = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero( WX );
-  CV_CALL(WH = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero( WH );
-  CV_CALL(H_prev = cvCreateMat( 1, n_hiddens * batch_size, CV_32F )); cvZero(H_prev);
-  CV_CALL(H_curr = cvCreateMat( 1, n_hiddens * batch_size, CV_32F )); cvZero(H_curr);
-  CV_CALL(WX_curr = cvCreateMat( 1, n_hiddens * batch_size, CV_32F )); cvZero( WX_curr );
-  CV_CALL(WH_curr = cvCreateMat( 1, n_outputs * batch_size, CV_32F )); cvZero( WH_curr );
+  CV_CALL(WX = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WX_BATCH,batch_size, n_hiddens, CV_32F)); cvZero( WX );
+  CV_CALL(WH = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WH_BATCH,batch_size, n_hiddens, CV_32F)); cvZero( WH );
+  CV_CALL(H_prev = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_H_PREV,1, n_hiddens * batch_size, CV_32F)); cvZero(H_prev);
+  CV_CALL(H_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_H_CURR,1, n_hiddens * batch_size, CV_32F)); cvZero(H_curr);
+  CV_CALL(WX_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WX_CURR,1, n_hiddens * batch_size, CV_32F)); cvZero( WX_curr );
+  CV_CALL(WH_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WH_CURR,1, n_outputs * batch_size, CV_32F)); cvZero( WH_curr );
   
   // bias on last column vector
   CV_CALL(cvGetCols( Whh, &Whh_submat, 0, Whh->cols-1));
   CV_CALL(cvGetCols( Why, &Why_submat, 0, Why->cols-1));
   CV_CALL(cvGetCol( Whh, &hbiascol, Whh->cols-1));
   CV_CALL(cvGetCol( Why, &ybiascol, Why->cols-1));
-  CvMat * hbias = cvCreateMat(hbiascol.rows,batch_size,CV_32F);
-  CvMat * ybias = cvCreateMat(ybiascol.rows,batch_size,CV_32F);
+  CvMat * hbias = 0;
+  CV_CALL(hbias = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_HBIAS,hbiascol.rows,batch_size,CV_32F));
+  CvMat * ybias = 0;
+  CV_CALL(ybias = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_YBIAS,ybiascol.rows,batch_size,CV_32F));
   cvRepeat(&hbiascol,hbias);
   cvRepeat(&ybiascol,ybias);
 
   // hidden states
   CvMat H_prev_hdr, H_curr_hdr, WX_curr_hdr, WH_curr_hdr, Y_curr_hdr;
   if (layer->time_index==0){ 
-#if 1
-    cvZero(H_prev); // LOGW("previous state should be reused.");
-#else
-    cvGetRow(layerH,&H_prev_hdr,layer->seq_length-1); cvCopy(&H_prev_hdr,H_prev);
-#endif
+    // a copy per time step starts each sequence from zero states, states
+    // are carried over between batches by stateful layers in sequence mode
+    cvZero(H_prev);
   }else{
     cvGetRow(layerH,&H_prev_hdr,layer->time_index-1); cvCopy(&H_prev_hdr,H_prev);
   }
@@ -200,42 +454,31 @@ void icvCNNRecurrentForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y)
   CV_CALL(cvGEMM( X, Wxh, 1, 0, 1, WX, CV_GEMM_B_T ));
   CV_CALL(cvGEMM( &H_prev_reshaped, &Whh_submat, 1, hbias, 1, WH, CV_GEMM_B_T+CV_GEMM_C_T ));  
   cvAdd(WX,WH,&H_curr_reshaped);
-  cvCopy(&H_curr_reshaped,&WX_curr_reshaped);
   
-  // activation for hidden states, relu and tahn is preferred
-  cvTanh( H_curr, H_curr ); 
+  // activation for hidden states, relu and tahn is preferred,
+  // pre-activation values are kept in WX_curr in the same pass
+  CV_CALL(cvActivate( CV_DNN_ACTIVATION_TANH, &H_curr_reshaped, 0, &WX_curr_reshaped, &H_curr_reshaped ));
 
   // get H, Y for current time_index, output Y_curr_hdr, H_curr_hdr
   cvGetRow(layerH,&H_curr_hdr,layer->time_index); cvCopy(H_curr,&H_curr_hdr);
   cvGetRow(layerY,&Y_curr_hdr,layer->time_index);
-  CvMat * Y_curr = cvCreateMat(batch_size,n_outputs,CV_32F); cvZero(Y_curr);
+  CvMat * Y_curr = 0;
+  CV_CALL(Y_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_Y_CURR,batch_size,n_outputs,CV_32F));cvZero(Y_curr);
   CvMat Y_curr_reshape_hdr; cvReshape(&Y_curr_hdr,&Y_curr_reshape_hdr,0,batch_size);
   CV_ASSERT(cvCountNAN(&Y_curr_hdr)<1);
 
-  // Y = activate(Why * H + by)
+  // Y = activate(Why * H + by), keeping Why * H + by in WH_curr
   cvGEMM( &H_curr_reshaped, &Why_submat, 1, ybias, 1, Y_curr, CV_GEMM_B_T+CV_GEMM_C_T );
-  cvCopy(Y_curr,&WH_curr_reshaped); 
-  CV_ASSERT(cvCountNonZero(&WH_curr_reshaped)>1);
   CV_ASSERT(cvCountNAN(Y_curr)<1);
-  CV_CALL(cvCopy(WH_curr,&WH_curr_hdr));          // copy to layer->WH
-
-  // apply activation to output
-  if (!strcmp(layer->activation,"sigmoid")){
-    CV_CALL(cvSigmoid( &Y_curr_hdr, &Y_curr_hdr )); 
-  }else if (!strcmp(layer->activation,"tanh")){
-    CV_CALL(cvTanh( &Y_curr_hdr, &Y_curr_hdr )); 
-  }else if (!strcmp(layer->activation,"relu")){
-    CV_CALL(cvReLU( &Y_curr_hdr, &Y_curr_hdr )); 
-  }else if (!strcmp(layer->activation,"softmax")){
+  if (layer->activation_type==CV_DNN_ACTIVATION_SOFTMAX){
     CV_ASSERT(Y_curr->cols==n_outputs && Y_curr->rows==batch_size);
     CV_ASSERT(cvSdv(Y_curr)<10.f);
-    cvSoftmax(Y_curr,Y_curr);
-  }else{
-    CV_ERROR(CV_StsBadArg,"invalid output activation type for RNN layer, `softmax` is prefered.");
   }
+  CV_CALL(cvActivate( layer->activation_type, Y_curr, 0, &WH_curr_reshaped, Y_curr ));
+  CV_ASSERT(cvCountNonZero(&WH_curr_reshaped)>1);
+  CV_CALL(cvCopy(WH_curr,&WH_curr_hdr));          // copy to layer->WH
   cvCopy(Y_curr,&Y_curr_reshape_hdr);
   CV_ASSERT(cvCountNAN(Y_curr)<1);
-  if (Y_curr){cvReleaseMat(&Y_curr);Y_curr=0;}
 
   // copy layer->Y to output variable Y
 #if 0
@@ -249,15 +492,6 @@ void icvCNNRecurrentForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y)
     cvCopy(&layer_Y_submat_hdr,&Y_submat_hdr);
   }
 #endif
-    
-  if (WX){cvReleaseMat(&WX);WX=0;}
-  if (WH){cvReleaseMat(&WH);WH=0;}
-  if (H_prev){cvReleaseMat(&H_prev);H_prev=0;}
-  if (H_curr){cvReleaseMat(&H_curr);H_curr=0;}
-  if (WX_curr){cvReleaseMat(&WX_curr);WX_curr=0;}
-  if (WH_curr){cvReleaseMat(&WH_curr);WH_curr=0;}
-  if (hbias){cvReleaseMat(&hbias);hbias=0;}
-  if (ybias){cvReleaseMat(&ybias);ybias=0;}
 
   __END__;
 }
@@ -273,17 +507,22 @@ void icvCNNRecurrentForward( CvDNNLayer* _layer, const CvMat* X, CvMat * Y)
    Input parameter <dE_dY> is the partial derivative of the
    loss function with respect to the planes components
    of the current layer. */
-void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
+void icvCNNRecurrentBackward( CvDNNLayer* _layer, int /*t*/,
                                      const CvMat * X, const CvMat * _dE_dY, CvMat * dE_dX )
 {
   CV_FUNCNAME( "icvCNNRecurrentBackward" );
   if ( !icvIsSimpleRNNLayer(_layer) ) { CV_ERROR( CV_StsBadArg, "Invalid layer" ); }
+  if ( icvIsSequenceRNNLayer(_layer) ){
+    icvCNNRecurrentSequenceBackward((CvDNNSimpleRNNLayer*)_layer,X,_dE_dY,dE_dX); return;
+  }
 
   __BEGIN__;
 
   CvDNNSimpleRNNLayer * layer = (CvDNNSimpleRNNLayer*)_layer;
   CvDNNSimpleRNNLayer * ref_layer = (CvDNNSimpleRNNLayer*)layer->ref_layer;
   CvMat * dE_dY = (CvMat*)_dE_dY;
+  // scratch buffers are dead after each call, thus shared by all time steps
+  CvDNNLayer * ws_layer = ref_layer?(CvDNNLayer*)ref_layer:_layer;
   
   // TODO: compute average from all output_layers
   int n_output_layers = ref_layer?ref_layer->output_layers.size():layer->output_layers.size();
@@ -291,7 +530,8 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
   if (n_output_layers){
     const int n_Y_planes = layer->n_output_planes;
     const int Y_plane_size   = layer->output_height*layer->output_width;
-    dE_dY = cvCreateMat(batch_size,Y_plane_size*n_Y_planes,CV_32F); cvZero(dE_dY);
+    CV_CALL(dE_dY = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DEDY,batch_size,Y_plane_size*n_Y_planes,CV_32F));
+    cvZero(dE_dY);
     for (int li=0;li<n_output_layers;li++){
       CvDNNLayer * output_layer = ref_layer?ref_layer->output_layers[li]:layer->output_layers[li];
       if (icvIsDenseLayer(output_layer)){
@@ -328,17 +568,19 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
   if ( !ref_layer ){ CV_ASSERT(layer->H && layer->Y && layer->WX && layer->WH); }
   if ( ref_layer ){
     if ( layer->time_index==seq_length-1 ){  // assuming last layer
-      if (!ref_layer->dH){ 
-        CV_ASSERT(!ref_layer->dWxh && !ref_layer->dWhh && !ref_layer->dWhy);
-        ref_layer->dH   = cvCreateMat(layerH->rows,  layerH->cols,  CV_32F);
-        ref_layer->dWxh = cvCreateMat(layer_Wxh->rows,layer_Wxh->cols,CV_32F);
-        ref_layer->dWhh = cvCreateMat(layer_Whh->rows,layer_Whh->cols,CV_32F);
-        ref_layer->dWhy = cvCreateMat(layer_Why->rows,layer_Why->cols,CV_32F);
-      }
+      CV_CALL(ref_layer->dH = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DH,layerH->rows,layerH->cols,CV_32F));
+      CV_CALL(ref_layer->dWxh = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DWXH,layer_Wxh->rows,layer_Wxh->cols,CV_32F));
+      CV_CALL(ref_layer->dWhh = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DWHH,layer_Whh->rows,layer_Whh->cols,CV_32F));
+      CV_CALL(ref_layer->dWhy = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DWHY,layer_Why->rows,layer_Why->cols,CV_32F));
+      // gradients of weights shared by all time steps are summed, over 
+      // all sequences passed backward since last step
       cvZero(ref_layer->dH  ); layer_dH  =ref_layer->dH  ;
-      cvZero(ref_layer->dWxh); layer_dWxh=ref_layer->dWxh;
-      cvZero(ref_layer->dWhh); layer_dWhh=ref_layer->dWhh;
-      cvZero(ref_layer->dWhy); layer_dWhy=ref_layer->dWhy;
+      if (!ref_layer->n_grads){
+        cvZero(ref_layer->dWxh); cvZero(ref_layer->dWhh); cvZero(ref_layer->dWhy);
+      }
+      layer_dWxh=ref_layer->dWxh;
+      layer_dWhh=ref_layer->dWhh;
+      layer_dWhy=ref_layer->dWhy;
     }else{ 
       CV_ASSERT(dE_dY->cols==n_outputs && 
                 layer_dH==ref_layer->dH && layer_dWxh==ref_layer->dWxh && 
@@ -356,22 +598,22 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
   }
   
   // memory allocation
-  CV_CALL(WX = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero( WX );
-  CV_CALL(WH = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero( WH );
-  CV_CALL(H_prev = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero(H_prev);
-  CV_CALL(H_curr = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero(H_curr);
-  CV_CALL(WX_curr = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero(WX_curr);
-  CV_CALL(WH_curr = cvCreateMat( batch_size, n_outputs, CV_32F )); cvZero(WH_curr);
-  CV_CALL(dE_dY_curr = cvCreateMat( batch_size, n_outputs, CV_32F )); cvZero(dE_dY_curr);
-  CV_CALL(dE_dY_afder = cvCreateMat( batch_size, n_outputs, CV_32F )); cvZero(dE_dY_afder);
-  CV_CALL(dH_curr = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero(dH_curr);
-  CV_CALL(dH_next = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero(dH_next);
-  CV_CALL(dH_raw  = cvCreateMat( batch_size, n_hiddens, CV_32F )); cvZero(dH_raw);
+  CV_CALL(WX = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WX_BATCH,batch_size, n_hiddens, CV_32F)); cvZero( WX );
+  CV_CALL(WH = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WH_BATCH,batch_size, n_hiddens, CV_32F)); cvZero( WH );
+  CV_CALL(H_prev = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_H_PREV,batch_size, n_hiddens, CV_32F)); cvZero(H_prev);
+  CV_CALL(H_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_H_CURR,batch_size, n_hiddens, CV_32F)); cvZero(H_curr);
+  CV_CALL(WX_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WX_CURR,batch_size, n_hiddens, CV_32F)); cvZero(WX_curr);
+  CV_CALL(WH_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_WH_CURR,batch_size, n_outputs, CV_32F)); cvZero(WH_curr);
+  CV_CALL(dE_dY_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DEDY_CURR,batch_size, n_outputs, CV_32F)); cvZero(dE_dY_curr);
+  CV_CALL(dE_dY_afder = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DEDY_AFDER,batch_size, n_outputs, CV_32F)); cvZero(dE_dY_afder);
+  CV_CALL(dH_curr = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DH_CURR,batch_size, n_hiddens, CV_32F)); cvZero(dH_curr);
+  CV_CALL(dH_next = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DH_NEXT,batch_size, n_hiddens, CV_32F)); cvZero(dH_next);
+  CV_CALL(dH_raw  = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DH_RAW,batch_size, n_hiddens, CV_32F)); cvZero(dH_raw);
   // follow variables are added to layer_dWxh,layer_dWhh,layer_dWhy, 
   // and they are later added to layer_Wxh,layer_Whh,layer_Why
-  CV_CALL(dWxh = cvCreateMat( layer_Wxh->rows, layer_Wxh->cols, CV_32F )); cvZero(dWxh);
-  CV_CALL(dWhh = cvCreateMat( layer_Whh->rows, layer_Whh->cols, CV_32F )); cvZero(dWhh);
-  CV_CALL(dWhy = cvCreateMat( layer_Why->rows, layer_Why->cols, CV_32F )); cvZero(dWhy);
+  CV_CALL(dWxh = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DWXH_CURR,layer_Wxh->rows, layer_Wxh->cols, CV_32F)); cvZero(dWxh);
+  CV_CALL(dWhh = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DWHH_CURR,layer_Whh->rows, layer_Whh->cols, CV_32F)); cvZero(dWhh);
+  CV_CALL(dWhy = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DWHY_CURR,layer_Why->rows, layer_Why->cols, CV_32F)); cvZero(dWhy);
 
   // bias on last column vector
   CV_CALL(cvGetCols( layer_Whh, &layer_Whh_submat, 0, layer_Whh->cols-1));
@@ -384,8 +626,10 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
   CV_CALL(cvGetCols( layer_dWhy, &layer_dWhy_submat, 0, layer_dWhy->cols-1));
   CV_CALL(cvGetCol(  layer_dWhh, &layer_dhbiascol,      layer_dWhh->cols-1));
   CV_CALL(cvGetCol(  layer_dWhy, &layer_dybiascol,      layer_dWhy->cols-1));
-  CvMat * layer_dhbias = cvCreateMat(layer_dhbiascol.rows,batch_size,CV_32F); 
-  CvMat * layer_dybias = cvCreateMat(layer_dybiascol.rows,batch_size,CV_32F);  
+  CvMat * layer_dhbias = 0;
+  CV_CALL(layer_dhbias = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_HBIAS,layer_dhbiascol.rows,batch_size,CV_32F));
+  CvMat * layer_dybias = 0;
+  CV_CALL(layer_dybias = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_YBIAS,layer_dybiascol.rows,batch_size,CV_32F));
   cvRepeat(&layer_dhbiascol,layer_dhbias);
   cvRepeat(&layer_dybiascol,layer_dybias);
 
@@ -436,34 +680,25 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
 #endif
   
   // output activation derivative
-  if (!strcmp(layer->activation,"sigmoid")){
-    cvSigmoidDer(WH_curr,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY_curr,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"tanh")){
-    cvTanhDer(WH_curr,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY_curr,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"relu")){
-    cvReLUDer(WH_curr,dE_dY_afder);
-    cvMul(dE_dY_afder,dE_dY_curr,dE_dY_afder);
-  }else if (!strcmp(layer->activation,"softmax")){
+  if (layer->activation_type==CV_DNN_ACTIVATION_SOFTMAX){
     cvCopy(dE_dY_curr,dE_dY_afder);    // softmax for classification
   }else{
-    CV_ERROR(CV_StsBadArg,"invalid output activation type for RNN layer, `softmax` is prefered.");
+    CV_CALL(cvActivateDer(layer->activation_type,WH_curr,dE_dY_curr,dE_dY_afder));
   }
 
   // dWhy += dE_dY_afder * H_curr'
   CV_GEMM(dE_dY_afder,H_curr,1.f,0,1.f,&dWhy_submat,CV_GEMM_A_T);
-  if (time_index==seq_length-1){CV_ASSERT(cvSdv(&layer_dWhy_submat)<1e-5f);}
+  if (time_index==seq_length-1 && !ws_layer->n_grads){CV_ASSERT(cvSdv(&layer_dWhy_submat)<1e-5f);}
   else{CV_ASSERT(cvSdv(&layer_dWhy_submat)>0.f);}
   cvAdd(&layer_dWhy_submat,&dWhy_submat,&layer_dWhy_submat);
   
   // dby += dy
-  CvMat * dE_dY_afder_transpose = cvCreateMat(dE_dY_afder->cols,dE_dY_afder->rows,CV_32F);
+  CvMat * dE_dY_afder_transpose = 0;
+  CV_CALL(dE_dY_afder_transpose = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DEDY_AFDER_T,dE_dY_afder->cols,dE_dY_afder->rows,CV_32F));
   cvTranspose(dE_dY_afder,dE_dY_afder_transpose);
   cvAdd(layer_dybias,dE_dY_afder_transpose,layer_dybias);
   cvReduce(layer_dybias,&layer_dybiascol,-1,CV_REDUCE_AVG); // ::TODO:: average dybias update ???
   cvZero(layer_dybias);
-  cvReleaseMat(&dE_dY_afder_transpose);
 
   // dH_curr = Why * dy + dH_next
   CV_GEMM(dE_dY_afder,&layer_Why_submat,1.f,dH_next,1.f,dH_curr,0);
@@ -471,12 +706,12 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
   cvPow(H_curr,dH_raw,2.f); cvSubRS(dH_raw,cvScalar(1.f),dH_raw);
   cvMul(dH_raw, dH_curr, dH_raw);
   // dhbias += dH_raw
-  CvMat * dH_raw_transpose = cvCreateMat(dH_raw->cols,dH_raw->rows,CV_32F);
+  CvMat * dH_raw_transpose = 0;
+  CV_CALL(dH_raw_transpose = cvGetWorkspaceMat(ws_layer,ICV_RNN_WS_DH_RAW_T,dH_raw->cols,dH_raw->rows,CV_32F));
   cvTranspose(dH_raw,dH_raw_transpose);
   cvAdd(layer_dhbias,dH_raw_transpose,layer_dhbias);
   cvReduce(layer_dhbias,&layer_dhbiascol,-1,CV_REDUCE_AVG); // ::TODO:: average dhbias update ???
   cvZero(layer_dhbias);
-  cvReleaseMat(&dH_raw_transpose);
 
   // dWxh += dH_raw * X_curr'
   CV_ASSERT(dH_raw->rows==batch_size && X->rows==batch_size);
@@ -497,37 +732,8 @@ void icvCNNRecurrentBackward( CvDNNLayer* _layer, int t,
   CvMat dH_curr_reshape_hdr; cvReshape(dH_curr,&dH_curr_reshape_hdr,0,1);
   cvCopy(&dH_curr_reshape_hdr,&dH_curr_hdr); CV_ASSERT(cvCountNAN(&dH_curr_hdr)<1);
 
-  // 2) update weights
-  if (layer->time_index==0){
-    float eta = -layer->init_learn_rate*cvInvSqrt(t);
-    CvMat * W[5] = {layer_Wxh,&layer_Whh_submat,&layer_Why_submat,&layer_hbiascol,&layer_ybiascol};
-    CvMat * dW[5] = {layer_dWxh,&layer_dWhh_submat,&layer_dWhy_submat,
-                     &layer_dhbiascol,&layer_dybiascol};
-    for (int ii=0;ii<5;ii++){ 
-      CV_ASSERT(cvCountNAN(dW[ii])<1 && cvCountNAN(W[ii])<1);
-      cvMaxS(dW[ii],-5,dW[ii]); cvMinS(dW[ii],5,dW[ii]); 
-      cvScaleAdd( dW[ii], cvScalar(eta), W[ii], W[ii] );
-    }
-  }
-
-  if (n_output_layers){cvReleaseMat(&dE_dY);dE_dY=0;}
-
-  if (layer_dhbias){cvReleaseMat(&layer_dhbias);layer_dhbias=0;}
-  if (layer_dybias){cvReleaseMat(&layer_dybias);layer_dybias=0;}
-  if (WX){cvReleaseMat(&WX);WX=0;}
-  if (WH){cvReleaseMat(&WH);WH=0;}
-  if (H_prev){cvReleaseMat(&H_prev);H_prev=0;}
-  if (H_curr){cvReleaseMat(&H_curr);H_curr=0;}
-  if (WX_curr){cvReleaseMat(&WX_curr);WX_curr=0;}
-  if (WH_curr){cvReleaseMat(&WH_curr);WH_curr=0;}
-  if (dE_dY_curr){cvReleaseMat(&dE_dY_curr);dE_dY_curr=0;}
-  if (dE_dY_afder){cvReleaseMat(&dE_dY_afder);dE_dY_afder=0;}
-  if (dH_curr){cvReleaseMat(&dH_curr);dH_curr=0;}
-  if (dH_next){cvReleaseMat(&dH_next);dH_next=0;}
-  if (dH_raw ){cvReleaseMat(&dH_raw );dH_raw =0;}
-  if (dWxh){cvReleaseMat(&dWxh);dWxh=0;}
-  if (dWhh){cvReleaseMat(&dWhh);dWhh=0;}
-  if (dWhy){cvReleaseMat(&dWhy);dWhy=0;}
+  // sequence is complete, its gradients are applied by icvCNNRecurrentStep
+  if (layer->time_index==0){ layer->n_grads++; }
 
   __END__;
 }
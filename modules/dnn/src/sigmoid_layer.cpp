@@ -37,9 +37,7 @@ void cvSigmoid(CvMat * src, CvMat * dst)
   if (CV_MAT_TYPE(src->type)==CV_32F){
     float * srcptr = src->data.fl;
     float * dstptr = dst->data.fl;
-    for (ii=0;ii<elemsize;ii++){
-      dstptr[ii] = 1.f/(1.f+exp(-srcptr[ii]));
-    }
+    icvSigmoid_32f(srcptr,dstptr,elemsize);
   }else if (CV_MAT_TYPE(src->type)==CV_64F){
     double * srcptr = src->data.db;
     double * dstptr = dst->data.db;
@@ -55,9 +53,30 @@ void cvSigmoid(CvMat * src, CvMat * dst)
 
 //! compute derivative of logistic function : y = (1-sig(x))*sig(x)
 void cvSigmoidDer(CvMat * src, CvMat * dst) {
-  cvSigmoid(src,dst);
-  CvMat * tmp = cvCloneMat(dst);
-  cvSubRS(dst,cvScalar(1),dst);cvMul(tmp,dst,dst);
-  cvReleaseMat(&tmp);
+  CV_FUNCNAME("cvSigmoidDer");
+  int ii,elemsize=src->rows*src->cols;
+  __CV_BEGIN__
+  {
+  CV_ASSERT(src->rows==dst->rows && src->cols==dst->cols);
+  CV_ASSERT(CV_MAT_TYPE(src->type)==CV_MAT_TYPE(dst->type));
+  if (CV_MAT_TYPE(src->type)==CV_32F){
+    float * srcptr = src->data.fl;
+    float * dstptr = dst->data.fl;
+    icvSigmoid_32f(srcptr,dstptr,elemsize);
+    for (ii=0;ii<elemsize;ii++){
+      dstptr[ii] = dstptr[ii]*(1.f-dstptr[ii]);
+    }
+  }else if (CV_MAT_TYPE(src->type)==CV_64F){
+    double * srcptr = src->data.db;
+    double * dstptr = dst->data.db;
+    for (ii=0;ii<elemsize;ii++){
+      double sig = 1./(1.+exp(-srcptr[ii]));
+      dstptr[ii] = sig*(1.-sig);
+    }
+  }else{
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
+  }
+  }
+  __CV_END__
 }
 
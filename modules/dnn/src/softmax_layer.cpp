@@ -25,92 +25,146 @@
 
 #include "_dnn.h"
  
-//! assuming column vectors (a column is a sample)
-void cvSoftmax_old(CvMat * src, CvMat * dst, int flag){
-  CV_FUNCNAME("cvSoftmax");
-  __BEGIN__;
-  CV_ASSERT(cvCountNAN(src)<1);
-  cvExp(src,dst);
-  CV_ASSERT(cvCountNAN(dst)<1);
-  const int dtype = CV_MAT_TYPE(src->type);
-  CvMat * sum = cvCreateMat(1,src->cols,dtype);
-  CvMat * sum_repeat = cvCreateMat(src->rows,src->cols,dtype);
-  cvReduce(dst,sum,-1,CV_REDUCE_SUM);
-  CV_ASSERT(cvCountNAN(sum)<1);
-  cvRepeat(sum,sum_repeat);
-  cvDiv(dst,sum_repeat,dst);
-  cvReleaseMat(&sum);
-  cvReleaseMat(&sum_repeat);
-  __END__;
+//! assuming row vectors (a row is a sample), computed in place row by row
+//! without temporary matrices, max value of each row is subtracted for 
+//! numerical stability.
+template<typename T>
+static void icvSoftmaxRow(const T * src, T * dst, const int n)
+{
+  T maxval = src[0], sum = 0;
+  for (int ii=1;ii<n;ii++){ if (src[ii]>maxval){maxval=src[ii];} }
+  for (int ii=0;ii<n;ii++){ dst[ii] = exp(src[ii]-maxval); sum += dst[ii]; }
+  const T scale = T(1)/sum;
+  for (int ii=0;ii<n;ii++){ dst[ii] *= scale; }
 }
 
-void cvSoftmaxDer_old(CvMat * X, CvMat * dE_dY, CvMat * dE_dY_afder) {
-  CV_FUNCNAME("cvSoftmaxDer");
-  __BEGIN__;
-  const int nr = X->rows, nc = X->cols, dtype = CV_MAT_TYPE(X->type);
-  CvMat * Y = cvCreateMat(nr, nc, dtype);
-  CvMat * dE_dY_transpose = cvCreateMat(nr, nc, dtype);
-  CvMat * sum = cvCreateMat(1, nc, dtype);
-  CvMat * sum_repeat = cvCreateMat(nr, nc, dtype);
-  cvSoftmax(X, Y);
-  if (dE_dY->rows==nc && dE_dY->cols==nr){
-    cvTranspose(dE_dY,dE_dY_transpose);
-    cvMul(Y,dE_dY_transpose,dE_dY_afder);
-  }else{
-    cvMul(Y,dE_dY,dE_dY_afder);
+//! float rows take the vectorized exp, the shifted input is exponentiated
+//! in place in <dst>.
+static void icvSoftmaxRow(const float * src, float * dst, const int n)
+{
+  float maxval = src[0], sum = 0;
+  for (int ii=1;ii<n;ii++){ if (src[ii]>maxval){maxval=src[ii];} }
+  for (int ii=0;ii<n;ii++){ dst[ii] = src[ii]-maxval; }
+  icvExp_32f(dst,dst,n);
+  for (int ii=0;ii<n;ii++){ sum += dst[ii]; }
+  const float scale = 1.f/sum;
+  for (int ii=0;ii<n;ii++){ dst[ii] *= scale; }
+}
+
+//! dE_dY_afder = Y.*(dE_dY - sum(Y.*dE_dY)) with Y = softmax(X), where
+//! dE_dY can be accessed with stride <dstep> for transposed input.
+template<typename T>
+static void icvSoftmaxDerRow(const T * src, const T * dE_dY, const int dstep, 
+                             T * dE_dY_afder, const int n)
+{
+  T maxval = src[0], sum = 0, dot = 0;
+  for (int ii=1;ii<n;ii++){ if (src[ii]>maxval){maxval=src[ii];} }
+  for (int ii=0;ii<n;ii++){ sum += exp(src[ii]-maxval); }
+  const T scale = T(1)/sum;
+  for (int ii=0;ii<n;ii++){ dot += exp(src[ii]-maxval)*scale*dE_dY[dstep*ii]; }
+  for (int ii=0;ii<n;ii++){
+    dE_dY_afder[ii] = exp(src[ii]-maxval)*scale*(dE_dY[dstep*ii]-dot);
   }
-  cvReduce(dE_dY_afder,sum,-1,CV_REDUCE_SUM);
-  cvRepeat(sum,sum_repeat);
-  cvMul(Y,sum_repeat,sum_repeat);
-  cvSub(dE_dY_afder,sum_repeat,dE_dY_afder);
-  cvReleaseMat(&dE_dY_transpose);
-  cvReleaseMat(&sum);
-  cvReleaseMat(&sum_repeat);
-  cvReleaseMat(&Y);
-  __END__;
 }
 
-//! assuming row vectors (a row is a sample)
+//! same as above, with softmax kept in <dE_dY_afder> instead of being
+//! recomputed, which requires <dE_dY_afder> not to overlap <dE_dY>.
+static void icvSoftmaxDerRow(const float * src, const float * dE_dY, const int dstep,
+                             float * dE_dY_afder, const int n)
+{
+  float dot = 0;
+  icvSoftmaxRow(src,dE_dY_afder,n);
+  for (int ii=0;ii<n;ii++){ dot += dE_dY_afder[ii]*dE_dY[dstep*ii]; }
+  for (int ii=0;ii<n;ii++){ dE_dY_afder[ii] *= dE_dY[dstep*ii]-dot; }
+}
+
+//! dE_dX = softmax(X)-target, gradient of cross entropy loss 
+//! -sum(target.*log(softmax(X))) with respect to X.
+template<typename T>
+static void icvSoftmaxCrossEntropyDerRow(const T * src, const T * target, T * dE_dX, const int n)
+{
+  icvSoftmaxRow(src,dE_dX,n);
+  for (int ii=0;ii<n;ii++){ dE_dX[ii] -= target[ii]; }
+}
+
 void cvSoftmax(CvMat * src, CvMat * dst){
   CV_FUNCNAME("cvSoftmax");
   __BEGIN__;
   CV_ASSERT(cvCountNAN(src)<1);
-  cvExp(src,dst);
+  CV_ASSERT(CV_ARE_SIZES_EQ(src,dst) && CV_ARE_TYPES_EQ(src,dst));
+  const int nr = src->rows, nc = src->cols;
+  if (CV_MAT_TYPE(src->type)==CV_32F){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxRow((float*)(src->data.ptr+src->step*ri),(float*)(dst->data.ptr+dst->step*ri),nc);
+    }
+  }else if (CV_MAT_TYPE(src->type)==CV_64F){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxRow((double*)(src->data.ptr+src->step*ri),(double*)(dst->data.ptr+dst->step*ri),nc);
+    }
+  }else{
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
+  }
   CV_ASSERT(cvCountNAN(dst)<1);
-  const int dtype = CV_MAT_TYPE(src->type);
-  CvMat * sum = cvCreateMat(src->rows,1,dtype);
-  CvMat * sum_repeat = cvCreateMat(src->rows,src->cols,dtype);
-  cvReduce(dst,sum,-1,CV_REDUCE_SUM);
-  CV_ASSERT(cvCountNAN(sum)<1);
-  cvRepeat(sum,sum_repeat);
-  cvDiv(dst,sum_repeat,dst);
-  cvReleaseMat(&sum);
-  cvReleaseMat(&sum_repeat);
   __END__;
 }
 
 void cvSoftmaxDer(CvMat * X, CvMat * dE_dY, CvMat * dE_dY_afder) {
   CV_FUNCNAME("cvSoftmaxDer");
   __BEGIN__;
-  const int nr = X->rows, nc = X->cols, dtype = CV_MAT_TYPE(X->type);
-  CvMat * Y = cvCreateMat(nr, nc, dtype);
-  CvMat * dE_dY_transpose = cvCreateMat(nr, nc, dtype);
-  CvMat * sum = cvCreateMat(nr, 1, dtype);
-  CvMat * sum_repeat = cvCreateMat(nr, nc, dtype);
-  cvSoftmax(X, Y);
-  if (dE_dY->rows==nc && dE_dY->cols==nr){
-    cvTranspose(dE_dY,dE_dY_transpose);
-    cvMul(Y,dE_dY_transpose,dE_dY_afder);
+  const int nr = X->rows, nc = X->cols, elemsize = CV_ELEM_SIZE(X->type);
+  CV_ASSERT(CV_ARE_SIZES_EQ(X,dE_dY_afder) && CV_ARE_TYPES_EQ(X,dE_dY_afder));
+  CV_ASSERT(CV_ARE_TYPES_EQ(X,dE_dY));
+  // dE_dY is either in the same shape as X, or transposed
+  const int transposed = (dE_dY->rows==nc && dE_dY->cols==nr && nr!=nc);
+  CV_ASSERT(transposed || CV_ARE_SIZES_EQ(X,dE_dY));
+  const int dstep = transposed?dE_dY->step/elemsize:1;
+  const int rstep = transposed?elemsize:dE_dY->step;
+  if (CV_MAT_TYPE(X->type)==CV_32F && dE_dY->data.ptr!=dE_dY_afder->data.ptr){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxDerRow((const float*)(X->data.ptr+X->step*ri),(const float*)(dE_dY->data.ptr+rstep*ri),dstep,
+                       (float*)(dE_dY_afder->data.ptr+dE_dY_afder->step*ri),nc);
+    }
+  }else if (CV_MAT_TYPE(X->type)==CV_32F){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxDerRow<float>((float*)(X->data.ptr+X->step*ri),(float*)(dE_dY->data.ptr+rstep*ri),dstep,
+                       (float*)(dE_dY_afder->data.ptr+dE_dY_afder->step*ri),nc);
+    }
+  }else if (CV_MAT_TYPE(X->type)==CV_64F){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxDerRow((double*)(X->data.ptr+X->step*ri),(double*)(dE_dY->data.ptr+rstep*ri),dstep,
+                       (double*)(dE_dY_afder->data.ptr+dE_dY_afder->step*ri),nc);
+    }
+  }else{
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
+  }
+  __END__;
+}
+
+/* Gradient of cross entropy between softmax of <X> and <target> with respect 
+   to <X>, computed row by row in a single call instead of the softmax 
+   followed by its jacobian. <dE_dX> may be the same as <X> but not <target>. */
+void cvSoftmaxCrossEntropyDer(const CvMat * X, const CvMat * target, CvMat * dE_dX)
+{
+  CV_FUNCNAME("cvSoftmaxCrossEntropyDer");
+  __BEGIN__;
+  const int nr = X->rows, nc = X->cols;
+  CV_ASSERT(CV_ARE_SIZES_EQ(X,target) && CV_ARE_TYPES_EQ(X,target));
+  CV_ASSERT(CV_ARE_SIZES_EQ(X,dE_dX) && CV_ARE_TYPES_EQ(X,dE_dX));
+  CV_ASSERT(target->data.ptr!=dE_dX->data.ptr);
+  if (CV_MAT_TYPE(X->type)==CV_32F){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxCrossEntropyDerRow((const float*)(X->data.ptr+X->step*ri),
+                                   (const float*)(target->data.ptr+target->step*ri),
+                                   (float*)(dE_dX->data.ptr+dE_dX->step*ri),nc);
+    }
+  }else if (CV_MAT_TYPE(X->type)==CV_64F){
+    for (int ri=0;ri<nr;ri++){
+      icvSoftmaxCrossEntropyDerRow((const double*)(X->data.ptr+X->step*ri),
+                                   (const double*)(target->data.ptr+target->step*ri),
+                                   (double*)(dE_dX->data.ptr+dE_dX->step*ri),nc);
+    }
   }else{
-    cvMul(Y,dE_dY,dE_dY_afder);
+    CV_ERROR(CV_StsBadArg,"Unsupported data type");
   }
-  cvReduce(dE_dY_afder,sum,-1,CV_REDUCE_SUM);
-  cvRepeat(sum,sum_repeat);
-  cvMul(Y,sum_repeat,sum_repeat);
-  cvSub(dE_dY_afder,sum_repeat,dE_dY_afder);
-  cvReleaseMat(&dE_dY_transpose);
-  cvReleaseMat(&sum);
-  cvReleaseMat(&sum_repeat);
-  cvReleaseMat(&Y);
   __END__;
 }
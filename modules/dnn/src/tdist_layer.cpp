@@ -26,6 +26,9 @@
 #include "_dnn.h"
 #include "cvimgwarp.h"
 
+// slot of workspace buffer keeping a copy of output
+#define ICV_TDIST_WS_Y   0
+
 /*-------------- functions for image cropping layer ------------------*/
 static void icvCNNTimeDistributedRelease( CvDNNLayer** p_layer );
 static void icvCNNTimeDistributedForward( CvDNNLayer* layer, const CvMat* X, CvMat* Y );
@@ -112,7 +115,8 @@ static void icvCNNTimeDistributedForward( CvDNNLayer * _layer, const CvMat * _X,
   }else{
     CV_ERROR(CV_StsBadArg,"invalid layer definition.");
   }
-  if (layer->Y){cvCopy(Y,layer->Y);}else{layer->Y=cvCloneMat(Y);}
+  CV_CALL(layer->Y = cvGetWorkspaceMat(_layer,ICV_TDIST_WS_Y,Y->rows,Y->cols,CV_32F));
+  cvCopy(Y,layer->Y);
   if (layer->visualize){ icvVisualizeCNNLayer((CvDNNLayer*)layer, Y); }
   __END__;
 }
@@ -122,4 +126,7 @@ static void icvCNNTimeDistributedBackward( CvDNNLayer* layer, int t,
 {
 }
 
-static void icvCNNTimeDistributedRelease( CvDNNLayer** p_layer ){}
+static void icvCNNTimeDistributedRelease( CvDNNLayer** p_layer )
+{
+  if (p_layer && *p_layer){cvReleaseWorkspaceMats(*p_layer);}
+}
@@ -0,0 +1,172 @@
+/** -*- c++ -*-
+ *
+ * \file   tensor.cpp
+ * \date   Sat Oct 17 10:12:31 2026
+ *
+ * \copyright
+ * Copyright (c) 2016 Liangfu Chen <liangfu.chen@nlpr.ia.ac.cn>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms are permitted
+ * provided that the above copyright notice and this paragraph are
+ * duplicated in all such forms and that any documentation,
+ * advertising materials, and other materials related to such
+ * distribution and use acknowledge that the software was developed
+ * by the Brainnetome Center & NLPR at Institute of Automation, CAS. The
+ * name of the Brainnetome Center & NLPR at Institute of Automation, CAS
+ * may not be used to endorse or promote products derived
+ * from this software without specific prior written permission.
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND WITHOUT ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, WITHOUT LIMITATION, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * \brief  binary tensor files, mapped into memory without parsing
+ */
+
+#include "_dnn.h"
+#include "cnn.h"
+
+#if defined(WIN32) || defined(WIN64)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define ICV_DNN_TENSOR_VERSION 1
+
+// leading part of the header page of a tensor file
+typedef struct CvDNNTensorHeader
+{
+  char magic[8];
+  int version;
+  // element type, as CV_MAT_TYPE
+  int type;
+  int rows;
+  int cols;
+}CvDNNTensorHeader;
+
+// header of a mapped tensor, <mat> points into the mapped file
+typedef struct CvDNNMappedTensor
+{
+  CvMat mat;
+  void * addr;
+  size_t length;
+}CvDNNMappedTensor;
+
+static int icvReadTensorHeader(FILE * fp, CvDNNTensorHeader * header)
+{
+  if (fread(header,sizeof(CvDNNTensorHeader),1,fp)!=1){return 0;}
+  return !memcmp(header->magic,CV_DNN_TENSOR_MAGIC,sizeof(header->magic));
+}
+
+ML_IMPL void cvSaveTensor(const char * filename, const CvMat * mat)
+{
+  FILE * fp = 0;
+  CV_FUNCNAME("cvSaveTensor");
+  __BEGIN__;
+  if (!CV_IS_MAT(mat)){CV_ERROR(CV_StsBadArg,"Invalid matrix");}
+  CvDNNTensorHeader header;
+  char page[CV_DNN_TENSOR_HEADER_SIZE];
+  const size_t rowsize = size_t(CV_ELEM_SIZE(mat->type))*mat->cols;
+  memset(&header,0,sizeof(CvDNNTensorHeader));
+  memcpy(header.magic,CV_DNN_TENSOR_MAGIC,sizeof(header.magic));
+  header.version = ICV_DNN_TENSOR_VERSION;
+  header.type = CV_MAT_TYPE(mat->type);
+  header.rows = mat->rows;
+  header.cols = mat->cols;
+  memset(page,0,sizeof(page));
+  memcpy(page,&header,sizeof(CvDNNTensorHeader));
+  fp = fopen(filename,"wb");
+  if (!fp){CV_ERROR(CV_StsError,"Can not open file for writing");}
+  if (fwrite(page,sizeof(page),1,fp)!=1){CV_ERROR(CV_StsError,"Failed to write tensor header");}
+  // rows are written one by one, the matrix may be a sub-matrix
+  for (int ii=0;ii<mat->rows;ii++){
+    if (fwrite(mat->data.ptr+size_t(mat->step)*ii,1,rowsize,fp)!=rowsize){
+      CV_ERROR(CV_StsError,"Failed to write tensor data");
+    }
+  }
+  __END__;
+  if (fp){fclose(fp);}
+}
+
+ML_IMPL int cvIsTensorFile(const char * filename)
+{
+  CvDNNTensorHeader header;
+  FILE * fp = fopen(filename,"rb");
+  if (!fp){return 0;}
+  int retval = icvReadTensorHeader(fp,&header);
+  fclose(fp);
+  return retval;
+}
+
+/* Returns header of a read-only matrix whose data is the payload of the
+   file, pages are loaded on first access instead of being parsed and copied. */
+ML_IMPL CvMat * cvMapTensor(const char * filename)
+{
+  CvDNNMappedTensor * tensor = 0;
+  FILE * fp = 0;
+  CV_FUNCNAME("cvMapTensor");
+  __BEGIN__;
+  CvDNNTensorHeader header;
+  size_t length = 0;
+  fp = fopen(filename,"rb");
+  if (!fp){CV_ERROR(CV_StsError,"Can not open tensor file");}
+  if (!icvReadTensorHeader(fp,&header)){CV_ERROR(CV_StsBadArg,"Not a tensor file");}
+  if (header.version!=ICV_DNN_TENSOR_VERSION){CV_ERROR(CV_StsBadArg,"Unsupported tensor version");}
+  if (header.rows<1 || header.cols<1 || CV_MAT_TYPE(header.type)!=header.type){
+    CV_ERROR(CV_StsBadArg,"Invalid tensor header");
+  }
+  length = CV_DNN_TENSOR_HEADER_SIZE+
+    size_t(CV_ELEM_SIZE(header.type))*size_t(header.cols)*size_t(header.rows);
+  fseek(fp,0,SEEK_END);
+  if (size_t(ftell(fp))<length){CV_ERROR(CV_StsBadSize,"Tensor file is truncated");}
+
+  CV_CALL(tensor = (CvDNNMappedTensor*)cvAlloc(sizeof(CvDNNMappedTensor)));
+  memset(tensor,0,sizeof(CvDNNMappedTensor));
+#if defined(WIN32) || defined(WIN64)
+  // no mapping, the file is read at once
+  CV_CALL(tensor->addr = cvAlloc(length));
+  fseek(fp,0,SEEK_SET);
+  if (fread(tensor->addr,1,length,fp)!=length){CV_ERROR(CV_StsError,"Failed to read tensor file");}
+#else
+  {
+  void * addr = mmap(0,length,PROT_READ,MAP_PRIVATE,fileno(fp),0);
+  if (addr==MAP_FAILED){CV_ERROR(CV_StsError,"Failed to map tensor file");}
+  tensor->addr = addr;
+  }
+#endif
+  tensor->length = length;
+  cvInitMatHeader(&tensor->mat,header.rows,header.cols,header.type,
+                  (uchar*)tensor->addr+CV_DNN_TENSOR_HEADER_SIZE);
+  __END__;
+  if (fp){fclose(fp);}
+  if (cvGetErrStatus()<0 && tensor){
+    CvMat * mat = &tensor->mat;
+    cvReleaseMappedTensor(&mat);
+    tensor = 0;
+  }
+  return tensor?&tensor->mat:0;
+}
+
+ML_IMPL void cvReleaseMappedTensor(CvMat ** p_mat)
+{
+  CV_FUNCNAME("cvReleaseMappedTensor");
+  __BEGIN__;
+  if (!p_mat){CV_ERROR(CV_StsNullPtr,"Null double pointer");}
+  if (*p_mat){
+    CvDNNMappedTensor * tensor = (CvDNNMappedTensor*)*p_mat;
+    if (tensor->addr){
+#if defined(WIN32) || defined(WIN64)
+      cvFree(&tensor->addr);
+#else
+      munmap(tensor->addr,tensor->length);
+#endif
+    }
+    cvFree(&tensor);
+    *p_mat = 0;
+  }
+  __END__;
+}
@@ -7,6 +7,15 @@
 
 #include "cvext_c.h"
 
+#if !defined(WIN32) && !defined(WIN64)
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
 typedef void (*CvActivationFunc)(CvMat *, CvMat *);
 typedef void (*CvActivationDerFunc)(CvMat *, CvMat *, CvMat *);
 
@@ -56,10 +65,10 @@ void cvCNNLayerGradCheck(CvDNNLayer * layer, CvMat * X, CvMat * Y, CvMat * targe
   CvMat * weights = cvCloneMat(layer->weights);
   CvMat * Y_less = cvCreateMat(Y->rows,Y->cols,dtype);
   CvMat * Y_more = cvCreateMat(Y->rows,Y->cols,dtype);
-  CvMat * dE_dY = cvCreateMat(Y->cols,Y->rows,dtype);
-  CvMat * dE_dX = cvCreateMat(X->cols,X->rows,dtype);
+  CvMat * dE_dY = cvCreateMat(Y->rows,Y->cols,dtype);
+  CvMat * dE_dX = cvCreateMat(X->rows,X->cols,dtype);
   cvCopy(weights,layer->weights); 
-  layer->forward(layer,X,Y); cvTranspose(target,dE_dY); cvAdd(Y,target,target);
+  layer->forward(layer,X,Y); cvCopy(target,dE_dY); cvAdd(Y,target,target);
   cvScale(dE_dY,dE_dY,-1.f); 
   layer->backward(layer,1,X,dE_dY,dE_dX); cvCopy(layer->dE_dW,grad1);
   for (int ridx=0;ridx<layer->weights->rows;ridx++){
@@ -116,6 +125,119 @@ TEST(ML_Softmax, gradcheck){
   // cvActivationGradCheck(cvSoftmax, cvSoftmaxDer, CV_32F);
   // cvActivationGradCheck(cvSoftmax, cvSoftmaxDer, CV_64F);
 }
+TEST(ML_FastMath, error_bounds){
+  const int n = 1003; // not a multiple of the vector width
+  CvMat * src = cvCreateMat(1,n,CV_32F);
+  CvMat * dst = cvCreateMat(1,n,CV_32F);
+  for (int ii=0;ii<n;ii++){ src->data.fl[ii] = -20.f+40.f*ii/float(n-1); }
+  const int max_level = cvSetFastMathLevel(CV_DNN_FASTMATH_AVX2);
+  for (int level=CV_DNN_FASTMATH_SCALAR;level<=max_level;level++){
+    EXPECT_EQ(cvSetFastMathLevel(level), level);
+    double exp_err = 0, tanh_err = 0, sigmoid_err = 0;
+    cvFastExp(src,dst);
+    for (int ii=0;ii<n;ii++){
+      double ref = exp(double(src->data.fl[ii]));
+      exp_err = MAX(exp_err,fabs(dst->data.fl[ii]-ref)/ref);
+    }
+    cvTanh(src,dst);
+    for (int ii=0;ii<n;ii++){
+      tanh_err = MAX(tanh_err,fabs(dst->data.fl[ii]-tanh(double(src->data.fl[ii]))));
+    }
+    cvSigmoid(src,dst);
+    for (int ii=0;ii<n;ii++){
+      double ref = 1./(1.+exp(-double(src->data.fl[ii])));
+      sigmoid_err = MAX(sigmoid_err,fabs(dst->data.fl[ii]-ref));
+    }
+    EXPECT_LT(exp_err, 1e-6);
+    EXPECT_LT(tanh_err, 1e-6);
+    EXPECT_LT(sigmoid_err, 1e-6);
+  }
+  cvSetFastMathLevel(max_level);
+  cvReleaseMat(&src);
+  cvReleaseMat(&dst);
+}
+TEST(ML_Softmax, cross_entropy_der){
+  const int nr = 8, nc = 10;
+  CvMat * X = cvCreateMat(nr,nc,CV_32F);
+  CvMat * target = cvCreateMat(nr,nc,CV_32F);
+  CvMat * Y = cvCreateMat(nr,nc,CV_32F);
+  CvMat * dE_dX = cvCreateMat(nr,nc,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-50),cvScalar(50));
+  cvZero(target);
+  for (int ri=0;ri<nr;ri++){ CV_MAT_ELEM(*target,float,ri,ri%nc) = 1.f; }
+  cvSoftmax(X,Y);
+  for (int ri=0;ri<nr;ri++){
+    CvMat row; cvGetRow(Y,&row,ri);
+    EXPECT_NEAR(cvSum(&row).val[0], 1., 1e-5);
+  }
+  cvSoftmaxCrossEntropyDer(X,target,dE_dX);
+  cvSub(Y,target,Y);
+  EXPECT_LT(cvNorm(dE_dX,Y,CV_C), 1e-6);
+  cvReleaseMat(&X);
+  cvReleaseMat(&target);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dX);
+}
+TEST(ML_Activation, fused_epilogue){
+  const int nr=20, nc=30;
+  const int types[] = {CV_DNN_ACTIVATION_NONE,CV_DNN_ACTIVATION_TANH,
+                       CV_DNN_ACTIVATION_SIGMOID,CV_DNN_ACTIVATION_RELU,
+                       CV_DNN_ACTIVATION_SOFTMAX};
+  CvMat * src = cvCreateMat(nr,nc,CV_32F);
+  CvMat * bias = cvCreateMat(1,nc,CV_32F);
+  CvMat * dy = cvCreateMat(nr,nc,CV_32F);
+  CvMat * WX = cvCreateMat(nr,nc,CV_32F);
+  CvMat * Y = cvCreateMat(nr,nc,CV_32F);
+  CvMat * ref_WX = cvCreateMat(nr,nc,CV_32F);
+  CvMat * ref_Y = cvCreateMat(nr,nc,CV_32F);
+  CvMat * der = cvCreateMat(nr,nc,CV_32F);
+  CvMat * ref_der = cvCreateMat(nr,nc,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,src,CV_RAND_UNI,cvScalar(-3),cvScalar(3));
+  cvRandArr(&rng,bias,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,dy,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  for (int ri=0;ri<nr;ri++){
+    CvMat src_row, ref_row;
+    cvGetRow(src,&src_row,ri); cvGetRow(ref_WX,&ref_row,ri);
+    cvAdd(&src_row,bias,&ref_row);
+  }
+  EXPECT_EQ(cvGetActivationType("relu"), CV_DNN_ACTIVATION_RELU);
+  EXPECT_EQ(cvGetActivationType("foo"), -1);
+  for (int ii=0;ii<int(sizeof(types)/sizeof(int));ii++){
+    const int type = types[ii];
+    cvActivate(type,src,bias,WX,Y);
+    switch(type){
+    case CV_DNN_ACTIVATION_NONE:    cvCopy(ref_WX,ref_Y); break;
+    case CV_DNN_ACTIVATION_TANH:    cvTanh(ref_WX,ref_Y); break;
+    case CV_DNN_ACTIVATION_SIGMOID: cvSigmoid(ref_WX,ref_Y); break;
+    case CV_DNN_ACTIVATION_RELU:    cvReLU(ref_WX,ref_Y); break;
+    case CV_DNN_ACTIVATION_SOFTMAX: cvSoftmax(ref_WX,ref_Y); break;
+    }
+    EXPECT_LT(cvNorm(WX,ref_WX,CV_C), 1e-5);
+    EXPECT_LT(cvNorm(Y,ref_Y,CV_C), 1e-5);
+    if (type==CV_DNN_ACTIVATION_SOFTMAX){continue;}
+    // derivative is multiplied into dy in the same pass
+    cvActivateDer(type,WX,dy,der);
+    switch(type){
+    case CV_DNN_ACTIVATION_NONE:    cvSet(ref_der,cvScalar(1)); break;
+    case CV_DNN_ACTIVATION_TANH:    cvTanhDer(ref_WX,ref_der); break;
+    case CV_DNN_ACTIVATION_SIGMOID: cvSigmoidDer(ref_WX,ref_der); break;
+    case CV_DNN_ACTIVATION_RELU:    cvReLUDer(ref_WX,ref_der); break;
+    }
+    cvMul(ref_der,dy,ref_der);
+    EXPECT_LT(cvNorm(der,ref_der,CV_C), 1e-5);
+  }
+  cvReleaseMat(&src);
+  cvReleaseMat(&bias);
+  cvReleaseMat(&dy);
+  cvReleaseMat(&WX);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&ref_WX);
+  cvReleaseMat(&ref_Y);
+  cvReleaseMat(&der);
+  cvReleaseMat(&ref_der);
+}
 
 TEST(ML_ConvolutionLayer, gradcheck){
   const int n_inputs = 2;
@@ -126,16 +248,16 @@ TEST(ML_ConvolutionLayer, gradcheck){
   const int imsize_out = imsize-ksize+1;
   CvDNNLayer * layer = 
     cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.01,1,"tanh",0,0);
-  CvMat * X = cvCreateMat(imsize*imsize*n_inputs,batch_size,CV_32F);
-  CvMat * Y = cvCreateMat(imsize_out*imsize_out*n_outputs,batch_size,CV_32F);
-  CvMat * target = cvCreateMat(imsize_out*imsize_out*n_outputs,batch_size,CV_32F);
+  CvMat * X = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvMat * target = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
   CvMat * grad0 = cvCreateMat(layer->weights->rows,layer->weights->cols,CV_32F);
   CvMat * grad1 = cvCreateMat(layer->weights->rows,layer->weights->cols,CV_32F);
   CvMat * norm = cvCreateMat(layer->weights->rows,layer->weights->cols,CV_32F);
   CvRNG rng = cvRNG(-1);
   cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-3),cvScalar(3));
   cvRandArr(&rng,target,CV_RAND_NORMAL,cvScalar(0),cvScalar(.1));
-  cvCNNLayerGradCheck(layer, X, Y, target, grad0, grad1, CV_L1);
+  cvCNNLayerGradCheck(layer, X, Y, target, grad0, grad1, CV_NORM_TYPE1);
   fprintf(stderr,"\ngrad0:\n");cvPrintf(stderr,"%.2f ",grad0);
   fprintf(stderr,"\ngrad1:\n");cvPrintf(stderr,"%.2f ",grad1);
   for (int ridx=0;ridx<grad0->rows;ridx++){
@@ -153,6 +275,7 @@ TEST(ML_ConvolutionLayer, gradcheck){
   fprintf(stderr,"\nquantile [80%%]:%f",cvQuantile(norm,.8));
   fprintf(stderr,"\nquantile [90%%]:%f\n",cvQuantile(norm,.9));
   EXPECT_LT(cvQuantile(norm,.9),.99f);
+  EXPECT_LT(cvQuantile(norm,.5),.01f);
   cvReleaseMat(&X);
   cvReleaseMat(&Y);
   cvReleaseMat(&target);
@@ -161,6 +284,137 @@ TEST(ML_ConvolutionLayer, gradcheck){
   cvReleaseMat(&norm);
 }
 
+void ConvolutionAlgorithmTest(int n_inputs, int imsize, int n_outputs, int ksize, 
+                              int batch_size, int algorithm)
+{
+  const int imsize_out = imsize-ksize+1;
+  CvDNNLayer * layer = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.01,1,"tanh",0,0);
+  CvMat * X = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * X0 = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * X1 = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * Y0 = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvMat * Y1 = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-3),cvScalar(3));
+  cvRandArr(&rng,layer->weights,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvCopy(X,X0); cvCopy(X,X1); // input is normalized in place
+  ((CvDNNConvolutionLayer*)layer)->algorithm = CV_DNN_CONVOLUTION_DIRECT;
+  layer->forward(layer,X0,Y0);
+  ((CvDNNConvolutionLayer*)layer)->algorithm = algorithm;
+  layer->forward(layer,X1,Y1);
+  EXPECT_LT(cvNorm(Y0,Y1,CV_C), 1e-5);
+  EXPECT_LT(cvNorm(Y0,Y1,CV_RELATIVE_L2), 1e-5);
+  layer->release(&layer);
+  cvReleaseMat(&X);
+  cvReleaseMat(&X0);
+  cvReleaseMat(&X1);
+  cvReleaseMat(&Y0);
+  cvReleaseMat(&Y1);
+}
+
+TEST(ML_ConvolutionLayer, im2col){
+  ConvolutionAlgorithmTest(1, 28, 6, 5, 3, CV_DNN_CONVOLUTION_IM2COL);
+  ConvolutionAlgorithmTest(6, 12,16, 5, 3, CV_DNN_CONVOLUTION_IM2COL);
+  ConvolutionAlgorithmTest(3, 20, 4, 3, 1, CV_DNN_CONVOLUTION_IM2COL);
+  ConvolutionAlgorithmTest(2, 19, 5, 7, 2, CV_DNN_CONVOLUTION_IM2COL);
+}
+
+TEST(ML_ConvolutionLayer, winograd){
+  ConvolutionAlgorithmTest(1, 28, 6, 3, 3, CV_DNN_CONVOLUTION_WINOGRAD_2X2);
+  ConvolutionAlgorithmTest(6, 13,16, 3, 2, CV_DNN_CONVOLUTION_WINOGRAD_2X2);
+  ConvolutionAlgorithmTest(1, 28, 6, 3, 3, CV_DNN_CONVOLUTION_WINOGRAD_4X4);
+  ConvolutionAlgorithmTest(6, 13,16, 3, 2, CV_DNN_CONVOLUTION_WINOGRAD_4X4);
+  ConvolutionAlgorithmTest(3, 20, 4, 3, 1, CV_DNN_CONVOLUTION_WINOGRAD_4X4);
+}
+
+TEST(ML_ConvolutionLayer, fft){
+  ConvolutionAlgorithmTest(1, 28, 6, 5, 3, CV_DNN_CONVOLUTION_FFT);
+  ConvolutionAlgorithmTest(6, 12,16, 5, 3, CV_DNN_CONVOLUTION_FFT);
+  ConvolutionAlgorithmTest(2, 19, 5, 7, 2, CV_DNN_CONVOLUTION_FFT);
+  ConvolutionAlgorithmTest(1, 64, 6, 7, 4, CV_DNN_CONVOLUTION_FFT);
+  ConvolutionAlgorithmTest(1, 36, 6, 5, 4, CV_DNN_CONVOLUTION_FFT);
+}
+
+TEST(ML_ConvolutionLayer, auto){
+  ConvolutionAlgorithmTest(1, 28, 6, 3, 3, CV_DNN_CONVOLUTION_AUTO);
+  ConvolutionAlgorithmTest(6, 12,16, 5, 3, CV_DNN_CONVOLUTION_AUTO);
+}
+
+/* weight transforms must follow weight updates in backward pass */
+TEST(ML_ConvolutionLayer, winograd_weights_update){
+  const int n_inputs = 2, n_outputs = 4, imsize = 10, ksize = 3, batch_size = 2;
+  const int imsize_out = imsize-ksize+1;
+  CvDNNLayer * layer = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.1,1,"none",0,0);
+  CvMat * X = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * X1 = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * Y0 = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvMat * Y1 = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvMat * dE_dX = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-3),cvScalar(3));
+  ((CvDNNConvolutionLayer*)layer)->algorithm = CV_DNN_CONVOLUTION_WINOGRAD_4X4;
+  cvCopy(X,X1); layer->forward(layer,X1,Y1);
+  layer->backward(layer,1,X1,Y1,dE_dX);
+  layer->step(layer,1,1); // updates weights
+  cvCopy(X,X1); layer->forward(layer,X1,Y1);
+  ((CvDNNConvolutionLayer*)layer)->algorithm = CV_DNN_CONVOLUTION_DIRECT;
+  cvCopy(X,X1); layer->forward(layer,X1,Y0);
+  EXPECT_LT(cvNorm(Y0,Y1,CV_C), 1e-5);
+  layer->release(&layer);
+  cvReleaseMat(&X);
+  cvReleaseMat(&X1);
+  cvReleaseMat(&Y0);
+  cvReleaseMat(&Y1);
+  cvReleaseMat(&dE_dX);
+}
+
+// gradients of layers sharing weights through ref_layer are summed into a 
+// single update
+TEST(ML_ConvolutionLayer, shared_weights_gradient){
+  const int n_inputs = 1, n_outputs = 3, imsize = 8, ksize = 3, batch_size = 2;
+  const int imsize_out = imsize-ksize+1;
+  CvDNNLayer * conv1 = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  CvDNNLayer * conv2 = 
+    cvCreateConvolutionLayer(CV_32F,"conv2",conv1,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  CvMat * X1 = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * X2 = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvMat * dE_dX = cvCreateMat(batch_size,imsize*imsize*n_inputs,CV_32F);
+  CvMat * grad_sum = cvCreateMat(conv1->weights->rows,conv1->weights->cols,CV_32F);
+  CvMat * weights = cvCloneMat(conv1->weights);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X1,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,X2,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  // gradients of each input on its own
+  conv1->forward(conv1,X1,Y); conv1->backward(conv1,1,X1,Y,dE_dX);
+  cvCopy(conv1->dE_dW,grad_sum); conv1->n_grads = 0;
+  conv1->forward(conv1,X2,Y); conv1->backward(conv1,1,X2,Y,dE_dX);
+  cvAdd(conv1->dE_dW,grad_sum,grad_sum); conv1->n_grads = 0;
+  // the same inputs through the layer and its copy, only conv1 is updated
+  conv1->forward(conv1,X1,Y); conv1->backward(conv1,1,X1,Y,dE_dX);
+  conv2->forward(conv2,X2,Y); conv2->backward(conv2,1,X2,Y,dE_dX);
+  EXPECT_EQ(conv1->n_grads, 2);
+  EXPECT_EQ(conv2->n_grads, 0);
+  EXPECT_LT(cvNorm(conv1->dE_dW,grad_sum,CV_RELATIVE_L2), 1e-5);
+  conv2->step(conv2,1,1);
+  EXPECT_EQ(cvNorm(conv1->weights,weights,CV_C), 0);
+  conv1->step(conv1,1,1);
+  EXPECT_EQ(conv1->n_grads, 0);
+  cvScaleAdd(grad_sum,cvScalar(-.1),weights,weights);
+  EXPECT_LT(cvNorm(conv1->weights,weights,CV_C), 1e-5);
+  conv2->release(&conv2);
+  conv1->release(&conv1);
+  cvReleaseMat(&X1);
+  cvReleaseMat(&X2);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dX);
+  cvReleaseMat(&grad_sum);
+  cvReleaseMat(&weights);
+}
+
 void DenseLayerTest(int n_inputs, int n_outputs, int batch_size, 
                           int dtype, int norm_type, const char * actype);
 TEST(ML_DenseLayer, gradcheck){
@@ -174,14 +428,59 @@ TEST(ML_DenseLayer, gradcheck){
   DenseLayerTest(n_inputs, n_outputs, batch_size, dtype, CV_NORM_TYPE1, "relu");
 }
 
+// gradients of micro batches accumulated over several backward passes are 
+// averaged at the step: with the loss of each batch being its mean over the
+// samples, the update is that of the whole mini batch
+TEST(ML_DenseLayer, accumulate_gradients){
+  const int n_inputs = 12, n_outputs = 5, batch_size = 8, n_micro = 4;
+  CvDNNLayer * fc1 = cvCreateDenseLayer(CV_32F,"fc1",0,0,n_inputs,n_outputs,.1,1,"tanh",0);
+  CvDNNLayer * fc2 = cvCreateDenseLayer(CV_32F,"fc2",0,0,n_inputs,n_outputs,.1,1,"tanh",0);
+  cvCopy(fc1->weights,fc2->weights);
+  CvMat * X = cvCreateMat(batch_size,n_inputs,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs,CV_32F);
+  CvMat * dE_dY = cvCreateMat(batch_size,n_outputs,CV_32F);
+  CvMat * dE_dY_mean = cvCreateMat(batch_size,n_outputs,CV_32F);
+  CvMat * dE_dX = cvCreateMat(batch_size,n_inputs,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,dE_dY,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  // the mean over batch_size samples, rather than over those of a micro batch
+  cvScale(dE_dY,dE_dY_mean,1./n_micro);
+  fc1->forward(fc1,X,Y);
+  fc1->backward(fc1,1,X,dE_dY_mean,dE_dX);
+  fc1->step(fc1,1,1);
+  for (int mi=0;mi<n_micro;mi++){
+    const int start = batch_size*mi/n_micro, end = batch_size*(mi+1)/n_micro;
+    CvMat X_submat, Y_submat, dE_dY_submat, dE_dX_submat;
+    cvGetRows(X,&X_submat,start,end);
+    cvGetRows(Y,&Y_submat,start,end);
+    cvGetRows(dE_dY,&dE_dY_submat,start,end);
+    cvGetRows(dE_dX,&dE_dX_submat,start,end);
+    fc2->forward(fc2,&X_submat,&Y_submat);
+    fc2->backward(fc2,1,&X_submat,&dE_dY_submat,&dE_dX_submat);
+  }
+  EXPECT_EQ(fc2->n_grads, n_micro);
+  EXPECT_GT(cvNorm(fc1->weights,fc2->weights,CV_C), 1e-3);
+  fc2->step(fc2,1,n_micro);
+  EXPECT_EQ(fc2->n_grads, 0);
+  EXPECT_LT(cvNorm(fc1->weights,fc2->weights,CV_C), 1e-5);
+  fc1->release(&fc1);
+  fc2->release(&fc2);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dY);
+  cvReleaseMat(&dE_dY_mean);
+  cvReleaseMat(&dE_dX);
+}
+
 void DenseLayerTest(int n_inputs, int n_outputs, int batch_size, 
                           int dtype, int norm_type, const char * actype)
 {
   CvDNNLayer * layer = 
     cvCreateDenseLayer(dtype,"fc1",0,0,n_inputs,n_outputs,.01,1,actype,0);
   ASSERT_TRUE(icvIsDenseLayer(layer));
-  CvMat * X = cvCreateMat(n_inputs,batch_size,dtype);
-  CvMat * Y = cvCreateMat(n_outputs,batch_size,dtype);
+  CvMat * X = cvCreateMat(batch_size,n_inputs,dtype);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs,dtype);
   CvMat * target = cvCreateMat(Y->rows,Y->cols,dtype);
   CvMat * grad0 = cvCreateMat(layer->weights->rows,layer->weights->cols,dtype);
   CvMat * grad1 = cvCreateMat(layer->weights->rows,layer->weights->cols,dtype);
@@ -220,12 +519,1473 @@ void DenseLayerTest(int n_inputs, int n_outputs, int batch_size,
   cvReleaseMat(&norm);
 }
 
+// loss 0.5*|Y-target|^2 of a recurrent layer in sequence mode
+static double icvSequenceLoss(CvDNNLayer * layer, CvMat * X, CvMat * Y, CvMat * target)
+{
+  double loss = 0;
+  layer->forward(layer,X,Y);
+  CV_FOREACH_ELEM(Y,ri,ci){double val=cvmGet(Y,ri,ci)-cvmGet(target,ri,ci);loss+=val*val;}
+  return loss*.5;
+}
+
+TEST(ML_RecurrentLayer, sequence_gradcheck){
+  const int n_inputs = 5, n_hiddens = 7, n_outputs = 4, seq_length = 3, batch_size = 2;
+  const float eps = 1e-2f;
+  CvDNNLayer * layer = cvCreateSimpleRNNLayer(CV_32F,"rnn1",0,n_inputs,n_outputs,n_hiddens,
+    seq_length,CV_DNN_RNN_SEQUENCE,.1,1,"tanh",0,0,0);
+  ASSERT_TRUE(icvIsSequenceRNNLayer(layer));
+  CvDNNSimpleRNNLayer * rnn = (CvDNNSimpleRNNLayer*)layer;
+  CvMat * X = cvCreateMat(batch_size,n_inputs*seq_length,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs*seq_length,CV_32F);
+  CvMat * target = cvCreateMat(Y->rows,Y->cols,CV_32F);
+  CvMat * dE_dY = cvCreateMat(Y->rows,Y->cols,CV_32F);
+  CvMat * dE_dX = cvCreateMat(X->rows,X->cols,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,target,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  cvRandArr(&rng,rnn->Whh,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  cvRandArr(&rng,rnn->Why,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  layer->forward(layer,X,Y);
+  cvSub(Y,target,dE_dY);
+  layer->backward(layer,1,X,dE_dY,dE_dX);
+  EXPECT_EQ(layer->n_grads, 1);
+  // gradients of all weights, including bias columns, and of the input
+  CvMat * W[4] = {rnn->Wxh,rnn->Whh,rnn->Why,X};
+  CvMat * dW[4] = {rnn->dWxh,rnn->dWhh,rnn->dWhy,dE_dX};
+  for (int ii=0;ii<4;ii++){
+    double max_error = 0, max_grad = 0;
+    CV_FOREACH_ELEM(W[ii],ri,ci){
+      const float val = CV_MAT_ELEM(*W[ii],float,ri,ci);
+      CV_MAT_ELEM(*W[ii],float,ri,ci) = val+eps;
+      double loss_more = icvSequenceLoss(layer,X,Y,target);
+      CV_MAT_ELEM(*W[ii],float,ri,ci) = val-eps;
+      double loss_less = icvSequenceLoss(layer,X,Y,target);
+      CV_MAT_ELEM(*W[ii],float,ri,ci) = val;
+      double grad = (loss_more-loss_less)/(2.*eps);
+      max_error = MAX(max_error,fabs(grad-CV_MAT_ELEM(*dW[ii],float,ri,ci)));
+      max_grad = MAX(max_grad,fabs(grad));
+    }
+    EXPECT_GT(max_grad, 1e-2) << "weights " << ii;
+    EXPECT_LT(max_error, 1e-2*max_grad) << "weights " << ii;
+  }
+  layer->release(&layer);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&target);
+  cvReleaseMat(&dE_dY);
+  cvReleaseMat(&dE_dX);
+}
+
+// sequence mode computes the same outputs as a layer per time step
+TEST(ML_RecurrentLayer, sequence_matches_unrolled){
+  const int n_inputs = 6, n_hiddens = 9, n_outputs = 5, seq_length = 4, batch_size = 3;
+  CvDNNLayer * layer = cvCreateSimpleRNNLayer(CV_32F,"rnn1",0,n_inputs,n_outputs,n_hiddens,
+    seq_length,CV_DNN_RNN_SEQUENCE,.1,1,"softmax",0,0,0);
+  CvDNNSimpleRNNLayer * rnn = (CvDNNSimpleRNNLayer*)layer;
+  CvDNNLayer * steps[seq_length];
+  steps[0] = cvCreateSimpleRNNLayer(CV_32F,"rnn2",0,n_inputs,n_outputs,n_hiddens,
+    seq_length,0,.1,1,"softmax",rnn->Wxh,rnn->Whh,rnn->Why);
+  for (int t=1;t<seq_length;t++){
+    steps[t] = cvCreateSimpleRNNLayer(CV_32F,"rnn2",steps[0],n_inputs,n_outputs,n_hiddens,
+      seq_length,t,.1,1,"softmax",0,0,0);
+  }
+  CvMat * X = cvCreateMat(batch_size,n_inputs*seq_length,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs*seq_length,CV_32F);
+  CvMat * X_curr = cvCreateMat(batch_size,n_inputs,CV_32F);
+  CvMat * Y_curr = cvCreateMat(batch_size,n_outputs,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,rnn->Whh,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  cvRandArr(&rng,rnn->Why,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  cvCopy(rnn->Whh,((CvDNNSimpleRNNLayer*)steps[0])->Whh);
+  cvCopy(rnn->Why,((CvDNNSimpleRNNLayer*)steps[0])->Why);
+  layer->forward(layer,X,Y);
+  for (int t=0;t<seq_length;t++){
+    CvMat submat;
+    cvCopy(cvGetCols(X,&submat,n_inputs*t,n_inputs*(t+1)),X_curr);
+    steps[t]->forward(steps[t],X_curr,Y_curr);
+    EXPECT_LT(cvNorm(Y_curr,cvGetCols(Y,&submat,n_outputs*t,n_outputs*(t+1)),CV_C), 1e-5) 
+      << "time step " << t;
+  }
+  for (int t=seq_length-1;t>=0;t--){steps[t]->release(&steps[t]);}
+  layer->release(&layer);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&X_curr);
+  cvReleaseMat(&Y_curr);
+}
+
+// gradients of packed gate weights, including bias column, and of the input
+static void icvGatedRecurrentGradCheck(CvDNNLayer * layer, int batch_size)
+{
+  const int n_inputs = layer->n_input_planes, n_hiddens = layer->n_output_planes;
+  const int seq_length = layer->seq_length;
+  const float eps = 1e-2f;
+  ASSERT_TRUE(icvIsSequenceRNNLayer(layer));
+  CvMat * X = cvCreateMat(batch_size,n_inputs*seq_length,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_hiddens*seq_length,CV_32F);
+  CvMat * target = cvCreateMat(Y->rows,Y->cols,CV_32F);
+  CvMat * dE_dY = cvCreateMat(Y->rows,Y->cols,CV_32F);
+  CvMat * dE_dX = cvCreateMat(X->rows,X->cols,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,target,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  cvRandArr(&rng,layer->weights,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  layer->forward(layer,X,Y);
+  cvSub(Y,target,dE_dY);
+  layer->backward(layer,1,X,dE_dY,dE_dX);
+  EXPECT_EQ(layer->n_grads, 1);
+  CvMat * W[2] = {layer->weights,X};
+  CvMat * dW[2] = {layer->dE_dW,dE_dX};
+  for (int ii=0;ii<2;ii++){
+    double max_error = 0, max_grad = 0;
+    CV_FOREACH_ELEM(W[ii],ri,ci){
+      const float val = CV_MAT_ELEM(*W[ii],float,ri,ci);
+      CV_MAT_ELEM(*W[ii],float,ri,ci) = val+eps;
+      double loss_more = icvSequenceLoss(layer,X,Y,target);
+      CV_MAT_ELEM(*W[ii],float,ri,ci) = val-eps;
+      double loss_less = icvSequenceLoss(layer,X,Y,target);
+      CV_MAT_ELEM(*W[ii],float,ri,ci) = val;
+      double grad = (loss_more-loss_less)/(2.*eps);
+      max_error = MAX(max_error,fabs(grad-CV_MAT_ELEM(*dW[ii],float,ri,ci)));
+      max_grad = MAX(max_grad,fabs(grad));
+    }
+    EXPECT_GT(max_grad, 1e-2) << "weights " << ii;
+    EXPECT_LT(max_error, 1e-2*max_grad) << "weights " << ii;
+  }
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&target);
+  cvReleaseMat(&dE_dY);
+  cvReleaseMat(&dE_dX);
+}
+
+TEST(ML_LSTMLayer, gradcheck){
+  CvDNNLayer * layer = cvCreateLSTMLayer(CV_32F,"lstm1",5,6,3,.1,1,0);
+  icvGatedRecurrentGradCheck(layer,2);
+  layer->release(&layer);
+}
+
+TEST(ML_GRULayer, gradcheck){
+  CvDNNLayer * layer = cvCreateGRULayer(CV_32F,"gru1",5,6,3,.1,1,0);
+  icvGatedRecurrentGradCheck(layer,2);
+  layer->release(&layer);
+}
+
+// gradients accumulated over mini batches are averaged at the step, as for
+// other layers: two passes of the same batch update as a single one
+TEST(ML_GatedRecurrentLayer, accumulated_step){
+  const int n_inputs = 5, n_hiddens = 6, seq_length = 3, batch_size = 2;
+  CvDNNLayer * layers[2] = {
+    cvCreateLSTMLayer(CV_32F,"lstm1",n_inputs,n_hiddens,seq_length,.1,1,0),
+    cvCreateGRULayer(CV_32F,"gru1",n_inputs,n_hiddens,seq_length,.1,1,0)};
+  CvMat * X = cvCreateMat(batch_size,n_inputs*seq_length,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_hiddens*seq_length,CV_32F);
+  CvMat * dE_dY = cvCreateMat(batch_size,n_hiddens*seq_length,CV_32F);
+  CvMat * dE_dX = cvCreateMat(batch_size,n_inputs*seq_length,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,dE_dY,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  for (int li=0;li<2;li++){
+    CvDNNLayer * layer = layers[li];
+    CvMat * W0 = cvCloneMat(layer->weights);
+    layer->forward(layer,X,Y);
+    layer->backward(layer,1,X,dE_dY,dE_dX);
+    layer->step(layer,1,1);
+    CvMat * W1 = cvCloneMat(layer->weights);
+    cvCopy(W0,layer->weights);
+    layer->forward(layer,X,Y);
+    layer->backward(layer,1,X,dE_dY,dE_dX);
+    layer->backward(layer,1,X,dE_dY,dE_dX);
+    EXPECT_EQ(layer->n_grads, 2);
+    layer->step(layer,1,2);
+    EXPECT_GT(cvNorm(W0,W1,CV_C), 1e-4) << "layer " << li;
+    EXPECT_LT(cvNorm(layer->weights,W1,CV_C), 1e-6) << "layer " << li;
+    cvReleaseMat(&W0);
+    cvReleaseMat(&W1);
+    layer->release(&layers[li]);
+  }
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dY);
+  cvReleaseMat(&dE_dX);
+}
+
+// fused gate kernels of all levels give the same states
+TEST(ML_FastMath, gated_cells){
+  const int n_inputs = 4, n_hiddens = 13, seq_length = 3, batch_size = 5; // not a multiple of the vector width
+  CvDNNLayer * layers[2] = {
+    cvCreateLSTMLayer(CV_32F,"lstm1",n_inputs,n_hiddens,seq_length,.1,1,0),
+    cvCreateGRULayer(CV_32F,"gru1",n_inputs,n_hiddens,seq_length,.1,1,0)};
+  CvMat * X = cvCreateMat(batch_size,n_inputs*seq_length,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_hiddens*seq_length,CV_32F);
+  CvMat * Y_ref = cvCreateMat(batch_size,n_hiddens*seq_length,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(2));
+  const int max_level = cvSetFastMathLevel(CV_DNN_FASTMATH_AVX2);
+  for (int li=0;li<2;li++){
+    cvSetFastMathLevel(CV_DNN_FASTMATH_SCALAR);
+    layers[li]->forward(layers[li],X,Y_ref);
+    for (int level=CV_DNN_FASTMATH_SCALAR+1;level<=max_level;level++){
+      cvSetFastMathLevel(level);
+      layers[li]->forward(layers[li],X,Y);
+      EXPECT_LT(cvNorm(Y,Y_ref,CV_C), 1e-5) << "layer " << li << ", level " << level;
+    }
+    layers[li]->release(&layers[li]);
+  }
+  cvSetFastMathLevel(max_level);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&Y_ref);
+}
+
+// loss sum(Y.*R) of a spatial transform layer warping the image given to <input>
+static double icvSpatialTransformLoss(CvDNNLayer * input, CvDNNLayer * layer, 
+                                      const CvMat * I, const CvMat * X, CvMat * Y, const CvMat * R)
+{
+  CvMat * I_copy = cvCloneMat(I);
+  input->forward(input,I,I_copy);
+  layer->forward(layer,X,Y);
+  cvReleaseMat(&I_copy);
+  return cvDotProduct(Y,R);
+}
+
+TEST(ML_SpatialTransformLayer, gradcheck){
+  const int height = 9, width = 11, output_height = 5, output_width = 7, batch_size = 3, nch = 2;
+  const float eps = 1e-4f;
+  CvDNNLayer * input = cvCreateInputLayer(CV_32F,"input1",nch,height,width,1,.1,1);
+  CvDNNLayer * layer = cvCreateSpatialTransformLayer(CV_32F,"st1",0,input,nch,output_height,output_width,1,0,.1,1);
+  CvMat * I = cvCreateMat(batch_size,nch*height*width,CV_32F);
+  CvMat * X = cvCreateMat(batch_size,6,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,nch*output_height*output_width,CV_32F);
+  CvMat * R = cvCreateMat(batch_size,nch*output_height*output_width,CV_32F);
+  CvMat * dE_dX = cvCreateMat(batch_size,6,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,I,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,R,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  // rotated and scaled, partly sampled outside of the image, off the pixel
+  // grid where the bilinear interpolation is not differentiable
+  for (int bi=0;bi<batch_size;bi++){
+    const float a = .3f*bi+.1f, s = .7f+.3f*bi;
+    const float A[6] = {s*cos(a),-s*sin(a),.1f*bi+.059f, s*sin(a),s*cos(a),.004f-.05f*bi};
+    memcpy(X->data.ptr+X->step*bi,A,sizeof(A));
+  }
+  icvSpatialTransformLoss(input,layer,I,X,Y,R);
+  layer->backward(layer,1,X,R,dE_dX);
+  ASSERT_TRUE(layer->dE_dX!=0);
+  CvMat * dE_dI = cvCloneMat(layer->dE_dX);
+  ASSERT_TRUE(CV_ARE_SIZES_EQ(dE_dI,I));
+
+  // transform parameters
+  for (int ii=0;ii<batch_size*6;ii++){
+    const float x = X->data.fl[ii];
+    const float xp = x+eps, xm = x-eps; // steps as stored in float
+    X->data.fl[ii] = xp; const double fp = icvSpatialTransformLoss(input,layer,I,X,Y,R);
+    X->data.fl[ii] = xm; const double fm = icvSpatialTransformLoss(input,layer,I,X,Y,R);
+    X->data.fl[ii] = x;
+    const double numeric = (fp-fm)/(xp-xm);
+    EXPECT_NEAR(dE_dX->data.fl[ii], numeric, 2e-2*MAX(1.,fabs(numeric))) << "param " << ii;
+  }
+  // image, the loss is linear in pixel values
+  for (int ii=0;ii<I->rows*I->cols;ii+=5){
+    const float x = I->data.fl[ii];
+    I->data.fl[ii] = x+.5f; const double fp = icvSpatialTransformLoss(input,layer,I,X,Y,R);
+    I->data.fl[ii] = x-.5f; const double fm = icvSpatialTransformLoss(input,layer,I,X,Y,R);
+    I->data.fl[ii] = x;
+    EXPECT_NEAR(dE_dI->data.fl[ii], fp-fm, 1e-4) << "pixel " << ii;
+  }
+
+  cvReleaseMat(&dE_dI);
+  cvReleaseMat(&I);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&R);
+  cvReleaseMat(&dE_dX);
+  layer->release(&layer);
+  input->release(&input);
+}
+
+// samplers of all levels give the same output, including tails of rows 
+// shorter than the vector width and points outside of the image
+TEST(ML_FastMath, bilinear_sample){
+  const int height = 6, width = 23, output_height = 4, output_width = 21, batch_size = 3, nch = 3;
+  CvDNNLayer * input = cvCreateInputLayer(CV_32F,"input1",nch,height,width,1,.1,1);
+  CvDNNLayer * layer = cvCreateSpatialTransformLayer(CV_32F,"st1",0,input,nch,output_height,output_width,1,0,.1,1);
+  CvMat * I = cvCreateMat(batch_size,nch*height*width,CV_32F);
+  CvMat * X = cvCreateMat(batch_size,6,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,nch*output_height*output_width,CV_32F);
+  CvMat * Y_ref = cvCreateMat(batch_size,nch*output_height*output_width,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,I,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-1.5),cvScalar(1.5));
+  CvMat * I_copy = cvCloneMat(I);
+  input->forward(input,I,I_copy);
+  const int max_level = cvSetFastMathLevel(CV_DNN_FASTMATH_AVX2);
+  cvSetFastMathLevel(CV_DNN_FASTMATH_SCALAR);
+  layer->forward(layer,X,Y_ref);
+  for (int level=CV_DNN_FASTMATH_SCALAR+1;level<=max_level;level++){
+    cvSetFastMathLevel(level);
+    layer->forward(layer,X,Y);
+    EXPECT_LT(cvNorm(Y,Y_ref,CV_C), 1e-5) << "level " << level;
+  }
+  cvSetFastMathLevel(max_level);
+  layer->release(&layer);
+
+  // resizing to the same size reproduces the image
+  layer = cvCreateSpatialTransformLayer(CV_32F,"st2",0,input,nch,height,width,1,0,.1,1);
+  layer->forward(layer,I,I_copy);
+  EXPECT_LT(cvNorm(I,I_copy,CV_C), 1e-5);
+  layer->release(&layer);
+  input->release(&input);
+  cvReleaseMat(&I);
+  cvReleaseMat(&I_copy);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&Y_ref);
+}
+
+// a stateful layer run on consecutive pieces of sequences gives the same 
+// outputs and gradients as a layer run on whole sequences, with back 
+// propagation through time truncated at the boundaries of the pieces
+static void icvStatefulMatchesTruncated(CvDNNLayer * whole, CvDNNLayer * piece, int batch_size)
+{
+  const int n_inputs = whole->n_input_planes, n_outputs = whole->n_output_planes;
+  const int piece_length = piece->seq_length, n_pieces = whole->seq_length/piece_length;
+  ASSERT_EQ(whole->seq_length, piece_length*n_pieces);
+  whole->bptt_window = piece_length;
+  piece->stateful = 1;
+  CvMat * X = cvCreateMat(batch_size,n_inputs*whole->seq_length,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs*whole->seq_length,CV_32F);
+  CvMat * dE_dY = cvCreateMat(Y->rows,Y->cols,CV_32F);
+  CvMat * dE_dX = cvCreateMat(X->rows,X->cols,CV_32F);
+  CvMat * X_piece = cvCreateMat(batch_size,n_inputs*piece_length,CV_32F);
+  CvMat * Y_piece = cvCreateMat(batch_size,n_outputs*piece_length,CV_32F);
+  CvMat * dE_dY_piece = cvCreateMat(Y_piece->rows,Y_piece->cols,CV_32F);
+  CvMat * dE_dX_piece = cvCreateMat(X_piece->rows,X_piece->cols,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_NORMAL,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,dE_dY,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  whole->forward(whole,X,Y);
+  whole->backward(whole,1,X,dE_dY,dE_dX);
+  for (int pi=0;pi<n_pieces;pi++){
+    CvMat submat;
+    cvCopy(cvGetCols(X,&submat,n_inputs*piece_length*pi,n_inputs*piece_length*(pi+1)),X_piece);
+    cvCopy(cvGetCols(dE_dY,&submat,n_outputs*piece_length*pi,n_outputs*piece_length*(pi+1)),dE_dY_piece);
+    piece->forward(piece,X_piece,Y_piece);
+    piece->backward(piece,1,X_piece,dE_dY_piece,dE_dX_piece);
+    EXPECT_LT(cvNorm(Y_piece,cvGetCols(Y,&submat,n_outputs*piece_length*pi,
+                                       n_outputs*piece_length*(pi+1)),CV_C), 1e-5) << "piece " << pi;
+    EXPECT_LT(cvNorm(dE_dX_piece,cvGetCols(dE_dX,&submat,n_inputs*piece_length*pi,
+                                           n_inputs*piece_length*(pi+1)),CV_C), 1e-4) << "piece " << pi;
+  }
+  EXPECT_EQ(piece->n_carried, batch_size);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dY);
+  cvReleaseMat(&dE_dX);
+  cvReleaseMat(&X_piece);
+  cvReleaseMat(&Y_piece);
+  cvReleaseMat(&dE_dY_piece);
+  cvReleaseMat(&dE_dX_piece);
+}
+
+TEST(ML_RecurrentLayer, stateful_matches_truncated){
+  const int n_inputs = 5, n_hiddens = 7, n_outputs = 4, piece_length = 3;
+  CvDNNLayer * whole = cvCreateSimpleRNNLayer(CV_32F,"rnn1",0,n_inputs,n_outputs,n_hiddens,
+    piece_length*3,CV_DNN_RNN_SEQUENCE,.1,1,"tanh",0,0,0);
+  CvDNNSimpleRNNLayer * rnn = (CvDNNSimpleRNNLayer*)whole;
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,rnn->Whh,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  cvRandArr(&rng,rnn->Why,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  CvDNNLayer * piece = cvCreateSimpleRNNLayer(CV_32F,"rnn2",0,n_inputs,n_outputs,n_hiddens,
+    piece_length,CV_DNN_RNN_SEQUENCE,.1,1,"tanh",rnn->Wxh,rnn->Whh,rnn->Why);
+  icvStatefulMatchesTruncated(whole,piece,2);
+  CvDNNSimpleRNNLayer * rnn_piece = (CvDNNSimpleRNNLayer*)piece;
+  EXPECT_EQ(rnn_piece->n_grads, 3);
+  EXPECT_LT(cvNorm(rnn->dWxh,rnn_piece->dWxh,CV_C), 1e-4);
+  EXPECT_LT(cvNorm(rnn->dWhh,rnn_piece->dWhh,CV_C), 1e-4);
+  EXPECT_LT(cvNorm(rnn->dWhy,rnn_piece->dWhy,CV_C), 1e-4);
+  whole->release(&whole);
+  piece->release(&piece);
+}
+
+TEST(ML_LSTMLayer, stateful_matches_truncated){
+  CvDNNLayer * whole = cvCreateLSTMLayer(CV_32F,"lstm1",5,6,8,.1,1,0);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,whole->weights,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  CvDNNLayer * piece = cvCreateLSTMLayer(CV_32F,"lstm2",5,6,4,.1,1,whole->weights);
+  icvStatefulMatchesTruncated(whole,piece,3);
+  EXPECT_LT(cvNorm(whole->dE_dW,piece->dE_dW,CV_C), 1e-4);
+  whole->release(&whole);
+  piece->release(&piece);
+}
+
+TEST(ML_GRULayer, stateful_matches_truncated){
+  CvDNNLayer * whole = cvCreateGRULayer(CV_32F,"gru1",5,6,8,.1,1,0);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,whole->weights,CV_RAND_UNI,cvScalar(-.5),cvScalar(.5));
+  CvDNNLayer * piece = cvCreateGRULayer(CV_32F,"gru2",5,6,2,.1,1,whole->weights);
+  icvStatefulMatchesTruncated(whole,piece,3);
+  EXPECT_LT(cvNorm(whole->dE_dW,piece->dE_dW,CV_C), 1e-4);
+  whole->release(&whole);
+  piece->release(&piece);
+}
+
+// a layer frees its buffers when released, and a layer without workspace 
+// keeps its buffers to itself
+TEST(ML_Workspace, release_layer_buffers){
+  const int n_inputs = 12, n_outputs = 5, batch_size = 4;
+  CvDNNWorkspace * workspace = cvCreateDNNWorkspace();
+  CvDNNLayer * fc1 = cvCreateDenseLayer(CV_32F,"fc1",0,0,n_inputs,n_outputs,.1,1,"tanh",0);
+  CvDNNLayer * fc2 = cvCreateDenseLayer(CV_32F,"fc2",0,0,n_inputs,n_outputs,.1,1,"tanh",0);
+  CvDNNLayer * fc3 = cvCreateDenseLayer(CV_32F,"fc3",0,0,n_inputs,n_outputs,.1,1,"tanh",0);
+  fc1->workspace = workspace; fc2->workspace = workspace;
+  cvCopy(fc1->weights,fc3->weights);
+  CvMat * X = cvCreateMat(batch_size,n_inputs,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,n_outputs,CV_32F);
+  CvMat * Y3 = cvCreateMat(batch_size,n_outputs,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  fc1->forward(fc1,X,Y);
+  const int n_buffers = workspace->n_buffers;
+  const size_t total_bytes = workspace->total_bytes;
+  EXPECT_GT(n_buffers, 0);
+  fc2->forward(fc2,X,Y);
+  EXPECT_EQ(workspace->n_buffers, 2*n_buffers);
+  EXPECT_EQ(workspace->total_bytes, 2*total_bytes);
+  fc3->forward(fc3,X,Y3);
+  EXPECT_EQ(workspace->n_buffers, 2*n_buffers);
+  fc2->release(&fc2);
+  EXPECT_EQ(workspace->n_buffers, n_buffers);
+  EXPECT_EQ(workspace->total_bytes, total_bytes);
+  // buffers of fc1 go with the workspace, and are reserved again if needed
+  cvReleaseDNNWorkspace(&workspace);
+  fc1->workspace = 0;
+  fc1->forward(fc1,X,Y);
+  fc3->forward(fc3,X,Y3);
+  EXPECT_EQ(cvNorm(Y,Y3,CV_C), 0);
+  fc1->release(&fc1);
+  fc3->release(&fc3);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&Y3);
+}
+
+TEST(ML_Workspace, zero_steady_state_allocations){
+  const int n_inputs = 2, imsize = 12, n_outputs = 4, ksize = 3;
+  const int imsize_out = imsize-ksize+1, n_classes = 10;
+  CvDNNWorkspace * workspace = cvCreateDNNWorkspace();
+  CvDNNLayer * conv = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,n_inputs,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  CvDNNLayer * fc = 
+    cvCreateDenseLayer(CV_32F,"fc1",0,0,imsize_out*imsize_out*n_outputs,n_classes,.01,1,"softmax",0);
+  ((CvDNNConvolutionLayer*)conv)->algorithm = CV_DNN_CONVOLUTION_IM2COL;
+  conv->workspace = workspace; fc->workspace = workspace;
+  CvMat * X = cvCreateMat(16,imsize*imsize*n_inputs,CV_32F);
+  CvMat * H = cvCreateMat(16,imsize_out*imsize_out*n_outputs,CV_32F);
+  CvMat * Y = cvCreateMat(16,n_classes,CV_32F);
+  CvMat * dE_dY = cvCreateMat(16,n_classes,CV_32F);
+  CvMat * dE_dH = cvCreateMat(H->rows,H->cols,CV_32F);
+  CvMat * dE_dX = cvCreateMat(X->rows,X->cols,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,X,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  int n_allocs = -1;
+  for (int iter=0;iter<6;iter++){
+    // last iterations process a smaller remainder batch
+    int batch_size = iter<3?16:5;
+    CvMat X_submat, H_submat, Y_submat, dE_dY_submat, dE_dH_submat, dE_dX_submat;
+    cvGetRows(X,&X_submat,0,batch_size);
+    cvGetRows(H,&H_submat,0,batch_size);
+    cvGetRows(Y,&Y_submat,0,batch_size);
+    cvGetRows(dE_dY,&dE_dY_submat,0,batch_size);
+    cvGetRows(dE_dH,&dE_dH_submat,0,batch_size);
+    cvGetRows(dE_dX,&dE_dX_submat,0,batch_size);
+    conv->forward(conv,&X_submat,&H_submat);
+    fc->forward(fc,&H_submat,&Y_submat);
+    cvSubS(&Y_submat,cvScalar(.1),&dE_dY_submat);
+    fc->backward(fc,iter+1,&H_submat,&dE_dY_submat,&dE_dH_submat);
+    conv->backward(conv,iter+1,&X_submat,&dE_dH_submat,&dE_dX_submat);
+    fc->step(fc,iter+1,1);
+    conv->step(conv,iter+1,1);
+    if (iter==0){ n_allocs = workspace->n_allocs; }
+  }
+  EXPECT_GT(n_allocs, 0);
+  EXPECT_EQ(n_allocs, workspace->n_allocs);
+  conv->release(&conv);
+  fc->release(&fc);
+  cvReleaseDNNWorkspace(&workspace);
+  cvReleaseMat(&X);
+  cvReleaseMat(&H);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&dE_dY);
+  cvReleaseMat(&dE_dH);
+  cvReleaseMat(&dE_dX);
+}
+
+TEST(ML_MemoryPlan, predict){
+  const int imsize = 12, ksize = 3, n_outputs = 4, n_classes = 3;
+  const int imsize_out = imsize-ksize+1, n_pooled = n_outputs*(imsize_out/2)*(imsize_out/2);
+  const int nsamples = 19, batch_size = 8;
+  CvDNNLayer * input = cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1);
+  CvDNNLayer * conv = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  CvDNNLayer * pool = 
+    cvCreateMaxPoolingLayer(CV_32F,"pool1",0,n_outputs,imsize_out,imsize_out,2,.1,1,0);
+  CvDNNLayer * fc1 = cvCreateDenseLayer(CV_32F,"fc1",0,0,n_pooled,10,.1,1,"relu",0);
+  // reads output of pool1 through a side edge, skipping fc1
+  CvDNNLayer * fc2 = cvCreateDenseLayer(CV_32F,"fc2",0,pool,n_pooled,n_classes,.1,1,"softmax",0);
+  CvNetwork * network = cvCreateNetwork(input);
+  network->add_layer(network,conv);
+  network->add_layer(network,pool);
+  network->add_layer(network,fc1);
+  network->add_layer(network,fc2);
+  CvDNNStatModel * model = 
+    cvCreateStatModel(CV_STAT_MODEL_MAGIC_VAL|CV_DNN_MAGIC_VAL,sizeof(CvDNNStatModel));
+  model->network = network;
+
+  CvMat * samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  CvMat * result = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(255));
+  // input conversion of training data
+  network->input_scale = 10./(255*.5f);
+  network->input_shift = -1;
+  model->predict(network,samples,result,batch_size);
+
+  // reference: a distinct buffer for each layer output
+  CvMat * X[6] = {0,};
+  X[0] = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  cvConvertScale(samples,X[0],network->input_scale,network->input_shift);
+  CvDNNLayer * layer = network->first_layer;
+  for (int k=0;k<network->n_layers;k++,layer=layer->next_layer){
+    X[k+1] = cvCreateMat(nsamples,layer->n_output_planes*layer->output_height*layer->output_width,CV_32F);
+    layer->forward(layer,X[k],X[k+1]);
+    if (layer->clear){layer->clear(layer);}
+  }
+  EXPECT_LT(cvNorm(X[5],result,CV_C), 1e-5);
+
+  CvDNNMemoryPlan * plan = network->memory_plan;
+  ASSERT_TRUE(plan!=0);
+  EXPECT_EQ(plan->n_tensors, 6);
+  EXPECT_EQ(plan->last_use[3], 4);
+  EXPECT_LT(plan->planned_bytes, plan->naive_bytes);
+  EXPECT_GE(plan->planned_bytes, plan->live_bytes);
+  for (int ii=0;ii<plan->n_tensors;ii++){
+  for (int jj=ii+1;jj<plan->n_tensors;jj++){
+    if (plan->first_use[ii]>plan->last_use[jj] || plan->first_use[jj]>plan->last_use[ii]){continue;}
+    EXPECT_TRUE(plan->offsets[ii]+plan->sizes[ii]<=plan->offsets[jj] ||
+                plan->offsets[jj]+plan->sizes[jj]<=plan->offsets[ii]);
+  }
+  }
+
+  for (int k=0;k<6;k++){cvReleaseMat(&X[k]);}
+  cvReleaseMat(&samples);
+  cvReleaseMat(&result);
+  model->release(&model);
+}
+
+// the output of a sample is the same whether it is predicted alone or batched
+// with other samples, as served requests are
+TEST(ML_MemoryPlan, predict_batched_request){
+  const int imsize = 12, ksize = 3, n_outputs = 4, n_classes = 3;
+  const int imsize_out = imsize-ksize+1;
+  const int nsamples = 5, batch_size = 8;
+  CvDNNLayer * input = cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1);
+  CvDNNLayer * conv = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  CvDNNLayer * fc1 = 
+    cvCreateDenseLayer(CV_32F,"fc1",0,0,n_outputs*imsize_out*imsize_out,n_classes,.1,1,"softmax",0);
+  CvNetwork * network = cvCreateNetwork(input);
+  network->add_layer(network,conv);
+  network->add_layer(network,fc1);
+  network->input_scale = 10./(255*.5f);
+  network->input_shift = -1;
+  CvDNNStatModel * model = 
+    cvCreateStatModel(CV_STAT_MODEL_MAGIC_VAL|CV_DNN_MAGIC_VAL,sizeof(CvDNNStatModel));
+  model->network = network;
+
+  CvMat * samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  CvMat * result = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvMat * single = cvCreateMat(1,n_classes,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(128));
+  // a brighter request, and a blank one
+  CvMat sample_hdr, result_hdr;
+  cvGetRow(samples,&sample_hdr,1); cvAddS(&sample_hdr,cvScalar(127),&sample_hdr);
+  cvGetRow(samples,&sample_hdr,3); cvZero(&sample_hdr);
+  model->predict(network,samples,result,batch_size);
+  for (int si=0;si<nsamples;si++){
+    cvGetRow(samples,&sample_hdr,si);
+    cvGetRow(result,&result_hdr,si);
+    model->predict(network,&sample_hdr,single,batch_size);
+    EXPECT_LT(cvNorm(single,&result_hdr,CV_C), 1e-6) << "sample " << si;
+  }
+
+  cvReleaseMat(&samples);
+  cvReleaseMat(&result);
+  cvReleaseMat(&single);
+  model->release(&model);
+}
+
+TEST(ML_ExecPlan, compile){
+  const int imsize = 12, ksize = 5, n_outputs = 4, n_classes = 3;
+  const int imsize_out = imsize-ksize+1, n_pooled = n_outputs*(imsize_out/2)*(imsize_out/2);
+  CvDNNLayer * input = cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1);
+  CvDNNLayer * conv = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  CvDNNLayer * pool = 
+    cvCreateMaxPoolingLayer(CV_32F,"pool1",0,n_outputs,imsize_out,imsize_out,2,.1,1,0);
+  CvDNNLayer * fc1 = cvCreateDenseLayer(CV_32F,"fc1",0,0,n_pooled,10,.1,1,"relu",0);
+  CvDNNLayer * fc2 = cvCreateDenseLayer(CV_32F,"fc2",0,pool,n_pooled,n_classes,.1,1,"softmax",0);
+  CvNetwork * network = cvCreateNetwork(input);
+  network->add_layer(network,conv);
+  network->add_layer(network,pool);
+  network->add_layer(network,fc1);
+
+  CvDNNExecPlan * plan = cvCompileNetwork(network);
+  ASSERT_TRUE(plan!=0);
+  EXPECT_EQ(plan->n_ops, 4);
+  EXPECT_TRUE(plan->last_layer==fc1);
+  EXPECT_TRUE(cvCompileNetwork(network)==plan);
+  // adding a layer drops the plan
+  network->add_layer(network,fc2);
+  EXPECT_TRUE(network->exec_plan==0);
+  plan = cvCompileNetwork(network);
+  ASSERT_TRUE(plan!=0);
+  EXPECT_EQ(plan->n_ops, 5);
+  CvDNNLayer * layers[5] = {input,conv,pool,fc1,fc2};
+  for (int k=0;k<plan->n_ops;k++){
+    EXPECT_TRUE(plan->ops[k].layer==layers[k]);
+    EXPECT_EQ(plan->ops[k].input, k);
+    EXPECT_EQ(plan->ops[k].output, k+1);
+    EXPECT_TRUE(network->get_layer(network,layers[k]->name)==layers[k]);
+  }
+  // output of pool1 is read by fc2 through a side edge
+  EXPECT_EQ(plan->ops[2].last_use, 4);
+  EXPECT_EQ(plan->ops[3].last_use, 4);
+  EXPECT_EQ(plan->ops[4].last_use, 5);
+  EXPECT_TRUE(network->get_layer(network,"fc3")==0);
+  EXPECT_TRUE(cvGetCNNLastLayer(network)==fc2);
+
+  network->release(&network);
+}
+
+TEST(ML_ExecContext, concurrent_predict){
+  const int imsize = 12, ksize = 3, n_outputs = 4, n_classes = 3;
+  const int imsize_out = imsize-ksize+1, n_pooled = n_outputs*(imsize_out/2)*(imsize_out/2);
+  const int nsamples = 19, batch_size = 8, n_contexts = 4;
+  CvDNNLayer * input = cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1);
+  CvDNNLayer * conv = 
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0);
+  ((CvDNNConvolutionLayer*)conv)->algorithm = CV_DNN_CONVOLUTION_FFT;
+  CvDNNLayer * pool = 
+    cvCreateMaxPoolingLayer(CV_32F,"pool1",0,n_outputs,imsize_out,imsize_out,2,.1,1,0);
+  CvDNNLayer * fc1 = cvCreateDenseLayer(CV_32F,"fc1",0,0,n_pooled,10,.1,1,"relu",0);
+  CvDNNLayer * fc2 = cvCreateDenseLayer(CV_32F,"fc2",0,pool,n_pooled,n_classes,.1,1,"softmax",0);
+  CvNetwork * network = cvCreateNetwork(input);
+  network->add_layer(network,conv);
+  network->add_layer(network,pool);
+  network->add_layer(network,fc1);
+  network->add_layer(network,fc2);
+  CvDNNStatModel * model = 
+    cvCreateStatModel(CV_STAT_MODEL_MAGIC_VAL|CV_DNN_MAGIC_VAL,sizeof(CvDNNStatModel));
+  model->network = network;
+
+  CvMat * samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  CvMat * expected = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(255));
+  model->predict(network,samples,expected,batch_size);
+
+  CvDNNExecContext * contexts[n_contexts];
+  CvMat * results[n_contexts];
+  for (int ci=0;ci<n_contexts;ci++){
+    contexts[ci] = cvCreateDNNExecContext(network);
+    ASSERT_TRUE(contexts[ci]!=0);
+    results[ci] = cvCreateMat(nsamples,n_classes,CV_32F);
+  }
+  // weights and cached kernel spectra are shared with the network
+  CvDNNLayer * conv_copy = contexts[0]->network->first_layer->next_layer;
+  EXPECT_TRUE(conv_copy->shared_layer==conv);
+  EXPECT_TRUE(conv_copy->weights==conv->weights);
+  EXPECT_TRUE(((CvDNNConvolutionLayer*)conv_copy)->Wt==((CvDNNConvolutionLayer*)conv)->Wt);
+  EXPECT_TRUE(contexts[0]->network->get_last_layer(contexts[0]->network)->input_layers[0]==
+              contexts[0]->network->first_layer->next_layer->next_layer);
+
+#pragma omp parallel for num_threads(n_contexts)
+  for (int ci=0;ci<n_contexts;ci++){
+    for (int iter=0;iter<3;iter++){
+      cvDNNPredict(contexts[ci],samples,results[ci],batch_size);
+    }
+  }
+  for (int ci=0;ci<n_contexts;ci++){
+    EXPECT_LT(cvNorm(results[ci],expected,CV_C), 1e-5);
+    cvReleaseDNNExecContext(&contexts[ci]);
+    EXPECT_TRUE(contexts[ci]==0);
+    cvReleaseMat(&results[ci]);
+  }
+  EXPECT_TRUE(((CvDNNConvolutionLayer*)conv)->Wt!=0);
+
+  cvReleaseMat(&samples);
+  cvReleaseMat(&expected);
+  model->release(&model);
+}
+
+static CvNetwork * icvCreateTestConvNetwork(int imsize, int ksize, int n_outputs, int n_classes){
+  const int imsize_out = imsize-ksize+1, n_pooled = n_outputs*(imsize_out/2)*(imsize_out/2);
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1));
+  network->add_layer(network,
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,n_outputs,ksize,.1,1,"tanh",0,0));
+  network->add_layer(network,
+    cvCreateMaxPoolingLayer(CV_32F,"pool1",0,n_outputs,imsize_out,imsize_out,2,.1,1,0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,n_pooled,10,.1,1,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,10,n_classes,.1,1,"softmax",0));
+  return network;
+}
+
+TEST(ML_DataParallel, matches_serial){
+  const int imsize = 12, ksize = 3, n_outputs = 4, n_classes = 3, nsamples = 40;
+  CvRNG rng = cvRNG(-1);
+  CvMat * samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  CvMat * responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvZero(responses);
+  for (int i=0;i<nsamples;i++){CV_MAT_ELEM(*responses,float,i,i%n_classes)=1;}
+
+  CvNetwork * networks[2];
+  CvDNNStatModel * models[2];
+  const int n_workers[2] = {1,3};
+  for (int ni=0;ni<2;ni++){
+    networks[ni] = icvCreateTestConvNetwork(imsize,ksize,n_outputs,n_classes);
+  }
+  // both networks start from the same weights
+  for (CvDNNLayer * src = networks[0]->first_layer, * dst = networks[1]->first_layer;
+       src && dst; src = src->next_layer, dst = dst->next_layer){
+    if (src->weights){cvCopy(src->weights,dst->weights);}
+  }
+  for (int ni=0;ni<2;ni++){
+    CvDNNStatModelParams params;
+    memset(&params,0,sizeof(params));
+    params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+    params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+    cvSetIdentity(params.etalons);
+    params.network = networks[ni];
+    params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+    params.max_iter = 1;
+    params.batch_size = 8;
+    params.validate_ratio = .2f;
+    params.nepochs = 2;
+    params.n_workers = n_workers[ni];
+    CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+    models[ni] = cvTrainCNNClassifierFromSource(source,&params);
+    source->release(&source);
+    cvReleaseMat(&params.etalons);
+    ASSERT_TRUE(models[ni]!=0);
+  }
+  // gradients summed over workers are those of the whole mini batch
+  for (CvDNNLayer * a = networks[0]->first_layer, * b = networks[1]->first_layer;
+       a && b; a = a->next_layer, b = b->next_layer){
+    if (a->weights){EXPECT_LT(cvNorm(a->weights,b->weights,CV_C), 1e-4);}
+  }
+  for (int ni=0;ni<2;ni++){models[ni]->release(&models[ni]);}
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+}
+
+TEST(ML_Checkpoint, matches_full){
+  const int imsize = 12, ksize = 3, n_outputs = 4, n_classes = 3, nsamples = 40;
+  CvRNG rng = cvRNG(-1);
+  CvMat * samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  CvMat * responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvZero(responses);
+  for (int i=0;i<nsamples;i++){CV_MAT_ELEM(*responses,float,i,i%n_classes)=1;}
+
+  CvNetwork * networks[2];
+  CvDNNStatModel * models[2];
+  const int n_segments[2] = {0,3};
+  for (int ni=0;ni<2;ni++){
+    networks[ni] = icvCreateTestConvNetwork(imsize,ksize,n_outputs,n_classes);
+  }
+  for (CvDNNLayer * src = networks[0]->first_layer, * dst = networks[1]->first_layer;
+       src && dst; src = src->next_layer, dst = dst->next_layer){
+    if (src->weights){cvCopy(src->weights,dst->weights);}
+  }
+
+  // boundaries split the layers, interior activations share a buffer
+  CvDNNCheckpointPlan * plan = cvCreateCheckpointPlan(networks[1],8,n_segments[1]);
+  ASSERT_TRUE(plan!=0);
+  EXPECT_EQ(plan->n_segments, 3);
+  EXPECT_EQ(plan->bounds[0], 0);
+  EXPECT_EQ(plan->bounds[plan->n_segments], networks[1]->n_layers);
+  for (int si=0;si<plan->n_segments;si++){EXPECT_LT(plan->bounds[si],plan->bounds[si+1]);}
+  EXPECT_LT(plan->checkpointed_bytes, plan->naive_bytes);
+  cvReleaseCheckpointPlan(&plan);
+
+  for (int ni=0;ni<2;ni++){
+    CvDNNStatModelParams params;
+    memset(&params,0,sizeof(params));
+    params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+    params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+    cvSetIdentity(params.etalons);
+    params.network = networks[ni];
+    params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+    params.max_iter = 1;
+    params.batch_size = 8;
+    params.validate_ratio = .2f;
+    params.nepochs = 2;
+    params.n_workers = 1;
+    params.checkpoint_segments = n_segments[ni];
+    CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+    models[ni] = cvTrainCNNClassifierFromSource(source,&params);
+    source->release(&source);
+    cvReleaseMat(&params.etalons);
+    ASSERT_TRUE(models[ni]!=0);
+  }
+  // recomputed activations are those of the forward pass
+  for (CvDNNLayer * a = networks[0]->first_layer, * b = networks[1]->first_layer;
+       a && b; a = a->next_layer, b = b->next_layer){
+    if (a->weights){EXPECT_LT(cvNorm(a->weights,b->weights,CV_C), 1e-6);}
+  }
+  for (int ni=0;ni<2;ni++){models[ni]->release(&models[ni]);}
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+}
+
+// fc4 reads the output of fc1 through a side edge, instead of that of fc3
+static CvNetwork * icvCreateTestSideEdgeNetwork(int n_inputs, int n_hiddens, int n_classes){
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",n_inputs,1,1,1,.1,1));
+  CvDNNLayer * fc1 = cvCreateDenseLayer(CV_32F,"fc1",0,0,n_inputs,n_inputs,.1,1,"tanh",0);
+  network->add_layer(network,fc1);
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,n_inputs,n_hiddens,.1,1,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc3",0,0,n_hiddens,n_inputs*2,.1,1,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc4",0,fc1,n_inputs,n_classes,.1,1,"softmax",0));
+  return network;
+}
+
+TEST(ML_Checkpoint, lowers_peak){
+  const int n_inputs = 16, n_hiddens = 64, n_classes = 3, nsamples = 40, batch_size = 8;
+  CvRNG rng = cvRNG(-1);
+  CvMat * samples = cvCreateMat(nsamples,n_inputs,CV_32F);
+  CvMat * responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvZero(responses);
+  for (int i=0;i<nsamples;i++){CV_MAT_ELEM(*responses,float,i,i%n_classes)=1;}
+
+  CvNetwork * networks[2];
+  CvDNNStatModel * models[2];
+  size_t activation_bytes[2], peak_bytes[2];
+  const int n_segments[2] = {0,2};
+  for (int ni=0;ni<2;ni++){
+    networks[ni] = icvCreateTestSideEdgeNetwork(n_inputs,n_hiddens,n_classes);
+  }
+  for (CvDNNLayer * src = networks[0]->first_layer, * dst = networks[1]->first_layer;
+       src && dst; src = src->next_layer, dst = dst->next_layer){
+    if (src->weights){cvCopy(src->weights,dst->weights);}
+  }
+  // output of fc1 is interior to the first segment, and read by fc4 in the 
+  // second one, whose interior activation takes its place in the shared buffer
+  CvDNNCheckpointPlan * plan = cvCreateCheckpointPlan(networks[1],batch_size,n_segments[1]);
+  ASSERT_TRUE(plan!=0);
+  activation_bytes[0] = plan->naive_bytes;
+  activation_bytes[1] = plan->checkpointed_bytes;
+  EXPECT_EQ(plan->n_segments, 2);
+  EXPECT_EQ(plan->bounds[1], 3);
+  cvReleaseCheckpointPlan(&plan);
+
+  for (int ni=0;ni<2;ni++){
+    CvDNNStatModelParams params;
+    memset(&params,0,sizeof(params));
+    params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+    params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+    cvSetIdentity(params.etalons);
+    params.network = networks[ni];
+    params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+    params.max_iter = 1;
+    params.batch_size = batch_size;
+    params.validate_ratio = .2f;
+    params.nepochs = 2;
+    params.n_workers = 1;
+    params.checkpoint_segments = n_segments[ni];
+    CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+    models[ni] = cvTrainCNNClassifierFromSource(source,&params);
+    source->release(&source);
+    cvReleaseMat(&params.etalons);
+    ASSERT_TRUE(models[ni]!=0);
+    peak_bytes[ni] = activation_bytes[ni]+networks[ni]->workspace->peak_bytes;
+  }
+  // layers read their outputs from the activations rather than from copies
+  // of their own, and scratch buffers are held for a segment at a time
+  EXPECT_LT(networks[1]->workspace->peak_bytes, networks[0]->workspace->peak_bytes);
+  EXPECT_LT(peak_bytes[1], peak_bytes[0]);
+  // fc4 reads the output of fc1 as computed in forward pass
+  for (CvDNNLayer * a = networks[0]->first_layer, * b = networks[1]->first_layer;
+       a && b; a = a->next_layer, b = b->next_layer){
+    if (a->weights){EXPECT_LT(cvNorm(a->weights,b->weights,CV_C), 1e-6);}
+  }
+  for (int ni=0;ni<2;ni++){models[ni]->release(&models[ni]);}
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+}
+
+TEST(ML_Hogwild, converges){
+  const int n_inputs = 16, n_classes = 3, nsamples = 300;
+  CvRNG rng = cvRNG(-1);
+  CvMat * templates = cvCreateMat(n_classes,n_inputs,CV_32F);
+  CvMat * samples = cvCreateMat(nsamples,n_inputs,CV_32F);
+  CvMat * responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvMat * result = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(&rng,templates,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(.5));
+  cvZero(responses);
+  for (int i=0;i<nsamples;i++){
+    CvMat sample, tmpl;
+    cvAdd(cvGetRow(samples,&sample,i),cvGetRow(templates,&tmpl,i%n_classes),&sample);
+    CV_MAT_ELEM(*responses,float,i,i%n_classes)=1;
+  }
+
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",n_inputs,1,1,1,.1,1));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,n_inputs,10,.1,1,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,10,n_classes,.1,1,"softmax",0));
+  CvDNNStatModelParams params;
+  memset(&params,0,sizeof(params));
+  params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+  params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+  cvSetIdentity(params.etalons);
+  params.network = network;
+  params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+  params.max_iter = 1;
+  params.batch_size = 4;
+  params.validate_ratio = .1f;
+  params.nepochs = 5;
+  params.n_workers = 3;
+  params.train_mode = CV_DNN_TRAIN_HOGWILD;
+  CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+  CvDNNStatModel * model = cvTrainCNNClassifierFromSource(source,&params);
+  source->release(&source);
+  cvReleaseMat(&params.etalons);
+  ASSERT_TRUE(model!=0);
+
+  // updates of all workers land in the weights of the network
+  model->predict(network,samples,result,params.batch_size);
+  EXPECT_GT(network->eval(network->get_last_layer(network),result,responses), 90.f);
+
+  model->release(&model);
+  cvReleaseMat(&templates);
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+  cvReleaseMat(&result);
+}
+
+TEST(ML_Optimizer, fused_update){
+  const int nr = 4, nc = 37, n_steps = 3; // rows not a multiple of the vector width
+  const float lr = .01f, mu = .9f, beta2 = .999f, eps = 1e-8f, wd = .01f;
+  CvRNG rng = cvRNG(-1);
+  CvMat * weights_buf = cvCreateMat(nr,nc+3,CV_32F);
+  CvMat * grads = cvCreateMat(n_steps*nr,nc,CV_32F);
+  CvMat * init = cvCreateMat(nr,nc,CV_32F);
+  cvRandArr(&rng,init,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,grads,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  const int max_level = cvSetFastMathLevel(CV_DNN_FASTMATH_AVX2);
+  for (int type=CV_DNN_OPTIMIZER_SGD;type<=CV_DNN_OPTIMIZER_ADAMW;type++){
+  for (int level=CV_DNN_FASTMATH_SCALAR;level<=max_level;level++){
+    cvSetFastMathLevel(level);
+    CvDNNOptimizer * optimizer = cvCreateDNNOptimizer(type,mu,beta2,eps,wd);
+    // weights are a sub-matrix, whose rows are not continuous
+    CvMat weights;
+    cvGetCols(weights_buf,&weights,1,nc+1);
+    cvCopy(init,&weights);
+    double w[nr*nc], m[nr*nc], v[nr*nc];
+    for (int i=0;i<nr*nc;i++){ w[i] = init->data.fl[i]; m[i] = v[i] = 0; }
+    for (int t=1;t<=n_steps;t++){
+      CvMat grad;
+      cvGetRows(grads,&grad,(t-1)*nr,t*nr);
+      cvOptimizerUpdate(optimizer,&weights,&grad,lr);
+      for (int i=0;i<nr*nc;i++){
+        double g = grad.data.fl[i]+(type==CV_DNN_OPTIMIZER_ADAMW?0:wd*w[i]);
+        if (type==CV_DNN_OPTIMIZER_SGD){ w[i] -= lr*g; }
+        else if (type==CV_DNN_OPTIMIZER_MOMENTUM){ m[i] = mu*m[i]+g; w[i] -= lr*m[i]; }
+        else if (type==CV_DNN_OPTIMIZER_NESTEROV){ m[i] = mu*m[i]+g; w[i] -= lr*(g+mu*m[i]); }
+        else{
+          if (type==CV_DNN_OPTIMIZER_ADAMW){ w[i] -= lr*wd*w[i]; }
+          m[i] = mu*m[i]+(1-mu)*g; v[i] = beta2*v[i]+(1-beta2)*g*g;
+          w[i] -= lr*(m[i]/(1-pow(mu,t)))/(sqrt(v[i]/(1-pow(beta2,t)))+eps);
+        }
+      }
+    }
+    double err = 0;
+    for (int i=0;i<nr*nc;i++){ err = MAX(err,fabs(CV_MAT_ELEM(weights,float,i/nc,i%nc)-w[i])); }
+    EXPECT_LT(err, 1e-5) << "optimizer " << type << ", fastmath level " << level;
+    cvReleaseDNNOptimizer(&optimizer);
+  }
+  }
+  cvSetFastMathLevel(max_level);
+  cvReleaseMat(&weights_buf);
+  cvReleaseMat(&grads);
+  cvReleaseMat(&init);
+}
+
+/* Training loss after a single epoch with a small learning rate, which
+   momentum and Adam should bring down faster than plain gradient descent. */
+static double icvTestOptimizerLoss(int optimizer)
+{
+  const int n_inputs = 16, n_classes = 3, nsamples = 300;
+  CvRNG rng = cvRNG(-1);
+  CvMat * templates = cvCreateMat(n_classes,n_inputs,CV_32F);
+  CvMat * samples = cvCreateMat(nsamples,n_inputs,CV_32F);
+  CvMat * responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvMat * result = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(&rng,templates,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(.5));
+  cvZero(responses);
+  for (int i=0;i<nsamples;i++){
+    CvMat sample, tmpl;
+    cvAdd(cvGetRow(samples,&sample,i),cvGetRow(templates,&tmpl,i%n_classes),&sample);
+    CV_MAT_ELEM(*responses,float,i,i%n_classes)=1;
+  }
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",n_inputs,1,1,1,.01,1));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,n_inputs,10,.01,CV_DNN_LEARN_RATE_DECREASE_SQRT_INV,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,10,n_classes,.01,CV_DNN_LEARN_RATE_DECREASE_SQRT_INV,"softmax",0));
+  CvDNNStatModelParams params;
+  memset(&params,0,sizeof(params));
+  params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+  params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+  cvSetIdentity(params.etalons);
+  params.network = network;
+  params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+  params.max_iter = 1;
+  params.batch_size = 10;
+  params.validate_ratio = .1f;
+  params.nepochs = 1;
+  params.n_workers = 1;
+  params.momentum_ratio = .9f;
+  params.optimizer = optimizer;
+  CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+  CvDNNStatModel * model = cvTrainCNNClassifierFromSource(source,&params);
+  source->release(&source);
+  cvReleaseMat(&params.etalons);
+  model->predict(network,samples,result,params.batch_size);
+  const double loss = cvNorm(result,responses)/nsamples;
+  model->release(&model);
+  cvReleaseMat(&templates);
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+  cvReleaseMat(&result);
+  return loss;
+}
+
+TEST(ML_Optimizer, converges_faster){
+  const double sgd_loss = icvTestOptimizerLoss(CV_DNN_OPTIMIZER_SGD);
+  const double momentum_loss = icvTestOptimizerLoss(CV_DNN_OPTIMIZER_MOMENTUM);
+  const double nesterov_loss = icvTestOptimizerLoss(CV_DNN_OPTIMIZER_NESTEROV);
+  const double adam_loss = icvTestOptimizerLoss(CV_DNN_OPTIMIZER_ADAM);
+  fprintf(stderr,"loss: sgd %f, momentum %f, nesterov %f, adam %f\n",
+          sgd_loss,momentum_loss,nesterov_loss,adam_loss);
+  EXPECT_LT(momentum_loss, sgd_loss);
+  EXPECT_LT(nesterov_loss, sgd_loss);
+  EXPECT_LT(adam_loss, sgd_loss);
+}
+
+TEST(ML_Quantization, gemm_int8){
+  const int M = 5, N = 71, K = 27, kpad = 32; // rows of B not a multiple of the block
+  CvRNG rng = cvRNG(-1);
+  CvMat * A = cvCreateMat(M,kpad,CV_8S);
+  CvMat * B = cvCreateMat(N,kpad,CV_8S);
+  CvMat * C = cvCreateMat(M,N,CV_32S);
+  cvRandArr(&rng,A,CV_RAND_UNI,cvScalar(-127),cvScalar(128));
+  cvRandArr(&rng,B,CV_RAND_UNI,cvScalar(-127),cvScalar(128));
+  CvMat pad;
+  cvGetCols(A,&pad,K,kpad); cvZero(&pad);
+  cvGetCols(B,&pad,K,kpad); cvZero(&pad);
+  const int max_level = cvSetFastMathLevel(CV_DNN_FASTMATH_AVX2);
+  for (int level=CV_DNN_FASTMATH_SCALAR;level<=max_level;level++){
+    cvSetFastMathLevel(level);
+    cvZero(C);
+    cvGEMMInt8(A,B,C);
+    int err = 0;
+    for (int i=0;i<M;i++){
+    for (int j=0;j<N;j++){
+      int sum = 0;
+      for (int k=0;k<K;k++){ sum += CV_MAT_ELEM(*A,schar,i,k)*CV_MAT_ELEM(*B,schar,j,k); }
+      err = MAX(err,abs(CV_MAT_ELEM(*C,int,i,j)-sum));
+    }
+    }
+    EXPECT_EQ(err, 0) << "fastmath level " << level;
+  }
+  cvSetFastMathLevel(max_level);
+  cvReleaseMat(&A);
+  cvReleaseMat(&B);
+  cvReleaseMat(&C);
+}
+
+TEST(ML_Quantization, matches_float){
+  const int imsize = 12, ksize = 3, n_outputs = 4, n_classes = 3;
+  const int imsize_out = imsize-ksize+1, n_pooled = n_outputs*(imsize_out/2)*(imsize_out/2);
+  const int nsamples = 37, batch_size = 8;
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",1,imsize,imsize,1,.1,1));
+  network->add_layer(network,
+    cvCreateConvolutionLayer(CV_32F,"conv1",0,0,0,1,imsize,imsize,n_outputs,ksize,.1,1,"relu",0,0));
+  network->add_layer(network,
+    cvCreateMaxPoolingLayer(CV_32F,"pool1",0,n_outputs,imsize_out,imsize_out,2,.1,1,0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,n_pooled,10,.1,1,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,10,n_classes,.1,1,"softmax",0));
+  CvDNNStatModel * model = 
+    cvCreateStatModel(CV_STAT_MODEL_MAGIC_VAL|CV_DNN_MAGIC_VAL,sizeof(CvDNNStatModel));
+  model->network = network;
+
+  CvMat * samples = cvCreateMat(nsamples,imsize*imsize,CV_32F);
+  CvMat * result = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvMat * result_int8 = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvMat * result_restored = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvRNG rng = cvRNG(-1);
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(255));
+  model->predict(network,samples,result,batch_size);
+
+  // calibrate on every other sample
+  CvMat calib = cvMat(nsamples/2,imsize*imsize*2,CV_32F,samples->data.fl);
+  calib.cols = imsize*imsize;
+  cvQuantizeNetwork(network,CV_DNN_QUANT_INT8,&calib,batch_size);
+  CvDNNLayer * layer = network->first_layer->next_layer;
+  for (;layer;layer=layer->next_layer){
+    if (icvIsMaxPoolingLayer(layer)){ EXPECT_TRUE(layer->quant==0); continue; }
+    ASSERT_TRUE(layer->quant!=0);
+    EXPECT_EQ(layer->quant->state, CV_DNN_QUANT_INT8);
+    EXPECT_GT(layer->quant->xmax, 0);
+    EXPECT_EQ(layer->quant->W->cols%CV_DNN_QUANT_ALIGN, 0);
+  }
+  model->predict(network,samples,result_int8,batch_size);
+  EXPECT_GT(cvNorm(result_int8,result,CV_C), 0);
+  EXPECT_LT(cvNorm(result_int8,result,CV_C), .05);
+  EXPECT_EQ(cvGetNetworkQuantization(network), CV_DNN_QUANT_INT8);
+
+  // int8 weights and scales are saved with the network, and loaded back
+  const char * filename = "test_dnn_quantization.xml";
+  CvFileStorage * fs = cvOpenFileStorage(filename,0,CV_STORAGE_WRITE);
+  network->write(network,fs);
+  cvReleaseFileStorage(&fs);
+  cvDequantizeNetwork(network);
+  EXPECT_EQ(cvGetNetworkQuantization(network), 0);
+  fs = cvOpenFileStorage(filename,0,CV_STORAGE_READ);
+  network->read(network,fs);
+  cvReleaseFileStorage(&fs);
+  remove(filename);
+  EXPECT_EQ(cvGetNetworkQuantization(network), CV_DNN_QUANT_INT8);
+  model->predict(network,samples,result_restored,batch_size);
+  EXPECT_EQ(cvNorm(result_restored,result_int8,CV_C), 0);
+
+  // back to float inference
+  cvDequantizeNetwork(network);
+  model->predict(network,samples,result_restored,batch_size);
+  EXPECT_EQ(cvNorm(result_restored,result,CV_C), 0);
+
+  cvReleaseMat(&samples);
+  cvReleaseMat(&result);
+  cvReleaseMat(&result_int8);
+  cvReleaseMat(&result_restored);
+  model->release(&model);
+}
+
+TEST(ML_Quantization, gemm_float16){
+  const int M = 7, N = 19, K = 45; // none a multiple of the vector width
+  CvRNG rng = cvRNG(-1);
+  CvDNNLayer * fc = cvCreateDenseLayer(CV_32F,"fc1",0,0,K,N,.1,1,"none",0);
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",1,K,1,1,.1,1));
+  network->add_layer(network,fc);
+  CvMat * A = cvCreateMat(M,K,CV_32F);
+  CvMat * C = cvCreateMat(M,N,CV_32F);
+  CvMat * C_scalar = cvCreateMat(M,N,CV_32F);
+  CvMat * Y = cvCreateMat(M,N,CV_32F);
+  CvMat * expected = cvCreateMat(M,N,CV_32F);
+  CvMat weights;
+  cvRandArr(&rng,A,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvRandArr(&rng,fc->weights,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvGEMM(A,cvGetCols(fc->weights,&weights,0,K),1,0,0,expected,CV_GEMM_B_T);
+  CvMat * W0 = cvCloneMat(fc->weights);
+  const int max_level = cvSetFastMathLevel(CV_DNN_FASTMATH_AVX2);
+  for (int type=CV_DNN_QUANT_FP16;type<=CV_DNN_QUANT_BF16;type++){
+    cvQuantizeNetwork(network,type,0,0);
+    ASSERT_TRUE(fc->quant!=0);
+    EXPECT_EQ(fc->quant->state, type);
+    EXPECT_EQ(CV_MAT_TYPE(fc->quant->W->type), CV_16U);
+    // float weights are not kept next to the 16 bit ones
+    EXPECT_TRUE(fc->weights==0);
+    cvSetFastMathLevel(CV_DNN_FASTMATH_SCALAR);
+    cvGEMMFloat16(A,fc->quant->W,type,C_scalar);
+    cvSetFastMathLevel(max_level);
+    cvGEMMFloat16(A,fc->quant->W,type,C);
+    // 11 and 8 bits of mantissa, over K products
+    EXPECT_LT(cvNorm(C,expected,CV_C), type==CV_DNN_QUANT_FP16?1e-2:5e-2) << "type " << type;
+    EXPECT_LT(cvNorm(C,C_scalar,CV_C), 1e-4) << "type " << type;
+    // forward pass reads the 16 bit weights, bias is kept in float
+    fc->forward(fc,A,Y);
+    for (int j=0;j<N;j++){
+      CvMat col; cvGetCol(C,&col,j); cvAddS(&col,cvScalar(CV_MAT_ELEM(*W0,float,j,K)),&col);
+    }
+    EXPECT_LT(cvNorm(Y,C,CV_C), 1e-5) << "type " << type;
+  }
+
+  // 16 bit weights are saved in place of float weights, and loaded back
+  const char * filename = "test_dnn_float16.xml";
+  CvFileStorage * fs = cvOpenFileStorage(filename,0,CV_STORAGE_WRITE);
+  network->write(network,fs);
+  cvReleaseFileStorage(&fs);
+  cvDequantizeNetwork(network);
+  fs = cvOpenFileStorage(filename,0,CV_STORAGE_READ);
+  network->read(network,fs);
+  cvReleaseFileStorage(&fs);
+  remove(filename);
+  EXPECT_EQ(cvGetNetworkQuantization(network), CV_DNN_QUANT_BF16);
+  EXPECT_TRUE(fc->weights==0);
+  fc->forward(fc,A,C);
+  EXPECT_EQ(cvNorm(C,Y,CV_C), 0);
+
+  // float weights are restored within 8 bits of mantissa
+  cvDequantizeNetwork(network);
+  EXPECT_TRUE(fc->quant==0);
+  ASSERT_TRUE(fc->weights!=0);
+  EXPECT_LT(cvNorm(fc->weights,W0,CV_C), 1e-2);
+  cvReleaseMat(&W0);
+  cvReleaseMat(&A);
+  cvReleaseMat(&C);
+  cvReleaseMat(&C_scalar);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&expected);
+  network->release(&network);
+}
 
+#if !defined(WIN32) && !defined(WIN64)
+typedef struct CvTestPSWorker
+{
+  CvNetwork * network;
+  CvDNNStatModel * model;
+  const CvMat * samples;
+  const CvMat * responses;
+  int port;
+  int compression;
+}CvTestPSWorker;
+
+static CvNetwork * icvCreateTestDenseNetwork(int n_inputs, int n_classes)
+{
+  CvNetwork * network = cvCreateNetwork(cvCreateInputLayer(CV_32F,"input1",n_inputs,1,1,1,.1,1));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc1",0,0,n_inputs,10,.1,1,"tanh",0));
+  network->add_layer(network,cvCreateDenseLayer(CV_32F,"fc2",0,0,10,n_classes,.1,1,"softmax",0));
+  return network;
+}
 
+static void * icvTestPSServerThread(void * arg)
+{
+  try{cvRunParamServer((CvDNNParamServer*)arg);}catch(...){}
+  return 0;
+}
 
+static void * icvTestPSWorkerThread(void * arg)
+{
+  CvTestPSWorker * worker = (CvTestPSWorker*)arg;
+  const int n_classes = worker->responses->cols;
+  CvDNNStatModelParams params;
+  memset(&params,0,sizeof(params));
+  params.cls_labels = cvCreateMat(1,n_classes,CV_32F);
+  params.etalons = cvCreateMat(n_classes,n_classes,CV_32F);
+  cvSetIdentity(params.etalons);
+  params.network = worker->network;
+  params.grad_estim_type = CV_DNN_GRAD_ESTIM_RANDOM;
+  params.max_iter = 1;
+  params.batch_size = 5;
+  params.validate_ratio = .1f;
+  params.nepochs = 5;
+  params.n_workers = 1;
+  params.ps_host = "127.0.0.1";
+  params.ps_port = worker->port;
+  params.ps_compression = worker->compression;
+  params.ps_topk_ratio = .2f;
+  CvDNNDataSource * source = cvCreateMatDataSource(worker->samples,worker->responses);
+  try{worker->model = cvTrainCNNClassifierFromSource(source,&params);}catch(...){}
+  source->release(&source);
+  cvReleaseMat(&params.etalons);
+  return 0;
+}
 
+/* Connects to the server on localhost as a worker announcing a payload far
+   larger than any message; returns 1 if the server closes the connection 
+   instead of reading the payload. */
+static int icvTestPSOversizedHello(int port)
+{
+  // magic, type (hello), worker_id, n_workers, clock, compression, 
+  // n_weights, n_grads and payload_size
+  int fields[9] = {0x444e4e50,1,0,0,0,0,0,0,0x7fffffff};
+  struct sockaddr_in addr;
+  struct timeval timeout = {10,0};
+  char c = 0;
+  int fd = socket(AF_INET,SOCK_STREAM,0), closed = 0;
+  if (fd<0){return 0;}
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+  addr.sin_port = htons((unsigned short)port);
+  setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
+  for (int i=0;i<9;i++){fields[i] = htonl(fields[i]);}
+  if (connect(fd,(struct sockaddr*)&addr,sizeof(addr))==0 &&
+      send(fd,fields,sizeof(fields),0)==int(sizeof(fields))){
+    closed = recv(fd,&c,1,0)==0;
+  }
+  close(fd);
+  return closed;
+}
 
+/* Trains two workers of a parameter server on localhost, each on half of
+   the training samples, and checks they converge to the server weights; 
+   with <intruder>, a malformed connection is rejected before they join. */
+static void icvTestParamServer(int staleness, int compression, int intruder = 0)
+{
+  const int n_inputs = 16, n_classes = 3, nsamples = 300, n_workers = 2;
+  CvRNG rng = cvRNG(-1);
+  CvMat * templates = cvCreateMat(n_classes,n_inputs,CV_32F);
+  CvMat * samples = cvCreateMat(nsamples,n_inputs,CV_32F);
+  CvMat * responses = cvCreateMat(nsamples,n_classes,CV_32F);
+  CvMat * result = cvCreateMat(nsamples,n_classes,CV_32F);
+  cvRandArr(&rng,templates,CV_RAND_UNI,cvScalar(0),cvScalar(1));
+  cvRandArr(&rng,samples,CV_RAND_UNI,cvScalar(0),cvScalar(.5));
+  cvZero(responses);
+  for (int i=0;i<nsamples;i++){
+    CvMat sample, tmpl;
+    cvAdd(cvGetRow(samples,&sample,i),cvGetRow(templates,&tmpl,i%n_classes),&sample);
+    CV_MAT_ELEM(*responses,float,i,i%n_classes)=1;
+  }
 
+  CvNetwork * network = icvCreateTestDenseNetwork(n_inputs,n_classes);
+  CvDNNParamServer * server = cvCreateParamServer(network,0,n_workers,staleness);
+  ASSERT_TRUE(server!=0);
+  ASSERT_GT(cvGetParamServerPort(server),0);
+  CvTestPSWorker workers[n_workers];
+  pthread_t server_thread, worker_threads[n_workers];
+  pthread_create(&server_thread,0,icvTestPSServerThread,server);
+  if (intruder){EXPECT_TRUE(icvTestPSOversizedHello(cvGetParamServerPort(server)));}
+  for (int w=0;w<n_workers;w++){
+    workers[w].network = icvCreateTestDenseNetwork(n_inputs,n_classes);
+    workers[w].model = 0;
+    workers[w].samples = samples;
+    workers[w].responses = responses;
+    workers[w].port = cvGetParamServerPort(server);
+    workers[w].compression = compression;
+    pthread_create(&worker_threads[w],0,icvTestPSWorkerThread,&workers[w]);
+  }
+  for (int w=0;w<n_workers;w++){pthread_join(worker_threads[w],0);}
+  pthread_join(server_thread,0);
+  cvReleaseParamServer(&server);
 
+  // server weights are trained on all samples
+  CvDNNStatModel * model = workers[0].model;
+  ASSERT_TRUE(workers[0].model!=0 && workers[1].model!=0);
+  model->predict(network,samples,result,5);
+  EXPECT_GT(network->eval(network->get_last_layer(network),result,responses), 90.f);
+  // shards are of equal size, so that in synchronous training both workers
+  // pull the weights of the last update
+  for (int w=0;w<n_workers && !staleness;w++){
+    for (CvDNNLayer * a = network->first_layer, * b = workers[w].network->first_layer;
+         a && b; a = a->next_layer, b = b->next_layer){
+      if (a->weights){EXPECT_EQ(0,cvNorm(a->weights,b->weights,CV_C));}
+    }
+  }
 
+  for (int w=0;w<n_workers;w++){workers[w].model->release(&workers[w].model);}
+  network->release(&network);
+  cvReleaseMat(&templates);
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+  cvReleaseMat(&result);
+}
 
+TEST(ML_ParamServer, sync_fp16){icvTestParamServer(0,CV_DNN_COMPRESS_FP16);}
+
+TEST(ML_ParamServer, stale_topk){icvTestParamServer(2,CV_DNN_COMPRESS_TOPK);}
+
+TEST(ML_ParamServer, oversized_message){icvTestParamServer(0,CV_DNN_COMPRESS_NONE,1);}
+#endif
+
+TEST(ML_Tensor, save_and_map){
+  const char * filename = "test_dnn_tensor.bin";
+  CvRNG rng = cvRNG(-1);
+  CvMat * images = cvCreateMat(37,28*28,CV_8U);
+  cvRandArr(&rng,images,CV_RAND_UNI,cvScalar(0),cvScalar(256));
+  // a sub-matrix is saved row by row
+  CvMat * labels = cvCreateMat(37,12,CV_32F);
+  CvMat labels_submat;
+  cvRandArr(&rng,labels,CV_RAND_UNI,cvScalar(-1),cvScalar(1));
+  cvGetCols(labels,&labels_submat,2,12);
+
+  cvSaveTensor(filename,images);
+  ASSERT_TRUE(cvIsTensorFile(filename)!=0);
+  CvMat * mapped = cvMapTensor(filename);
+  ASSERT_TRUE(mapped!=0);
+  EXPECT_EQ(CV_MAT_TYPE(mapped->type), CV_8U);
+  EXPECT_TRUE(CV_ARE_SIZES_EQ(mapped,images));
+  EXPECT_EQ(cvNorm(mapped,images,CV_C), 0);
+  EXPECT_EQ(size_t(mapped->data.ptr)%CV_DNN_TENSOR_HEADER_SIZE, size_t(0));
+  cvReleaseMappedTensor(&mapped);
+  EXPECT_TRUE(mapped==0);
+
+  cvSaveTensor(filename,&labels_submat);
+  mapped = cvMapTensor(filename);
+  ASSERT_TRUE(mapped!=0);
+  EXPECT_EQ(CV_MAT_TYPE(mapped->type), CV_32F);
+  EXPECT_EQ(cvNorm(mapped,&labels_submat,CV_C), 0);
+  cvReleaseMappedTensor(&mapped);
+  remove(filename);
+
+  cvReleaseMat(&images);
+  cvReleaseMat(&labels);
+}
+
+TEST(ML_BatchLoader, shuffled_epochs){
+  const int n_samples = 50, n_train = 23, batch_size = 5, n_epochs = 3;
+  CvMat * samples = cvCreateMat(n_samples,6,CV_8U);
+  CvMat * responses = cvCreateMat(n_samples,1,CV_32F);
+  CvMat * train_idx = cvCreateMat(1,n_train,CV_32S);
+  for (int ii=0;ii<n_samples;ii++){
+    CvMat row; cvGetRow(samples,&row,ii); cvSet(&row,cvScalar(ii));
+    CV_MAT_ELEM(*responses,float,ii,0) = ii;
+  }
+  // training samples are the odd ones
+  for (int ii=0;ii<n_train;ii++){ train_idx->data.i[ii]=ii*2+1; }
+
+  CvDNNDataSource * source = cvCreateMatDataSource(samples,responses);
+  ASSERT_TRUE(source!=0);
+  EXPECT_EQ(source->n_samples, n_samples);
+  EXPECT_EQ(source->n_inputs, 6);
+  EXPECT_EQ(source->n_outputs, 1);
+  source->scale = .5; source->shift = 1;
+  CvRNG rng = cvRNG(0xffffffff);
+  CvDNNBatchLoader * loader = cvCreateBatchLoader(source,train_idx,batch_size,2,&rng);
+  ASSERT_TRUE(loader!=0);
+
+  CvMat * X = cvCreateMat(batch_size,6,CV_32F);
+  CvMat * Y = cvCreateMat(batch_size,1,CV_32F);
+  for (int epoch=0;epoch<n_epochs;epoch++){
+    int seen[n_samples] = {0}, order[n_train+batch_size];
+    for (int n=0;n<n_train;n+=batch_size){
+      cvGetNextBatch(loader,X,Y);
+      for (int ii=0;ii<batch_size;ii++){
+        const int sidx = cvRound(CV_MAT_ELEM(*Y,float,ii,0));
+        ASSERT_TRUE(sidx>=0 && sidx<n_samples);
+        EXPECT_EQ(sidx%2, 1);
+        EXPECT_FLOAT_EQ(CV_MAT_ELEM(*X,float,ii,5), sidx*.5f+1.f);
+        order[n+ii] = sidx;
+        if (n+ii<n_train){ seen[sidx]++; }
+      }
+    }
+    // every sample is drawn once per epoch, the last batch wraps around
+    for (int ii=0;ii<n_train;ii++){ EXPECT_EQ(seen[ii*2+1], 1); }
+    for (int ii=n_train;ii<(n_train+batch_size-1)/batch_size*batch_size;ii++){
+      EXPECT_EQ(order[ii], order[ii-n_train]);
+    }
+  }
+
+  cvReleaseBatchLoader(&loader);
+  EXPECT_TRUE(loader==0);
+  source->release(&source);
+  cvReleaseMat(&X);
+  cvReleaseMat(&Y);
+  cvReleaseMat(&samples);
+  cvReleaseMat(&responses);
+  cvReleaseMat(&train_idx);
+}
@@ -1,6 +1,9 @@
 #include "network.h"
 
 #include <stdio.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
@@ -101,6 +104,7 @@ void Network::loadModel(string inFile)
           this_layer->n_input_planes, this_layer->input_height, this_layer->input_width,
           this_layer->n_output_planes, this_layer->K,
           this_layer->init_learn_rate, this_layer->decay_type, this_layer->activation, NULL, NULL );
+        ((CvDNNConvolutionLayer*)layer)->algorithm = this_layer->algorithm;
       }else if (icvIsMaxPoolingLayer(predefined_layer)){
         CvDNNMaxPoolingLayer * this_layer = (CvDNNMaxPoolingLayer*)predefined_layer;
         layer = cvCreateMaxPoolingLayer( 
@@ -131,9 +135,23 @@ void Network::loadModel(string inFile)
       }
       n_output_planes = cvReadIntByName(fs,node,"n_output_planes");
       int ksize = cvReadIntByName(fs,node,"ksize");
+      const char * algorithm = cvReadStringByName(fs,node,"algorithm","direct");
       layer = cvCreateConvolutionLayer( dtype, name, 0, visualize, input_layer, 
         n_input_planes, input_height, input_width, n_output_planes, ksize,
         lr_init, decay_type, activation, NULL, NULL );
+      if (!strcmp(algorithm,"direct")){
+        ((CvDNNConvolutionLayer*)layer)->algorithm=CV_DNN_CONVOLUTION_DIRECT;
+      }else if (!strcmp(algorithm,"im2col")){
+        ((CvDNNConvolutionLayer*)layer)->algorithm=CV_DNN_CONVOLUTION_IM2COL;
+      }else if (!strcmp(algorithm,"fft")){
+        ((CvDNNConvolutionLayer*)layer)->algorithm=CV_DNN_CONVOLUTION_FFT;
+      }else if (!strcmp(algorithm,"winograd_2x2") && ksize==3){
+        ((CvDNNConvolutionLayer*)layer)->algorithm=CV_DNN_CONVOLUTION_WINOGRAD_2X2;
+      }else if (!strcmp(algorithm,"winograd_4x4") && ksize==3){
+        ((CvDNNConvolutionLayer*)layer)->algorithm=CV_DNN_CONVOLUTION_WINOGRAD_4X4;
+      }else if (!strcmp(algorithm,"auto")){
+        ((CvDNNConvolutionLayer*)layer)->algorithm=CV_DNN_CONVOLUTION_AUTO;
+      }else{fprintf(stderr,"Error: unknown convolution algorithm `%s` for ksize=%d\n",algorithm,ksize);exit(-1);}
       if (input_layer){input_layer->output_layers.push_back(layer);}
       n_input_planes = n_output_planes;
       input_height = input_height-ksize+1;
@@ -213,6 +231,25 @@ void Network::loadModel(string inFile)
       layer = cvCreateSimpleRNNLayer( dtype, name, 0, 
         n_input_planes, n_output_planes, n_hiddens, seq_length, time_index, 
         lr_init, decay_type, activation, NULL, NULL, NULL );
+      if (time_index==CV_DNN_RNN_SEQUENCE){
+        layer->bptt_window = cvReadIntByName(fs,node,"bptt_window",0);
+        layer->stateful = cvReadIntByName(fs,node,"stateful",0);
+      }
+      n_input_planes = n_output_planes; input_height = 1; input_width = 1;
+    }else if (!strcmp(type,"LSTM") || !strcmp(type,"GRU")){ // gated recurrent layer
+      const int n_input_planes_default = n_input_planes * input_height * input_width;
+      n_input_planes = cvReadIntByName(fs,node,"n_input_planes",n_input_planes_default);
+      n_output_planes = cvReadIntByName(fs,node,"n_output_planes",1);
+      const int seq_length = cvReadIntByName(fs,node,"seq_length",1);
+      if (!strcmp(type,"LSTM")){
+        layer = cvCreateLSTMLayer( dtype, name, 
+          n_input_planes, n_output_planes, seq_length, lr_init, decay_type, NULL );
+      }else{
+        layer = cvCreateGRULayer( dtype, name, 
+          n_input_planes, n_output_planes, seq_length, lr_init, decay_type, NULL );
+      }
+      layer->bptt_window = cvReadIntByName(fs,node,"bptt_window",0);
+      layer->stateful = cvReadIntByName(fs,node,"stateful",0);
       n_input_planes = n_output_planes; input_height = 1; input_width = 1;
     }else if (!strcmp(type,"Input")){ // data container layer
       n_input_planes = cvReadIntByName(fs,node,"n_input_planes",n_input_planes);
@@ -276,6 +313,12 @@ void Network::loadWeights(string inFile)
   CvFileStorage * fs = cvOpenFileStorage(inFile.c_str(),0,CV_STORAGE_READ);
   m_cnn->network->read(m_cnn->network,fs);
   cvReleaseFileStorage(&fs);
+  // float weights are stored as 16 bit floats right away, int8 layers need 
+  // samples for calibration and are quantized once trained, see train
+  const int type = m_solver->quantize();
+  if (type && type!=CV_DNN_QUANT_INT8 && !cvGetNetworkQuantization(m_cnn->network)){
+    quantize(0,0);
+  }
 }
 
 void Network::saveWeights(string outFile)
@@ -290,12 +333,12 @@ void Network::train(CvMat *trainingData, CvMat *responseMat)
 {
   int i, j;	
   CvDNNStatModelParams params;
-  assert(CV_MAT_TYPE(trainingData->type)==CV_32F);
+  assert(CV_MAT_CN(trainingData->type)==1);
 
   CvDNNLayer * last_layer = cvGetCNNLastLayer(m_cnn->network);
   int n_outputs = last_layer->n_output_planes;
-  if (icvIsSimpleRNNLayer(last_layer)){
-    n_outputs *= ((CvDNNSimpleRNNLayer*)last_layer)->seq_length;
+  if (icvIsSimpleRNNLayer(last_layer) || icvIsSequenceRNNLayer(last_layer)){
+    n_outputs *= last_layer->seq_length;
   }
 
   params.cls_labels = cvCreateMat( n_outputs, n_outputs, CV_32FC1 );
@@ -308,10 +351,28 @@ void Network::train(CvMat *trainingData, CvMat *responseMat)
   params.start_iter=0;
   params.max_iter=m_solver->maxiter();
   params.batch_size = m_solver->batch_size();
+  // every layer is updated by the mean gradient of accum_batches mini batches,
+  // the same update as a single batch of accum_batches*batch_size samples
+  params.accum_batches = m_solver->accum_batches();
+  params.checkpoint_segments = m_solver->checkpoint_segments();
   params.grad_estim_type=CV_DNN_GRAD_ESTIM_RANDOM;
   params.nepochs = m_solver->nepochs();
   params.validate_ratio = m_solver->validate_ratio();
   params.momentum_ratio = m_solver->momentum_ratio();
+  params.optimizer = m_solver->optimizer();
+  params.beta2 = m_solver->beta2();
+  params.epsilon = m_solver->epsilon();
+  params.weight_decay = m_solver->weight_decay();
+  params.train_mode = m_solver->train_mode();
+  params.ps_host = m_solver->ps_host();
+  params.ps_port = m_solver->ps_port();
+  params.ps_compression = m_solver->ps_compression();
+  params.ps_topk_ratio = m_solver->ps_topk_ratio();
+#ifdef _OPENMP
+  params.n_workers = omp_get_max_threads();
+#else
+  params.n_workers = 1;
+#endif
 
   if (CV_MAT_TYPE(responseMat->type)!=CV_32F){
     CvMat * tmp = cvCreateMat(responseMat->rows,responseMat->cols,CV_32F);
@@ -321,6 +382,31 @@ void Network::train(CvMat *trainingData, CvMat *responseMat)
   }else{
     m_cnn = cvTrainCNNClassifier( trainingData, CV_ROW_SAMPLE,responseMat,&params,0,0,0,0);
   }
+  if (m_solver->quantize()){quantize(trainingData,trainingData->rows);}
+}
+
+void Network::quantize(CvMat * samples, int nsamples)
+{
+  CV_FUNCNAME("Network::quantize");
+  CvMat * calib = 0;
+  __BEGIN__;
+  const int type = m_solver->quantize();
+  if (!type){EXIT;}
+  if (type==CV_DNN_QUANT_INT8){
+    CvMat src_row, dst_row;
+    const int n_calib = MAX(1,MIN(nsamples,m_solver->calib_samples()));
+    CV_ASSERT(samples && nsamples>0);
+    CV_CALL(calib = cvCreateMat(n_calib,samples->cols,CV_32F));
+    for (int ii=0;ii<n_calib;ii++){
+      cvGetRow(samples,&src_row,int(ii*(double(nsamples)/n_calib)));
+      cvGetRow(calib,&dst_row,ii);
+      cvConvert(&src_row,&dst_row);
+    }
+    fprintf(stderr, "int8: %d calibration samples\n", n_calib);
+  }
+  CV_CALL(cvQuantizeNetwork(m_cnn->network,type,calib,m_solver->batch_size()));
+  __END__;
+  if (calib){cvReleaseMat(&calib);}
 }
 
 float Network::evaluate(CvMat * testing, CvMat * expected, int nsamples, const char * predicted_filename)
@@ -337,7 +423,9 @@ float Network::evaluate(CvMat * testing, CvMat * expected, int nsamples, const c
 
   // testing data
   cvGetRows(testing,&samples,0,nsamples);
+  double elapsed = (double)cvGetTickCount();
   m_cnn->predict(m_cnn->network,&samples,result,m_solver->batch_size());
+  elapsed = ((double)cvGetTickCount()-elapsed)/(cvGetTickFrequency()*1e3);
 
   // compute loss & accuracy, print progress
   CvMat * expected_submat = cvCreateMat(nsamples*last_layer->seq_length,last_layer->n_output_planes,CV_32F);
@@ -346,13 +434,39 @@ float Network::evaluate(CvMat * testing, CvMat * expected, int nsamples, const c
     CV_ASSERT(expected->cols==last_layer->n_output_planes*last_layer->seq_length);
     cvGetRows(expected,&expected_submat_hdr,0,nsamples);
     cvReshape(&expected_submat_hdr,&expected_submat_reshape_hdr,0,nsamples*last_layer->seq_length);
-    cvCopy(&expected_submat_reshape_hdr,expected_submat);
+    cvConvert(&expected_submat_reshape_hdr,expected_submat);
     float trloss = cvNorm(result, expected_submat)/float(nsamples);
     top1 = m_cnn->network->eval(last_layer, result, expected_submat);
     static double sumloss = trloss;
     static double sumacc  = top1;
     fprintf(stderr, "sumacc: %.1f%%[%.1f%%], sumloss: %f\n", sumacc,top1,sumloss);
   }
+  if (cvGetNetworkQuantization(m_cnn->network)){
+    // the network runs as it is saved and served, with reduced precision
+    const int type = cvGetNetworkQuantization(m_cnn->network);
+    fprintf(stderr, "%s: time: %.1fms\n", 
+            type==CV_DNN_QUANT_INT8?"int8":(type==CV_DNN_QUANT_FP16?"fp16":"bf16"), elapsed);
+  }else if (m_solver->quantize()){
+    // weights saved without int8 layers, e.g. before quantize was set, are
+    // calibrated on testing samples, and reported against float prediction
+    CvMat * result_quant = cvCreateMat(result->rows,result->cols,CV_32F);
+    CV_CALL(quantize(testing,nsamples));
+    double elapsed_quant = (double)cvGetTickCount();
+    m_cnn->predict(m_cnn->network,&samples,result_quant,m_solver->batch_size());
+    elapsed_quant = ((double)cvGetTickCount()-elapsed_quant)/(cvGetTickFrequency()*1e3);
+    fprintf(stderr, "int8: time: %.1fms (float: %.1fms), max diff to float: %f\n",
+            elapsed_quant, elapsed, cvNorm(result_quant,result,CV_C));
+    if (expected){
+      const float top1_float = top1;
+      const float loss_float = cvNorm(result, expected_submat)/float(nsamples);
+      top1 = m_cnn->network->eval(last_layer, result_quant, expected_submat);
+      fprintf(stderr, "int8: acc: %.1f%% (float: %.1f%%), loss: %f (float: %f)\n", top1,
+              top1_float, cvNorm(result_quant, expected_submat)/float(nsamples), loss_float);
+    }
+    // reduced precision prediction is the one saved
+    cvCopy(result_quant,result);
+    cvReleaseMat(&result_quant);
+  }
   {
     List<int> output_planes; int output_planes_count=0;
     if (icvIsMergeLayer(last_layer)){
@@ -391,6 +505,31 @@ float Network::evaluate(CvMat * testing, CvMat * expected, int nsamples, const c
   return top1;
 }
 
+void cvSaveDataset(const char * filename, const CvMat * mat)
+{
+  const char * ext = strrchr(filename,'.');
+  if (ext && !strcmp(ext,".bin")){cvSaveTensor(filename,mat);}else{cvSave(filename,mat);}
+}
+
+CvMat * cvLoadDataset(const char * filename, int * mapped)
+{
+  *mapped = cvIsTensorFile(filename);
+  if (*mapped){return cvMapTensor(filename);}
+  CvMat * mat = (CvMat*)cvLoad(filename);
+  if (!mat){return 0;}
+  if (CV_MAT_TYPE(mat->type)!=CV_32F){
+    CvMat * ret = cvCreateMat(mat->rows,mat->cols,CV_32F);
+    cvConvert(mat,ret);
+    cvReleaseMat(&mat);
+    return ret;
+  }else{return mat;}
+}
+
+void cvReleaseDataset(CvMat ** mat, int mapped)
+{
+  if (mapped){cvReleaseMappedTensor(mat);}else{cvReleaseMat(mat);}
+}
+
 void cvSaveCategorialResult(CvDNNLayer * last_layer, CvMat * input, const char * output_filename)
 {
   List<int> output_planes; int output_planes_count=0;
@@ -25,9 +25,26 @@ class CvDNNSolver
   int m_decay_type;// = CV_DNN_LEARN_RATE_DECREASE_SQRT_INV;
   int m_maxiter;
   int m_batch_size;
+  int m_accum_batches;
+  int m_checkpoint_segments;
   int m_nepochs;
   float m_validate_ratio;
   float m_momentum_ratio;
+  int m_optimizer;
+  float m_beta2;
+  float m_epsilon;
+  float m_weight_decay;
+  int m_train_mode;
+  int m_quantize;
+  int m_calib_samples;
+
+  // parameter server, used by workers connecting to it and by the server itself
+  char m_ps_host[1<<10];
+  int m_ps_port;
+  int m_ps_workers;
+  int m_ps_staleness;
+  int m_ps_compression;
+  float m_ps_topk_ratio;
 
   char m_model_filename[1<<10];
   char m_weights_filename[1<<10];
@@ -40,7 +57,8 @@ class CvDNNSolver
 public:
   CvDNNSolver(char * solver_filename):
     m_lr_init(.0001f),m_decay_type(CV_DNN_LEARN_RATE_DECREASE_SQRT_INV),
-    m_maxiter(1),m_batch_size(1),m_validate_ratio(0.1f)
+    m_maxiter(1),m_batch_size(1),m_validate_ratio(0.1f),
+    m_optimizer(CV_DNN_OPTIMIZER_SGD),m_train_mode(CV_DNN_TRAIN_SYNC)
   {
     CvFileStorage * fs = cvOpenFileStorage(solver_filename,0,CV_STORAGE_READ);
     if (!fs){fprintf(stderr,"error: solver file %s not exist!\n",solver_filename); exit(-1);}
@@ -56,9 +74,38 @@ public:
     m_lr_init = cvReadRealByName(fs,node,"lr_init",0.05);
     m_maxiter = cvReadIntByName(fs,node,"maxiter",1);
     m_batch_size = cvReadIntByName(fs,node,"batch_size",1);
+    m_accum_batches = cvReadIntByName(fs,node,"accum_batches",1);
+    m_checkpoint_segments = cvReadIntByName(fs,node,"checkpoint_segments",0);
     m_nepochs = cvReadIntByName(fs, node, "n_epochs", 1);
     m_validate_ratio = cvReadRealByName(fs, node, "validate_ratio", .1);
     m_momentum_ratio = cvReadRealByName(fs, node, "momentum_ratio", .9);
+    const char * optimizer = cvReadStringByName(fs, node, "optimizer", "sgd");
+    m_optimizer = cvGetOptimizerType(optimizer);
+    if (m_optimizer<0){fprintf(stderr,"error: unknown optimizer `%s`\n",optimizer); exit(-1);}
+    m_beta2 = cvReadRealByName(fs, node, "beta2", .999);
+    m_epsilon = cvReadRealByName(fs, node, "epsilon", 1e-8);
+    m_weight_decay = cvReadRealByName(fs, node, "weight_decay", 0);
+    const char * train_mode = cvReadStringByName(fs, node, "train_mode", "sync");
+    if (!strcmp(train_mode,"sync")){m_train_mode=CV_DNN_TRAIN_SYNC;
+    }else if (!strcmp(train_mode,"hogwild")){m_train_mode=CV_DNN_TRAIN_HOGWILD;
+    }else{fprintf(stderr,"error: unknown train_mode `%s`\n",train_mode); exit(-1);}
+    const char * quantize = cvReadStringByName(fs, node, "quantize", "none");
+    if (!strcmp(quantize,"none")){m_quantize=0;
+    }else if (!strcmp(quantize,"int8")){m_quantize=CV_DNN_QUANT_INT8;
+    }else if (!strcmp(quantize,"fp16")){m_quantize=CV_DNN_QUANT_FP16;
+    }else if (!strcmp(quantize,"bf16")){m_quantize=CV_DNN_QUANT_BF16;
+    }else{fprintf(stderr,"error: unknown quantize `%s`\n",quantize); exit(-1);}
+    m_calib_samples = cvReadIntByName(fs, node, "calib_samples", 256);
+    strcpy(m_ps_host,cvReadStringByName(fs,node,"ps_host",""));
+    m_ps_port = cvReadIntByName(fs, node, "ps_port", 9876);
+    m_ps_workers = cvReadIntByName(fs, node, "ps_workers", 1);
+    m_ps_staleness = cvReadIntByName(fs, node, "ps_staleness", 0);
+    m_ps_topk_ratio = cvReadRealByName(fs, node, "ps_topk_ratio", .01);
+    const char * ps_compression = cvReadStringByName(fs, node, "ps_compression", "none");
+    if (!strcmp(ps_compression,"none")){m_ps_compression=CV_DNN_COMPRESS_NONE;
+    }else if (!strcmp(ps_compression,"fp16")){m_ps_compression=CV_DNN_COMPRESS_FP16;
+    }else if (!strcmp(ps_compression,"topk")){m_ps_compression=CV_DNN_COMPRESS_TOPK;
+    }else{fprintf(stderr,"error: unknown ps_compression `%s`\n",ps_compression); exit(-1);}
     if (fs){cvReleaseFileStorage(&fs);fs=0;}
   }
   ~CvDNNSolver(){}
@@ -67,9 +114,24 @@ public:
   int decay_type(){return m_decay_type;}
   int maxiter(){return m_maxiter;}
   int batch_size(){return m_batch_size;}
+  int accum_batches(){return m_accum_batches;}
+  int checkpoint_segments(){return m_checkpoint_segments;}
   int nepochs(){return m_nepochs;}
   float validate_ratio(){return m_validate_ratio;}
   float momentum_ratio(){return m_momentum_ratio;}
+  int optimizer(){return m_optimizer;}
+  float beta2(){return m_beta2;}
+  float epsilon(){return m_epsilon;}
+  float weight_decay(){return m_weight_decay;}
+  int train_mode(){return m_train_mode;}
+  int quantize(){return m_quantize;}
+  int calib_samples(){return m_calib_samples;}
+  char * ps_host(){return m_ps_host[0]?(char*)m_ps_host:0;}
+  int ps_port(){return m_ps_port;}
+  int ps_workers(){return m_ps_workers;}
+  int ps_staleness(){return m_ps_staleness;}
+  int ps_compression(){return m_ps_compression;}
+  float ps_topk_ratio(){return m_ps_topk_ratio;}
 
   char * model_filename(){return (char*)m_model_filename;}
   char * weights_filename(){return (char*)m_weights_filename;}
@@ -128,8 +190,30 @@ public:
    */
   void train(CvMat *trainingData, CvMat *responseMat);
 
+  /** \brief Switch to the reduced precision inference of the solver
+   * int8 layers are calibrated on evenly spaced rows of samples, which are
+   * not used otherwise; the quantized weights are saved by saveWeights.
+   * @param samples the first nsamples rows are used for calibration.
+   */
+  void quantize(CvMat * samples, int nsamples);
+
   float evaluate(CvMat * testing, CvMat * expected, int nsamples, const char * predicted_filename);
 };
 
+/** \brief Save a training or testing data matrix
+ * files with `.bin` extension are written as binary tensor files, keeping the
+ * element type of <mat>; other files are written with cvSave.
+ */
+void cvSaveDataset(const char * filename, const CvMat * mat);
+
+/** \brief Load a data matrix written by cvSaveDataset
+ * binary tensor files are mapped without copy and keep their element type,
+ * other files are parsed and converted to float.
+ * @param mapped set to 1 if the matrix is mapped, to be passed to cvReleaseDataset
+ */
+CvMat * cvLoadDataset(const char * filename, int * mapped);
+
+void cvReleaseDataset(CvMat ** mat, int mapped);
+
 #endif // __CV_DNNETWORK_H__
 
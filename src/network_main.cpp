@@ -9,16 +9,28 @@
 
 #include "network.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <deque>
+#include <vector>
+#include <algorithm>
+
 typedef cv::CommandLineParser CvCommandLineParser;
-CvMat * cvLoadMat32f(const char * fname);
+int cvServeNetwork(Network * cnn, const char * socket_path, float latency_ms);
 
 int main(int argc, char * argv[])
 {
   char keys[1<<12];
   sprintf(keys,
-          "{  1 |         | train | choose `train` or `test`     }"
+          "{  1 |         | train | choose `train`, `test`, `serve` or `pserver` }"
           "{  s | solver  |       | location of solver file      }"
           "{  o | omp     | %d    | number of threads to be used }"
+          "{  u | socket  |       | unix socket to serve on, stdin if empty }"
+          "{  l | latency | 5     | max time (ms) a request waits for batching }"
           "{  h | help    | false | display this help message    }", 
 #ifdef _OPENMP
           int(size_t(MAX(1.,std::ceil(float(omp_get_max_threads())*.5))))
@@ -27,12 +39,13 @@ int main(int argc, char * argv[])
 #endif
           );
   CvCommandLineParser parser(argc,argv,keys);
-  const char * task = parser.get<string>("1").c_str();
+  const string task_str = parser.get<string>("1");
+  const char * task = task_str.c_str();
   const int display_help = parser.get<bool>("help");
   const int max_threads = parser.get<int>("omp");
   if (display_help){parser.printParams();return 0;}
-  if (strcmp(task,"train")&&strcmp(task,"test")){
-    fprintf(stderr,"choose `train` or `test` as first argument.\n");return 0;
+  if (strcmp(task,"train")&&strcmp(task,"test")&&strcmp(task,"serve")&&strcmp(task,"pserver")){
+    fprintf(stderr,"choose `train`, `test`, `serve` or `pserver` as first argument.\n");return 0;
   }
   
   fprintf(stderr, "MAX_THREADS=%d\n",max_threads);
@@ -55,30 +68,71 @@ int main(int argc, char * argv[])
   const char * expected_filename = cnn->solver()->expected_filename();
   const char * predicted_filename = cnn->solver()->predicted_filename();
 
+  if (!strcmp(task,"serve")){
+    // model and weights are loaded once, then requests are served until 
+    // end of input or termination signal
+    cnn->loadWeights(cnn->solver()->weights_filename());
+    if (cnn->solver()->quantize() && !cvGetNetworkQuantization(cnn->model()->network)){
+      LOGE("warning: weights have no calibrated int8 layers, train again to serve int8.");
+    }
+    int retval = cvServeNetwork(cnn,parser.get<string>("socket").c_str(),
+                                parser.get<float>("latency"));
+    delete cnn;
+    return retval;
+  }
+
+  if (!strcmp(task,"pserver")){
+    // workers started with `train` and the same solver file fetch the
+    // initial weights from the server, which applies their gradients by the
+    // optimizer of the solver and saves the weights once training is over
+    CvDNNSolver * solver = cnn->solver();
+    CvDNNOptimizer * optimizer = 0;
+    if (solver->optimizer()!=CV_DNN_OPTIMIZER_SGD || solver->weight_decay()>0){
+      optimizer = cvCreateDNNOptimizer(solver->optimizer(),solver->momentum_ratio(),
+                                       solver->beta2(),solver->epsilon(),solver->weight_decay());
+    }
+    cvSetNetworkOptimizer(cnn->model()->network,optimizer);
+    CvDNNParamServer * server = cvCreateParamServer(cnn->model()->network,solver->ps_port(),
+                                                    solver->ps_workers(),solver->ps_staleness());
+    if (!server){LOGE("error: failed to start parameter server.\n"); return -1;}
+    CV_TIMER_START();
+    cvRunParamServer(server);
+    cnn->saveWeights(solver->weights_filename());
+    CV_TIMER_SHOW();
+    cvReleaseParamServer(&server);
+    cvSetNetworkOptimizer(cnn->model()->network,0);
+    cvReleaseDNNOptimizer(&optimizer);
+    delete cnn;
+    return 0;
+  }
+
   fprintf(stderr,"Loading Dataset ...\n");
   
   if (!strcmp(task,"train")){
-    CvMat * training = cvLoadMat32f((char*)training_filename);
-    CvMat * response = cvLoadMat32f((char*)response_filename);
+    // binary tensor files are mapped as is, e.g. uint8 images are converted
+    // to float one mini batch at a time
+    int training_mapped = 0, response_mapped = 0;
+    CvMat * training = cvLoadDataset(training_filename,&training_mapped);
+    CvMat * response = cvLoadDataset(response_filename,&response_mapped);
     if (!response || !training){
       LOGE("error: not all training files available, try transfer data first.\n"); return -1;
     }
-    assert(CV_MAT_TYPE(training->type)==CV_32F);
     assert(training->rows==response->rows);
     fprintf(stderr,"%d Training Images Loaded!\n",training->rows);
     CV_TIMER_START();
     cnn->train(training,response);
     cnn->saveWeights(cnn->solver()->weights_filename());
     CV_TIMER_SHOW();
-    cvReleaseMat(&training);
-    cvReleaseMat(&response);
+    cvReleaseDataset(&training,training_mapped);
+    cvReleaseDataset(&response,response_mapped);
   }else{
-    CvMat * testing  = cvLoadMat32f((char*) testing_filename);
-    CvMat * expected = strlen(expected_filename)<1?0:cvLoadMat32f((char*)expected_filename);
+    int testing_mapped = 0, expected_mapped = 0;
+    CvMat * testing  = cvLoadDataset(testing_filename,&testing_mapped);
+    CvMat * expected = strlen(expected_filename)<1?0:
+      cvLoadDataset(expected_filename,&expected_mapped);
     if (!testing){
       LOGE("error: testing file not available, try transfer data first.\n"); return -1;
     }
-    assert(CV_MAT_TYPE(testing->type)==CV_32F);
     if (expected){assert( testing->rows==expected->rows);}
     fprintf(stderr,"%d Testing Images Loaded!\n",testing->rows);
     CV_TIMER_START();
@@ -89,22 +143,320 @@ int main(int argc, char * argv[])
     cnn->evaluate(testing,expected,5,predicted_filename);
 #endif
     CV_TIMER_SHOW();
-    if (testing){cvReleaseMat(&testing);testing=0;}
-    if (expected){cvReleaseMat(&expected);expected=0;}
+    if (testing){cvReleaseDataset(&testing,testing_mapped);}
+    if (expected){cvReleaseDataset(&expected,expected_mapped);}
   }
 
   return 0;
 }
 
-CvMat * cvLoadMat32f(const char * fname)
+/****************************************************************************************\
+*                                      Serve mode                                        *
+\****************************************************************************************/
+/* Requests are lines of whitespace separated input values, one sample per line. Each
+   reply is a line of output values, written in the order requests were received on
+   the same connection. Requests from all connections are batched up to the solver's
+   batch size, the first request of a batch waits at most <latency_ms> for others. */
+
+typedef struct CvServeConnection
+{
+  FILE * in;
+  FILE * out;
+  // number of requests not yet replied
+  int pending;
+  // input has been closed, release the connection once all requests are replied
+  int closed;
+}CvServeConnection;
+
+typedef struct CvServeRequest
+{
+  CvServeConnection * conn;
+  // input values, 0 if the request could not be parsed
+  float * input;
+  double arrival;
+}CvServeRequest;
+
+typedef struct CvServeContext
+{
+  Network * cnn;
+  int n_inputs;
+  int n_outputs;
+  int batch_size;
+  double latency;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::deque<CvServeRequest*> queue;
+  std::vector<CvServeConnection*> connections;
+  int n_connections;
+  int shutdown;
+  // latency of each replied request, in seconds
+  std::vector<double> latencies;
+  double first_arrival;
+  double last_reply;
+  int n_batches;
+}CvServeContext;
+
+static volatile sig_atomic_t g_serve_terminated = 0;
+static void icvServeSignalHandler(int){ g_serve_terminated = 1; }
+
+static double icvServeNow()
 {
-  CvMat * ret = 0;
-  CvMat * mat = (CvMat*)cvLoad(fname);
-  if (!mat){return 0;}
-  if (CV_MAT_TYPE(mat->type)!=CV_32F){
-    ret = cvCreateMat(mat->rows,mat->cols,CV_32F);
-    cvConvert(mat,ret);
-    cvReleaseMat(&mat);
-    return ret;
-  }else{return mat;}
+  struct timespec ts; clock_gettime(CLOCK_REALTIME,&ts);
+  return ts.tv_sec+ts.tv_nsec*1e-9;
+}
+
+static void icvServeReleaseConnection(CvServeContext * ctx, CvServeConnection * conn)
+{
+  if (conn->in!=stdin){fclose(conn->in);}
+  if (conn->out!=stdout){fclose(conn->out);}
+  ctx->connections.erase(std::find(ctx->connections.begin(),ctx->connections.end(),conn));
+  delete conn;
+  ctx->n_connections--;
+  pthread_cond_broadcast(&ctx->cond);
+}
+
+static void icvServeReportLatency(CvServeContext * ctx)
+{
+  const int count = ctx->latencies.size();
+  if (count<1){fprintf(stderr,"serve: no request processed.\n");return;}
+  std::vector<double> sorted(ctx->latencies);
+  std::sort(sorted.begin(),sorted.end());
+  const double elapsed = MAX(ctx->last_reply-ctx->first_arrival,1e-9);
+  fprintf(stderr,"serve: %d requests in %d batches (avg %.1f), "
+          "latency p50: %.2fms, p99: %.2fms, throughput: %.1f req/s\n",
+          count,ctx->n_batches,float(count)/float(MAX(ctx->n_batches,1)),
+          sorted[(count-1)/2]*1000.,sorted[MIN(count-1,int(count*.99))]*1000.,
+          count/elapsed);
+}
+
+static CvServeConnection * icvServeOpenConnection(CvServeContext * ctx, FILE * in, FILE * out)
+{
+  CvServeConnection * conn = new CvServeConnection;
+  conn->in = in; conn->out = out; conn->pending = 0; conn->closed = 0;
+  pthread_mutex_lock(&ctx->mutex);
+  ctx->connections.push_back(conn);
+  ctx->n_connections++;
+  pthread_mutex_unlock(&ctx->mutex);
+  return conn;
+}
+
+// reads requests from a connection and puts them in the queue, until end of
+// input or interrupted by a signal
+static void icvServeRead(CvServeContext * ctx, CvServeConnection * conn)
+{
+  char * line = 0; size_t linesize = 0;
+  while (getline(&line,&linesize,conn->in)>0){
+    if (line[strspn(line," \t\r\n")]=='\0'){continue;}
+    CvServeRequest * request = new CvServeRequest;
+    request->conn = conn;
+    request->input = new float[ctx->n_inputs];
+    char * ptr = line, * end = 0; int count = 0;
+    for (;count<ctx->n_inputs;count++,ptr=end){
+      request->input[count] = strtof(ptr,&end);
+      if (end==ptr){break;}
+    }
+    if (count!=ctx->n_inputs || strspn(ptr," \t\r\n")!=strlen(ptr)){
+      delete [] request->input; request->input = 0;
+    }
+    pthread_mutex_lock(&ctx->mutex);
+    request->arrival = icvServeNow();
+    if (ctx->latencies.empty() && ctx->queue.empty()){ctx->first_arrival=request->arrival;}
+    conn->pending++;
+    ctx->queue.push_back(request);
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+  }
+  if (line){free(line);}
+  pthread_mutex_lock(&ctx->mutex);
+  conn->closed = 1;
+  if (!conn->pending){icvServeReleaseConnection(ctx,conn);}
+  pthread_mutex_unlock(&ctx->mutex);
+}
+
+typedef std::pair<CvServeContext*,CvServeConnection*> CvServeReaderArg;
+
+static void * icvServeReader(void * arg)
+{
+  icvServeRead(((CvServeReaderArg*)arg)->first,((CvServeReaderArg*)arg)->second);
+  delete (CvServeReaderArg*)arg;
+  return 0;
+}
+
+// worker threads are created with termination signals blocked, so that the
+// signals are delivered to the main thread
+static int icvServeCreateThread(pthread_t * thread, void * (*func)(void*), void * arg)
+{
+  sigset_t mask, oldmask;
+  sigemptyset(&mask); sigaddset(&mask,SIGINT); sigaddset(&mask,SIGTERM);
+  pthread_sigmask(SIG_BLOCK,&mask,&oldmask);
+  int retval = pthread_create(thread,0,func,arg);
+  pthread_sigmask(SIG_SETMASK,&oldmask,0);
+  return retval;
+}
+
+// collects batches from the queue, runs prediction and writes replies
+static void * icvServeBatcher(void * arg)
+{
+  CvServeContext * ctx = (CvServeContext*)arg;
+  CvDNNStatModel * model = ctx->cnn->model();
+  CvDNNLayer * last_layer = model->network->get_last_layer(model->network);
+  CvMat * samples = cvCreateMat(ctx->batch_size,ctx->n_inputs,CV_32F);
+  CvMat * result = cvCreateMat(ctx->batch_size*last_layer->seq_length,
+                               last_layer->n_output_planes,CV_32F);
+  CvServeRequest ** batch = new CvServeRequest*[ctx->batch_size];
+  for (;;){
+    pthread_mutex_lock(&ctx->mutex);
+    while (ctx->queue.empty() && !(ctx->shutdown && !ctx->n_connections)){
+      pthread_cond_wait(&ctx->cond,&ctx->mutex);
+    }
+    if (ctx->queue.empty()){pthread_mutex_unlock(&ctx->mutex);break;}
+    // wait for more requests, within latency budget of the first one
+    const double deadline = ctx->queue.front()->arrival+ctx->latency;
+    while (int(ctx->queue.size())<ctx->batch_size && ctx->n_connections && 
+           icvServeNow()<deadline){
+      struct timespec ts;
+      ts.tv_sec = time_t(deadline); ts.tv_nsec = long((deadline-ts.tv_sec)*1e9);
+      pthread_cond_timedwait(&ctx->cond,&ctx->mutex,&ts);
+    }
+    int nbatch = 0;
+    while (nbatch<ctx->batch_size && !ctx->queue.empty()){
+      batch[nbatch++] = ctx->queue.front(); ctx->queue.pop_front();
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    int nvalid = 0;
+    for (int ii=0;ii<nbatch;ii++){
+      if (!batch[ii]->input){continue;}
+      memcpy(samples->data.fl+ctx->n_inputs*nvalid,batch[ii]->input,sizeof(float)*ctx->n_inputs);
+      nvalid++;
+    }
+    if (nvalid>0){
+      CvMat samples_submat, result_submat;
+      cvGetRows(samples,&samples_submat,0,nvalid);
+      cvGetRows(result,&result_submat,0,nvalid*last_layer->seq_length);
+      model->predict(model->network,&samples_submat,&result_submat,ctx->batch_size);
+    }
+    for (int ii=0,vi=0;ii<nbatch;ii++){
+      FILE * out = batch[ii]->conn->out;
+      if (batch[ii]->input){
+        const float * optr = result->data.fl+ctx->n_outputs*vi++;
+        for (int jj=0;jj<ctx->n_outputs;jj++){fprintf(out,jj?" %g":"%g",optr[jj]);}
+        fprintf(out,"\n");
+      }else{
+        fprintf(out,"error: expected %d input values\n",ctx->n_inputs);
+      }
+      fflush(out);
+    }
+
+    const double now = icvServeNow();
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->n_batches++;
+    ctx->last_reply = now;
+    for (int ii=0;ii<nbatch;ii++){
+      CvServeConnection * conn = batch[ii]->conn;
+      ctx->latencies.push_back(now-batch[ii]->arrival);
+      if (batch[ii]->input){delete [] batch[ii]->input;}
+      delete batch[ii];
+      if (--conn->pending==0 && conn->closed){icvServeReleaseConnection(ctx,conn);}
+    }
+    if (ctx->latencies.size()%1000<size_t(nbatch)){icvServeReportLatency(ctx);}
+    pthread_mutex_unlock(&ctx->mutex);
+  }
+  delete [] batch;
+  cvReleaseMat(&samples);
+  cvReleaseMat(&result);
+  return 0;
+}
+
+int cvServeNetwork(Network * cnn, const char * socket_path, float latency_ms)
+{
+  CvDNNStatModel * model = cnn->model();
+  CvDNNLayer * first_layer = model->network->first_layer;
+  CvDNNLayer * last_layer = model->network->get_last_layer(model->network);
+  CvServeContext * ctx = new CvServeContext;
+  ctx->cnn = cnn;
+  ctx->n_inputs = first_layer->n_input_planes*first_layer->input_height*
+    first_layer->input_width*first_layer->seq_length;
+  ctx->n_outputs = last_layer->n_output_planes*last_layer->seq_length;
+  ctx->batch_size = MAX(1,cnn->solver()->batch_size());
+  ctx->latency = MAX(0.f,latency_ms)*1e-3;
+  ctx->n_connections = 0;
+  ctx->shutdown = 0;
+  ctx->first_arrival = ctx->last_reply = 0;
+  ctx->n_batches = 0;
+  pthread_mutex_init(&ctx->mutex,0);
+  pthread_cond_init(&ctx->cond,0);
+
+  // prepare memory plan and workspace of a full batch before serving
+  {
+    CvMat * samples = cvCreateMat(ctx->batch_size,ctx->n_inputs,CV_32F);
+    CvMat * result = cvCreateMat(ctx->batch_size*last_layer->seq_length,
+                                 last_layer->n_output_planes,CV_32F);
+    cvZero(samples);
+    model->predict(model->network,samples,result,ctx->batch_size);
+    cvReleaseMat(&samples);
+    cvReleaseMat(&result);
+  }
+
+  struct sigaction action;
+  memset(&action,0,sizeof(action));
+  action.sa_handler = icvServeSignalHandler; // no SA_RESTART, to interrupt accept()
+  sigaction(SIGINT,&action,0);
+  sigaction(SIGTERM,&action,0);
+  signal(SIGPIPE,SIG_IGN);
+
+  pthread_t batcher;
+  if (icvServeCreateThread(&batcher,icvServeBatcher,ctx)){
+    LOGE("failed to create batcher thread."); delete ctx; return -1;
+  }
+  int retval = 0, fd = -1;
+  if (!socket_path || strlen(socket_path)<1){
+    fprintf(stderr,"serving %d inputs -> %d outputs on stdin, batch_size: %d, latency: %.1fms\n",
+            ctx->n_inputs,ctx->n_outputs,ctx->batch_size,latency_ms);
+    icvServeRead(ctx,icvServeOpenConnection(ctx,stdin,stdout));
+  }else{
+    struct sockaddr_un addr;
+    memset(&addr,0,sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path,socket_path,sizeof(addr.sun_path)-1);
+    unlink(socket_path);
+    fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if (fd<0 || bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0 || listen(fd,64)<0){
+      LOGE("failed to listen on %s: %s",socket_path,strerror(errno)); retval = -1;
+    }else{
+      fprintf(stderr,"serving %d inputs -> %d outputs on %s, batch_size: %d, latency: %.1fms\n",
+              ctx->n_inputs,ctx->n_outputs,socket_path,ctx->batch_size,latency_ms);
+      while (!g_serve_terminated){
+        int cfd = accept(fd,0,0);
+        if (cfd<0){if (errno==EINTR){continue;} LOGE("accept: %s",strerror(errno)); break;}
+        FILE * in = fdopen(cfd,"r"), * out = fdopen(dup(cfd),"w");
+        if (!in || !out){LOGE("fdopen: %s",strerror(errno)); retval = -1; break;}
+        pthread_t reader;
+        CvServeConnection * conn = icvServeOpenConnection(ctx,in,out);
+        if (icvServeCreateThread(&reader,icvServeReader,new CvServeReaderArg(ctx,conn))){
+          LOGE("failed to create reader thread."); retval = -1; break;
+        }
+        pthread_detach(reader);
+      }
+    }
+  }
+
+  // stop reading from open connections, reply requests already received,
+  // then let the batcher finish
+  pthread_mutex_lock(&ctx->mutex);
+  for (size_t ii=0;ii<ctx->connections.size();ii++){
+    if (ctx->connections[ii]->in!=stdin){shutdown(fileno(ctx->connections[ii]->in),SHUT_RD);}
+  }
+  while (ctx->n_connections>0){pthread_cond_wait(&ctx->cond,&ctx->mutex);}
+  ctx->shutdown = 1;
+  pthread_cond_broadcast(&ctx->cond);
+  pthread_mutex_unlock(&ctx->mutex);
+  pthread_join(batcher,0);
+  if (fd>=0){close(fd);unlink(socket_path);}
+
+  icvServeReportLatency(ctx);
+  pthread_mutex_destroy(&ctx->mutex);
+  pthread_cond_destroy(&ctx->cond);
+  delete ctx;
+  return retval;
 }
@@ -61,10 +61,10 @@ int main(int argc, char * argv[])
   icvConvertIntToDecimal(ndigits,testingInt,testing);
   icvConvertIntToDecimal(ndigits,expectedInt,expected);
 
-  cvSave(training_filename_xml,training);
-  cvSave(response_filename_xml,response);
-  cvSave(testing_filename_xml,testing);
-  cvSave(expected_filename_xml,expected);
+  cvSaveDataset(training_filename_xml,training);
+  cvSaveDataset(response_filename_xml,response);
+  cvSaveDataset(testing_filename_xml,testing);
+  cvSaveDataset(expected_filename_xml,expected);
 
   return 0;
 }
@@ -37,16 +37,12 @@ CvMat * read_Mnist_Images(char * filename)
   n_rows = ReverseInt(n_rows);
   fread((char*) &n_cols, sizeof(n_cols),1,fp);
   n_cols = ReverseInt(n_cols);
-  CvMat * data = cvCreateMat(number_of_images,n_rows*n_cols,CV_32F);
+  // pixels are kept as uint8, converted to float while training
+  CvMat * data = cvCreateMat(number_of_images,n_rows*n_cols,CV_8U);
   for(int i = 0; i < number_of_images; ++i){
-  for(int r = 0; r < n_rows; ++r){
-  for(int c = 0; c < n_cols; ++c){
-	unsigned char temp = 0;
-	fread((char*) &temp, sizeof(temp),1,fp);
-	CV_MAT_ELEM(*data,float,i,r*n_cols+c)=float(temp);
-  }
-  }
+	fread(CV_MAT_ELEM_PTR(*data,i,0),1,n_rows*n_cols,fp);
   }
+  fclose(fp);
   return data;
 }
  
@@ -104,10 +100,10 @@ int main(int argc, char * argv[])
   cvPrepareResponse(response,responseMat);
   cvPrepareResponse(expected,expectedMat);
 
-  cvSave(training_filename_xml,training);
-  cvSave(response_filename_xml,responseMat);
-  cvSave( testing_filename_xml,testing );
-  cvSave(expected_filename_xml,expectedMat);
+  cvSaveDataset(training_filename_xml,training);
+  cvSaveDataset(response_filename_xml,responseMat);
+  cvSaveDataset( testing_filename_xml,testing );
+  cvSaveDataset(expected_filename_xml,expectedMat);
 
   cvReleaseMat(&training   );
   cvReleaseMat(&response   );
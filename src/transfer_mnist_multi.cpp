@@ -114,10 +114,10 @@ int main(int argc, char * argv[])
   cvGenerateMultiDigitMNIST(training, training_multi, response, response_multi, ndigits);
   cvGenerateMultiDigitMNIST( testing,  testing_multi, expected, expected_multi, ndigits);
 
-  cvSave(training_filename_xml,training_multi);
-  cvSave(response_filename_xml,response_multi);
-  cvSave( testing_filename_xml, testing_multi);
-  cvSave(expected_filename_xml,expected_multi);
+  cvSaveDataset(training_filename_xml,training_multi);
+  cvSaveDataset(response_filename_xml,response_multi);
+  cvSaveDataset( testing_filename_xml, testing_multi);
+  cvSaveDataset(expected_filename_xml,expected_multi);
 
   cvReleaseMat(&training);
   cvReleaseMat(&response);
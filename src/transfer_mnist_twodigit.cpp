@@ -115,10 +115,10 @@ int main(int argc, char * argv[])
   cvGenerateTwoDigitMNIST(training, training_twodigit, response, response_twodigit);
   cvGenerateTwoDigitMNIST( testing,  testing_twodigit, expected, expected_twodigit);
 
-  cvSave(training_filename_xml,training_twodigit);
-  cvSave(response_filename_xml,response_twodigit);
-  cvSave( testing_filename_xml, testing_twodigit);
-  cvSave(expected_filename_xml,expected_twodigit);
+  cvSaveDataset(training_filename_xml,training_twodigit);
+  cvSaveDataset(response_filename_xml,response_twodigit);
+  cvSaveDataset( testing_filename_xml, testing_twodigit);
+  cvSaveDataset(expected_filename_xml,expected_twodigit);
 
   cvReleaseMat(&training);
   cvReleaseMat(&response);
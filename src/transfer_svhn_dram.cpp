@@ -54,10 +54,10 @@ int main(int argc, char * argv[])
   fprintf(stderr,"%d training samples generated!\n", training->rows);
   fprintf(stderr,"%d testing samples generated!\n", testing->rows);
 
-  cvSave(training_filename_xml,training);
-  cvSave(response_filename_xml,response_mat);
-  cvSave( testing_filename_xml,testing);
-  cvSave(expected_filename_xml,expected_mat);
+  cvSaveDataset(training_filename_xml,training);
+  cvSaveDataset(response_filename_xml,response_mat);
+  cvSaveDataset( testing_filename_xml,testing);
+  cvSaveDataset(expected_filename_xml,expected_mat);
 
   cvReleaseMat(&training);
   cvReleaseMat(&response);